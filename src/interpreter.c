@@ -17,13 +17,22 @@
 #define MAX_LINE_WIDTH 512
 #define MAX_TOKEN_LEN 32
 #define MAX_ATTRS 10
+#define MAX_CONDS 4
 
 static const char* const t_database = "database";
 static const char* const t_show = "show";
+static const char* const t_set = "set";
+static const char* const t_buffer = "buffer";
+static const char* const t_quota = "quota";
+static const char* const t_log = "log";
+static const char* const t_mmap = "mmap";
 static const char* const t_print = "print";
 static const char* const t_create = "create";
 static const char* const t_drop = "drop";
 static const char* const t_table = "table";
+static const char* const t_index = "index";
+static const char* const t_hash = "hash";
+static const char* const t_bitmap = "bitmap";
 static const char* const t_insert = "insert";
 static const char* const t_into = "into";
 static const char* const t_values = "values";
@@ -37,18 +46,34 @@ static FILE *in_s; /* input stream, default to stdin */
 static int init_with_options (int argc, char* argv[]) {
   char cmd_file[MAX_LINE_WIDTH] = "";
   char db_dir[MAX_LINE_WIDTH] = "";
+  int num_pages = 0;
+  repl_policy policy = REPL_SAME;
+  long io_delay[3] = { 0, 0, 0 };
+  int dirty_pct[2];
   int c;
 
   msglevel = INFO;
 
-  while ((c = getopt(argc, argv, "hm:d:c:")) != -1)
+  while ((c = getopt(argc, argv, "hm:d:c:p:r:b:e:w:z:l:s:t:og")) != -1)
     switch (c) {
     case 'h':
       printf("Usage: runtest [switches]\n");
       printf("\t-h           help, print this message\n");
       printf("\t-m [fewid]   msg level [fatal,error,warn,info,debug]\n");
-      printf("\t-d db_dir    default to ./tests/testfront\n");
+      printf("\t-d db_dir    default to ./tests/testfront, %s for in memory\n", MEMORY_DB);
       printf("\t-c cmd file  eg. ./tests/testcmd.dbcmd, default to stdin\n");
+      printf("\t-p num_pages buffer size in pages, default to %d\n", NUM_PAGES);
+      printf("\t-r policy    page replacement [lru,clock,lru-k,2q,arc], default to lru\n");
+      printf("\t-b size      block size of a new database, default to %ld\n", BLOCK_SIZE);
+      printf("\t-e blocks    blocks a file grows by, default to %d\n", EXTENT_BLOCKS);
+      printf("\t-w level     durability [off,group,statement], default to group\n");
+      printf("\t-z size      memory of the compressed cache, default to %ld\n", CCACHE_SIZE);
+      printf("\t-l r,w,bw    slow disk: read and write latency in us, bytes/s\n");
+      printf("\t-s num_pages blocks shared with other processes, default to 0\n");
+      printf("\t-t high,low  dirty pages written back, in %% of the pages, default to %d,%d\n",
+             DIRTY_HIGH_PCT, DIRTY_LOW_PCT);
+      printf("\t-o           direct I/O (O_DIRECT) of table files\n");
+      printf("\t-g           buffer pages in reserved huge pages\n");
       exit(0);
     case 'm':
       switch (optarg[0]) {
@@ -64,8 +89,64 @@ static int init_with_options (int argc, char* argv[]) {
     case 'c':
       strcpy(cmd_file, optarg);
       break;
+    case 'p':
+      num_pages = atoi(optarg);
+      break;
+    case 'r':
+      policy = repl_policy_by_name(optarg);
+      if (policy == REPL_SAME)
+        printf("Unknown page replacement policy \"%s\", use lru.\n", optarg);
+      break;
+    case 'b':
+      if (!pager_set_block_size(atol(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 'e':
+      if (!pager_set_extent_blocks(atoi(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 'w':
+      if (durability_by_name(optarg) == -1)
+        printf("Unknown durability \"%s\", use group.\n", optarg);
+      else
+        pager_set_durability(durability_by_name(optarg));
+      break;
+    case 'z':
+      if (!pager_set_ccache_size(atol(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 'l':
+      if (sscanf(optarg, "%ld,%ld,%ld", &io_delay[0], &io_delay[1],
+                 &io_delay[2]) < 1) {
+        printf("Invalid disk delays \"%s\".\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (!pager_set_io_delay(io_delay[0], io_delay[1], io_delay[2]))
+        exit(EXIT_FAILURE);
+      break;
+    case 's':
+      if (!pager_set_shared_pages(atoi(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 't':
+      if (sscanf(optarg, "%d,%d", &dirty_pct[0], &dirty_pct[1]) != 2) {
+        printf("Invalid dirty thresholds \"%s\".\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (!pager_set_dirty_thresholds(dirty_pct[0], dirty_pct[1]))
+        exit(EXIT_FAILURE);
+      break;
+    case 'o':
+      pager_set_direct_io(1);
+      break;
+    case 'g':
+      pager_set_huge_pages(1);
+      break;
     case '?':
-      if (optopt == 'm' || optopt == 'd' || optopt == 'c')
+      if (optopt == 'm' || optopt == 'd' || optopt == 'c'
+          || optopt == 'p' || optopt == 'r' || optopt == 'b'
+          || optopt == 'e' || optopt == 'w' || optopt == 'z'
+          || optopt == 'l' || optopt == 's' || optopt == 't')
         printf("Option -%c requires an argument.\n", optopt);
       else if (isprint(optopt))
         printf("Unknown option `-%c'.\n", optopt);
@@ -109,6 +190,12 @@ static int init_with_options (int argc, char* argv[]) {
     return 0;
   }
 
+  if ((num_pages > 0 || policy != REPL_SAME)
+      && !pager_init(num_pages, policy)) {
+    put_msg(ERROR, "cannot make a buffer of %d pages\n", num_pages);
+    return 0;
+  }
+
   return open_db();
 }
 
@@ -236,10 +323,19 @@ static void show_help_info() {
   printf(" - # some comments in the rest of a line\n");
   printf(" - print text\n");
   printf(" - show database\n");
+  printf(" - show buffer\n");
+  printf(" - set buffer num_pages; (grow or shrink the buffer)\n");
+  printf(" - set quota table_name max_pages; (0 for no quota)\n");
+  printf(" - set log table_name; (store the table log-structured)\n");
+  printf(" - set mmap table_name; (read the table from a file mapping)\n");
   printf(" - create table table_name ( field_name field_type, ... )\n");
+  printf(" - create index on table_name ( int_field_name );\n");
+  printf(" - create hash index on table_name ( field_name );\n");
+  printf(" - create bitmap index on table_name ( int_field_name );\n");
   printf(" - drop table table_name (CAUTION: data will be deleted!!!)\n");
   printf(" - insert into table_name values ( value_1, value_2, ... )\n");
-  printf(" - select attr1, attr2 from table_name where attr = int_val;\n\n");
+  printf(" - select attr1, attr2 from table_name where attr = int_val;\n");
+  printf("   (where attr1 = int_val1 and attr2 != int_val2 ... or with or)\n\n");
 }
 
 static void quit() {
@@ -253,6 +349,10 @@ static void show_database() {
     put_msg(ERROR, "Show what?\n");
     return;
   }
+  if (strcmp(token, t_buffer) == 0) {
+    put_buffer_info(FORCE);
+    return;
+  }
   if (strcmp(token, t_database) != 0) {
     put_msg(ERROR, "Cannot show \"%s\".\n", token);
     return;
@@ -260,6 +360,93 @@ static void show_database() {
   put_db_info(FORCE);
 }
 
+/* Read a number of pages that ends a statement */
+static int next_num_pages(int* n) {
+  char token[MAX_TOKEN_LEN];
+  if (!next_token(token))
+    return 0;
+  char *p = strchr(token, ';');
+  if (p)
+    *p = 0;
+  else if (next_char() != ';')
+    return 0;
+  *n = strtol(token, &p, 10);
+  return p != token && *p == '\0' && *n >= 0;
+}
+
+static void set_option() {
+  char token[MAX_TOKEN_LEN], tbl_name[MAX_TOKEN_LEN];
+  int n;
+
+  if (!next_token(token)) {
+    put_msg(ERROR, "Set what?\n");
+    return;
+  }
+  if (strcmp(token, t_buffer) == 0) {
+    if (!next_num_pages(&n)) {
+      put_msg(ERROR, "set buffer: number of pages expected.\n");
+      skip_line();
+      return;
+    }
+    skip_line();
+    if (pager_resize(n))
+      put_msg(INFO, "The buffer has %d pages.\n", pager_num_pages());
+    return;
+  }
+  if (strcmp(token, t_quota) == 0) {
+    if (!next_token(tbl_name) || !next_num_pages(&n)) {
+      put_msg(ERROR, "set quota: table name and number of pages expected.\n");
+      skip_line();
+      return;
+    }
+    skip_line();
+    if (!get_schema(tbl_name)) {
+      put_msg(ERROR, "Table \"%s\" does not exist.\n", tbl_name);
+      return;
+    }
+    file_set_quota(tbl_name, n);
+    return;
+  }
+  if (strcmp(token, t_log) == 0) {
+    if (!next_token(tbl_name)) {
+      put_msg(ERROR, "set log: table name expected.\n");
+      skip_line();
+      return;
+    }
+    skip_line();
+    char *p = strchr(tbl_name, ';');
+    if (p)
+      *p = 0;
+    if (!get_table(tbl_name)) {
+      put_msg(ERROR, "Table \"%s\" does not exist.\n", tbl_name);
+      return;
+    }
+    if (set_tbl_log_structured(get_table(tbl_name)))
+      put_msg(INFO, "Table \"%s\" is stored log-structured.\n", tbl_name);
+    return;
+  }
+  if (strcmp(token, t_mmap) == 0) {
+    if (!next_token(tbl_name)) {
+      put_msg(ERROR, "set mmap: table name expected.\n");
+      skip_line();
+      return;
+    }
+    skip_line();
+    char *p = strchr(tbl_name, ';');
+    if (p)
+      *p = 0;
+    if (!get_schema(tbl_name)) {
+      put_msg(ERROR, "Table \"%s\" does not exist.\n", tbl_name);
+      return;
+    }
+    if (file_set_mmap(tbl_name, 1))
+      put_msg(INFO, "Table \"%s\" is read from a file mapping.\n", tbl_name);
+    return;
+  }
+  put_msg(ERROR, "Cannot set \"%s\".\n", token);
+  skip_line();
+}
+
 static void print_str() {
   char rest_of_line[MAX_LINE_WIDTH];
 
@@ -267,6 +454,32 @@ static void print_str() {
     printf("%s", rest_of_line + 1);
 }
 
+/* Make an index with the create function, described by kind */
+static void create_index_on(int (*create) (tbl_p, char const*),
+                            char const* kind) {
+  char idx_str[MAX_LINE_WIDTH];
+  char tbl_name[MAX_TOKEN_LEN], attr_name[MAX_TOKEN_LEN];
+
+  if (!read_till(idx_str, ';')) {
+    error_near(0);
+    return;
+  }
+  skip_line();
+  if (sscanf(idx_str, " on %31[^( ] ( %31[^) ] )",
+             tbl_name, attr_name) != 2) {
+    put_msg(ERROR, "create index: on table_name ( field_name ) expected.\n");
+    return;
+  }
+  tbl_p tbl = get_table(tbl_name);
+  if (!tbl) {
+    put_msg(ERROR, "Table \"%s\" does not exist.\n", tbl_name);
+    return;
+  }
+  if ((*create) (tbl, attr_name))
+    put_msg(INFO, "Table \"%s\" has %s index on \"%s\".\n",
+            tbl_name, kind, attr_name);
+}
+
 static void create_tbl() {
   char tbl_name[MAX_TOKEN_LEN], token[MAX_TOKEN_LEN];
 
@@ -274,6 +487,24 @@ static void create_tbl() {
     put_msg(ERROR, "Must create something.\n");
     return;
   }
+  if (strcmp(token, t_index) == 0) {
+    create_index_on(create_index, "an");
+    return;
+  }
+  if (strcmp(token, t_hash) == 0 || strcmp(token, t_bitmap) == 0) {
+    int hash = strcmp(token, t_hash) == 0;
+    if (!next_token(token) || strcmp(token, t_index) != 0) {
+      put_msg(ERROR, "create %s: \"index\" expected.\n",
+              hash ? t_hash : t_bitmap);
+      skip_line();
+      return;
+    }
+    if (hash)
+      create_index_on(create_hash_index, "a hash");
+    else
+      create_index_on(create_bitmap_index, "a bitmap");
+    return;
+  }
   if (strcmp(token, t_table) != 0) {
     put_msg(ERROR, "Cannot create \"%s\".\n", token);
     return;
@@ -468,8 +699,9 @@ static void insert_row() {
 */
 typedef struct select_desc {
   tbl_p from_tbl, right_tbl;
-  char where_attr[MAX_TOKEN_LEN], where_op[3];
-  int where_val;
+  int num_conds, where_any;  /* conditions joined with "or" if any */
+  char where_attr[MAX_CONDS][MAX_TOKEN_LEN], where_op[MAX_CONDS][3];
+  int where_val[MAX_CONDS];
   int num_attrs;
   char* attrs[MAX_ATTRS];
 } select_desc;
@@ -477,8 +709,8 @@ typedef struct select_desc {
 static select_desc* new_select_desc() {
   select_desc* slct = malloc(sizeof (select_desc));
   for ( size_t i = 0; i < 10; i++ ) slct->attrs[i] = 0;
-  slct->where_attr[0] = '\0';
-  slct->where_op[0] = '\0';
+  slct->num_conds = 0;
+  slct->where_any = 0;
   slct->num_attrs = 0;
   slct->from_tbl = 0;
   slct->right_tbl = 0;
@@ -541,11 +773,6 @@ static select_desc* parse_select() {
       release_select_desc(slct);
       return 0;
     }
-    if (strcmp(from_str, join_str) == 0) {
-      put_msg(ERROR, "natural join on same table is not supported.\n");
-      release_select_desc(slct);
-      return 0;
-    }
     slct->right_tbl = get_table(join_with);
     if (!slct->right_tbl) {
       put_msg(ERROR, "natural join: table \"%s\" does not exist.\n",
@@ -560,14 +787,28 @@ static select_desc* parse_select() {
 
   put_msg(DEBUG, "from: \"%s\", where: \"%s\"\n", from_str, where_str);
 
-  if (where_str) {
-    if (sscanf(where_str, "%s %s %d",
-               slct->where_attr, slct->where_op, &slct->where_val)
-        != 3) {
+  while (where_str) {
+    int i = slct->num_conds, n = 0;
+    char conj[4] = "";
+    if (i == MAX_CONDS
+        || sscanf(where_str, "%31s %2s %d %n", slct->where_attr[i],
+                  slct->where_op[i], &slct->where_val[i], &n) != 3) {
       put_msg(ERROR, "query \"%s\" is not supported.\n", where_str);
       release_select_desc(slct);
       return 0;
     }
+    slct->num_conds++;
+    where_str += n;
+    if (sscanf(where_str, "%3s %n", conj, &n) != 1)
+      break;
+    if ((strcmp(conj, "and") != 0 && strcmp(conj, "or") != 0)
+        || (i > 0 && slct->where_any != (conj[0] == 'o'))) {
+      put_msg(ERROR, "where: \"%s\" is not supported.\n", where_str);
+      release_select_desc(slct);
+      return 0;
+    }
+    slct->where_any = conj[0] == 'o';
+    where_str += n;
   }
   return slct;
 }
@@ -586,15 +827,24 @@ static void select_rows() {
     }
   }
 
-  if (slct->where_attr[0] != '\0' && slct->where_op[0] != '\0') {
+  if (slct->num_conds == 1)
     where_tbl = table_search(join_tbl ? join_tbl : slct->from_tbl,
-                             slct->where_attr,
-                             slct->where_op,
-                             slct->where_val);
-    if (!where_tbl) {
-      release_select_desc(slct);
-      return;
+                             slct->where_attr[0],
+                             slct->where_op[0],
+                             slct->where_val[0]);
+  else if (slct->num_conds > 1) {
+    char const *attrs[MAX_CONDS], *ops[MAX_CONDS];
+    for (int i = 0; i < slct->num_conds; i++) {
+      attrs[i] = slct->where_attr[i];
+      ops[i] = slct->where_op[i];
     }
+    where_tbl = table_search_where(join_tbl ? join_tbl : slct->from_tbl,
+                                   slct->num_conds, attrs, ops,
+                                   slct->where_val, slct->where_any);
+  }
+  if (slct->num_conds > 0 && !where_tbl) {
+    release_select_desc(slct);
+    return;
   }
 
   if (slct->attrs[0][0] == '*')
@@ -633,14 +883,16 @@ void interpret(int argc, char* argv[]) {
       { show_help_info(); continue; }
     if (strcmp(token, t_show) == 0)
       { show_database(); continue; }
+    if (strcmp(token, t_set) == 0)
+      { set_option(); continue; }
     if (strcmp(token, t_print) == 0)
       { print_str(); continue; }
     if (strcmp(token, t_create) == 0)
-      { create_tbl(); continue; }
+      { create_tbl(); pager_commit(); continue; }
     if (strcmp(token, t_drop) == 0)
-      { drop_tbl(); continue; }
+      { drop_tbl(); pager_commit(); continue; }
     if (strcmp(token, t_insert) == 0)
-      { insert_row(); continue; }
+      { insert_row(); pager_commit(); continue; }
     if (strcmp(token, t_select) == 0)
       { select_rows(); continue; }
     error_near(token);
@@ -4,6 +4,7 @@
  * Author: Weihai Yu                                      *
  **********************************************************/
 
+#define _GNU_SOURCE /* O_DIRECT */
 #include "pager.h"
 #include "pmsg.h"
 #include <unistd.h>
@@ -11,26 +12,137 @@
 #include <string.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+
+/** K of the LRU-K replacement policy */
+#define LRU_K 2
+
+/** Max number of blocks read ahead at a time */
+#define RA_MAX_DEPTH 64
+
+/** Number of blocks read ahead when a sequential scan is detected */
+#define RA_INIT_DEPTH 4
+
+/** Number of consecutive blocks accessed before reading ahead */
+#define RA_TRIGGER 2
+
+/** Max number of adjacent blocks written with one disk write */
+#define WRITE_MAX_RUN 64
+
+/** Alignment of the memory of buffer pages, enough for direct I/O */
+#define FRAME_ALIGN 4096
+
+/** Size of huge pages that back a large buffer */
+#define HUGE_PAGE_SIZE (2L << 20)
+
+/** Size of a CPU cache line */
+#define CACHE_LINE_SIZE 64
+
+/** Number of locks of the block table, each guarding a stripe of buckets */
+#define BLK_STRIPES 64
+
+/** Max number of pages of the ring of a sequential scan */
+#define SCAN_RING_PAGES 8
+
+/** Number of pages of its ring a scan keeps pinned: the page it is at
+    and the next one, got before the first is unpinned */
+#define SCAN_PINS 2
+
+/** Number of partitions of a large shared pool, each with its own mutex */
+#define SPOOL_PARTS 16
+
+/** Max number of processes attached to a shared pool */
+#define SPOOL_MAX_PROCS 64
+
+/** First fd of the log-structured files, above the fds of the system */
+#define LSS_FD_BASE (1 << 24)
+
+/** Number of blocks of a segment of a log-structured file */
+#define LSS_SEG_BLOCKS 256
+
+/** Milliseconds between the rounds of the cleaner of log-structured files */
+#define LSS_CLEAN_MS 200
+
+/** Max percentage of blocks in use of a segment the cleaner compacts */
+#define LSS_CLEAN_PCT 50
+
+/** Number of unused pages preloading leaves to the other threads, which
+    would otherwise wait for the pages being preloaded */
+#define PRELOAD_HEADROOM 2
+
+/** Milliseconds to wait for an unpinned page before giving up */
+#define PIN_WAIT_MS 100
+
+/** Size in bytes of the unwritten log at which the log writer is woken */
+#define WAL_WAKE_SIZE (64L << 10)
+
+/** Shortest match of the compressor of the compressed cache */
+#define LZ_MIN_MATCH 4
+
+/** Number of bits of the hash values of the compressor */
+#define LZ_HASH_BITS 12
 
 /** the dir in which the database files are stored */
 char sys_dir[512];
 
+typedef struct file_handle_struct * fhandle_p;
+typedef struct pqueue * pqueue_p;
+
+/** @brief Identity of a file in the shared pool, the same in all processes */
+typedef struct spool_file {
+  dev_t dev;
+  ino_t ino;  /**< 0 if the file is not in the shared pool */
+} spool_file;
+
 /** @brief Database file handle */
 typedef struct file_handle_struct {
   char *fname;  /**< file name */
-  int fd;       /**< Unix file descriptor */
-  /** The blocks (max NUM_PAGES) currently in the memory.
-      blocks_in_mem[i] == NULL when that slot is left unused.
-  */
+  int fid;      /**< file id, unique among the files opened by the pager */
+  int fd;       /**< Unix file descriptor, -1 if closed while idle */
+  fhandle_p hnext;  /**< next file handle in the same bucket of fh_table */
+  fhandle_p fd_prev; /**< previous (less recently used) open file */
+  fhandle_p fd_next; /**< next (more recently used) open file */
   int num_blocks; /**< number of blocks this file has. */
-  block_p blocks_in_mem[NUM_PAGES];
-  block_p current_block; /**current block been accessd */
+  int phys_blocks; /**< number of blocks allocated on disk, including
+                      preallocated blocks that are not used yet */
+  /** The blocks currently in the memory, linked through
+      @ref block_struct::fnext "fnext".
+  */
+  block_p blocks_in_mem;
+  int num_blocks_in_mem; /**< length of blocks_in_mem */
+  int ra_last;   /**< block nr of the last accessed block */
+  int ra_seq;    /**< number of consecutive blocks accessed till ra_last */
+  int ra_depth;  /**< number of blocks to read ahead next time */
+  int ra_issued; /**< number of blocks read ahead last time */
+  int ra_used;   /**< number of them that are accessed */
+  int use_mmap;  /**< non-zero if blocks are served from a mapping */
+  char *map;     /**< memory mapping of the file, NULL if not mapped */
+  int map_blocks; /**< number of blocks in the mapping */
+  int map_advice; /**< current madvise() advice of the mapping */
+  struct old_map *old_maps; /**< mappings replaced while pages used them */
+  int io_users;  /**< number of disk I/Os using fd without the pool lock */
+  int wal_epoch; /**< log epoch in which the file name was logged */
+  int max_pages; /**< quota of buffer pages, 0 if there is none */
+  spool_file sfile; /**< the file in the shared pool */
 } file_handle_struct;
 
-typedef struct file_handle_struct * fhandle_p;
+/** @brief A mapping of a file that is no longer used for new pages.
+    It is unmapped when the file is closed, since pages may still
+    be served from it. */
+typedef struct old_map {
+  char *map;
+  size_t len;
+  struct old_map *next;
+} old_map;
 
-/** Handles of all files that are open */
-fhandle_p file_handles[MAX_OPEN_FILES];
 
 typedef struct pq_elm * pq_elm_p;
 
@@ -39,6 +151,9 @@ typedef struct block_struct {
   fhandle_p fhandle; /**< file handle */
   int blk_nr;            /**< block number */
   page_p page;           /**< buffer page of the block */
+  block_p hnext;         /**< next block in the same bucket of blk_table */
+  block_p fprev;         /**< previous block in fhandle->blocks_in_mem */
+  block_p fnext;         /**< next block in fhandle->blocks_in_mem */
 } block_struct;
 
 /** @brief Database buffer page
@@ -49,30 +164,46 @@ then a series of records, and finally free space.
 The header includes:
  - bytes 0-3: header size
  - bytes 4-7: position of the beginning of the unused space
+ - bytes 8-11: block size (0 in blocks of old databases of 512-byte blocks)
  - possibly some more, for example, when implementing variable-length records,
    file as linked list of blocks, or lsn for write-ahead logging
 */
 
+/** @brief element in pqueue, part of the queued page */
+typedef struct pq_elm {
+  page_p page;   /**< pointing to the queued page */
+  pq_elm_p prev; /**< previous page */
+  pq_elm_p next; /**< next page */
+} pq_elm;
+
+/* Pages are kept in an array, each page starting at a cache line */
 typedef struct page_struct {
-  char *content;   /**< BLOCK_SIZE of bytes */
+  char *content;   /**< block_size bytes, in buffer or a file mapping */
+  char *buffer;    /**< block_size bytes owned by the page */
   int page_nr;
   block_p block;   /**< the correspoding file block */
-  pq_elm_p qelm;   /**< the corresponding elm in pfifo */
-  int pinned;      /**< non-zoro if the block is pinned to the page */
+  pq_elm qelm;     /**< the elm of the page in queue */
+  pqueue_p queue;  /**< the queue qelm is in, NULL if not queued */
+  int ref;         /**< reference bit (CLOCK) */
+  unsigned long hist[LRU_K]; /**< times of the last K references (LRU-K) */
+  int heap_i;      /**< position in the heap of unpinned pages (LRU-K) */
+  int pin_count;   /**< number of pins, -1 while the page is being replaced */
+  int valid;       /**< non-zero when the block has been read into the page */
+  int prefetched;  /**< non-zero if read ahead and not accessed yet */
   int dirty;       /**< non-zero if the content has been changed (dirty) */
   int free_pos;    /**< beginning of free space */
   int current_pos; /**< current position for next access */
-} page_struct;
+  int pending;     /**< accesses not yet told to the replacement policy */
+  page_p pending_next; /**< next page with pending accesses */
+  long long lsn;     /**< end of the log record of the last change */
+  long long rec_lsn; /**< start of the log record of the first change
+                        since the page was clean, 0 if clean */
+  unsigned long last_used; /**< time of the last access, see use_clock */
+  pthread_rwlock_t latch; /**< shared/exclusive latch of the content */
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) page_struct;
 
 /** page queue */
 
-/** @brief element in pqueue */
-typedef struct pq_elm {
-  page_p page;   /**< pointing to the queued page */
-  pq_elm_p prev; /**< previous page */
-  pq_elm_p next; /**< next page */
-} pq_elm;
-
 /** @brief queue of pages */
 typedef struct pqueue {
   pq_elm_p first;
@@ -80,25 +211,197 @@ typedef struct pqueue {
   int len;
 } pqueue;
 
-typedef pqueue * pqueue_p;
-
-/** Page LRF queues for page replacement */
-static pqueue_p q_pinned, q_unpinned;
-
-/** Pager profiler */
-static struct {
-  int num_seeks;       /**< number of seeks after the reset of pager profiler */
-  int num_disk_reads;  /**< number of disk reads after the reset of pager profiler */
-  int num_disk_writes; /**< number of disk writes after the reset of pager profiler */
+/** Pager profiler counters.
+    Every thread counts in counters of its own, so that threads using
+    the pager do not contend for them. The profiler sums them up. */
+typedef struct pager_counters {
+  long long num_seeks;       /**< number of seeks after the reset of pager profiler */
+  long long num_disk_reads;  /**< number of disk reads after the reset of pager profiler */
+  long long num_disk_writes; /**< number of disk writes after the reset of pager profiler */
+  long long num_hits;        /**< number of blocks found in the buffer */
+  long long num_misses;      /**< number of blocks not found in the buffer */
+  long long num_evictions;   /**< number of blocks replaced from the buffer */
+  long long num_ra_reads;    /**< number of disk reads reading ahead */
+  long long num_ra_blocks;   /**< number of blocks read ahead */
+  long long num_ra_hits;     /**< number of blocks read ahead and accessed */
+  long long num_ra_wasted;   /**< number of blocks read ahead but replaced unaccessed */
+  long long num_wb_writes;   /**< number of disk writes writing dirty pages back */
+  long long num_wb_blocks;   /**< number of blocks written back */
+  long long num_mapped;      /**< number of blocks served from file mappings */
+  long long num_extents;     /**< number of extents preallocated */
+  long long num_log_records; /**< number of changes logged */
+  long long num_log_bytes;   /**< number of bytes logged */
+  long long num_log_syncs;   /**< number of times the log is forced to disk */
+  long long num_commits;     /**< number of statements committed */
+  long long num_checkpoints; /**< number of checkpoints of the log */
+  long long num_preloaded;   /**< number of blocks preloaded by a warm restart */
+  long long num_cc_puts;     /**< number of replaced blocks kept compressed */
+  long long num_cc_hits;     /**< number of blocks read from the compressed cache */
+  long long num_sp_puts;     /**< number of blocks put into the shared pool */
+  long long num_sp_hits;     /**< number of blocks read from the shared pool */
+  long long num_lss_writes;  /**< number of blocks appended to segment logs */
+  long long num_lss_moved;   /**< number of blocks moved by the segment cleaner */
+  long long num_ring_reuses; /**< number of pages recycled by scan rings */
+} pager_counters;
+
+/** @brief Profiler state of a thread */
+typedef struct thread_profiler {
+  pager_counters c;
   int last_fd;     /** fd of the last visited block, used to check if a new seek is needed */
   int last_blk_nr; /** nr of the last visited block, used to check if a new seek is needed */
-} pager_profiler;
-
+  struct thread_profiler *next; /**< profiler of the next thread */
+} thread_profiler;
+
+/** Profilers of the threads that use the pager */
+static thread_profiler *thread_profilers;
+/** Sum of the counters of the threads that have exited */
+static pager_counters exited_counters;
+static pthread_mutex_t profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t profiler_key;
+static pthread_once_t profiler_once = PTHREAD_ONCE_INIT;
+static __thread thread_profiler *my_profiler;
+
+
+/** File table.
+    Handles of all files that are open, hashed on the file name and
+    chained through @ref file_handle_struct::hnext "hnext".
+    The number of buckets is a power of two.
+*/
+static fhandle_p *fh_table;
+static size_t fh_table_mask;
 
 /** The number of files that are currently open */
 int num_file_handles = 0;
 
-page_p pages[NUM_PAGES];
+/** Files with an open file descriptor, from least to most recently used.
+    At most MAX_OPEN_FILES of them. */
+static fhandle_p fd_lru_first;
+static fhandle_p fd_lru_last;
+static int num_open_fds;
+
+/** File id of the next opened file */
+static int next_fid = 0;
+
+page_p *pages;
+
+/** Number of pages in the buffer, set by pager_init() and pager_resize() */
+static int num_pages = 0;
+
+/** Number of pages allocated. The pages in pages[] beyond num_pages
+    have been taken out of the buffer by pager_resize(). */
+static int num_alloc_pages = 0;
+
+/** Number of pages used by the next pager_init() without a given size */
+static int num_pages_conf = NUM_PAGES;
+
+/** Block size of the pager, set by pager_init() */
+static long block_size = BLOCK_SIZE;
+
+/** Block size used by the next pager_init() */
+static long block_size_conf = BLOCK_SIZE;
+
+/** Clock of page accesses, ticking with the pool lock */
+static unsigned long use_clock;
+
+/** Pages that are not associated with any block (a stack) */
+static page_p *free_pages;
+static int num_free_pages = 0;
+
+/** @brief Pages allocated together, by pager_init() or pager_resize() */
+typedef struct page_chunk {
+  page_struct *structs; /**< the pages */
+  char *frames;         /**< memory of the pages, page i at frames + i * block_size */
+  size_t frames_size;
+  struct page_chunk *next;
+} page_chunk;
+
+/** The chunks of all allocated pages */
+static page_chunk *page_chunks;
+
+/** non-zero if the buffer pages may use reserved huge pages */
+static int huge_pages;
+
+/** Released blocks, to be reused (linked through hnext) */
+static block_p spare_blocks;
+
+/** non-zero if files are opened for direct I/O */
+static int direct_io;
+
+/** non-zero if the files of the database are in memory, see set_system_dir() */
+static int in_memory;
+
+/** Delays of the storage of the next pager_init(), see pager_set_io_delay() */
+static long io_read_us_conf, io_write_us_conf, io_bandwidth_conf;
+
+/** Number of blocks a file grows by */
+static int extent_blocks = EXTENT_BLOCKS;
+
+/** Durability of the pager, and of the next pager_init() */
+static durability_level durability;
+static durability_level durability_conf = DURABILITY_GROUP;
+
+/** Block table.
+    The blocks in memory, hashed on (file id, block nr) and chained
+    through @ref block_struct::hnext "hnext".
+    The number of buckets is a power of two, so that a bucket is
+    found by masking the hash value.
+*/
+static block_p *blk_table;
+static size_t blk_table_mask;
+
+/* ---------------------------------------------------------------------
+   Concurrency.
+   Any number of threads may get, latch and unpin pages concurrently.
+   - The pool lock guards the replacement policy, the unused pages,
+     the block table and file handles against changes, and the open
+     file descriptors. Misses, evictions and write-backs take it, but
+     disk reads are done without it.
+   - The block table is also guarded by striped locks, so that a hit
+     finds and pins its block holding only the lock of its stripe.
+   - The pin count of a page is atomic. An unpinned page is claimed for
+     replacement by turning its pin count from 0 to -1, after which it
+     can no longer be pinned through the block table.
+   - A hit that finds the pool lock taken does not wait for it. The
+     accesses it has to tell the replacement policy are queued at the
+     page and applied by the next thread that holds the pool lock.
+   - The latch of a page guards its content: shared for reading,
+     exclusive for changing. A page must be pinned while it is latched.
+     A page is latched exclusively while its block is being read, and
+     pinning threads wait for the read by latching it shared.
+   - The file table has a read-write lock, so that files are looked up
+     without the pool lock.
+   Locks are taken in the order: pool lock, file table lock or block
+   table stripe, flusher lock. Page latches are never waited for while
+   holding the pool lock.
+   --------------------------------------------------------------------- */
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a page is unpinned and some thread waits for one */
+static pthread_cond_t page_unpinned = PTHREAD_COND_INITIALIZER;
+static int num_unpin_waiters;
+/** Number of pins this thread holds, to tell whether waiting for an
+    unpin is of any use */
+static __thread int my_pins;
+
+/** @brief A lock of a stripe of the block table, in a cache line of its own */
+typedef struct blk_stripe {
+  pthread_mutex_t mutex;
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) blk_stripe;
+
+static blk_stripe blk_stripes[BLK_STRIPES] = {
+  [0 ... BLK_STRIPES - 1] = {PTHREAD_MUTEX_INITIALIZER}
+};
+
+static pthread_rwlock_t fh_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Accesses of a page pending for the replacement policy */
+#define PENDING_TOUCH 1  /**< the page has been accessed */
+#define PENDING_PIN 2    /**< the page may have turned pinned or unpinned */
+#define PENDING_QUEUED 4 /**< the page is in the list of pending pages */
+
+/** Pages with pending accesses, linked through pending_next */
+static page_p pending_pages;
 
 static void put_fhandle_info(pmsg_level level, fhandle_p fh) {
   if (!fh) {
@@ -106,25 +409,29 @@ static void put_fhandle_info(pmsg_level level, fhandle_p fh) {
     return;
   }
   put_msg(level, "  fname: \"%s\", fd: %d, ", fh->fname, fh->fd);
-  append_msg(level, "%d blocks, current: %d.\n",
-             fh->num_blocks,
-             fh->current_block ? fh->current_block->blk_nr : -100);
-  put_msg(level, "   in memory: ");
-  for (size_t i = 0; i < NUM_PAGES; i++)
-    if (fh->blocks_in_mem[i])
-      append_msg(level,  " %d,", fh->blocks_in_mem[i]->blk_nr);
+  append_msg(level, "%d blocks.\n", fh->num_blocks);
+  put_msg(level, "   %d in memory", fh->num_blocks_in_mem);
+  if (fh->max_pages > 0)
+    append_msg(level, " (quota %d)", fh->max_pages);
+  append_msg(level, ": ");
+  for (block_p b = fh->blocks_in_mem; b; b = b->fnext)
+    append_msg(level,  " %d,", b->blk_nr);
   append_msg(level,  "\n");
 }
 
 /* forward declaration */
 static fhandle_p get_tbl_file(char const* fname);
+static void pool_lock(void);
+static void pool_unlock(void);
 
 void put_file_info(pmsg_level level, char const* name) {
+  pool_lock();
   fhandle_p fh = get_tbl_file(name);
   if (!fh)
     put_msg(level, "file \"%s\" not open.\n", name);
   else
     put_fhandle_info(level, fh);
+  pool_unlock();
 }
 
 void put_page_info(pmsg_level level, page_p p) {
@@ -139,10 +446,10 @@ void put_page_info(pmsg_level level, page_p p) {
   put_msg(level, "  current_pos: %d, ", p->current_pos);
   append_msg(level, "  free_pos: %d, ", p->free_pos);
 
-  if (p->pinned == 0)
+  if (p->pin_count <= 0)
     append_msg(level,  "unpinned, ");
   else
-    append_msg(level,  "pinned, ");
+    append_msg(level,  "pinned %d times, ", p->pin_count);
 
   if (p->dirty == 0)
     append_msg(level,  "clean\n");
@@ -161,33 +468,151 @@ void put_block_info(pmsg_level level, block_p b) {
              b->blk_nr, b->page->page_nr);
 }
 
+/* Occupancy of the buffer by the files, with the pool lock */
+static void put_occupancy_info(pmsg_level level) {
+  put_msg(level, "Buffer: %d pages, %d free\n", num_pages, num_free_pages);
+  for (size_t i = 0; fh_table && i <= fh_table_mask; i++)
+    for (fhandle_p fh = fh_table[i]; fh; fh = fh->hnext) {
+      if (fh->num_blocks_in_mem == 0 && fh->max_pages == 0) continue;
+      put_msg(level, "  \"%s\": %d pages (%.1f%%)", fh->fname,
+              fh->num_blocks_in_mem,
+              num_pages ? 100.0 * fh->num_blocks_in_mem / num_pages : 0.0);
+      if (fh->max_pages > 0)
+        append_msg(level, ", quota %d", fh->max_pages);
+      append_msg(level, "\n");
+    }
+}
+
+void put_buffer_info(pmsg_level level) {
+  pool_lock();
+  put_occupancy_info(level);
+  pool_unlock();
+}
+
 void put_pager_info(pmsg_level level,  char const* msg) {
   if (!msg) msg = "";
   put_msg(level,  "----Pager Info Begin----\n");
   put_msg(level,  "(%s)\n", msg);
+  pool_lock();
+  put_occupancy_info(level);
   put_msg(level, "file handlers:\n");
-  for (size_t i = 0; i < MAX_OPEN_FILES; i++)
-    if (file_handles[i]) {
-      put_msg(level,  " %d:\n", i);
-      put_fhandle_info(level, file_handles[i]);
+  for (size_t i = 0; fh_table && i <= fh_table_mask; i++)
+    for (fhandle_p fh = fh_table[i]; fh; fh = fh->hnext) {
+      put_msg(level,  " %d:\n", fh->fid);
+      put_fhandle_info(level, fh);
     }
 
-  put_msg(level, "pages:\n");
-  for (size_t i = 0; i < NUM_PAGES; i++)
+  put_msg(level, "pages (%d, %d free):\n", num_pages, num_free_pages);
+  for (size_t i = 0; i < num_pages; i++)
     if (pages[i]) {
       put_msg(level,  " page  %d:\n", i);
       put_page_info(level, pages[i]);
     }
+  pool_unlock();
 
   put_msg(level,  "----Pager Info End ----\n");
 }
 
+/* Fold the counters of an exiting thread into exited_counters */
+static void release_thread_profiler(void* arg) {
+  thread_profiler* tp = arg;
+  pthread_mutex_lock(&profiler_mutex);
+  for (thread_profiler** tpp = &thread_profilers; *tpp; tpp = &(*tpp)->next)
+    if (*tpp == tp) {
+      *tpp = tp->next;
+      break;
+    }
+  long long *sum = (long long*) &exited_counters, *c = (long long*) &tp->c;
+  for (size_t i = 0; i < sizeof (pager_counters) / sizeof (long long); i++)
+    sum[i] += c[i];
+  pthread_mutex_unlock(&profiler_mutex);
+  free(tp);
+}
+
+static void make_profiler_key(void) {
+  pthread_key_create(&profiler_key, release_thread_profiler);
+}
+
+/* The profiler of the calling thread, made on its first use */
+static thread_profiler* prof(void) {
+  if (my_profiler) return my_profiler;
+  pthread_once(&profiler_once, make_profiler_key);
+  thread_profiler* tp = calloc(1, sizeof (thread_profiler));
+  if (!tp) {
+    /* count nowhere rather than fail */
+    static __thread thread_profiler dummy;
+    return &dummy;
+  }
+  tp->last_fd = -1;
+  tp->last_blk_nr = -1;
+  pthread_mutex_lock(&profiler_mutex);
+  tp->next = thread_profilers;
+  thread_profilers = tp;
+  pthread_mutex_unlock(&profiler_mutex);
+  pthread_setspecific(profiler_key, tp);
+  my_profiler = tp;
+  return tp;
+}
+
+/* Sum of the counters of all threads */
+static void sum_counters(pager_counters* sum) {
+  pthread_mutex_lock(&profiler_mutex);
+  *sum = exited_counters;
+  for (thread_profiler* tp = thread_profilers; tp; tp = tp->next) {
+    long long *s = (long long*) sum, *c = (long long*) &tp->c;
+    for (size_t i = 0; i < sizeof (pager_counters) / sizeof (long long); i++)
+      s[i] += c[i];
+  }
+  pthread_mutex_unlock(&profiler_mutex);
+}
+
 void put_pager_profiler_info(pmsg_level level) {
-  put_msg(level, "Number of disk seeks/reads/writes/IOs: %d/%d/%d/%d\n",
-          pager_profiler.num_seeks,
-          pager_profiler.num_disk_reads,
-          pager_profiler.num_disk_writes,
-          pager_profiler.num_disk_reads + pager_profiler.num_disk_writes);
+  pager_counters pc;
+  sum_counters(&pc);
+  put_msg(level, "Number of disk seeks/reads/writes/IOs: %lld/%lld/%lld/%lld\n",
+          pc.num_seeks,
+          pc.num_disk_reads,
+          pc.num_disk_writes,
+          pc.num_disk_reads + pc.num_disk_writes);
+  long long num_accesses = pc.num_hits + pc.num_misses;
+  put_msg(level, "Buffer hits/misses/evictions: %lld/%lld/%lld, hit ratio %.1f%%\n",
+          pc.num_hits,
+          pc.num_misses,
+          pc.num_evictions,
+          num_accesses ? 100.0 * pc.num_hits / num_accesses : 0.0);
+  if (pc.num_ra_reads > 0)
+    put_msg(level, "Read ahead: %lld blocks in %lld reads, %lld accessed, %lld wasted\n",
+            pc.num_ra_blocks,
+            pc.num_ra_reads,
+            pc.num_ra_hits,
+            pc.num_ra_wasted);
+  if (pc.num_wb_writes > 0)
+    put_msg(level, "Write back: %lld blocks in %lld writes\n",
+            pc.num_wb_blocks,
+            pc.num_wb_writes);
+  if (pc.num_mapped > 0)
+    put_msg(level, "Memory mapped: %lld blocks served from file mappings\n",
+            pc.num_mapped);
+  if (pc.num_extents > 0)
+    put_msg(level, "File growth: %lld extents of %d blocks\n",
+            pc.num_extents, extent_blocks);
+  if (pc.num_preloaded > 0)
+    put_msg(level, "Warm restart: %lld blocks preloaded\n", pc.num_preloaded);
+  if (pc.num_cc_puts > 0)
+    put_msg(level, "Compressed cache: %lld blocks kept, %lld read back\n",
+            pc.num_cc_puts, pc.num_cc_hits);
+  if (pc.num_sp_puts > 0 || pc.num_sp_hits > 0)
+    put_msg(level, "Shared pool: %lld blocks put, %lld read from it\n",
+            pc.num_sp_puts, pc.num_sp_hits);
+  if (pc.num_lss_writes > 0 || pc.num_lss_moved > 0)
+    put_msg(level, "Log-structured: %lld blocks appended, %lld moved by the cleaner\n",
+            pc.num_lss_writes, pc.num_lss_moved);
+  if (pc.num_ring_reuses > 0)
+    put_msg(level, "Scan rings: %lld pages recycled\n", pc.num_ring_reuses);
+  if (pc.num_log_records > 0)
+    put_msg(level, "Log: %lld changes (%lld bytes) of %lld statements in %lld syncs, "
+            "%lld checkpoints\n", pc.num_log_records, pc.num_log_bytes,
+            pc.num_commits, pc.num_log_syncs, pc.num_checkpoints);
 }
 
 static void put_pqueue_info(pmsg_level level, pqueue_p q,
@@ -209,18 +634,25 @@ static void put_pqueue_info(pmsg_level level, pqueue_p q,
   append_msg(level, "\n");
 }
 
+/* forward declaration */
+static void put_repl_info(pmsg_level level);
+
 void put_pqueues_info(pmsg_level level) {
-  put_pqueue_info(level, q_unpinned, "unpinned");
-  put_pqueue_info(level, q_pinned, "pinned");
+  pool_lock();
+  put_repl_info(level);
+  pool_unlock();
 }
 
 
 void pager_profiler_reset(void) {
-  pager_profiler.num_seeks = 0;
-  pager_profiler.num_disk_reads = 0;
-  pager_profiler.num_disk_writes = 0;
-  pager_profiler.last_fd = -1;
-  pager_profiler.last_blk_nr = -1;
+  pthread_mutex_lock(&profiler_mutex);
+  memset(&exited_counters, 0, sizeof exited_counters);
+  for (thread_profiler* tp = thread_profilers; tp; tp = tp->next) {
+    memset(&tp->c, 0, sizeof tp->c);
+    tp->last_fd = -1;
+    tp->last_blk_nr = -1;
+  }
+  pthread_mutex_unlock(&profiler_mutex);
 }
 
 int set_system_dir(char const* dir) {
@@ -232,43 +664,83 @@ int set_system_dir(char const* dir) {
   }
 
   pager_terminate();
-  if (chdir(dir) == -1) {
-    if ((mkdir(dir, 0755) == -1) || (chdir(dir) == -1)) {
-      put_msg(ERROR, "%s - Invalid dir for database.\n", dir);
-      return 0;
+  if (strcmp(dir, MEMORY_DB) == 0) {
+    /* the files are in memory, not in any dir */
+    in_memory = 1;
+    strcpy(sys_dir, dir);
+  } else {
+    if (chdir(dir) == -1) {
+      if ((mkdir(dir, 0755) == -1) || (chdir(dir) == -1)) {
+        put_msg(ERROR, "%s - Invalid dir for database.\n", dir);
+        return 0;
+      }
     }
+    getcwd(sys_dir, sizeof sys_dir);
   }
-  getcwd(sys_dir, sizeof sys_dir);
   put_msg(DEBUG, "db dir : %s\n", sys_dir);
 
-  return pager_init();
+  return pager_init(0, REPL_SAME);
 }
 
 char* system_dir() {
   return sys_dir;
 }
 
+static int num_dirty_pages;
+static int dirty_high_pct = DIRTY_HIGH_PCT;
+static int dirty_low_pct = DIRTY_LOW_PCT;
+
+static void set_page_dirty(page_p p) {
+  if (!__atomic_exchange_n(&p->dirty, 1, __ATOMIC_ACQ_REL))
+    __atomic_add_fetch(&num_dirty_pages, 1, __ATOMIC_RELAXED);
+}
+
+static void set_page_clean(page_p p) {
+  if (__atomic_exchange_n(&p->dirty, 0, __ATOMIC_ACQ_REL))
+    __atomic_sub_fetch(&num_dirty_pages, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->rec_lsn, 0, __ATOMIC_RELEASE);
+}
+
+/* The page is dirty again after writing it failed. The log of all its
+   changes is kept, since it is not known which of them are written. */
+static void set_page_unwritten(page_p p) {
+  set_page_dirty(p);
+  __atomic_store_n(&p->rec_lsn, 1, __ATOMIC_RELEASE);
+}
+
+/* forward declaration */
+static void wal_log(page_p p, int offset, int len);
+
+/* Make the content of the page its own before changing it,
+   if the content is served from a file mapping */
+static void unmap_page(page_p p) {
+  if (p->content == p->buffer) return;
+  memcpy(p->buffer, p->content, block_size);
+  p->content = p->buffer;
+}
+
 /** Increment num_seeks if needed
     update last_fd, last_blk_nr */
 static void inc_num_seeks_maybe(int fd, int blk_nr) {
   /* put_msg (DEBUG, "seeks_maybe: fd %d, blk: %d\n", fd, blk_nr); */
-  if (fd != pager_profiler.last_fd
-      || abs(blk_nr - pager_profiler.last_blk_nr) > 1)
-    pager_profiler.num_seeks++;
-  pager_profiler.last_fd = fd;
-  pager_profiler.last_blk_nr = blk_nr;
+  thread_profiler* tp = prof();
+  if (fd != tp->last_fd
+      || abs(blk_nr - tp->last_blk_nr) > 1)
+    tp->c.num_seeks++;
+  tp->last_fd = fd;
+  tp->last_blk_nr = blk_nr;
 }
 
 /** Increment num_disk_reads */
 static void inc_num_reads(int fd, int blk_nr) {
   inc_num_seeks_maybe(fd, blk_nr);
-  pager_profiler.num_disk_reads++;
+  prof()->c.num_disk_reads++;
 }
 
 /** increment num_disk_writes */
 static void inc_num_writes(int fd, int blk_nr) {
   inc_num_seeks_maybe(fd, blk_nr);
-  pager_profiler.num_disk_writes++;
+  prof()->c.num_disk_writes++;
 }
 
 static int get_header_int_at(page_p  p, int offset) {
@@ -289,8 +761,10 @@ static int put_header_int_at(page_p p, int offset, int val) {
             offset, 0L, PAGE_HEADER_SIZE - INT_SIZE - 1);
     return 0;
   }
+  unmap_page(p);
   memcpy(p->content + offset, (char *) &val, INT_SIZE);
-  p->dirty = 1;
+  set_page_dirty(p);
+  wal_log(p, offset, INT_SIZE);
   return 1;
 }
 
@@ -298,6 +772,7 @@ static int put_header_int_at(page_p p, int offset, int val) {
    the current position */
 static void init_page_header_size(page_p p) {
   put_header_int_at(p, 0, PAGE_HEADER_SIZE);
+  put_header_int_at(p, 8, block_size);
 }
 
 static void check_page_header_size(page_p p) {
@@ -308,6 +783,15 @@ static void check_page_header_size(page_p p) {
             header_size, PAGE_HEADER_SIZE);
     exit(EXIT_FAILURE);
   }
+  /* blocks written before block sizes were recorded are of 512 bytes */
+  int blk_size = get_header_int_at(p, 8);
+  if (blk_size == 0) blk_size = MIN_BLOCK_SIZE;
+  if (blk_size != block_size) {
+    put_msg(FATAL,
+            "Block size of block is %d, which is incompatible with %ld of current pager.\n",
+            blk_size, block_size);
+    exit(EXIT_FAILURE);
+  }
 }
 
 static void set_page_free_pos(page_p p, int pos) {
@@ -319,30 +803,55 @@ static void set_page_free_pos_from_content(page_p p) {
   p->free_pos = get_header_int_at(p, 4);
 }
 
+/* Set up the page from the content of its block just read.
+   A block of zeros is preallocated but not written yet, it gets the
+   header of an empty block. Returns 0 for such a block. */
+static int set_page_from_content(page_p p) {
+  if (get_header_int_at(p, 0) == 0) {
+    init_page_header_size(p);
+    set_page_free_pos(p, PAGE_HEADER_SIZE);
+    return 0;
+  }
+  check_page_header_size(p);
+  set_page_free_pos_from_content(p);
+  return 1;
+}
+
+/** header offset of the number of blocks in use, in block 0 */
+#define HEADER_NUM_BLOCKS 12
+
+/* Record the number of blocks of the file in block 0, about to be written */
+static void stamp_num_blocks(page_p p) {
+  if (p->block->blk_nr != 0 || p->content != p->buffer) return;
+  int n = __atomic_load_n(&p->block->fhandle->num_blocks, __ATOMIC_ACQUIRE);
+  memcpy(p->content + HEADER_NUM_BLOCKS, &n, INT_SIZE);
+}
+
 static void init_page(page_p p) {
   if (!p) return;
-  memset(p->content, 0, BLOCK_SIZE);
+  p->block = 0;
+  p->content = p->buffer;
+  memset(p->content, 0, block_size);
   init_page_header_size(p);
   set_page_free_pos(p, PAGE_HEADER_SIZE);
-  p->qelm = 0;
-  p->block = 0;
-  p->pinned = 0;
-  p->dirty = 0;
+  p->qelm.page = p;
+  p->queue = 0;
+  p->ref = 0;
+  p->heap_i = -1;
+  p->lsn = 0;
+  __atomic_store_n(&p->pin_count, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&p->valid, 0, __ATOMIC_RELEASE);
+  p->prefetched = 0;
+  set_page_clean(p);
   p->current_pos = PAGE_HEADER_SIZE;
 }
 
-static page_p make_page(int page_nr) {
-  page_p p = malloc(sizeof (page_struct));
-  if (!p) {
-    put_msg(ERROR, "make_page failed");
-    return 0;
-  }
-  p->content = malloc(BLOCK_SIZE);
-  if (!p->content) {
-    free(p);
-    put_msg(ERROR, "make_page failed");
-    return 0;
-  }
+static page_p make_page(page_p p, int page_nr, char* buffer) {
+  p->dirty = 0;
+  p->buffer = buffer;
+  p->pending = 0;
+  p->pending_next = 0;
+  pthread_rwlock_init(&p->latch, 0);
   init_page(p);
   p->page_nr = page_nr;
   return p;
@@ -356,31 +865,18 @@ static pqueue_p make_pqueue() {
   return pq;
 }
 
+/* The elements are part of the pages and are not released */
 static pqueue_p release_pqueue(pqueue_p q) {
   if (!q) return 0;
-  pq_elm_p nextp = q->first;
-  pq_elm_p p;
-  while (nextp) {
-    p = nextp; nextp = p->next;
-    free(p);
-    if (nextp == q->last) {
-      if (nextp != q->first)
-        free(nextp); /* beware: already freed if last == first */
-      nextp = 0;
-    }
+  for (int i = 0; q->first && i < q->len; i++) {
+    page_p pg = q->first->page;
+    q->first = q->first->next;
+    pg->queue = 0;
   }
   free(q);
-  q = 0;
   return 0;
 }
 
-static pq_elm_p make_pq_elm(page_p pg) {
-  pq_elm_p p = malloc(sizeof (pq_elm));
-  p->page = pg;
-  pg->qelm = p;
-  return p;
-}
-
 /* pg becomes the last in q */
 static void pq_insert(pqueue_p q, pq_elm_p p) {
   if (!q->first) {
@@ -421,425 +917,4978 @@ static void pq_enqueue(pqueue_p q, page_p pg) {
     put_msg(ERROR, "pq_enqueue: NULL pqueue or page.\n");
     return;
   }
-  return pq_insert(q, make_pq_elm(pg));
+  pq_insert(q, &pg->qelm);
+  pg->queue = q;
+}
+
+/* pg is moved to the last in q */
+static void pq_move(pqueue_p q, page_p pg) {
+  pq_elm_p p = &pg->qelm;
+  if (!pg->queue) {
+    pq_enqueue(q, pg);
+    return;
+  }
+  pq_remove(pg->queue, p);
+  pq_insert(q, p);
+  pg->queue = q;
 }
 
-/* pg is moved to the last in the LRF queue */
+/* pg is moved to the last in its queue */
 static void pq_touch(page_p pg) {
   if (!pg) {
     put_msg(WARN, "touching NULL page.\n");
     return;
   }
-  pq_elm_p p = pg->qelm;
-  if (!p) {
-    put_msg(WARN, "touching NULL qelm.\n");
+  pq_elm_p p = &pg->qelm;
+  if (!pg->queue) {
+    put_msg(WARN, "touching a page not in any queue.\n");
     return;
   }
 
-  pqueue_p q = pg->pinned ? q_pinned : q_unpinned;
+  pqueue_p q = pg->queue;
   if (p == q->last) return;
   pq_remove(q, p);
   pq_insert(q, p);
   return;
 }
 
-/* remove the first in q */
-static page_p pq_dequeue_unpinned() {
-  if (!q_unpinned->first) return 0;
+/* Remove pg from the queue it is in */
+static void pq_remove_page(page_p pg) {
+  if (!pg->queue) return;
+  pq_remove(pg->queue, &pg->qelm);
+  pg->queue = 0;
+}
 
-  pq_elm_p p = q_unpinned->first;
-  page_p pg = p->page;
-  pq_remove(q_unpinned, p);
-  free(p);
-  return pg;
+/** Hash value of block @em blk_nr of file @em fid.
+    The bucket of the block is the hash value masked with blk_table_mask,
+    which may change while the buffer grows, see grow_blk_table(). */
+static size_t blk_hash(int fid, int blk_nr) {
+  uint64_t k = ((uint64_t) (uint32_t) fid << 32) | (uint32_t) blk_nr;
+  /* finalizer of MurmurHash3, spreads the bits of both numbers */
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return (size_t) k;
 }
 
-static page_p pq_dequeue_pinned() {
-  if (!q_pinned->first) return 0;
+/* The lock of the stripe of the block table that hash value h is in.
+   There are at least BLK_STRIPES buckets, so all blocks of a bucket
+   are in the same stripe. */
+static pthread_mutex_t* blk_stripe_lock(size_t h) {
+  return &blk_stripes[h & (BLK_STRIPES - 1)].mutex;
+}
 
-  pq_elm_p p = q_pinned->first;
-  page_p pg = p->page;
-  unpin(pg);
-  pq_remove(q_unpinned, p);
-  free(p);
-  return pg;
+/* Returns the block in memory with block nr bnr of the file,
+   NULL if the block is not in memory.
+   The block table only changes under the pool lock, which the caller
+   holds. */
+static block_p lookup_block(fhandle_p fh, int bnr) {
+  for (block_p b = blk_table[blk_hash(fh->fid, bnr) & blk_table_mask];
+       b; b = b->hnext)
+    if (b->fhandle == fh && b->blk_nr == bnr)
+      return b;
+  return 0;
 }
 
-/* pg truns into pinned, move it to another queue */
-static void pq_turn_pinned(page_p pg) {
-  if (pg->pinned) return;
-  pq_elm_p p = pg->qelm;
-  pq_remove(q_unpinned, p);
-  pq_insert(q_pinned, p);
-  return;
+/* Make the block managed in the block table and the file handle */
+static void link_block(block_p b) {
+  fhandle_p fh = b->fhandle;
+  size_t h = blk_hash(fh->fid, b->blk_nr);
+  pthread_mutex_lock(blk_stripe_lock(h));
+  b->hnext = blk_table[h & blk_table_mask];
+  blk_table[h & blk_table_mask] = b;
+  pthread_mutex_unlock(blk_stripe_lock(h));
+
+  b->fprev = 0;
+  b->fnext = fh->blocks_in_mem;
+  if (fh->blocks_in_mem)
+    fh->blocks_in_mem->fprev = b;
+  fh->blocks_in_mem = b;
+  fh->num_blocks_in_mem++;
 }
 
-/* pg turns into unpinned, move it to another queue */
-static void pq_turn_unpinned(page_p pg) {
-  if (!pg->pinned) return;
-  pq_elm_p p = pg->qelm;
-  pq_remove(q_pinned, p);
-  pq_insert(q_unpinned, p);
-  return;
+/* Reverse of link_block() */
+static void unlink_block(block_p b) {
+  fhandle_p fh = b->fhandle;
+  size_t h = blk_hash(fh->fid, b->blk_nr);
+  pthread_mutex_lock(blk_stripe_lock(h));
+  block_p *bp = &blk_table[h & blk_table_mask];
+  while (*bp && *bp != b)
+    bp = &(*bp)->hnext;
+  int linked = *bp != 0;
+  if (linked)
+    *bp = b->hnext;
+  pthread_mutex_unlock(blk_stripe_lock(h));
+  if (!linked) return;
+
+  if (b->fprev)
+    b->fprev->fnext = b->fnext;
+  else
+    fh->blocks_in_mem = b->fnext;
+  if (b->fnext)
+    b->fnext->fprev = b->fprev;
+  fh->num_blocks_in_mem--;
 }
 
-/* Search the global file_handles[] to see if the file
-   is already open and returns its position in file_handles[].
-   Returns -1 if the file is not open.
-*/
-static int find_fhandle_i(char const* fname) {
-  for (size_t i = 0, num_compared = 0;
-       num_compared < num_file_handles;
-       i++) {
-    if (file_handles[i]) {
-      if (strcmp(file_handles[i]->fname, fname) == 0)
-        return i;
-      num_compared++;
-    }
-  }
-  return -1;
+/* Pin the page once more, unless it is being replaced.
+   Returns the new pin count, 0 if the page is being replaced. */
+static int pin_page(page_p pg) {
+  int c = __atomic_load_n(&pg->pin_count, __ATOMIC_RELAXED);
+  while (c >= 0)
+    if (__atomic_compare_exchange_n(&pg->pin_count, &c, c + 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return c + 1;
+  return 0;
 }
 
-/* Search the global file_handles[] for an empty slot,
-   to be used to store a new file handle.
-   Returns -1 if there is no empty slot (the number of
-   open files has reached MAX_OPEN_FILES).
-*/
-static int get_empty_fhandle_i() {
-  for (size_t i = 0; i < MAX_OPEN_FILES; i++)
-    if (!file_handles[i]) return i;
+/* Take away one pin of the page, if it is pinned.
+   Returns the new pin count, -1 if the page was not pinned. */
+static int unpin_page(page_p pg) {
+  int c = __atomic_load_n(&pg->pin_count, __ATOMIC_RELAXED);
+  while (c > 0)
+    if (__atomic_compare_exchange_n(&pg->pin_count, &c, c - 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return c - 1;
   return -1;
 }
 
-static fhandle_p make_fhandle(char const* fname, int fd) {
-  fhandle_p fh = malloc(sizeof (file_handle_struct));
-  fh->fname = malloc(strlen(fname) + 1);
-  strcpy(fh->fname, fname);
-  fh->fd = fd;
-  fh->num_blocks = lseek(fd, (off_t) 0, SEEK_END) / BLOCK_SIZE;
-  fh->current_block = 0;
-  for (size_t i = 0; i < NUM_PAGES; i++)
-    fh->blocks_in_mem[i] = 0;
-
-  return fh;
+/* Claim an unpinned page for replacement. Returns 0 if it is pinned. */
+static int claim_page(page_p pg) {
+  int c = 0;
+  return __atomic_compare_exchange_n(&pg->pin_count, &c, -1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
 }
 
-static fhandle_p get_tbl_file(char const* fname) {
-  int file_i = find_fhandle_i(fname);
-
-  if (file_i == -1) return 0;
+static int is_pinned(page_p pg) {
+  return __atomic_load_n(&pg->pin_count, __ATOMIC_ACQUIRE) > 0;
+}
 
-  return file_handles[file_i];
+/* Pin the page of block bnr of the file if the block is in memory,
+   holding only the lock of the stripe of the block.
+   Returns NULL if the block is not in memory or is being replaced. */
+static page_p pin_buffered(fhandle_p fh, int bnr, int* pin_count) {
+  size_t h = blk_hash(fh->fid, bnr);
+  page_p pg = 0;
+  pthread_mutex_lock(blk_stripe_lock(h));
+  for (block_p b = blk_table[h & blk_table_mask]; b; b = b->hnext)
+    if (b->fhandle == fh && b->blk_nr == bnr) {
+      if ((*pin_count = pin_page(b->page)) > 0)
+        pg = b->page;
+      break;
+    }
+  pthread_mutex_unlock(blk_stripe_lock(h));
+  return pg;
 }
 
-static fhandle_p open_tbl_file(char const* fname) {
-  if (num_file_handles == MAX_OPEN_FILES) {
-    put_msg(WARN,
-            "open Cannot file %s because the limit %d of open files has reached.",
-            fname, MAX_OPEN_FILES);
-    return 0;
-  }
+/* ---------------------------------------------------------------------
+   Storage backends.
+   All I/O of table files goes through the ops of a backend, on file
+   descriptors the backend hands out:
+   - posix: files in the system dir;
+   - memory: files in the memory of the process, for a ":memory:"
+     system dir. They are kept till the process exits;
+   - slow: wraps one of them, a read or a write is done at once but
+     returns only after a latency and the time its bytes take at a
+     bandwidth that all reads and writes share, as on a slow disk;
+   - lss: laid over the others, for the files that are stored
+     log-structured, see below.
+   The log is made and dropped in the system dir with POSIX calls, but
+   it is written through the backend. A memory database has no log.
+   --------------------------------------------------------------------- */
+
+/** @brief Operations of a storage backend.
+    They return what the POSIX calls return, with errno set upon failure. */
+typedef struct {
+  char const* name;
+  /** open the file for read and write, created if it does not exist */
+  int (*open)(char const* fname, int direct);
+  int (*close)(int fd);
+  ssize_t (*pread)(int fd, void* buf, size_t len, off_t pos);
+  ssize_t (*pwrite)(int fd, void const* buf, size_t len, off_t pos);
+  ssize_t (*preadv)(int fd, struct iovec const* iov, int n, off_t pos);
+  ssize_t (*pwritev)(int fd, struct iovec const* iov, int n, off_t pos);
+  off_t (*size)(int fd);
+  int (*truncate)(int fd, off_t size);
+  /** make room for len bytes at pos, returns 0 or an error number */
+  int (*allocate)(int fd, off_t pos, off_t len);
+  int (*sync)(int fd);
+  /** hint that the len bytes at pos are not read again soon,
+      returns 0 or an error number */
+  int (*drop_cache)(int fd, off_t pos, off_t len);
+  /** map the first len bytes for reading, MAP_FAILED upon failure */
+  void* (*map)(int fd, size_t len);
+  int (*unmap)(void* map, size_t len);
+  int (*exists)(char const* fname);
+  int (*remove)(char const* fname);
+  int (*rename)(char const* from, char const* to);
+} vfs_ops;
+
+/* Turn off direct I/O on fd if an I/O failed because of it, for example
+   when the device needs a larger alignment than block_size.
+   Returns non-zero if the I/O should be tried again. */
+static int direct_io_fallback(int fd) {
+  if (errno != EINVAL) return 0;
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || !(flags & O_DIRECT)) return 0;
+  if (fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1) return 0;
+  put_msg(WARN, "Direct I/O is not supported on fd %d, turned off.\n", fd);
+  return 1;
+}
 
-  int fd = open(fname, O_RDWR, 0);
-  if (fd == -1) {
+static int posix_open(char const* fname, int direct) {
+  int flags = O_RDWR | (direct ? O_DIRECT : 0);
+  int fd = open(fname, flags, 0);
+  if (fd == -1 && errno == ENOENT) {
     /* if the file does not exist, create one */
     if ((fd = creat(fname, 0600)) == -1) {
       put_msg(WARN, "Failed to create file %s.", fname);
-      return 0;
+      return -1;
     }
 
     /* close and open the created file again for read and write */
-    if (close(fd) == -1 || (fd = open(fname, O_RDWR, 0)) == -1)
-      return 0;
+    if (close(fd) == -1)
+      return -1;
+    fd = open(fname, flags, 0);
+  }
+  if (fd == -1 && direct && errno == EINVAL) {
+    /* the file system does not support direct I/O */
+    put_msg(WARN, "Direct I/O is not supported for file %s.\n", fname);
+    fd = open(fname, O_RDWR, 0);
   }
+  return fd;
+}
 
-  int empty_i = get_empty_fhandle_i();
-  if (empty_i == -1) return 0;
+static ssize_t posix_pread(int fd, void* buf, size_t len, off_t pos) {
+  ssize_t n;
+  while ((n = pread(fd, buf, len, pos)) == -1 && direct_io_fallback(fd))
+    ;
+  return n;
+}
 
-  fhandle_p fh = make_fhandle(fname, fd);
+static ssize_t posix_pwrite(int fd, void const* buf, size_t len, off_t pos) {
+  ssize_t n;
+  while ((n = pwrite(fd, buf, len, pos)) == -1 && direct_io_fallback(fd))
+    ;
+  return n;
+}
 
-  file_handles[empty_i] = fh;
-  num_file_handles++;
+static ssize_t posix_preadv(int fd, struct iovec const* iov, int cnt,
+                            off_t pos) {
+  ssize_t n;
+  while ((n = preadv(fd, iov, cnt, pos)) == -1 && direct_io_fallback(fd))
+    ;
+  return n;
+}
 
-  return fh;
+static ssize_t posix_pwritev(int fd, struct iovec const* iov, int cnt,
+                             off_t pos) {
+  ssize_t n;
+  while ((n = pwritev(fd, iov, cnt, pos)) == -1 && direct_io_fallback(fd))
+    ;
+  return n;
 }
 
-int file_num_blocks(char const* fname) {
-  fhandle_p fh = get_tbl_file(fname);
-  if (!fh) fh = open_tbl_file(fname);
+static off_t posix_size(int fd) {
+  return lseek(fd, 0, SEEK_END);
+}
 
-  if (!fh) {
-    put_msg(ERROR, "file_num_blocks: cannot get file \"fname\".\n");
-    return -1;
-  }
-  return fh->num_blocks;
+/* The kernel may drop the bytes from its page cache */
+static int posix_drop_cache(int fd, off_t pos, off_t len) {
+  return posix_fadvise(fd, pos, len, POSIX_FADV_DONTNEED);
 }
 
-/* forward declaration */
-static void release_block(block_p b);
+static void* posix_map(int fd, size_t len) {
+  return mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+}
 
-static void close_tbl_file(fhandle_p fhandle) {
-  if (!fhandle) return;
-  for (size_t i = 0; i < NUM_PAGES; i++) {
-    if (fhandle->blocks_in_mem[i])
-      release_block(fhandle->blocks_in_mem[i]);
-  }
-  if (close(fhandle->fd) == 0) {
-    int file_i = find_fhandle_i(fhandle->fname);
-    free(fhandle->fname);
-    free(fhandle);
-    file_handles[file_i] = 0;
-    num_file_handles--;
-  }
+static int posix_exists(char const* fname) {
+  return access(fname, F_OK) == 0;
 }
 
-int close_file(char const* fname) {
-  int i = find_fhandle_i(fname);
-  if (i != -1)
-    close_tbl_file(file_handles[i]);
-  return i;
+static vfs_ops const posix_vfs = {
+  "posix", posix_open, close, posix_pread, posix_pwrite,
+  posix_preadv, posix_pwritev, posix_size, ftruncate, posix_fallocate,
+  fdatasync, posix_drop_cache, posix_map, munmap, posix_exists, remove, rename
+};
+
+/** @brief A file of the memory backend, its fd is its index in mem_files */
+typedef struct {
+  char *name;  /**< NULL if the slot is free */
+  char *data;
+  size_t size;
+  size_t cap;
+} mem_file;
+
+/** The files of the memory backend, guarded by mem_lock.
+    Reads share the lock, writes may move the data of a file. */
+static mem_file *mem_files;
+static int num_mem_files;
+static pthread_rwlock_t mem_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The file with the given fd, with mem_lock */
+static mem_file* mem_file_of(int fd) {
+  if (fd < 0 || fd >= num_mem_files || !mem_files[fd].name) {
+    errno = EBADF;
+    return 0;
+  }
+  return &mem_files[fd];
 }
 
-int pager_init(void) {
-  num_file_handles = 0;
+/* The fd of the file with the given name, -1 if there is none.
+   With mem_lock. */
+static int mem_find(char const* fname) {
+  for (int fd = 0; fd < num_mem_files; fd++)
+    if (mem_files[fd].name && strcmp(mem_files[fd].name, fname) == 0)
+      return fd;
+  return -1;
+}
 
-  /* global vars file_handles[] are initialized with NULL.
-     in case they are not, or pager_init is called again
-     after pager_terminate, initialize them anyway */
-  for (size_t i = 0; i < MAX_OPEN_FILES; i++)
-    file_handles[i] = 0;
-  for (size_t i = 0; i < NUM_PAGES; i++) {
-    pages[i] = make_page(i);
-    if (pages[i] == NULL) {
-      put_msg(ERROR, "pager_init failed");
-      pager_terminate();
+/* Let the file have size bytes at least, the new ones are zeros.
+   With mem_lock for writing. Returns 0 if memory runs out. */
+static int mem_extend(mem_file* f, size_t size) {
+  if (size <= f->size) return 1;
+  if (size > f->cap) {
+    size_t cap = f->cap ? f->cap : MAX_BLOCK_SIZE;
+    while (cap < size)
+      cap *= 2;
+    char *data = realloc(f->data, cap);
+    if (!data) {
+      errno = ENOSPC;
       return 0;
     }
+    f->data = data;
+    f->cap = cap;
   }
-  q_pinned = make_pqueue();
-  q_unpinned = make_pqueue();
-  pager_profiler_reset();
+  memset(f->data + f->size, 0, size - f->size);
+  f->size = size;
   return 1;
 }
 
-static block_p get_buffered_blk_in_fhandle(fhandle_p fh, int bnr) {
-  for (size_t i = 0; i < NUM_PAGES; i++)
-    if (fh->blocks_in_mem[i]
-        && fh->blocks_in_mem[i]->blk_nr == bnr) {
-      pq_touch(fh->blocks_in_mem[i]->page);
-      return fh->blocks_in_mem[i];
+static int mem_open(char const* fname, int direct) {
+  pthread_rwlock_wrlock(&mem_lock);
+  int fd = mem_find(fname);
+  if (fd == -1) {
+    for (fd = 0; fd < num_mem_files && mem_files[fd].name; fd++)
+      ;
+    if (fd == num_mem_files) {
+      mem_file *fs = realloc(mem_files, (fd + 1) * sizeof (mem_file));
+      if (fs) {
+        mem_files = fs;
+        num_mem_files++;
+      }
+    }
+    if (fd < num_mem_files && (mem_files[fd].name = strdup(fname))) {
+      mem_files[fd].data = 0;
+      mem_files[fd].size = mem_files[fd].cap = 0;
+    } else {
+      errno = ENOMEM;
+      fd = -1;
     }
+  }
+  pthread_rwlock_unlock(&mem_lock);
+  return fd;
+}
 
+/* The files stay when they are closed */
+static int mem_close(int fd) {
   return 0;
 }
 
-static int set_blk_in_fhandle(fhandle_p fh, block_p b) {
-  for (size_t i = 0; i < NUM_PAGES; i++)
-    if (!fh->blocks_in_mem[i]) {
-      fh->blocks_in_mem[i] = b;
-      return i;
-    }
+/* Read from the file, with mem_lock */
+static ssize_t mem_read(mem_file* f, void* buf, size_t len, off_t pos) {
+  if (pos < 0 || (size_t) pos >= f->size) return 0;
+  if (len > f->size - pos) len = f->size - pos;
+  memcpy(buf, f->data + pos, len);
+  return len;
+}
 
-  put_msg(ERROR, "set_blk_in_fhandle: fails.\n");
-  return -1;
+static ssize_t mem_pread(int fd, void* buf, size_t len, off_t pos) {
+  pthread_rwlock_rdlock(&mem_lock);
+  mem_file *f = mem_file_of(fd);
+  ssize_t n = f ? mem_read(f, buf, len, pos) : -1;
+  pthread_rwlock_unlock(&mem_lock);
+  return n;
 }
 
-static void remove_blk_from_fhandle(block_p b) {
-  for (size_t i = 0; i < NUM_PAGES; i++)
-    if (b->fhandle->blocks_in_mem[i] == b) {
-      b->fhandle->blocks_in_mem[i] = 0;
-      return;
-    }
+static ssize_t mem_preadv(int fd, struct iovec const* iov, int cnt,
+                          off_t pos) {
+  pthread_rwlock_rdlock(&mem_lock);
+  mem_file *f = mem_file_of(fd);
+  ssize_t n = f ? 0 : -1;
+  for (int i = 0; f && i < cnt; i++) {
+    ssize_t m = mem_read(f, iov[i].iov_base, iov[i].iov_len, pos + n);
+    n += m;
+    if (m < (ssize_t) iov[i].iov_len) break;
+  }
+  pthread_rwlock_unlock(&mem_lock);
+  return n;
 }
 
-static int same_block(block_p b1, block_p b2) {
-  if (!b1 || !b2) return 0;
-  return ((strcmp(b1->fhandle->fname, b2->fhandle->fname) == 0)
-          && (b1->blk_nr == b2->blk_nr));
+static ssize_t mem_pwritev(int fd, struct iovec const* iov, int cnt,
+                           off_t pos) {
+  size_t len = 0;
+  for (int i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+  pthread_rwlock_wrlock(&mem_lock);
+  mem_file *f = mem_file_of(fd);
+  if (!f || !mem_extend(f, pos + len)) {
+    pthread_rwlock_unlock(&mem_lock);
+    return -1;
+  }
+  for (int i = 0; i < cnt; i++) {
+    memcpy(f->data + pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  pthread_rwlock_unlock(&mem_lock);
+  return len;
 }
 
-static int is_last_block(block_p b) {
-  return (b->blk_nr == b->fhandle->num_blocks - 1);
+static ssize_t mem_pwrite(int fd, void const* buf, size_t len, off_t pos) {
+  struct iovec iov = { (void*) buf, len };
+  return mem_pwritev(fd, &iov, 1, pos);
 }
 
-int peof(page_p p) {
-  return (is_last_block(p->block) && eop(p));
+static off_t mem_size(int fd) {
+  pthread_rwlock_rdlock(&mem_lock);
+  mem_file *f = mem_file_of(fd);
+  off_t size = f ? (off_t) f->size : -1;
+  pthread_rwlock_unlock(&mem_lock);
+  return size;
 }
 
-/** Release a block (and unpinn). */
-static void release_block(block_p b) {
-  if (!b) return;
-  if (b->page->pinned)
-    unpin(b->page);
-  remove_blk_from_fhandle(b);
-  if (b->fhandle->current_block == b)
-    b->fhandle->current_block = 0;
-  b->page->block = 0;
-  free(b);
+static int mem_truncate(int fd, off_t size) {
+  pthread_rwlock_wrlock(&mem_lock);
+  mem_file *f = mem_file_of(fd);
+  int ok = f && mem_extend(f, size);
+  if (ok) f->size = size;
+  pthread_rwlock_unlock(&mem_lock);
+  return ok ? 0 : -1;
 }
 
-void pager_terminate(void) {
-  /* put_pqueues_info (DEBUG); */
-  for (size_t i = 0; i < NUM_PAGES; i++) {
-    if (!pages[i]) continue;
-    release_block(pages[i]->block);
-    if (pages[i]) {
-      free(pages[i]->content);
-      free(pages[i]);
-    }
-    pages[i] = 0;
-  }
-  for (size_t i = 0; i < MAX_OPEN_FILES; i++)
-    close_tbl_file(file_handles[i]);
-  q_unpinned = release_pqueue(q_unpinned);
-  q_pinned = release_pqueue(q_pinned);
+static int mem_allocate(int fd, off_t pos, off_t len) {
+  pthread_rwlock_wrlock(&mem_lock);
+  mem_file *f = mem_file_of(fd);
+  int res = !f ? EBADF : !mem_extend(f, pos + len) ? ENOSPC : 0;
+  pthread_rwlock_unlock(&mem_lock);
+  return res;
 }
 
-/* Find an available buffer page, in this order:
-   - unused page,
-   - unpinned page,
-   - unpin a pinned page.
-*/
-static page_p available_page() {
-  /* put_pqueues_info (DEBUG); */
-  page_p pg;
-  size_t i;
-  /* First, get an unused page */
-  if (q_pinned->len + q_unpinned->len < NUM_PAGES) {
-    for (i = 0; pages[i]->block; i++);
-    pg = pages[i];
-  } else {
-    /* put_msg (DEBUG, "available_page: all pages are used.\n"); */
-    pg = pq_dequeue_unpinned(); /* replace an unpinned page */
-    if (!pg)
-      /* put_msg(DEBUG, "available_page: all pages are pinned.\n"); */
-      /* If all pages are pinned, unpin the first page
-         and get that one.
-         This is of course a bad page replacement strategy. */
-      pg = pq_dequeue_pinned();
-
-    release_block(pg->block);
-    init_page(pg);
-  }
-  pq_enqueue(q_unpinned, pg);
-  return pg;
+static int mem_sync(int fd) {
+  return 0;
 }
 
-/* Returns the buffer page (position in pages[]) of the block).
-   If the block does not have a buffer page allocated, allocate one.
-*/
-static page_p page_for_block(block_p b) {
-  if (!b) return 0;
-  for (size_t i = 0; i < NUM_PAGES; i++) {
-    if (pages[i] && same_block(pages[i]->block, b))
-      return pages[i];
-  }
-  /* put_msg(WARN, "block %d not in mem yet, allocate an available one.\n", b->blk_nr); */
-  return available_page();
+static int mem_drop_cache(int fd, off_t pos, off_t len) {
+  return 0;
 }
 
-page_p get_page(char const* fname, int blknr) {
-  block_p blk = 0; //block is 0
-  fhandle_p fh = get_tbl_file(fname);
-  if (!fh) fh = open_tbl_file(fname);
+/* The data of a file moves as it grows, so it cannot be mapped */
+static void* mem_map(int fd, size_t len) {
+  errno = ENODEV;
+  return MAP_FAILED;
+}
 
-  if (!fh) {
-    put_msg(ERROR, "get_page: NULL fh.\n");
-    return 0;
-  }
+static int mem_unmap(void* map, size_t len) {
+  errno = EINVAL;
+  return -1;
+}
 
-  if (blknr == -1)
-    blknr = fh->num_blocks == 0 ? 0 : fh->num_blocks - 1;
+static int mem_exists(char const* fname) {
+  pthread_rwlock_rdlock(&mem_lock);
+  int fd = mem_find(fname);
+  pthread_rwlock_unlock(&mem_lock);
+  return fd != -1;
+}
 
-  if (blknr < 0 || blknr > fh->num_blocks) {
-    put_msg(ERROR, "get_page: block nr %d out of ragne [0,%d].",
-            blknr, fh->num_blocks);
-    return 0;
-  }
+/* Drop the file with the given fd, with mem_lock for writing */
+static void mem_drop(int fd) {
+  free(mem_files[fd].name);
+  free(mem_files[fd].data);
+  mem_files[fd].name = 0;
+  mem_files[fd].data = 0;
+}
 
-  if (fh->current_block && blknr == fh->current_block->blk_nr)
-    blk = fh->current_block; //blk is the match
-  else if (blknr == fh->num_blocks)
-    fh->num_blocks++; 
+static int mem_remove(char const* fname) {
+  pthread_rwlock_wrlock(&mem_lock);
+  int fd = mem_find(fname);
+  if (fd != -1)
+    mem_drop(fd);
   else
-    blk = get_buffered_blk_in_fhandle(fh, blknr);
+    errno = ENOENT;
+  pthread_rwlock_unlock(&mem_lock);
+  return fd != -1 ? 0 : -1;
+}
 
-  if (!blk) {
-    blk = malloc(sizeof (block_struct));
-    blk->fhandle = fh;
-    blk->blk_nr = blknr;
-    if (pin(blk) == NULL) {
-      remove_blk_from_fhandle(blk);
-      free(blk);
-      return 0;
-    }
-    set_blk_in_fhandle(fh, blk);
-    blk->page->current_pos = PAGE_HEADER_SIZE;
-  }
-  /* put_msg (DEBUG, "get_page: blk %d, page %d\n",
-     blk->blk_nr, blk->page->page_nr); */
-  fh->current_block = blk;
-  return blk->page;
+static int mem_rename(char const* from, char const* to) {
+  pthread_rwlock_wrlock(&mem_lock);
+  int fd = mem_find(from), res = -1;
+  char *name = fd != -1 ? strdup(to) : 0;
+  if (name) {
+    int old = mem_find(to);
+    if (old != -1 && old != fd)
+      mem_drop(old);
+    free(mem_files[fd].name);
+    mem_files[fd].name = name;
+    res = 0;
+  } else
+    errno = fd == -1 ? ENOENT : ENOMEM;
+  pthread_rwlock_unlock(&mem_lock);
+  return res;
+}
+
+static vfs_ops const mem_vfs = {
+  "memory", mem_open, mem_close, mem_pread, mem_pwrite,
+  mem_preadv, mem_pwritev, mem_size, mem_truncate, mem_allocate,
+  mem_sync, mem_drop_cache, mem_map, mem_unmap, mem_exists, mem_remove, mem_rename
+};
+
+/** The backend wrapped by the slow backend, and its delays */
+static vfs_ops const* slow_base;
+static long io_read_us, io_write_us, io_bandwidth;
+
+/** Time in ns (CLOCK_MONOTONIC) when the bytes of the reads and writes
+    so far have gone through at io_bandwidth */
+static long long slow_busy_until;
+static pthread_mutex_t slow_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Wait for the latency and for the transfer of len bytes after the
+   bytes of the other reads and writes */
+static void slow_delay(ssize_t len, long latency_us) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  long long now = ts.tv_sec * 1000000000LL + ts.tv_nsec, until = now;
+  if (io_bandwidth > 0 && len > 0) {
+    pthread_mutex_lock(&slow_mutex);
+    if (slow_busy_until < now)
+      slow_busy_until = now;
+    slow_busy_until += (long long) (1e9 * len / io_bandwidth);
+    until = slow_busy_until;
+    pthread_mutex_unlock(&slow_mutex);
+  }
+  until += latency_us * 1000LL;
+  if (until <= now) return;
+  ts.tv_sec = until / 1000000000LL;
+  ts.tv_nsec = until % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+    ;
+}
+
+static int slow_open(char const* fname, int direct) {
+  return slow_base->open(fname, direct);
+}
+
+static int slow_close(int fd) {
+  return slow_base->close(fd);
+}
+
+static ssize_t slow_pread(int fd, void* buf, size_t len, off_t pos) {
+  ssize_t n = slow_base->pread(fd, buf, len, pos);
+  slow_delay(n, io_read_us);
+  return n;
+}
+
+static ssize_t slow_pwrite(int fd, void const* buf, size_t len, off_t pos) {
+  ssize_t n = slow_base->pwrite(fd, buf, len, pos);
+  slow_delay(n, io_write_us);
+  return n;
+}
+
+static ssize_t slow_preadv(int fd, struct iovec const* iov, int cnt,
+                           off_t pos) {
+  ssize_t n = slow_base->preadv(fd, iov, cnt, pos);
+  slow_delay(n, io_read_us);
+  return n;
+}
+
+static ssize_t slow_pwritev(int fd, struct iovec const* iov, int cnt,
+                            off_t pos) {
+  ssize_t n = slow_base->pwritev(fd, iov, cnt, pos);
+  slow_delay(n, io_write_us);
+  return n;
+}
+
+static off_t slow_size(int fd) {
+  return slow_base->size(fd);
+}
+
+static int slow_truncate(int fd, off_t size) {
+  return slow_base->truncate(fd, size);
+}
+
+static int slow_allocate(int fd, off_t pos, off_t len) {
+  return slow_base->allocate(fd, pos, len);
+}
+
+/* A sync waits for the disk to have written its cache */
+static int slow_sync(int fd) {
+  int res = slow_base->sync(fd);
+  slow_delay(0, io_write_us);
+  return res;
+}
+
+static int slow_drop_cache(int fd, off_t pos, off_t len) {
+  return slow_base->drop_cache(fd, pos, len);
+}
+
+/* Reads of a mapping could not be delayed */
+static void* slow_map(int fd, size_t len) {
+  errno = ENODEV;
+  return MAP_FAILED;
+}
+
+static int slow_unmap(void* map, size_t len) {
+  return slow_base->unmap(map, len);
+}
+
+static int slow_exists(char const* fname) {
+  return slow_base->exists(fname);
+}
+
+static int slow_remove(char const* fname) {
+  return slow_base->remove(fname);
+}
+
+static int slow_rename(char const* from, char const* to) {
+  return slow_base->rename(from, to);
+}
+
+static vfs_ops const slow_vfs = {
+  "slow", slow_open, slow_close, slow_pread, slow_pwrite,
+  slow_preadv, slow_pwritev, slow_size, slow_truncate, slow_allocate,
+  slow_sync, slow_drop_cache, slow_map, slow_unmap, slow_exists, slow_remove, slow_rename
+};
+
+/** The backend of the pager */
+static vfs_ops const* vfs = &posix_vfs;
+
+/* Pick the backend of a starting pager */
+static void vfs_start(void) {
+  vfs = slow_base = in_memory ? &mem_vfs : &posix_vfs;
+  io_read_us = io_read_us_conf;
+  io_write_us = io_write_us_conf;
+  io_bandwidth = io_bandwidth_conf;
+  if (io_read_us || io_write_us || io_bandwidth) {
+    vfs = &slow_vfs;
+    slow_busy_until = 0;
+  }
+}
+
+int pager_set_io_delay(long read_us, long write_us, long bandwidth) {
+  if (read_us < 0 || write_us < 0 || bandwidth < 0) {
+    put_msg(ERROR, "pager_set_io_delay: invalid delay.\n");
+    return 0;
+  }
+  io_read_us_conf = read_us;
+  io_write_us_conf = write_us;
+  io_bandwidth_conf = bandwidth;
+  return 1;
+}
+
+int pager_in_memory(void) {
+  return in_memory;
+}
+
+/* ---------------------------------------------------------------------
+   Log-structured files.
+   A file can be stored log-structured, see file_set_log_structured():
+   its blocks are appended to segment files of LSS_SEG_BLOCKS blocks,
+   named <file>.seg<n>, wherever they belong in the file, so that every
+   write is sequential. The file itself is a map from each block nr to
+   the segment and slot of the block, which is read when the file is
+   opened and written again (to <file>.map, renamed over the file) when
+   it is synced or closed, after the segments written since are synced.
+   Until then, the previous map and the segments it refers to stay, and
+   the log of the pager has the changes made since.
+   The lss backend lays this over the other backends: it hands out fds
+   from LSS_FD_BASE on for log-structured files, and passes the fds of
+   other files through. A background cleaner moves the blocks in use
+   of segments that are mostly overwritten to the head of the log, and
+   segments that are no longer used are removed at the next map write.
+   --------------------------------------------------------------------- */
+
+static char const lss_magic[8] = "pglss01";
+
+/** @brief Header of the map of a log-structured file, followed by the
+    location of each block: segment * LSS_SEG_BLOCKS + slot + 1,
+    0 for a block of zeros. */
+typedef struct lss_header {
+  char magic[8];
+  int block_size;
+  int num_blocks;  /**< size of the file in blocks */
+  int num_segs;    /**< segment nrs used so far are below it */
+  int head_seg;    /**< segment that blocks are appended to */
+  int head_slot;   /**< next slot of the head segment */
+  int unused;
+} lss_header;
+
+/** @brief An open log-structured file, shared by all opens of it */
+typedef struct lss_file {
+  char *name;
+  int users;           /**< number of opens, guarded by lss_mutex */
+  pthread_rwlock_t lock; /**< shared by reads, exclusive for changes */
+  long long *loc;      /**< location of each block */
+  int num_blocks;
+  int loc_cap;
+  int num_segs;
+  int head_seg;
+  int head_slot;
+  int *seg_live;       /**< blocks in use of each segment, -1 if removed */
+  int *seg_fd;         /**< fd of each segment, -1 if not open */
+  int ckpt_seg;        /**< first segment written since the map was written */
+  int dirty;           /**< non-zero if the map changed since */
+  int gone;            /**< non-zero if removed or renamed while in use */
+} lss_file;
+
+/** The backend under log-structured files */
+static vfs_ops const* lss_base = &posix_vfs;
+
+/** The open log-structured files, the fd of lss_files[i] is
+    LSS_FD_BASE + i. Guarded by lss_mutex. */
+static lss_file **lss_files;
+static int num_lss_files;
+static pthread_mutex_t lss_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t lss_cleaner;
+static int lss_cleaner_running;
+static int lss_cleaner_stop;
+static pthread_cond_t lss_cleaner_wake = PTHREAD_COND_INITIALIZER;
+
+static void lss_seg_name(char const* fname, int seg, char* name, size_t len) {
+  snprintf(name, len, "%s.seg%d", fname, seg);
+}
+
+/* The fd of the segment, opened on demand.
+   Readers may race to open it, the fd of the loser is closed. */
+static int lss_seg_fd(lss_file* f, int seg) {
+  int fd = __atomic_load_n(&f->seg_fd[seg], __ATOMIC_ACQUIRE);
+  if (fd != -1) return fd;
+  char name[PATH_MAX];
+  lss_seg_name(f->name, seg, name, sizeof name);
+  int expected = -1;
+  fd = lss_base->open(name, 0);
+  if (fd != -1
+      && !__atomic_compare_exchange_n(&f->seg_fd[seg], &expected, fd, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    lss_base->close(fd);
+    fd = expected;
+  }
+  return fd;
+}
+
+/* Make room for n blocks in the map. Returns 0 if memory runs out. */
+static int lss_reserve(lss_file* f, int n) {
+  if (n <= f->loc_cap) return 1;
+  int cap = f->loc_cap ? f->loc_cap : 64;
+  while (cap < n)
+    cap *= 2;
+  long long *loc = realloc(f->loc, cap * sizeof (long long));
+  if (!loc) return 0;
+  f->loc = loc;
+  f->loc_cap = cap;
+  return 1;
+}
+
+/* Add a segment, the head of the log from now on */
+static int lss_add_seg(lss_file* f) {
+  int *live = realloc(f->seg_live, (f->num_segs + 1) * sizeof (int));
+  if (live) f->seg_live = live;
+  int *fds = realloc(f->seg_fd, (f->num_segs + 1) * sizeof (int));
+  if (fds) f->seg_fd = fds;
+  if (!live || !fds) return 0;
+  f->seg_live[f->num_segs] = 0;
+  f->seg_fd[f->num_segs] = -1;
+  f->head_seg = f->num_segs++;
+  f->head_slot = 0;
+  return 1;
+}
+
+static void lss_free(lss_file* f) {
+  for (int s = 0; s < f->num_segs; s++)
+    if (f->seg_fd[s] != -1)
+      lss_base->close(f->seg_fd[s]);
+  pthread_rwlock_destroy(&f->lock);
+  free(f->seg_fd);
+  free(f->seg_live);
+  free(f->loc);
+  free(f->name);
+  free(f);
+}
+
+/* A log-structured file of no blocks */
+static lss_file* lss_new(char const* fname) {
+  lss_file *f = calloc(1, sizeof (lss_file));
+  if (!f) return 0;
+  pthread_rwlock_init(&f->lock, 0);
+  if (!(f->name = strdup(fname)) || !lss_add_seg(f)) {
+    lss_free(f);
+    return 0;
+  }
+  return f;
+}
+
+/* Read the header of the file if it is log-structured.
+   Returns 0 if it is not. */
+static int lss_read_header(char const* fname, lss_header* h, int* pfd) {
+  if (!lss_base->exists(fname)) return 0;
+  int fd = lss_base->open(fname, 0);
+  if (fd == -1) return 0;
+  int res = lss_base->pread(fd, h, sizeof *h, 0) == sizeof *h
+    && memcmp(h->magic, lss_magic, sizeof lss_magic) == 0;
+  if (res && pfd)
+    *pfd = fd;
+  else
+    lss_base->close(fd);
+  return res;
+}
+
+/* Read the map of the log-structured file, NULL upon failure */
+static lss_file* lss_load(char const* fname) {
+  lss_header h;
+  int fd;
+  if (!lss_read_header(fname, &h, &fd)) return 0;
+  lss_file *f = h.block_size == block_size ? lss_new(fname) : 0;
+  size_t len = h.num_blocks * sizeof (long long);
+  int ok = f && lss_reserve(f, h.num_blocks)
+    && lss_base->pread(fd, f->loc, len, sizeof h) == (ssize_t) len;
+  lss_base->close(fd);
+  while (ok && f->num_segs < h.num_segs)
+    ok = lss_add_seg(f);
+  if (!ok) {
+    if (f) lss_free(f);
+    put_msg(WARN, "Cannot read the map of log-structured file %s.\n", fname);
+    return 0;
+  }
+  f->num_blocks = h.num_blocks;
+  f->head_seg = h.head_seg;
+  f->head_slot = h.head_slot;
+  f->ckpt_seg = h.head_seg;
+  for (int b = 0; b < f->num_blocks; b++)
+    if (f->loc[b])
+      f->seg_live[(f->loc[b] - 1) / LSS_SEG_BLOCKS]++;
+  /* a segment left by a crash before it was removed is removed later */
+  for (int s = 0; s < f->num_segs; s++)
+    if (f->seg_live[s] == 0 && s != f->head_seg)
+      f->dirty = 1;
+  return f;
+}
+
+/* Write the map of the file, after the segments written since the last
+   time, and remove the segments no longer used.
+   With the lock of the file for writing. Returns 0 upon failure. */
+static int lss_checkpoint(lss_file* f) {
+  if (!f->dirty) return 1;
+  for (int s = f->ckpt_seg; s <= f->head_seg; s++)
+    if (f->seg_fd[s] != -1 && lss_base->sync(f->seg_fd[s]) == -1)
+      return 0;
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof tmp, "%s.map", f->name);
+  int fd = lss_base->open(tmp, 0);
+  if (fd == -1) return 0;
+  lss_header h;
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, lss_magic, sizeof lss_magic);
+  h.block_size = block_size;
+  h.num_blocks = f->num_blocks;
+  h.num_segs = f->num_segs;
+  h.head_seg = f->head_seg;
+  h.head_slot = f->head_slot;
+  size_t len = f->num_blocks * sizeof (long long);
+  int ok = lss_base->truncate(fd, 0) == 0
+    && lss_base->pwrite(fd, &h, sizeof h, 0) == sizeof h
+    && lss_base->pwrite(fd, f->loc, len, sizeof h) == (ssize_t) len
+    && lss_base->sync(fd) == 0;
+  lss_base->close(fd);
+  if (!ok || lss_base->rename(tmp, f->name) == -1) {
+    put_msg(ERROR, "Cannot write the map of log-structured file %s.\n",
+            f->name);
+    return 0;
+  }
+  for (int s = 0; s < f->num_segs; s++)
+    if (f->seg_live[s] == 0 && s != f->head_seg) {
+      char name[PATH_MAX];
+      if (f->seg_fd[s] != -1)
+        lss_base->close(f->seg_fd[s]);
+      f->seg_fd[s] = -1;
+      lss_seg_name(f->name, s, name, sizeof name);
+      lss_base->remove(name);
+      f->seg_live[s] = -1;
+    }
+  f->ckpt_seg = f->head_seg;
+  f->dirty = 0;
+  return 1;
+}
+
+/* Append n blocks to the log as blocks [blk_nr, blk_nr + n) of the file.
+   With the lock of the file for writing. Returns 0 upon failure. */
+static int lss_append(lss_file* f, int blk_nr, char const* data, int n) {
+  if (!lss_reserve(f, blk_nr + n)) return 0;
+  while (f->num_blocks < blk_nr + n)
+    f->loc[f->num_blocks++] = 0;
+  while (n > 0) {
+    if (f->head_slot == LSS_SEG_BLOCKS && !lss_add_seg(f)) return 0;
+    int k = LSS_SEG_BLOCKS - f->head_slot;
+    if (k > n) k = n;
+    int fd = lss_seg_fd(f, f->head_seg);
+    if (fd == -1
+        || lss_base->pwrite(fd, data, block_size * k,
+                            (off_t) block_size * f->head_slot)
+        != block_size * k)
+      return 0;
+    for (int i = 0; i < k; i++, blk_nr++) {
+      if (f->loc[blk_nr])
+        f->seg_live[(f->loc[blk_nr] - 1) / LSS_SEG_BLOCKS]--;
+      f->loc[blk_nr] = (long long) f->head_seg * LSS_SEG_BLOCKS
+        + f->head_slot++ + 1;
+      f->seg_live[f->head_seg]++;
+    }
+    data += block_size * k;
+    n -= k;
+    f->dirty = 1;
+  }
+  return 1;
+}
+
+/* Read n blocks from blk_nr on, blocks beyond the end are zeros.
+   Blocks next to each other in a segment are read with one read.
+   With the lock of the file. Returns 0 upon failure. */
+static int lss_read(lss_file* f, int blk_nr, char* buf, int n) {
+  int i = 0;
+  while (i < n) {
+    long long loc = blk_nr + i < f->num_blocks ? f->loc[blk_nr + i] : 0;
+    if (!loc) {
+      memset(buf + block_size * i++, 0, block_size);
+      continue;
+    }
+    int k = 1;
+    while (i + k < n && blk_nr + i + k < f->num_blocks
+           && f->loc[blk_nr + i + k] == loc + k
+           && (loc - 1) % LSS_SEG_BLOCKS + k < LSS_SEG_BLOCKS)
+      k++;
+    int fd = lss_seg_fd(f, (loc - 1) / LSS_SEG_BLOCKS);
+    if (fd == -1
+        || lss_base->pread(fd, buf + block_size * i, block_size * k,
+                           (off_t) block_size * ((loc - 1) % LSS_SEG_BLOCKS))
+        != block_size * k)
+      return 0;
+    i += k;
+  }
+  return 1;
+}
+
+/* The open file with the given fd, NULL if it is not log-structured */
+static lss_file* lss_file_of(int fd) {
+  if (fd < LSS_FD_BASE) return 0;
+  pthread_mutex_lock(&lss_mutex);
+  lss_file *f = fd - LSS_FD_BASE < num_lss_files ?
+    lss_files[fd - LSS_FD_BASE] : 0;
+  pthread_mutex_unlock(&lss_mutex);
+  if (!f) errno = EBADF;
+  return f;
+}
+
+static int lss_open(char const* fname, int direct) {
+  lss_header h;
+  if (!lss_read_header(fname, &h, 0))
+    return lss_base->open(fname, direct);
+  pthread_mutex_lock(&lss_mutex);
+  int i = 0;
+  for (; i < num_lss_files; i++)
+    if (lss_files[i] && strcmp(lss_files[i]->name, fname) == 0)
+      break;
+  if (i == num_lss_files) {
+    lss_file *f = lss_load(fname);
+    for (i = 0; i < num_lss_files && lss_files[i]; i++)
+      ;
+    if (f && i == num_lss_files) {
+      lss_file **fs = realloc(lss_files, (i + 1) * sizeof (lss_file*));
+      if (fs) {
+        lss_files = fs;
+        lss_files[num_lss_files++] = 0;
+      }
+    }
+    if (!f || i == num_lss_files) {
+      if (f) lss_free(f);
+      pthread_mutex_unlock(&lss_mutex);
+      return -1;
+    }
+    lss_files[i] = f;
+  }
+  lss_files[i]->users++;
+  pthread_mutex_unlock(&lss_mutex);
+  return LSS_FD_BASE + i;
+}
+
+/* Take a use of the file away, with lss_mutex. The map is written when
+   the file is no longer used. */
+static int lss_release(int i) {
+  lss_file *f = lss_files[i];
+  if (--f->users > 0) return 1;
+  lss_files[i] = 0;
+  int ok = f->gone || lss_checkpoint(f);
+  lss_free(f);
+  return ok;
+}
+
+static int lss_close(int fd) {
+  if (fd < LSS_FD_BASE) return lss_base->close(fd);
+  pthread_mutex_lock(&lss_mutex);
+  int i = fd - LSS_FD_BASE;
+  int ok = i < num_lss_files && lss_files[i] && lss_release(i);
+  pthread_mutex_unlock(&lss_mutex);
+  return ok ? 0 : -1;
+}
+
+/* Read len bytes at pos into buf, through a block buffer for the blocks
+   not read whole. With the lock of the file. */
+static ssize_t lss_read_bytes(lss_file* f, char* buf, size_t len, off_t pos) {
+  off_t size = (off_t) block_size * f->num_blocks;
+  if (pos >= size) return 0;
+  if ((off_t) len > size - pos) len = size - pos;
+  if (pos % block_size == 0 && len % block_size == 0)
+    return lss_read(f, pos / block_size, buf, len / block_size) ? len : -1;
+  char *blk = malloc(block_size);
+  size_t done = 0;
+  while (blk && done < len) {
+    int b = (pos + done) / block_size, off = (pos + done) % block_size;
+    size_t k = block_size - off < len - done ? block_size - off : len - done;
+    if (!lss_read(f, b, blk, 1)) break;
+    memcpy(buf + done, blk + off, k);
+    done += k;
+  }
+  free(blk);
+  return done == len ? (ssize_t) len : -1;
+}
+
+/* Write len bytes at pos, reading the blocks not written whole first.
+   With the lock of the file for writing. */
+static ssize_t lss_write_bytes(lss_file* f, char const* buf, size_t len,
+                               off_t pos) {
+  if (pos % block_size == 0 && len % block_size == 0)
+    return lss_append(f, pos / block_size, buf, len / block_size) ? len : -1;
+  char *blk = malloc(block_size);
+  size_t done = 0;
+  while (blk && done < len) {
+    int b = (pos + done) / block_size, off = (pos + done) % block_size;
+    size_t k = block_size - off < len - done ? block_size - off : len - done;
+    if (!lss_read(f, b, blk, 1)) break;
+    memcpy(blk + off, buf + done, k);
+    if (!lss_append(f, b, blk, 1)) break;
+    done += k;
+  }
+  free(blk);
+  return done == len ? (ssize_t) len : -1;
+}
+
+static ssize_t lss_pread(int fd, void* buf, size_t len, off_t pos) {
+  if (fd < LSS_FD_BASE) return lss_base->pread(fd, buf, len, pos);
+  lss_file *f = lss_file_of(fd);
+  if (!f) return -1;
+  pthread_rwlock_rdlock(&f->lock);
+  ssize_t n = lss_read_bytes(f, buf, len, pos);
+  pthread_rwlock_unlock(&f->lock);
+  return n;
+}
+
+static ssize_t lss_pwrite(int fd, void const* buf, size_t len, off_t pos) {
+  if (fd < LSS_FD_BASE) return lss_base->pwrite(fd, buf, len, pos);
+  lss_file *f = lss_file_of(fd);
+  if (!f) return -1;
+  pthread_rwlock_wrlock(&f->lock);
+  ssize_t n = lss_write_bytes(f, buf, len, pos);
+  pthread_rwlock_unlock(&f->lock);
+  prof()->c.num_lss_writes += n > 0 ? (n + block_size - 1) / block_size : 0;
+  return n;
+}
+
+static ssize_t lss_preadv(int fd, struct iovec const* iov, int cnt,
+                          off_t pos) {
+  if (fd < LSS_FD_BASE) return lss_base->preadv(fd, iov, cnt, pos);
+  if (cnt == 1) return lss_pread(fd, iov[0].iov_base, iov[0].iov_len, pos);
+  size_t len = 0;
+  for (int i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+  char *buf = malloc(len);
+  if (!buf) return -1;
+  ssize_t n = lss_pread(fd, buf, len, pos);
+  for (ssize_t i = 0, done = 0; i < cnt && done < n; i++) {
+    size_t k = n - done < (ssize_t) iov[i].iov_len ? n - done : iov[i].iov_len;
+    memcpy(iov[i].iov_base, buf + done, k);
+    done += k;
+  }
+  free(buf);
+  return n;
+}
+
+static ssize_t lss_pwritev(int fd, struct iovec const* iov, int cnt,
+                           off_t pos) {
+  if (fd < LSS_FD_BASE) return lss_base->pwritev(fd, iov, cnt, pos);
+  if (cnt == 1) return lss_pwrite(fd, iov[0].iov_base, iov[0].iov_len, pos);
+  size_t len = 0;
+  for (int i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+  char *buf = malloc(len);
+  if (!buf) return -1;
+  for (size_t i = 0, done = 0; i < cnt; done += iov[i++].iov_len)
+    memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+  ssize_t n = lss_pwrite(fd, buf, len, pos);
+  free(buf);
+  return n;
+}
+
+static off_t lss_size(int fd) {
+  if (fd < LSS_FD_BASE) return lss_base->size(fd);
+  lss_file *f = lss_file_of(fd);
+  if (!f) return -1;
+  pthread_rwlock_rdlock(&f->lock);
+  off_t size = (off_t) block_size * f->num_blocks;
+  pthread_rwlock_unlock(&f->lock);
+  return size;
+}
+
+/* The file has the blocks of its size only, the blocks added are zeros */
+static int lss_truncate(int fd, off_t size) {
+  if (fd < LSS_FD_BASE) return lss_base->truncate(fd, size);
+  lss_file *f = lss_file_of(fd);
+  if (!f) return -1;
+  int n = (size + block_size - 1) / block_size, ok = 1;
+  pthread_rwlock_wrlock(&f->lock);
+  if (n > f->num_blocks && (ok = lss_reserve(f, n)))
+    while (f->num_blocks < n)
+      f->loc[f->num_blocks++] = 0;
+  for (; ok && f->num_blocks > n; f->num_blocks--)
+    if (f->loc[f->num_blocks - 1])
+      f->seg_live[(f->loc[f->num_blocks - 1] - 1) / LSS_SEG_BLOCKS]--;
+  f->dirty = 1;
+  pthread_rwlock_unlock(&f->lock);
+  return ok ? 0 : -1;
+}
+
+/* Blocks are not preallocated, where they go is known when they are
+   written */
+static int lss_allocate(int fd, off_t pos, off_t len) {
+  if (fd < LSS_FD_BASE) return lss_base->allocate(fd, pos, len);
+  off_t size = lss_size(fd);
+  if (size == -1) return errno;
+  return size < pos + len && lss_truncate(fd, pos + len) == -1 ? errno : 0;
+}
+
+static int lss_sync(int fd) {
+  if (fd < LSS_FD_BASE) return lss_base->sync(fd);
+  lss_file *f = lss_file_of(fd);
+  if (!f) return -1;
+  pthread_rwlock_wrlock(&f->lock);
+  int ok = lss_checkpoint(f);
+  pthread_rwlock_unlock(&f->lock);
+  return ok ? 0 : -1;
+}
+
+/* The blocks of a log-structured file are scattered over segments,
+   and their pages in the cache go as the segments are cleaned */
+static int lss_drop_cache(int fd, off_t pos, off_t len) {
+  return fd < LSS_FD_BASE ? lss_base->drop_cache(fd, pos, len) : 0;
+}
+
+/* The blocks of a log-structured file are scattered over segments */
+static void* lss_map(int fd, size_t len) {
+  if (fd < LSS_FD_BASE) return lss_base->map(fd, len);
+  errno = ENODEV;
+  return MAP_FAILED;
+}
+
+static int lss_unmap(void* map, size_t len) {
+  return lss_base->unmap(map, len);
+}
+
+static int lss_exists(char const* fname) {
+  return lss_base->exists(fname);
+}
+
+/* Keep a file in use by the cleaner from writing its map again, with
+   lss_mutex */
+static void lss_forget(char const* fname) {
+  for (int i = 0; i < num_lss_files; i++)
+    if (lss_files[i] && strcmp(lss_files[i]->name, fname) == 0)
+      lss_files[i]->gone = 1;
+}
+
+static int lss_remove(char const* fname) {
+  lss_header h;
+  pthread_mutex_lock(&lss_mutex);
+  lss_forget(fname);
+  pthread_mutex_unlock(&lss_mutex);
+  if (lss_read_header(fname, &h, 0))
+    for (int s = 0; s < h.num_segs; s++) {
+      char name[PATH_MAX];
+      lss_seg_name(fname, s, name, sizeof name);
+      lss_base->remove(name);
+    }
+  return lss_base->remove(fname);
+}
+
+static int lss_rename(char const* from, char const* to) {
+  lss_header h;
+  if (lss_base->exists(to))
+    lss_remove(to);
+  pthread_mutex_lock(&lss_mutex);
+  lss_forget(from);
+  pthread_mutex_unlock(&lss_mutex);
+  if (lss_read_header(from, &h, 0))
+    for (int s = 0; s < h.num_segs; s++) {
+      char name[PATH_MAX], new_name[PATH_MAX];
+      lss_seg_name(from, s, name, sizeof name);
+      lss_seg_name(to, s, new_name, sizeof new_name);
+      if (lss_base->exists(name))
+        lss_base->rename(name, new_name);
+    }
+  return lss_base->rename(from, to);
+}
+
+static vfs_ops const lss_vfs = {
+  "lss", lss_open, lss_close, lss_pread, lss_pwrite,
+  lss_preadv, lss_pwritev, lss_size, lss_truncate, lss_allocate,
+  lss_sync, lss_drop_cache, lss_map, lss_unmap, lss_exists, lss_remove, lss_rename
+};
+
+/* Move the blocks in use of the segment of the file with the fewest of
+   them to the head of the log, if it has few enough, and write the map.
+   With the lock of the file for writing. */
+static void lss_clean(lss_file* f, char* buf) {
+  int victim = -1;
+  for (int s = 0; s < f->num_segs; s++)
+    if (s != f->head_seg && f->seg_live[s] >= 0
+        && f->seg_live[s] <= LSS_SEG_BLOCKS * LSS_CLEAN_PCT / 100
+        && (victim == -1 || f->seg_live[s] < f->seg_live[victim]))
+      victim = s;
+  if (victim == -1) return;
+  if (f->seg_live[victim] > 0) {
+    int fd = lss_seg_fd(f, victim);
+    if (fd == -1
+        || lss_base->pread(fd, buf, block_size * LSS_SEG_BLOCKS, 0) == -1)
+      return;
+    long long first = (long long) victim * LSS_SEG_BLOCKS + 1;
+    for (int b = 0; b < f->num_blocks && f->seg_live[victim] > 0; b++)
+      if (f->loc[b] >= first && f->loc[b] < first + LSS_SEG_BLOCKS) {
+        if (!lss_append(f, b, buf + block_size * (f->loc[b] - first), 1))
+          return;
+        prof()->c.num_lss_moved++;
+      }
+  }
+  f->dirty = 1;
+  lss_checkpoint(f);
+}
+
+/* The cleaner, cleaning a segment of every open log-structured file
+   every LSS_CLEAN_MS ms */
+static void* lss_cleaner_main(void* arg) {
+  char *buf = malloc(block_size * LSS_SEG_BLOCKS);
+  pthread_mutex_lock(&lss_mutex);
+  while (buf && !lss_cleaner_stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += LSS_CLEAN_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&lss_cleaner_wake, &lss_mutex, &until);
+    for (int i = 0; i < num_lss_files && !lss_cleaner_stop; i++) {
+      lss_file *f = lss_files[i];
+      if (!f) continue;
+      f->users++;
+      pthread_mutex_unlock(&lss_mutex);
+      pthread_rwlock_wrlock(&f->lock);
+      if (!f->gone)
+        lss_clean(f, buf);
+      pthread_rwlock_unlock(&f->lock);
+      pthread_mutex_lock(&lss_mutex);
+      lss_release(i);
+    }
+  }
+  pthread_mutex_unlock(&lss_mutex);
+  free(buf);
+  return 0;
+}
+
+/* Lay the lss backend over the backend of a starting pager */
+static void lss_start(void) {
+  lss_base = vfs;
+  vfs = &lss_vfs;
+  lss_cleaner_stop = 0;
+  lss_cleaner_running =
+    pthread_create(&lss_cleaner, 0, lss_cleaner_main, 0) == 0;
+}
+
+/* Stop the cleaner, after the files are closed */
+static void lss_terminate(void) {
+  if (!lss_cleaner_running) return;
+  pthread_mutex_lock(&lss_mutex);
+  lss_cleaner_stop = 1;
+  pthread_cond_signal(&lss_cleaner_wake);
+  pthread_mutex_unlock(&lss_mutex);
+  pthread_join(lss_cleaner, 0);
+  lss_cleaner_running = 0;
+}
+
+/* Store the file log-structured, copying the blocks it has.
+   The map replaces the file when the blocks are all copied. */
+static int lss_convert(char const* fname) {
+  lss_header h;
+  if (lss_read_header(fname, &h, 0)) return 1;
+  int fd = lss_base->open(fname, 0);
+  if (fd == -1) return 0;
+  lss_file *f = lss_new(fname);
+  char *buf = malloc(block_size);
+  off_t size = lss_base->size(fd);
+  int ok = f && buf && size != -1;
+  for (int b = 0; ok && (off_t) block_size * b < size; b++) {
+    memset(buf, 0, block_size);
+    ok = lss_base->pread(fd, buf, block_size, (off_t) block_size * b) != -1
+      && lss_append(f, b, buf, 1);
+  }
+  lss_base->close(fd);
+  if (f) {
+    f->dirty = 1;
+    ok = ok && lss_checkpoint(f);
+    lss_free(f);
+  }
+  free(buf);
+  return ok;
+}
+
+/* ---------------------------------------------------------------------
+   Shared pool.
+   Processes using the same system dir can share a pool of blocks in a
+   POSIX shared memory segment, named after the system dir, under their
+   own buffers: a block is read from it before it is read from disk, and
+   a block read from or written to disk is put into it.
+   The segment consists of a header, partitions, their hash buckets, the
+   slots, and a frame of block_size bytes for every slot. A block is
+   kept in the partition of its hash value, which has a process-shared
+   mutex, its own buckets and slots, and a clock hand over its slots.
+   The mutexes are robust: the partition of a mutex held by a process
+   that died is emptied. A file is known by its device and inode, the
+   same in all processes. The processes attached are recorded by their
+   pids: the last process to detach removes the segment, not counting
+   the processes that died attached.
+   --------------------------------------------------------------------- */
+
+static size_t fname_hash(char const* fname);
+
+static char const spool_magic[8] = "pgshm02";
+
+/** @brief Header of the shared pool segment */
+typedef struct spool_header {
+  char magic[8];
+  int ready;       /**< set when the segment is initialized */
+  int procs[SPOOL_MAX_PROCS]; /**< pids of the processes attached,
+                                   0 for none */
+  long block_size;
+  int num_parts;
+  int slots_per_part;
+  int buckets_per_part; /**< a power of 2 */
+} spool_header;
+
+/** @brief A partition of the shared pool */
+typedef struct spool_part {
+  pthread_mutex_t mutex;
+  int hand;        /**< next slot of the clock */
+} spool_part;
+
+/** @brief A slot of the shared pool, slots are linked by their index */
+typedef struct spool_slot {
+  spool_file sfile;
+  int blk_nr;
+  int hnext;       /**< next slot in the bucket, -1 at the end */
+  int used;
+  int ref;         /**< referenced since the clock hand passed */
+} spool_slot;
+
+static int shared_pages_conf;
+
+/** The mapped segment, NULL if there is no shared pool */
+static spool_header *spool;
+static size_t spool_size;
+static char spool_name[64];
+static spool_part *spool_parts;
+static int *spool_buckets;
+static spool_slot *spool_slots;
+static char *spool_frames;
+
+/* Empty the partition, with its mutex */
+static void spool_clear_part(int p) {
+  int *buckets = spool_buckets + (size_t) p * spool->buckets_per_part;
+  for (int i = 0; i < spool->buckets_per_part; i++)
+    buckets[i] = -1;
+  for (int i = 0; i < spool->slots_per_part; i++)
+    spool_slots[p * spool->slots_per_part + i].used = 0;
+  spool_parts[p].hand = 0;
+}
+
+static void spool_lock(int p) {
+  if (pthread_mutex_lock(&spool_parts[p].mutex) == EOWNERDEAD) {
+    /* a process died holding it, the partition may be half changed */
+    spool_clear_part(p);
+    pthread_mutex_consistent(&spool_parts[p].mutex);
+  }
+}
+
+static void spool_unlock(int p) {
+  pthread_mutex_unlock(&spool_parts[p].mutex);
+}
+
+/* Hash value of block blk_nr of the file */
+static size_t spool_hash(spool_file sf, int blk_nr) {
+  uint64_t id = (uint64_t) sf.ino ^ ((uint64_t) sf.dev << 40);
+  return blk_hash((int) (id ^ id >> 32), blk_nr);
+}
+
+/* The bucket of the block in partition p */
+static int* spool_bucket(int p, size_t h) {
+  return &spool_buckets[(size_t) p * spool->buckets_per_part
+                        + ((h / spool->num_parts) & (spool->buckets_per_part - 1))];
+}
+
+static int spool_same(spool_slot* s, spool_file sf, int blk_nr) {
+  return s->blk_nr == blk_nr && s->sfile.ino == sf.ino && s->sfile.dev == sf.dev;
+}
+
+/* The slot of the block in partition p, -1 if it is not there */
+static int spool_find(int p, size_t h, spool_file sf, int blk_nr) {
+  for (int s = *spool_bucket(p, h); s != -1; s = spool_slots[s].hnext)
+    if (spool_same(&spool_slots[s], sf, blk_nr))
+      return s;
+  return -1;
+}
+
+/* Take the slot out of its bucket, with the mutex of partition p */
+static void spool_unlink(int p, int s) {
+  spool_slot *slot = &spool_slots[s];
+  int *sp = spool_bucket(p, spool_hash(slot->sfile, slot->blk_nr));
+  while (*sp != s)
+    sp = &spool_slots[*sp].hnext;
+  *sp = slot->hnext;
+  slot->used = 0;
+}
+
+/* A slot of partition p for another block, by the clock */
+static int spool_victim(int p) {
+  spool_part *part = &spool_parts[p];
+  for (;;) {
+    int s = p * spool->slots_per_part + part->hand;
+    part->hand = (part->hand + 1) % spool->slots_per_part;
+    if (!spool_slots[s].used) return s;
+    if (spool_slots[s].ref)
+      spool_slots[s].ref = 0;
+    else {
+      spool_unlink(p, s);
+      return s;
+    }
+  }
+}
+
+/* Copy the block out of the shared pool into content.
+   Returns 0 if it is not there. */
+static int spool_get(spool_file sf, int blk_nr, char* content) {
+  if (!spool || !sf.ino) return 0;
+  size_t h = spool_hash(sf, blk_nr);
+  int p = h % spool->num_parts;
+  spool_lock(p);
+  int s = spool_find(p, h, sf, blk_nr);
+  if (s != -1) {
+    memcpy(content, spool_frames + (size_t) s * block_size, block_size);
+    spool_slots[s].ref = 1;
+  }
+  spool_unlock(p);
+  if (s == -1) return 0;
+  prof()->c.num_sp_hits++;
+  return 1;
+}
+
+/* Put the content of the block into the shared pool. A block read from
+   disk (written = 0) does not replace a copy that is there already,
+   which may have been written meanwhile. */
+static void spool_put(spool_file sf, int blk_nr, char const* content,
+                      int written) {
+  if (!spool || !sf.ino) return;
+  size_t h = spool_hash(sf, blk_nr);
+  int p = h % spool->num_parts;
+  spool_lock(p);
+  int s = spool_find(p, h, sf, blk_nr);
+  if (s == -1) {
+    s = spool_victim(p);
+    spool_slot *slot = &spool_slots[s];
+    slot->sfile = sf;
+    slot->blk_nr = blk_nr;
+    slot->used = 1;
+    int *bucket = spool_bucket(p, h);
+    slot->hnext = *bucket;
+    *bucket = s;
+    written = 1;
+  }
+  if (written) {
+    memcpy(spool_frames + (size_t) s * block_size, content, block_size);
+    prof()->c.num_sp_puts++;
+  }
+  spool_slots[s].ref = 1;
+  spool_unlock(p);
+}
+
+/* Drop the blocks of the file from block from on, which are no longer
+   what the file has */
+static void spool_drop(spool_file sf, int from) {
+  if (!spool || !sf.ino) return;
+  for (int p = 0; p < spool->num_parts; p++) {
+    spool_lock(p);
+    for (int i = 0; i < spool->slots_per_part; i++) {
+      int s = p * spool->slots_per_part + i;
+      if (spool_slots[s].used && spool_slots[s].blk_nr >= from
+          && spool_slots[s].sfile.ino == sf.ino
+          && spool_slots[s].sfile.dev == sf.dev)
+        spool_unlink(p, s);
+    }
+    spool_unlock(p);
+  }
+}
+
+/* The identity of the file open at fd in the shared pool,
+   an inode of 0 if it is not shared */
+static spool_file spool_file_of(int fd) {
+  spool_file sf = { 0, 0 };
+  struct stat st;
+  /* files of the shared pool are POSIX files */
+  if (spool && fstat(fd, &st) == 0) {
+    sf.dev = st.st_dev;
+    sf.ino = st.st_ino;
+  }
+  return sf;
+}
+
+/* Size of the segment of the given geometry. The pointers into it are
+   set if it is mapped at base. */
+static size_t spool_layout(char* base, int num_parts, int slots_per_part,
+                           int buckets_per_part) {
+  size_t off = sizeof (spool_header);
+  off = (off + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+  size_t parts_off = off;
+  off += num_parts * sizeof (spool_part);
+  size_t buckets_off = off;
+  off += (size_t) num_parts * buckets_per_part * sizeof (int);
+  off = (off + sizeof (long) - 1) / sizeof (long) * sizeof (long);
+  size_t slots_off = off;
+  off += (size_t) num_parts * slots_per_part * sizeof (spool_slot);
+  off = (off + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+  if (base) {
+    spool_parts = (spool_part*) (base + parts_off);
+    spool_buckets = (int*) (base + buckets_off);
+    spool_slots = (spool_slot*) (base + slots_off);
+    spool_frames = base + off;
+  }
+  return off + (size_t) num_parts * slots_per_part * block_size;
+}
+
+/* Map the segment of the given size. Returns 0 upon failure. */
+static int spool_map(int fd, size_t size) {
+  void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return 0;
+  spool = map;
+  spool_size = size;
+  return 1;
+}
+
+/* Make the segment of num_pages pages in the new shared memory fd */
+static int spool_init(int fd, int num_pages) {
+  int num_parts = num_pages >= SPOOL_PARTS * 4 ? SPOOL_PARTS : 1;
+  int slots_per_part = num_pages / num_parts, buckets_per_part = 1;
+  while (buckets_per_part < slots_per_part)
+    buckets_per_part <<= 1;
+  size_t size = spool_layout(0, num_parts, slots_per_part, buckets_per_part);
+  if (ftruncate(fd, size) == -1 || !spool_map(fd, size)) return 0;
+  spool_layout((char*) spool, num_parts, slots_per_part, buckets_per_part);
+  spool->block_size = block_size;
+  spool->num_parts = num_parts;
+  spool->slots_per_part = slots_per_part;
+  spool->buckets_per_part = buckets_per_part;
+  spool->procs[0] = getpid();
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  for (int p = 0; p < num_parts; p++) {
+    pthread_mutex_init(&spool_parts[p].mutex, &attr);
+    spool_clear_part(p);
+  }
+  pthread_mutexattr_destroy(&attr);
+  memcpy(spool->magic, spool_magic, sizeof spool_magic);
+  __atomic_store_n(&spool->ready, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Whether the process of the pid is alive */
+static int proc_alive(int pid) {
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Record the process as attached, in a free entry or in the entry of a
+   process that died. Returns 0 if there is none. */
+static int spool_add_proc(void) {
+  int me = getpid();
+  for (int i = 0; i < SPOOL_MAX_PROCS; i++) {
+    int pid = __atomic_load_n(&spool->procs[i], __ATOMIC_ACQUIRE);
+    if ((pid == 0 || !proc_alive(pid))
+        && __atomic_compare_exchange_n(&spool->procs[i], &pid, me, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return 1;
+  }
+  return 0;
+}
+
+/* Record the process as detached. Returns the number of the other
+   processes attached that are alive. */
+static int spool_remove_proc(void) {
+  int me = getpid(), n = 0;
+  for (int i = 0; i < SPOOL_MAX_PROCS; i++) {
+    int pid = __atomic_load_n(&spool->procs[i], __ATOMIC_ACQUIRE);
+    if (pid == me)
+      __atomic_store_n(&spool->procs[i], 0, __ATOMIC_RELEASE);
+    else if (pid != 0 && proc_alive(pid))
+      n++;
+  }
+  return n;
+}
+
+/* Attach to the segment made by another process in fd */
+static int spool_join(int fd) {
+  spool_header h;
+  memset(&h, 0, sizeof h);
+  /* wait a while for the process making it */
+  for (int i = 0; i < 1000 && !h.ready; i++)
+    if (pread(fd, &h, sizeof h, 0) != sizeof h || !h.ready) {
+      h.ready = 0;
+      usleep(1000);
+    }
+  if (!h.ready) {
+    /* left by a process that died making it */
+    shm_unlink(spool_name);
+    return 0;
+  }
+  if (memcmp(h.magic, spool_magic, sizeof spool_magic) != 0
+      || h.block_size != block_size)
+    return 0;
+  size_t size = spool_layout(0, h.num_parts, h.slots_per_part,
+                             h.buckets_per_part);
+  if (!spool_map(fd, size)) return 0;
+  spool_layout((char*) spool, h.num_parts, h.slots_per_part,
+               h.buckets_per_part);
+  if (!spool_add_proc()) {
+    munmap(spool, spool_size);
+    spool = 0;
+    return 0;
+  }
+  return 1;
+}
+
+/* Make or attach to the shared pool of the system dir */
+static void spool_attach(void) {
+  if (shared_pages_conf <= 0 || in_memory) return;
+  char dir[sizeof sys_dir];
+  if (!getcwd(dir, sizeof dir)) return;
+  snprintf(spool_name, sizeof spool_name, "/pager-%016lx",
+           (unsigned long) fname_hash(dir));
+  int fd = shm_open(spool_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  int ok;
+  if (fd != -1) {
+    ok = spool_init(fd, shared_pages_conf);
+    if (!ok) shm_unlink(spool_name);
+  } else if ((fd = shm_open(spool_name, O_RDWR, 0)) != -1)
+    ok = spool_join(fd);
+  else
+    ok = 0;
+  if (fd != -1) close(fd);
+  if (!ok)
+    put_msg(WARN, "Cannot attach to the shared pool %s.\n", spool_name);
+}
+
+/* Detach from the shared pool, the last process removes it */
+static void spool_detach(void) {
+  if (!spool) return;
+  if (spool_remove_proc() == 0)
+    shm_unlink(spool_name);
+  munmap(spool, spool_size);
+  spool = 0;
+}
+
+int pager_set_shared_pages(int num_pages) {
+  if (num_pages < 0) {
+    put_msg(ERROR, "pager_set_shared_pages: %d pages is negative.\n",
+            num_pages);
+    return 0;
+  }
+  shared_pages_conf = num_pages;
+  return 1;
+}
+
+int pager_shared_pages(void) {
+  return shared_pages_conf;
+}
+
+/* ---------------------------------------------------------------------
+   Background flusher.
+   Dirty pages are not written when they are unpinned. A copy of the
+   content of dirty pages is queued instead, and the pages are clean
+   again. The flusher thread writes the queued copies to disk.
+   Pages are handed to the flusher
+   - when the number of dirty pages exceeds the high threshold, until
+     it is down to the low threshold,
+   - when a dirty page is replaced, together with the dirty pages of
+     the adjacent blocks, and
+   - when a file is closed or the pager terminates.
+   Dirty pages are sorted by file and block nr, and a run of adjacent
+   blocks is written with one disk write.
+   Reads and synchronous writes of a block wait till the queued copies
+   of the block are written.
+   A copy is not written before the log records of its changes are on
+   disk (see the write-ahead log below).
+   --------------------------------------------------------------------- */
+
+/* forward declaration */
+static void wal_force(long long lsn);
+
+/** A copy of a run of adjacent dirty pages waiting for the flusher */
+typedef struct flush_job {
+  int fd;
+  int blk_nr;      /**< first block of the run */
+  int num_blocks;  /**< length of the run */
+  char* content;   /**< num_blocks * block_size bytes */
+  long long lsn;   /**< the log up to lsn is to be on disk first */
+  spool_file sfile; /**< the file in the shared pool */
+  struct flush_job* next;
+} flush_job_struct;
+
+typedef flush_job_struct* flush_job_p;
+
+static pthread_t flusher;
+static int flusher_running;
+static int flusher_stop;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static flush_job_p flush_first;  /* queued jobs, in FIFO order */
+static flush_job_p flush_last;
+static flush_job_p flush_busy;   /* job being written */
+static int num_flush_blocks;     /* blocks of queued and busy jobs */
+static int flush_hand;           /* next page to check for dirtiness */
+static page_p *flush_batch;      /* pages to be written back together */
+
+static void* flusher_main(void* arg) {
+  pthread_mutex_lock(&flush_mutex);
+  for (;;) {
+    while (!flush_first && !flusher_stop)
+      pthread_cond_wait(&flush_queued, &flush_mutex);
+    if (!flush_first) break;
+    flush_job_p job = flush_first;
+    flush_first = job->next;
+    if (!flush_first) flush_last = 0;
+    flush_busy = job;
+    /* one sync of the log for the jobs queued */
+    long long lsn = job->lsn;
+    for (flush_job_p j = flush_first; j; j = j->next)
+      if (j->lsn > lsn)
+        lsn = j->lsn;
+    pthread_mutex_unlock(&flush_mutex);
+
+    wal_force(lsn);
+    ssize_t len = block_size * job->num_blocks, written;
+    written = vfs->pwrite(job->fd, job->content, len,
+                          (off_t) block_size * job->blk_nr);
+    if (written != len)
+      put_msg(ERROR, "flusher: writing blocks [%d,%d) to fd %d fails.\n",
+              job->blk_nr, job->blk_nr + job->num_blocks, job->fd);
+    else
+      for (int i = 0; i < job->num_blocks; i++)
+        spool_put(job->sfile, job->blk_nr + i,
+                  job->content + block_size * i, 1);
+
+    pthread_mutex_lock(&flush_mutex);
+    flush_busy = 0;
+    num_flush_blocks -= job->num_blocks;
+    free(job->content);
+    free(job);
+    pthread_cond_broadcast(&flush_done);
+  }
+  pthread_mutex_unlock(&flush_mutex);
+  return 0;
+}
+
+static void flusher_start(void) {
+  flusher_stop = 0;
+  flusher_running = pthread_create(&flusher, 0, flusher_main, 0) == 0;
+  if (!flusher_running)
+    put_msg(WARN, "flusher: cannot start, dirty pages are written directly.\n");
+}
+
+/* Write all queued jobs and stop the flusher */
+static void flusher_terminate(void) {
+  if (!flusher_running) return;
+  pthread_mutex_lock(&flush_mutex);
+  flusher_stop = 1;
+  pthread_cond_signal(&flush_queued);
+  pthread_mutex_unlock(&flush_mutex);
+  pthread_join(flusher, 0);
+  flusher_running = 0;
+}
+
+static int is_flush_job_for(flush_job_p job, int fd, int from, int n) {
+  return job->fd == fd
+    && job->blk_nr < from + n && from < job->blk_nr + job->num_blocks;
+}
+
+/* Wait till no copy of blocks [from, from + n) of fd is queued */
+static void flusher_wait(int fd, int from, int n) {
+  if (!flusher_running) return;
+  pthread_mutex_lock(&flush_mutex);
+  for (;;) {
+    int pending = flush_busy && is_flush_job_for(flush_busy, fd, from, n);
+    for (flush_job_p job = flush_first; job && !pending; job = job->next)
+      pending = is_flush_job_for(job, fd, from, n);
+    if (!pending) break;
+    pthread_cond_wait(&flush_done, &flush_mutex);
+  }
+  pthread_mutex_unlock(&flush_mutex);
+}
+
+/* forward declaration */
+static int fh_fd(fhandle_p fh);
+
+/* The log up to the last change of the pages of the run */
+static long long run_lsn(page_p* run, int n) {
+  long long lsn = 0;
+  for (int i = 0; i < n; i++)
+    if (__atomic_load_n(&run[i]->lsn, __ATOMIC_ACQUIRE) > lsn)
+      lsn = __atomic_load_n(&run[i]->lsn, __ATOMIC_ACQUIRE);
+  return lsn;
+}
+
+/* Queue a copy of the run for the flusher.
+   Waits if the flusher lags more than a buffer full behind. */
+static int flusher_enqueue(int fd, page_p* run, int n) {
+  flush_job_p job = malloc(sizeof (flush_job_struct));
+  if (!job) return 0;
+  if (posix_memalign((void**) &job->content, block_size, block_size * n)) {
+    free(job);
+    return 0;
+  }
+  job->fd = fd;
+  job->blk_nr = run[0]->block->blk_nr;
+  job->num_blocks = n;
+  job->lsn = run_lsn(run, n);
+  job->sfile = run[0]->block->fhandle->sfile;
+  job->next = 0;
+  for (int i = 0; i < n; i++)
+    memcpy(job->content + block_size * i, run[i]->content, block_size);
+
+  pthread_mutex_lock(&flush_mutex);
+  while (num_flush_blocks > 0 && num_flush_blocks + n > num_pages)
+    pthread_cond_wait(&flush_done, &flush_mutex);
+  if (flush_last)
+    flush_last->next = job;
+  else
+    flush_first = job;
+  flush_last = job;
+  num_flush_blocks += n;
+  pthread_cond_signal(&flush_queued);
+  pthread_mutex_unlock(&flush_mutex);
+  return 1;
+}
+
+/* Write back a run of dirty pages of adjacent blocks with one write:
+   queue it for the flusher, or write it directly if the flusher
+   is not there. The pages are latched shared by the caller, and are
+   clean and unlatched afterwards.
+   A page is marked clean before its content is copied, so that a change
+   made meanwhile marks it dirty again. */
+static void write_back_run(page_p* run, int n) {
+  fhandle_p fh = run[0]->block->fhandle;
+  int blk_nr = run[0]->block->blk_nr;
+  int fd = fh_fd(fh);
+  if (fd == -1) {
+    put_msg(ERROR, "write_back: cannot open \"%s\".\n", fh->fname);
+    for (int i = 0; i < n; i++)
+      pthread_rwlock_unlock(&run[i]->latch);
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    stamp_num_blocks(run[i]);
+    set_page_clean(run[i]);
+  }
+  if (!flusher_running || !flusher_enqueue(fd, run, n)) {
+    struct iovec iov[WRITE_MAX_RUN];
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = run[i]->content;
+      iov[i].iov_len = block_size;
+    }
+    flusher_wait(fd, blk_nr, n);
+    wal_force(run_lsn(run, n));
+    ssize_t written = vfs->pwritev(fd, iov, n, (off_t) block_size * blk_nr);
+    if (written != block_size * n) {
+      put_msg(ERROR, "write_back: writing blocks [%d,%d) of \"%s\" fails.\n",
+              blk_nr, blk_nr + n, fh->fname);
+      for (int i = 0; i < n; i++) {
+        set_page_unwritten(run[i]);
+        pthread_rwlock_unlock(&run[i]->latch);
+      }
+      return;
+    }
+    for (int i = 0; i < n; i++)
+      spool_put(fh->sfile, blk_nr + i, run[i]->content, 1);
+  }
+  prof()->c.num_wb_writes++;
+  prof()->c.num_wb_blocks += n;
+  for (int i = 0; i < n; i++) {
+    inc_num_writes(fd, blk_nr + i);
+    pthread_rwlock_unlock(&run[i]->latch);
+  }
+}
+
+static int cmp_page_blocks(void const* a, void const* b) {
+  block_p x = (*(page_p const*) a)->block;
+  block_p y = (*(page_p const*) b)->block;
+  if (x->fhandle->fid != y->fhandle->fid)
+    return x->fhandle->fid < y->fhandle->fid ? -1 : 1;
+  return x->blk_nr - y->blk_nr;
+}
+
+static int is_dirty(page_p pg) {
+  return __atomic_load_n(&pg->dirty, __ATOMIC_ACQUIRE);
+}
+
+/* Latch the dirty page shared for writing it back, without waiting
+   for a thread that is changing it. Returns 0 if it is not latched. */
+static int latch_for_write_back(page_p pg) {
+  if (pthread_rwlock_tryrdlock(&pg->latch) != 0) return 0;
+  if (is_dirty(pg)) return 1;
+  pthread_rwlock_unlock(&pg->latch);
+  return 0;
+}
+
+/* Write back the dirty pages, sorted by file and block nr,
+   with one write for each run of adjacent blocks.
+   Pages that are being changed are left for another time. */
+static void write_back_pages(page_p* pgs, int n) {
+  int m = 0;
+  for (int i = 0; i < n; i++)
+    if (latch_for_write_back(pgs[i]))
+      pgs[m++] = pgs[i];
+  qsort(pgs, m, sizeof (page_p), cmp_page_blocks);
+  for (int i = 0, len; i < m; i += len) {
+    block_p b = pgs[i]->block;
+    for (len = 1; i + len < m && len < WRITE_MAX_RUN; len++) {
+      block_p next = pgs[i + len]->block;
+      if (next->fhandle != b->fhandle || next->blk_nr != b->blk_nr + len)
+        break;
+    }
+    write_back_run(pgs + i, len);
+  }
+}
+
+/* Latch the page of the block if it is dirty, see latch_for_write_back() */
+static int latch_dirty_block(block_p b) {
+  return b && latch_for_write_back(b->page);
+}
+
+/* Write back the dirty page, together with the dirty pages of the
+   adjacent blocks of the file.
+   The page is not pinned, so no thread is changing it. */
+static void write_back(page_p p) {
+  if (!is_dirty(p) || !p->block) return;
+  /* not waiting for the latch while holding the pool lock, see above */
+  while (pthread_rwlock_tryrdlock(&p->latch) != 0)
+    sched_yield();
+  fhandle_p fh = p->block->fhandle;
+  int from = p->block->blk_nr, to = from + 1;
+  while (to - from < WRITE_MAX_RUN && latch_dirty_block(lookup_block(fh, to)))
+    to++;
+  while (to - from < WRITE_MAX_RUN && latch_dirty_block(lookup_block(fh, from - 1)))
+    from--;
+
+  page_p run[WRITE_MAX_RUN];
+  for (int i = 0; i < to - from; i++)
+    run[i] = lookup_block(fh, from + i)->page;
+  write_back_run(run, to - from);
+}
+
+/* Write back all dirty pages of the file, or of all files if fh is NULL */
+static void write_back_all(fhandle_p fh) {
+  int n = 0;
+  for (int i = 0; i < num_pages; i++) {
+    page_p pg = pages[i];
+    if (pg && is_dirty(pg) && pg->block && (!fh || pg->block->fhandle == fh))
+      flush_batch[n++] = pg;
+  }
+  if (n > 0)
+    write_back_pages(flush_batch, n);
+}
+
+static int too_many_dirty_pages(void) {
+  /* num_pages changes only with the pool lock, which may not be held */
+  return __atomic_load_n(&num_dirty_pages, __ATOMIC_RELAXED) * 100
+    > __atomic_load_n(&num_pages, __ATOMIC_RELAXED) * dirty_high_pct;
+}
+
+/* Write back dirty pages if there are too many of them.
+   Pinned pages are left alone, they are likely to be changed again. */
+static void flush_dirty_pages_maybe(void) {
+  if (!too_many_dirty_pages()) return;
+  int n = 0;
+  int num_dirty = __atomic_load_n(&num_dirty_pages, __ATOMIC_RELAXED);
+  for (int i = 0; i < num_pages
+         && (num_dirty - n) * 100 > num_pages * dirty_low_pct; i++) {
+    page_p pg = pages[flush_hand];
+    if (is_dirty(pg) && pg->block && !is_pinned(pg))
+      flush_batch[n++] = pg;
+    flush_hand = (flush_hand + 1) % num_pages;
+  }
+  if (n > 0)
+    write_back_pages(flush_batch, n);
+}
+
+int pager_set_dirty_thresholds(int high_pct, int low_pct) {
+  if (high_pct < 0 || high_pct > 100 || low_pct < 0 || low_pct > high_pct) {
+    put_msg(ERROR, "pager_set_dirty_thresholds: invalid thresholds %d%%, %d%%.\n",
+            high_pct, low_pct);
+    return 0;
+  }
+  dirty_high_pct = high_pct;
+  dirty_low_pct = low_pct;
+  return 1;
+}
+
+void pager_dirty_thresholds(int* high_pct, int* low_pct) {
+  *high_pct = dirty_high_pct;
+  *low_pct = dirty_low_pct;
+}
+
+/* Page replacement policies
+
+   A policy keeps track of the pages that hold blocks and chooses
+   the victim when available_page() runs out of unused pages.
+   The pager calls
+   - admit() when a page gets a block that was not in the buffer,
+   - touch() when the block of a page is accessed again,
+   - pin()/unpin() when a page turns pinned/unpinned. Since pages are
+     pinned without the pool lock, the policy may be told later, and
+     a page the policy takes as unpinned may be pinned already.
+   - victim() to take an unpinned page (away from the policy) that is
+     to be replaced with block b, NULL if all pages are pinned,
+     claiming it with claim_page(),
+   - remove() when a page no longer holds a block.
+*/
+
+/* for policies that need not know */
+static void repl_noop(page_p pg) {
+}
+
+/** @brief Operations of a page replacement policy */
+typedef struct repl_ops {
+  char const* name;
+  void (*init)(void);
+  void (*terminate)(void);
+  void (*admit)(page_p pg);
+  void (*touch)(page_p pg);
+  void (*pin)(page_p pg);
+  void (*unpin)(page_p pg);
+  page_p (*victim)(block_p b);
+  void (*remove)(page_p pg);
+  void (*info)(pmsg_level level);
+} repl_ops;
+
+/* Ghosts are the ids of recently replaced blocks, which some
+   policies remember to recognize blocks that come back.
+   A ghost is in one of the ghost lists, from least to most recent,
+   and can be found in the ghost table by the id of its block. */
+
+typedef struct ghost_struct * ghost_p;
+typedef struct ghost_list * ghost_list_p;
+
+/** @brief Id of a replaced block */
+typedef struct ghost_struct {
+  int fid;             /**< file id of the block */
+  int blk_nr;          /**< block number */
+  unsigned long last_ref; /**< time of the last reference (LRU-K) */
+  ghost_list_p list;   /**< the ghost list it is in */
+  ghost_p hnext;       /**< next ghost in the same bucket of ghost_table */
+  ghost_p prev;        /**< previous (less recent) ghost in list */
+  ghost_p next;        /**< next (more recent) ghost in list */
+} ghost_struct;
+
+/** @brief list of ghosts */
+typedef struct ghost_list {
+  ghost_p first; /**< least recent */
+  ghost_p last;  /**< most recent */
+  int len;
+} ghost_list;
+
+static ghost_p *ghost_table;
+static size_t ghost_table_mask;
+static ghost_list ghosts1, ghosts2;
+static ghost_p spare_ghosts; /* removed ghosts to reuse, linked by next */
+
+static void ghosts_init(void) {
+  size_t num_buckets = blk_table_mask + 1;
+  ghost_table = calloc(num_buckets, sizeof (ghost_p));
+  ghost_table_mask = num_buckets - 1;
+  ghosts1.first = ghosts1.last = 0;
+  ghosts1.len = 0;
+  ghosts2 = ghosts1;
+}
+
+static ghost_p find_ghost(block_p b) {
+  int fid = b->fhandle->fid;
+  for (ghost_p g = ghost_table[blk_hash(fid, b->blk_nr) & ghost_table_mask];
+       g; g = g->hnext)
+    if (g->fid == fid && g->blk_nr == b->blk_nr)
+      return g;
+  return 0;
+}
+
+static void remove_ghost(ghost_p g) {
+  ghost_p *gp = &ghost_table[blk_hash(g->fid, g->blk_nr) & ghost_table_mask];
+  while (*gp != g)
+    gp = &(*gp)->hnext;
+  *gp = g->hnext;
+
+  ghost_list_p l = g->list;
+  if (g->prev) g->prev->next = g->next;
+  else l->first = g->next;
+  if (g->next) g->next->prev = g->prev;
+  else l->last = g->prev;
+  l->len--;
+  g->next = spare_ghosts;
+  spare_ghosts = g;
+}
+
+/* The block of pg becomes the most recent ghost in l */
+static ghost_p add_ghost(ghost_list_p l, page_p pg) {
+  ghost_p g = spare_ghosts;
+  if (g)
+    spare_ghosts = g->next;
+  else
+    g = malloc(sizeof (ghost_struct));
+  g->fid = pg->block->fhandle->fid;
+  g->blk_nr = pg->block->blk_nr;
+  g->last_ref = pg->hist[0];
+  size_t h = blk_hash(g->fid, g->blk_nr) & ghost_table_mask;
+  g->hnext = ghost_table[h];
+  ghost_table[h] = g;
+
+  g->list = l;
+  g->next = 0;
+  g->prev = l->last;
+  if (l->last) l->last->next = g;
+  else l->first = g;
+  l->last = g;
+  l->len++;
+  return g;
+}
+
+/* Forget the least recent ghosts so that at most max_len are left in l */
+static void trim_ghosts(ghost_list_p l, int max_len) {
+  while (l->len > max_len && l->first)
+    remove_ghost(l->first);
+}
+
+static void ghosts_terminate(void) {
+  trim_ghosts(&ghosts1, 0);
+  trim_ghosts(&ghosts2, 0);
+  while (spare_ghosts) {
+    ghost_p g = spare_ghosts;
+    spare_ghosts = g->next;
+    free(g);
+  }
+  free(ghost_table);
+  ghost_table = 0;
+}
+
+/* The first unpinned page in q, claimed, NULL if all are pinned */
+static page_p pq_first_unpinned(pqueue_p q) {
+  pq_elm_p p = q->first;
+  for (int i = 0; i < q->len; i++, p = p->next)
+    if (claim_page(p->page))
+      return p->page;
+  return 0;
+}
+
+/* LRU: the unpinned page that is least recently used is replaced.
+   Pinned pages are moved from q_unpinned to q_pinned, so that the
+   victim is always the first in q_unpinned. */
+
+static pqueue_p q_pinned, q_unpinned;
+
+static void lru_init(void) {
+  q_pinned = make_pqueue();
+  q_unpinned = make_pqueue();
+}
+
+static void lru_terminate(void) {
+  q_unpinned = release_pqueue(q_unpinned);
+  q_pinned = release_pqueue(q_pinned);
+}
+
+static void lru_admit(page_p pg) {
+  pq_enqueue(is_pinned(pg) ? q_pinned : q_unpinned, pg);
+}
+
+static void lru_pin(page_p pg) {
+  pq_move(q_pinned, pg);
+}
+
+static void lru_unpin(page_p pg) {
+  pq_move(q_unpinned, pg);
+}
+
+static page_p lru_victim(block_p b) {
+  while (q_unpinned->first) {
+    page_p pg = q_unpinned->first->page;
+    if (claim_page(pg)) {
+      pq_remove_page(pg);
+      return pg;
+    }
+    /* pinned, the policy is yet to be told */
+    lru_pin(pg);
+  }
+  return 0;
+}
+
+static void lru_info(pmsg_level level) {
+  put_pqueue_info(level, q_unpinned, "unpinned");
+  put_pqueue_info(level, q_pinned, "pinned");
+}
+
+/* CLOCK: pages are swept in the order of pages[].
+   A page whose reference bit is set gets a second chance. */
+
+static size_t clock_hand;
+
+static void clock_init(void) {
+  clock_hand = 0;
+}
+
+static void clock_terminate(void) {
+}
+
+static void clock_touch(page_p pg) {
+  pg->ref = 1;
+}
+
+static page_p clock_victim(block_p b) {
+  /* after one round, all reference bits are cleared */
+  for (size_t i = 0; i < 2 * (size_t) num_pages; i++) {
+    page_p pg = pages[clock_hand];
+    clock_hand = (clock_hand + 1) % num_pages;
+    if (!pg->block || !pg->valid || is_pinned(pg)) continue;
+    if (pg->ref) {
+      pg->ref = 0;
+      continue;
+    }
+    if (claim_page(pg))
+      return pg;
+  }
+  return 0;
+}
+
+static void clock_remove(page_p pg) {
+  pg->ref = 0;
+}
+
+static void clock_info(pmsg_level level) {
+  put_msg(level, "Clock hand at page %d\n", clock_hand);
+}
+
+/* LRU-K: the page whose K-th most recent reference is the oldest is
+   replaced. Pages referenced less than K times come first, in LRU
+   order. The time of the last reference of a replaced block is kept
+   as a ghost, so that it counts when the block comes back.
+   The unpinned pages are kept in a min-heap on
+   (hist[LRU_K - 1], hist[0]). */
+
+static unsigned long lruk_time;
+static page_p *lruk_heap;
+static int lruk_heap_len;
+
+static int lruk_less(page_p a, page_p b) {
+  if (a->hist[LRU_K - 1] != b->hist[LRU_K - 1])
+    return a->hist[LRU_K - 1] < b->hist[LRU_K - 1];
+  return a->hist[0] < b->hist[0];
+}
+
+static void lruk_heap_set(int i, page_p pg) {
+  lruk_heap[i] = pg;
+  pg->heap_i = i;
+}
+
+static void lruk_sift_up(int i) {
+  page_p pg = lruk_heap[i];
+  while (i > 0 && lruk_less(pg, lruk_heap[(i - 1) / 2])) {
+    lruk_heap_set(i, lruk_heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  lruk_heap_set(i, pg);
+}
+
+static void lruk_sift_down(int i) {
+  page_p pg = lruk_heap[i];
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= lruk_heap_len) break;
+    if (c + 1 < lruk_heap_len && lruk_less(lruk_heap[c + 1], lruk_heap[c]))
+      c++;
+    if (!lruk_less(lruk_heap[c], pg)) break;
+    lruk_heap_set(i, lruk_heap[c]);
+    i = c;
+  }
+  lruk_heap_set(i, pg);
+}
+
+static void lruk_heap_insert(page_p pg) {
+  lruk_heap_set(lruk_heap_len++, pg);
+  lruk_sift_up(pg->heap_i);
+}
+
+static void lruk_heap_delete(page_p pg) {
+  int i = pg->heap_i;
+  if (i < 0) return;
+  pg->heap_i = -1;
+  if (--lruk_heap_len == i) return;
+  lruk_heap_set(i, lruk_heap[lruk_heap_len]);
+  lruk_sift_up(i);
+  lruk_sift_down(lruk_heap[i]->heap_i);
+}
+
+static void lruk_init(void) {
+  lruk_time = 0;
+  lruk_heap = malloc(num_pages * sizeof (page_p));
+  lruk_heap_len = 0;
+  ghosts_init();
+}
+
+static void lruk_terminate(void) {
+  free(lruk_heap);
+  lruk_heap = 0;
+  ghosts_terminate();
+}
+
+static void lruk_admit(page_p pg) {
+  ghost_p g = find_ghost(pg->block);
+  for (int i = LRU_K - 1; i > 0; i--)
+    pg->hist[i] = 0;
+  if (g) {
+    pg->hist[1] = g->last_ref;
+    remove_ghost(g);
+  }
+  pg->hist[0] = ++lruk_time;
+  pg->heap_i = -1;
+  if (!is_pinned(pg))
+    lruk_heap_insert(pg);
+}
+
+static void lruk_touch(page_p pg) {
+  for (int i = LRU_K - 1; i > 0; i--)
+    pg->hist[i] = pg->hist[i - 1];
+  pg->hist[0] = ++lruk_time;
+  if (pg->heap_i >= 0)
+    lruk_sift_down(pg->heap_i);
+}
+
+static void lruk_pin(page_p pg) {
+  lruk_heap_delete(pg);
+}
+
+static void lruk_unpin(page_p pg) {
+  if (pg->heap_i < 0)
+    lruk_heap_insert(pg);
+}
+
+static page_p lruk_victim(block_p b) {
+  while (lruk_heap_len > 0) {
+    page_p pg = lruk_heap[0];
+    /* a pinned page is inserted again when it is unpinned */
+    lruk_heap_delete(pg);
+    if (claim_page(pg)) {
+      add_ghost(&ghosts1, pg);
+      trim_ghosts(&ghosts1, num_pages);
+      return pg;
+    }
+  }
+  return 0;
+}
+
+static void lruk_remove(page_p pg) {
+  lruk_heap_delete(pg);
+}
+
+static void lruk_info(pmsg_level level) {
+  put_msg(level, "LRU-%d: %d unpinned pages, %d ghosts, time %lu\n",
+          LRU_K, lruk_heap_len, ghosts1.len, lruk_time);
+}
+
+/* 2Q: a block that is not recently replaced enters the FIFO queue
+   q_a1in. When it is replaced from there, it is remembered in the
+   ghost list A1out, and goes to the LRU queue q_am when it comes back.
+   So a block that is used only once (in a scan) does not push
+   frequently used blocks out of q_am. */
+
+static pqueue_p q_a1in, q_am;
+
+/* sizes of q_a1in and A1out, as suggested in the 2Q paper */
+#define TWOQ_KIN(n) ((n) / 4 > 0 ? (n) / 4 : 1)
+#define TWOQ_KOUT(n) ((n) / 2 > 0 ? (n) / 2 : 1)
+
+static void twoq_init(void) {
+  q_a1in = make_pqueue();
+  q_am = make_pqueue();
+  ghosts_init();
+}
+
+static void twoq_terminate(void) {
+  q_a1in = release_pqueue(q_a1in);
+  q_am = release_pqueue(q_am);
+  ghosts_terminate();
+}
+
+static void twoq_admit(page_p pg) {
+  ghost_p g = find_ghost(pg->block);
+  if (g) {
+    remove_ghost(g);
+    pq_enqueue(q_am, pg);
+  } else
+    pq_enqueue(q_a1in, pg);
+}
+
+static void twoq_touch(page_p pg) {
+  if (pg->queue == q_am)
+    pq_touch(pg);
+}
+
+static page_p twoq_victim(block_p b) {
+  page_p pg = 0;
+  if (q_a1in->len > TWOQ_KIN(num_pages) || q_am->len == 0)
+    pg = pq_first_unpinned(q_a1in);
+  if (!pg)
+    pg = pq_first_unpinned(q_am);
+  if (!pg)
+    pg = pq_first_unpinned(q_a1in);
+  if (!pg) return 0;
+
+  if (pg->queue == q_a1in) {
+    add_ghost(&ghosts1, pg);
+    trim_ghosts(&ghosts1, TWOQ_KOUT(num_pages));
+  }
+  pq_remove_page(pg);
+  return pg;
+}
+
+static void twoq_info(pmsg_level level) {
+  put_pqueue_info(level, q_a1in, "A1in");
+  put_pqueue_info(level, q_am, "Am");
+  put_msg(level, "A1out: %d ghosts\n", ghosts1.len);
+}
+
+/* ARC: recently used pages are in q_t1, frequently used pages in q_t2,
+   and the ghosts of the pages replaced from them in ghosts1 (B1) and
+   ghosts2 (B2). A hit on a ghost in B1 (B2) tells that q_t1 (q_t2)
+   should have been larger, so the target size arc_p of q_t1
+   is adapted. */
+
+static pqueue_p q_t1, q_t2;
+static int arc_p;
+
+static void arc_init(void) {
+  q_t1 = make_pqueue();
+  q_t2 = make_pqueue();
+  arc_p = 0;
+  ghosts_init();
+}
+
+static void arc_terminate(void) {
+  q_t1 = release_pqueue(q_t1);
+  q_t2 = release_pqueue(q_t2);
+  ghosts_terminate();
+}
+
+static void arc_admit(page_p pg) {
+  ghost_p g = find_ghost(pg->block);
+  if (g && g->list == &ghosts1) {
+    int delta = ghosts2.len > ghosts1.len ? ghosts2.len / ghosts1.len : 1;
+    arc_p = arc_p + delta < num_pages ? arc_p + delta : num_pages;
+  } else if (g) {
+    int delta = ghosts1.len > ghosts2.len ? ghosts1.len / ghosts2.len : 1;
+    arc_p = arc_p - delta > 0 ? arc_p - delta : 0;
+  }
+  if (g) {
+    remove_ghost(g);
+    pq_enqueue(q_t2, pg);
+  } else {
+    pq_enqueue(q_t1, pg);
+    /* the directory holds at most 2 * num_pages blocks,
+       of which at most num_pages are recently used */
+    trim_ghosts(&ghosts1, num_pages - q_t1->len);
+    trim_ghosts(&ghosts2,
+                2 * num_pages - q_t1->len - q_t2->len - ghosts1.len);
+  }
+}
+
+static void arc_touch(page_p pg) {
+  pq_move(q_t2, pg);
+}
+
+static page_p arc_victim(block_p b) {
+  page_p pg = 0;
+  ghost_p g = find_ghost(b);
+  int in_b2 = g && g->list == &ghosts2;
+  if (q_t1->len > 0 && (q_t1->len > arc_p || (in_b2 && q_t1->len == arc_p)))
+    pg = pq_first_unpinned(q_t1);
+  if (!pg)
+    pg = pq_first_unpinned(q_t2);
+  if (!pg)
+    pg = pq_first_unpinned(q_t1);
+  if (!pg) return 0;
+
+  add_ghost(pg->queue == q_t1 ? &ghosts1 : &ghosts2, pg);
+  pq_remove_page(pg);
+  return pg;
+}
+
+static void arc_info(pmsg_level level) {
+  put_pqueue_info(level, q_t1, "T1");
+  put_pqueue_info(level, q_t2, "T2");
+  put_msg(level, "B1: %d ghosts, B2: %d ghosts, target size of T1: %d\n",
+          ghosts1.len, ghosts2.len, arc_p);
+}
+
+/** The replacement policies, in the order of @ref repl_policy */
+static repl_ops const repl_policies[] = {
+  {"lru", lru_init, lru_terminate, lru_admit, pq_touch,
+   lru_pin, lru_unpin, lru_victim, pq_remove_page, lru_info},
+  {"clock", clock_init, clock_terminate, clock_touch, clock_touch,
+   repl_noop, repl_noop, clock_victim, clock_remove, clock_info},
+  {"lru-k", lruk_init, lruk_terminate, lruk_admit, lruk_touch,
+   lruk_pin, lruk_unpin, lruk_victim, lruk_remove, lruk_info},
+  {"2q", twoq_init, twoq_terminate, twoq_admit, twoq_touch,
+   repl_noop, repl_noop, twoq_victim, pq_remove_page, twoq_info},
+  {"arc", arc_init, arc_terminate, arc_admit, arc_touch,
+   repl_noop, repl_noop, arc_victim, pq_remove_page, arc_info},
+};
+
+/** Policy of the running pager */
+static repl_ops const* repl = 0;
+
+/** Policy used by the next pager_init() with REPL_SAME */
+static repl_policy repl_policy_conf = REPL_LRU;
+
+repl_policy repl_policy_by_name(char const* name) {
+  for (int i = REPL_LRU; i <= REPL_ARC; i++)
+    if (strcmp(name, repl_policies[i - REPL_LRU].name) == 0)
+      return i;
+  return REPL_SAME;
+}
+
+static void put_repl_info(pmsg_level level) {
+  if (!repl) {
+    put_msg(level, "No page replacement policy\n");
+    return;
+  }
+  put_msg(level, "Page replacement policy %s:\n", repl->name);
+  repl->info(level);
+}
+
+/* forward declaration */
+static void detect_sequential(fhandle_p fh, int blk_nr);
+
+/* Tell the replacement policy about accesses of the page */
+static void apply_accesses(page_p pg, int what) {
+  /* a page being read or replaced is told when it is admitted */
+  if (!pg->block || !__atomic_load_n(&pg->valid, __ATOMIC_ACQUIRE)) return;
+  if (what & PENDING_TOUCH) {
+    pg->last_used = ++use_clock;
+    repl->touch(pg);
+    detect_sequential(pg->block->fhandle, pg->block->blk_nr);
+  }
+  if (what & PENDING_PIN) {
+    if (is_pinned(pg))
+      repl->pin(pg);
+    else
+      repl->unpin(pg);
+  }
+}
+
+/* Queue accesses of the page for the next holder of the pool lock.
+   Repeated accesses of a page are told once. */
+static void defer_accesses(page_p pg, int what) {
+  int old = __atomic_fetch_or(&pg->pending, what | PENDING_QUEUED,
+                              __ATOMIC_ACQ_REL);
+  if (old & PENDING_QUEUED) return;
+  page_p head = __atomic_load_n(&pending_pages, __ATOMIC_RELAXED);
+  do
+    pg->pending_next = head;
+  while (!__atomic_compare_exchange_n(&pending_pages, &head, pg, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Apply the queued accesses, with the pool lock */
+static void apply_pending_accesses(void) {
+  page_p pg = __atomic_exchange_n(&pending_pages, 0, __ATOMIC_ACQUIRE);
+  while (pg) {
+    page_p next = pg->pending_next;
+    int what = __atomic_exchange_n(&pg->pending, 0, __ATOMIC_ACQ_REL);
+    apply_accesses(pg, what & ~PENDING_QUEUED);
+    pg = next;
+  }
+}
+
+static void pool_lock(void) {
+  pthread_mutex_lock(&pool_mutex);
+  if (repl) apply_pending_accesses();
+}
+
+static void pool_unlock(void) {
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Tell the replacement policy about accesses of the page right away if
+   the pool lock is free, otherwise later. If @em flush is non-zero,
+   dirty pages are written back if there are too many of them. */
+static void note_accesses(page_p pg, int what, int flush) {
+  flush = flush && too_many_dirty_pages();
+  if (!what && !flush) return;
+  if (pthread_mutex_trylock(&pool_mutex) != 0) {
+    if (what) defer_accesses(pg, what);
+    return;
+  }
+  apply_pending_accesses();
+  if (what) apply_accesses(pg, what);
+  if (flush) flush_dirty_pages_maybe();
+  pool_unlock();
+}
+
+/* Hash value of a file name (FNV-1a) */
+static size_t fname_hash(char const* fname) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *fname; fname++)
+    h = (h ^ (unsigned char) *fname) * 1099511628211ULL;
+  return (size_t) h;
+}
+
+/* Keep the file table at least as large as the number of files */
+static int grow_fh_table(void) {
+  size_t num_buckets = fh_table ? 2 * (fh_table_mask + 1) : 64;
+  fhandle_p *table = calloc(num_buckets, sizeof (fhandle_p));
+  if (!table) return 0;
+  for (size_t i = 0; fh_table && i <= fh_table_mask; i++)
+    while (fh_table[i]) {
+      fhandle_p fh = fh_table[i];
+      fh_table[i] = fh->hnext;
+      size_t h = fname_hash(fh->fname) & (num_buckets - 1);
+      fh->hnext = table[h];
+      table[h] = fh;
+    }
+  free(fh_table);
+  fh_table = table;
+  fh_table_mask = num_buckets - 1;
+  return 1;
+}
+
+/* Remove fh from the list of files with an open fd */
+static void fd_lru_remove(fhandle_p fh) {
+  if (fh->fd_prev) fh->fd_prev->fd_next = fh->fd_next;
+  else fd_lru_first = fh->fd_next;
+  if (fh->fd_next) fh->fd_next->fd_prev = fh->fd_prev;
+  else fd_lru_last = fh->fd_prev;
+  fh->fd_prev = fh->fd_next = 0;
+}
+
+/* fh becomes the most recently used file with an open fd */
+static void fd_lru_append(fhandle_p fh) {
+  fh->fd_next = 0;
+  fh->fd_prev = fd_lru_last;
+  if (fd_lru_last) fd_lru_last->fd_next = fh;
+  else fd_lru_first = fh;
+  fd_lru_last = fh;
+}
+
+/* Close the file descriptor of the file. The file stays open for the
+   pager, and its fd is opened again when it is needed. */
+static int close_fd(fhandle_p fh) {
+  if (fh->fd == -1) return 1;
+  flusher_wait(fh->fd, 0, INT_MAX);
+  fd_lru_remove(fh);
+  num_open_fds--;
+  int res = vfs->close(fh->fd);
+  fh->fd = -1;
+  return res == 0;
+}
+
+/* Open the file for read and write, create it if it does not exist */
+static int open_fd(char const* fname) {
+  int fd = vfs->open(fname, direct_io);
+  if (fd == -1)
+    put_msg(WARN, "Failed to open file %s.", fname);
+  return fd;
+}
+
+/* The file descriptor of the file, opened on demand.
+   When MAX_OPEN_FILES file descriptors are open already, the least
+   recently used one that no disk I/O is using is closed first.
+   Returns -1 upon failure. */
+static int fh_fd(fhandle_p fh) {
+  if (fh->fd != -1) {
+    if (fh != fd_lru_last) {
+      fd_lru_remove(fh);
+      fd_lru_append(fh);
+    }
+    return fh->fd;
+  }
+  if (num_open_fds >= MAX_OPEN_FILES) {
+    fhandle_p victim = fd_lru_first;
+    while (victim && __atomic_load_n(&victim->io_users, __ATOMIC_ACQUIRE))
+      victim = victim->fd_next;
+    if (victim)
+      close_fd(victim);
+  }
+  fh->fd = open_fd(fh->fname);
+  if (fh->fd == -1) return -1;
+  fd_lru_append(fh);
+  num_open_fds++;
+  return fh->fd;
+}
+
+/* The file descriptor of the file for a disk I/O done without the pool
+   lock, which the caller holds now. The fd stays open till io_end(). */
+static int io_begin(fhandle_p fh) {
+  int fd = fh_fd(fh);
+  if (fd != -1)
+    __atomic_add_fetch(&fh->io_users, 1, __ATOMIC_ACQ_REL);
+  return fd;
+}
+
+static void io_end(fhandle_p fh) {
+  __atomic_sub_fetch(&fh->io_users, 1, __ATOMIC_ACQ_REL);
+}
+
+/* ---------------------------------------------------------------------
+   File growth.
+   A file grows by extents of extent_blocks blocks, preallocated with
+   posix_fallocate() when the first block of an extent is appended, so
+   that the blocks of a table are laid out contiguously on disk.
+   The size of a file is the number of blocks allocated (phys_blocks),
+   the blocks in use (num_blocks) are recorded in the header of block 0
+   whenever it is written. The blocks not used yet are zeros, and are
+   given back when the file is closed. After a crash, the blocks beyond
+   the recorded number are probed backwards for the last block written.
+   --------------------------------------------------------------------- */
+
+/* Number of blocks in use of a file of phys blocks */
+static int logical_num_blocks(int fd, int phys) {
+  if (phys == 0) return 0;
+  char* buf;
+  if (posix_memalign((void**) &buf, FRAME_ALIGN, block_size))
+    return phys;
+  int recorded = 0, res = phys;
+  ssize_t n = vfs->pread(fd, buf, block_size, 0);
+  if (n == block_size)
+    memcpy(&recorded, buf + HEADER_NUM_BLOCKS, INT_SIZE);
+  if (recorded < phys) {
+    if (recorded < 1) recorded = 1;
+    for (res = phys; res > recorded; res--) {
+      int header_size = 0;
+      n = vfs->pread(fd, buf, block_size, (off_t) block_size * (res - 1));
+      if (n == block_size)
+        memcpy(&header_size, buf, INT_SIZE);
+      if (header_size != 0) break;
+    }
+  }
+  free(buf);
+  return res;
+}
+
+/* Make room on disk for the block to be appended to the file,
+   with the pool lock. Without preallocation, the file grows as blocks
+   are written. */
+static void grow_file(fhandle_p fh) {
+  int fd = fh_fd(fh);
+  if (fd != -1
+      && vfs->allocate(fd, (off_t) block_size * fh->num_blocks,
+                       (off_t) block_size * extent_blocks) == 0)
+    prof()->c.num_extents++;
+  fh->phys_blocks = fh->num_blocks + extent_blocks;
+}
+
+/* Give the preallocated blocks not used back, with the pool lock */
+static void trim_file(fhandle_p fh) {
+  if (fh->phys_blocks <= fh->num_blocks) return;
+  int fd = fh_fd(fh);
+  if (fd == -1) return;
+  flusher_wait(fd, 0, INT_MAX);
+  if (vfs->truncate(fd, (off_t) block_size * fh->num_blocks) == -1)
+    put_msg(WARN, "trim_file: cannot truncate \"%s\".\n", fh->fname);
+  spool_drop(fh->sfile, fh->num_blocks);
+  fh->phys_blocks = fh->num_blocks;
+}
+
+static fhandle_p make_fhandle(char const* fname) {
+  fhandle_p fh = malloc(sizeof (file_handle_struct));
+  if (!fh) return 0;
+  fh->fname = malloc(strlen(fname) + 1);
+  if (!fh->fname) {
+    free(fh);
+    return 0;
+  }
+  strcpy(fh->fname, fname);
+  fh->fd = -1;
+  fh->fd_prev = fh->fd_next = 0;
+  fh->io_users = 0;
+  int fd = fh_fd(fh);
+  if (fd == -1) {
+    free(fh->fname);
+    free(fh);
+    return 0;
+  }
+  fh->fid = next_fid++;
+  fh->phys_blocks = vfs->size(fd) / block_size;
+  fh->num_blocks = logical_num_blocks(fd, fh->phys_blocks);
+  fh->blocks_in_mem = 0;
+  fh->num_blocks_in_mem = 0;
+  fh->ra_last = -1;
+  fh->ra_seq = 0;
+  fh->ra_depth = RA_INIT_DEPTH;
+  fh->ra_issued = 0;
+  fh->ra_used = 0;
+  fh->use_mmap = 0;
+  fh->map = 0;
+  fh->map_blocks = 0;
+  fh->map_advice = MADV_NORMAL;
+  fh->old_maps = 0;
+  fh->wal_epoch = 0;
+  fh->max_pages = 0;
+  fh->sfile = spool_file_of(fd);
+
+  return fh;
+}
+
+static fhandle_p get_tbl_file(char const* fname) {
+  fhandle_p res = 0;
+  pthread_rwlock_rdlock(&fh_lock);
+  for (fhandle_p fh = fh_table ? fh_table[fname_hash(fname) & fh_table_mask] : 0;
+       fh; fh = fh->hnext)
+    if (strcmp(fh->fname, fname) == 0) {
+      res = fh;
+      break;
+    }
+  pthread_rwlock_unlock(&fh_lock);
+  return res;
+}
+
+/* Open the file, with the pool lock */
+static fhandle_p open_tbl_file(char const* fname) {
+  /* another thread may have opened it meanwhile */
+  fhandle_p fh = get_tbl_file(fname);
+  if (fh) return fh;
+
+  fh = make_fhandle(fname);
+  if (!fh) return 0;
+
+  pthread_rwlock_wrlock(&fh_lock);
+  if ((!fh_table || num_file_handles > fh_table_mask) && !grow_fh_table()) {
+    pthread_rwlock_unlock(&fh_lock);
+    put_msg(WARN, "Cannot open file %s, out of memory.", fname);
+    close_fd(fh);
+    free(fh->fname);
+    free(fh);
+    return 0;
+  }
+  size_t h = fname_hash(fname) & fh_table_mask;
+  fh->hnext = fh_table[h];
+  fh_table[h] = fh;
+  num_file_handles++;
+  pthread_rwlock_unlock(&fh_lock);
+
+  return fh;
+}
+
+/* The file, opened if it is not open yet */
+static fhandle_p get_or_open_tbl_file(char const* fname) {
+  fhandle_p fh = get_tbl_file(fname);
+  if (fh) return fh;
+  pool_lock();
+  fh = open_tbl_file(fname);
+  pool_unlock();
+  return fh;
+}
+
+/* Map the blocks the file has into memory */
+static int map_file(fhandle_p fh) {
+  if (fh->map) return 1;
+  if (fh->num_blocks == 0) return 0;
+  int fd = fh_fd(fh);
+  if (fd == -1) return 0;
+  void* map = vfs->map(fd, block_size * fh->num_blocks);
+  if (map == MAP_FAILED) {
+    put_msg(WARN, "Failed to map file %s, reading it into pages instead.\n",
+            fh->fname);
+    fh->use_mmap = 0;
+    return 0;
+  }
+  fh->map = map;
+  fh->map_blocks = fh->num_blocks;
+  fh->map_advice = MADV_NORMAL;
+  return 1;
+}
+
+/* Stop serving new pages from the mapping of the file. Pages that are
+   served from it may be in use by other threads, so it is unmapped
+   when the file is closed. */
+static void unmap_file(fhandle_p fh) {
+  if (!fh->map) return;
+  old_map* om = malloc(sizeof (old_map));
+  if (!om) {
+    /* no other thread may be using it then */
+    for (block_p b = fh->blocks_in_mem; b; b = b->fnext)
+      unmap_page(b->page);
+    vfs->unmap(fh->map, block_size * fh->map_blocks);
+  } else {
+    om->map = fh->map;
+    om->len = block_size * fh->map_blocks;
+    om->next = fh->old_maps;
+    fh->old_maps = om;
+  }
+  fh->map = 0;
+  fh->map_blocks = 0;
+}
+
+/* Unmap all mappings of the file, when no page is served from them */
+static void release_maps(fhandle_p fh) {
+  unmap_file(fh);
+  while (fh->old_maps) {
+    old_map* om = fh->old_maps;
+    fh->old_maps = om->next;
+    vfs->unmap(om->map, om->len);
+    free(om);
+  }
+}
+
+/* Tell the kernel how the mapping is going to be accessed */
+static void advise_map(fhandle_p fh, int advice) {
+  if (!fh->map || fh->map_advice == advice) return;
+  madvise(fh->map, block_size * fh->map_blocks, advice);
+  fh->map_advice = advice;
+}
+
+void pager_set_direct_io(int on) {
+  direct_io = on;
+}
+
+int pager_direct_io(void) {
+  return direct_io;
+}
+
+int file_set_mmap(char const* fname, int on) {
+  pool_lock();
+  fhandle_p fh = open_tbl_file(fname);
+
+  if (!fh) {
+    pool_unlock();
+    put_msg(ERROR, "file_set_mmap: cannot get file \"%s\".\n", fname);
+    return 0;
+  }
+  if (!on)
+    unmap_file(fh);
+  fh->use_mmap = on;
+  /* map it now, to tell if the file system cannot */
+  int ok = !on || fh->num_blocks == 0 || map_file(fh);
+  pool_unlock();
+  return ok;
+}
+
+long long pager_num_mapped(void) {
+  pager_counters pc;
+  sum_counters(&pc);
+  return pc.num_mapped;
+}
+
+static int num_blocks_of(fhandle_p fh) {
+  return __atomic_load_n(&fh->num_blocks, __ATOMIC_ACQUIRE);
+}
+
+int file_num_blocks(char const* fname) {
+  fhandle_p fh = get_or_open_tbl_file(fname);
+
+  if (!fh) {
+    put_msg(ERROR, "file_num_blocks: cannot get file \"fname\".\n");
+    return -1;
+  }
+  return num_blocks_of(fh);
+}
+
+/* forward declaration */
+static void release_block(block_p b);
+static void put_free_page(page_p pg);
+/** non-zero while changes are logged, see the write-ahead log below */
+static int wal_running;
+static void sync_file(fhandle_p fh);
+static void preload_terminate(void);
+static void ccache_drop_file(int fid);
+
+/* Close the file, with the pool lock. No other thread may use it. */
+static void close_tbl_file(fhandle_p fhandle) {
+  if (!fhandle) return;
+  write_back_all(fhandle);
+  while (fhandle->blocks_in_mem) {
+    page_p pg = fhandle->blocks_in_mem->page;
+    release_block(fhandle->blocks_in_mem);
+    put_free_page(pg);
+  }
+  ccache_drop_file(fhandle->fid);
+  release_maps(fhandle);
+  trim_file(fhandle);
+  if (wal_running)
+    sync_file(fhandle);
+  if (close_fd(fhandle)) {
+    pthread_rwlock_wrlock(&fh_lock);
+    fhandle_p *fp = &fh_table[fname_hash(fhandle->fname) & fh_table_mask];
+    while (*fp != fhandle)
+      fp = &(*fp)->hnext;
+    *fp = fhandle->hnext;
+    num_file_handles--;
+    pthread_rwlock_unlock(&fh_lock);
+    free(fhandle->fname);
+    free(fhandle);
+  }
+}
+
+int close_file(char const* fname) {
+  preload_terminate();
+  pool_lock();
+  fhandle_p fh = get_tbl_file(fname);
+  int fid = fh ? fh->fid : -1;
+  close_tbl_file(fh);
+  pool_unlock();
+  return fid;
+}
+
+/* Drop the blocks of the file from the shared pool, before the file
+   is removed or replaced */
+static void spool_drop_named(char const* fname) {
+  struct stat st;
+  if (spool && stat(fname, &st) == 0) {
+    spool_file sf = { st.st_dev, st.st_ino };
+    spool_drop(sf, 0);
+  }
+}
+
+int file_remove(char const* fname) {
+  close_file(fname);
+  spool_drop_named(fname);
+  return vfs->remove(fname) == 0;
+}
+
+int file_rename(char const* from, char const* to) {
+  close_file(from);
+  close_file(to);
+  spool_drop_named(to);
+  return vfs->rename(from, to) == 0;
+}
+
+int file_set_log_structured(char const* fname) {
+  close_file(fname);
+  spool_drop_named(fname);
+  if (!lss_convert(fname)) {
+    put_msg(ERROR, "file_set_log_structured: cannot convert %s.\n", fname);
+    return 0;
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------------------
+   Write-ahead log.
+   Every change to a page is appended to a log buffer in memory as a
+   record of the changed bytes, numbered by its position in the log
+   (log sequence number, LSN). A background log writer appends the
+   buffer to the log file and forces it to disk with one fdatasync()
+   for all changes made meanwhile:
+   - with DURABILITY_GROUP every WAL_GROUP_MS ms, or earlier when a
+     thread waits for it,
+   - with DURABILITY_STATEMENT as soon as there is something to write,
+     pager_commit() waiting for it, so that the statements committed
+     during a sync share the next one.
+   The first change to a page since it was clean is logged with the
+   whole content of the block (a block image), the others with the
+   bytes changed only.
+   A page is written to its file only after the log up to its last
+   change is on disk, so that a crash leaves the image and the changes
+   of every torn or lost block in the log.
+   A file is named in the log by a record of its fid and name before
+   the first change to it in each epoch of the log.
+   A checkpoint drops the beginning of the log whose changes are in
+   the files on disk: up to the first change to a page that is still
+   dirty (its rec_lsn).
+   pager_init() replays the log of a crash into the files, in the order
+   of the log, which makes every block at least as new as when its last
+   change was logged, even if it was torn by a write: the block image
+   comes first. The files of a log are synced and the log is
+   removed when the pager terminates.
+   --------------------------------------------------------------------- */
+
+/** name of the log file in the system dir */
+static const char wal_file[] = "__wal.log";
+static const char wal_tmp_file[] = "__wal.tmp";
+static const char wal_magic[8] = "db2700w";
+
+enum { WAL_PAGE, WAL_FILE };
+
+/** @brief Header of the log file */
+typedef struct wal_header {
+  char magic[8];
+  int block_size;      /**< block size of the pager that wrote the log */
+  int unused;
+  long long start_lsn; /**< LSN of the first record in the file */
+} wal_header;
+
+/** @brief Log record, followed by len bytes */
+typedef struct wal_rec {
+  int type;     /**< WAL_PAGE: bytes at offset of block blk_nr of file fid,
+                     WAL_FILE: name of file fid */
+  int fid;
+  int blk_nr;
+  int offset;
+  int len;
+  unsigned sum; /**< checksum of the record (with sum 0) and its bytes */
+} wal_rec;
+
+static pthread_t wal_writer;
+static int wal_stop;
+static int wal_fd = -1;
+static int wal_epoch;            /* bumped when files are to be named again */
+/* wal_mutex guards the log buffer and the LSNs below */
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_wanted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;
+/* wal_io_mutex guards the log file, taken before wal_mutex */
+static pthread_mutex_t wal_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wal_ckpt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *wal_buf;            /* records not handed to the writer yet */
+static size_t wal_len, wal_cap;
+static char *wal_spare;          /* the other buffer, used by the writer */
+static size_t wal_spare_cap;
+static long long wal_buf_lsn;    /* LSN of wal_buf[0] */
+static long long wal_durable_lsn; /* the log before it is on disk */
+static long long wal_forced_lsn; /* the log before it is waited for */
+static long long wal_start_lsn;  /* LSN of the first record in the file */
+
+static unsigned wal_sum(wal_rec const* r, char const* bytes) {
+  wal_rec h = *r;
+  h.sum = 0;
+  unsigned sum = 2166136261u; /* FNV-1a */
+  for (size_t i = 0; i < sizeof h; i++)
+    sum = (sum ^ ((unsigned char*) &h)[i]) * 16777619u;
+  for (int i = 0; i < r->len; i++)
+    sum = (sum ^ (unsigned char) bytes[i]) * 16777619u;
+  return sum;
+}
+
+/* Append a record to the log buffer, with wal_mutex.
+   Returns the LSN of the record, 0 if there is no memory. */
+static long long wal_append(int type, int fid, int blk_nr, int offset,
+                            char const* bytes, int len) {
+  size_t need = wal_len + sizeof (wal_rec) + len;
+  if (need > wal_cap) {
+    size_t cap = wal_cap ? wal_cap : WAL_WAKE_SIZE;
+    while (cap < need) cap *= 2;
+    char *buf = realloc(wal_buf, cap);
+    if (!buf) {
+      put_msg(ERROR, "wal: out of memory, a change is not logged.\n");
+      return 0;
+    }
+    wal_buf = buf;
+    wal_cap = cap;
+  }
+  wal_rec r = { type, fid, blk_nr, offset, len, 0 };
+  r.sum = wal_sum(&r, bytes);
+  long long lsn = wal_buf_lsn + wal_len;
+  memcpy(wal_buf + wal_len, &r, sizeof r);
+  memcpy(wal_buf + wal_len + sizeof r, bytes, len);
+  /* the first change of a group starts the clock of the log writer */
+  if (!wal_len || need >= WAL_WAKE_SIZE)
+    pthread_cond_signal(&wal_wanted);
+  wal_len = need;
+  return lsn;
+}
+
+/* Log the change of len bytes at offset of the page, which is latched
+   exclusively or being loaded. The first change since the page was
+   clean logs the whole block, since writing the block may tear it. */
+static void wal_log(page_p p, int offset, int len) {
+  if (!wal_running || !p->block) return;
+  fhandle_p fh = p->block->fhandle;
+  pthread_mutex_lock(&wal_mutex);
+  if (fh->wal_epoch != wal_epoch) {
+    wal_append(WAL_FILE, fh->fid, 0, 0, fh->fname, strlen(fh->fname));
+    fh->wal_epoch = wal_epoch;
+  }
+  if (!__atomic_load_n(&p->rec_lsn, __ATOMIC_ACQUIRE)) {
+    offset = 0;
+    len = block_size;
+  }
+  long long lsn = wal_append(WAL_PAGE, fh->fid, p->block->blk_nr, offset,
+                             p->content + offset, len);
+  if (lsn) {
+    if (!__atomic_load_n(&p->rec_lsn, __ATOMIC_ACQUIRE))
+      __atomic_store_n(&p->rec_lsn, lsn, __ATOMIC_RELEASE);
+    __atomic_store_n(&p->lsn, wal_buf_lsn + wal_len, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&wal_mutex);
+  thread_profiler* tp = prof();
+  tp->c.num_log_records++;
+  tp->c.num_log_bytes += sizeof (wal_rec) + len;
+}
+
+static void* wal_writer_main(void* arg) {
+  pthread_mutex_lock(&wal_mutex);
+  for (;;) {
+    /* write when somebody waits for it or the buffer is large, or
+       with DURABILITY_GROUP, WAL_GROUP_MS ms after the first change */
+    struct timespec until;
+    int timed = 0;
+    while (!wal_stop && !(wal_len && (wal_forced_lsn > wal_durable_lsn
+                                      || wal_len >= WAL_WAKE_SIZE))) {
+      if (durability != DURABILITY_GROUP || !wal_len) {
+        pthread_cond_wait(&wal_wanted, &wal_mutex);
+        continue;
+      }
+      if (!timed) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += WAL_GROUP_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+          until.tv_sec++;
+          until.tv_nsec -= 1000000000L;
+        }
+        timed = 1;
+      }
+      if (pthread_cond_timedwait(&wal_wanted, &wal_mutex, &until) == ETIMEDOUT)
+        break;
+    }
+    if (!wal_len) {
+      if (wal_stop) break;
+      continue;
+    }
+    char *buf = wal_buf;
+    size_t len = wal_len, cap = wal_cap;
+    long long lsn = wal_buf_lsn;
+    wal_buf = wal_spare;
+    wal_cap = wal_spare_cap;
+    wal_len = 0;
+    wal_buf_lsn = lsn + len;
+    pthread_mutex_unlock(&wal_mutex);
+
+    pthread_mutex_lock(&wal_io_mutex);
+    off_t pos = sizeof (wal_header) + (lsn - wal_start_lsn);
+    if (vfs->pwrite(wal_fd, buf, len, pos) != (ssize_t) len
+        || vfs->sync(wal_fd) == -1)
+      put_msg(ERROR, "wal: writing the log fails.\n");
+    prof()->c.num_log_syncs++;
+    pthread_mutex_lock(&wal_mutex);
+    wal_durable_lsn = lsn + len;
+    pthread_cond_broadcast(&wal_synced);
+    pthread_mutex_unlock(&wal_io_mutex);
+    wal_spare = buf;
+    wal_spare_cap = cap;
+  }
+  pthread_mutex_unlock(&wal_mutex);
+  return 0;
+}
+
+/* Wait till the log before lsn is on disk */
+static void wal_force(long long lsn) {
+  if (!wal_running || !lsn) return;
+  pthread_mutex_lock(&wal_mutex);
+  if (lsn > wal_forced_lsn) {
+    wal_forced_lsn = lsn;
+    pthread_cond_signal(&wal_wanted);
+  }
+  while (wal_durable_lsn < lsn)
+    pthread_cond_wait(&wal_synced, &wal_mutex);
+  pthread_mutex_unlock(&wal_mutex);
+}
+
+static int sync_dir(void) {
+  int fd = open(".", O_RDONLY);
+  if (fd == -1) return 0;
+  int res = fsync(fd);
+  close(fd);
+  return res == 0;
+}
+
+/* Make a log file starting at start_lsn with the bytes of the old log
+   file from start_lsn to end_lsn. Returns its fd, -1 upon failure. */
+static int wal_new_file(long long start_lsn, long long end_lsn) {
+  int fd = open(wal_tmp_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) return -1;
+  wal_header h;
+  memcpy(h.magic, wal_magic, sizeof h.magic);
+  h.block_size = block_size;
+  h.unused = 0;
+  h.start_lsn = start_lsn;
+  int ok = pwrite(fd, &h, sizeof h, 0) == sizeof h;
+  char buf[8192];
+  for (long long lsn = start_lsn; ok && lsn < end_lsn; ) {
+    size_t n = end_lsn - lsn < (long long) sizeof buf ? end_lsn - lsn : sizeof buf;
+    ok = pread(wal_fd, buf, n, sizeof h + (lsn - wal_start_lsn)) == (ssize_t) n
+      && pwrite(fd, buf, n, sizeof h + (lsn - start_lsn)) == (ssize_t) n;
+    lsn += n;
+  }
+  if (ok && fdatasync(fd) == 0 && rename(wal_tmp_file, wal_file) == 0
+      && sync_dir())
+    return fd;
+  close(fd);
+  unlink(wal_tmp_file);
+  return -1;
+}
+
+/* Wait till the copies of the file queued for the flusher are written,
+   and force the file to disk */
+static void sync_file(fhandle_p fh) {
+  int fd = fh_fd(fh);
+  if (fd == -1) return;
+  flusher_wait(fd, 0, INT_MAX);
+  if (vfs->sync(fd) == -1)
+    put_msg(ERROR, "sync_file: cannot sync \"%s\".\n", fh->fname);
+}
+
+/* Force all open files to disk */
+static void sync_all_files(void) {
+  pool_lock();
+  pthread_rwlock_rdlock(&fh_lock);
+  fhandle_p *fhs = malloc((num_file_handles + 1) * sizeof (fhandle_p));
+  int n = 0;
+  for (size_t i = 0; fhs && fh_table && i <= fh_table_mask; i++)
+    for (fhandle_p fh = fh_table[i]; fh; fh = fh->hnext)
+      if (io_begin(fh) != -1)
+        fhs[n++] = fh;
+  pthread_rwlock_unlock(&fh_lock);
+  pool_unlock();
+  for (int i = 0; i < n; i++) {
+    flusher_wait(fhs[i]->fd, 0, INT_MAX);
+    if (vfs->sync(fhs[i]->fd) == -1)
+      put_msg(ERROR, "wal: cannot sync \"%s\".\n", fhs[i]->fname);
+    io_end(fhs[i]);
+  }
+  free(fhs);
+}
+
+/* Drop the log whose changes are in the files on disk */
+static void wal_checkpoint(void) {
+  if (pthread_mutex_trylock(&wal_ckpt_mutex) != 0) return;
+  pool_lock();
+  write_back_all(0);
+  pool_unlock();
+
+  /* the changes before start are written (or queued for the flusher)
+     already, unless the page is still dirty */
+  pool_lock();
+  pthread_mutex_lock(&wal_mutex);
+  wal_epoch++;
+  long long start = wal_buf_lsn + wal_len;
+  for (int i = 0; i < num_pages; i++) {
+    long long rec_lsn = __atomic_load_n(&pages[i]->rec_lsn, __ATOMIC_ACQUIRE);
+    if (rec_lsn && rec_lsn < start)
+      start = rec_lsn;
+  }
+  pthread_mutex_unlock(&wal_mutex);
+  pool_unlock();
+  sync_all_files();
+  wal_force(start);
+
+  pthread_mutex_lock(&wal_io_mutex);
+  if (start > wal_start_lsn) {
+    int fd = wal_new_file(start, wal_durable_lsn);
+    if (fd != -1) {
+      close(wal_fd);
+      wal_fd = fd;
+      pthread_mutex_lock(&wal_mutex);
+      wal_start_lsn = start;
+      pthread_mutex_unlock(&wal_mutex);
+      prof()->c.num_checkpoints++;
+    } else
+      put_msg(WARN, "wal: checkpoint fails, the log is kept.\n");
+  }
+  pthread_mutex_unlock(&wal_io_mutex);
+  pthread_mutex_unlock(&wal_ckpt_mutex);
+}
+
+/** @brief A file being recovered */
+typedef struct wal_replay_file {
+  int fid;
+  int fd;  /**< -1 if the file no longer exists */
+} wal_replay_file;
+
+/* Replay the log left by a crash, if any, into the files */
+static void wal_replay(void) {
+  FILE *fp = fopen(wal_file, "r");
+  if (!fp) return;
+  wal_header h;
+  if (fread(&h, sizeof h, 1, fp) != 1
+      || memcmp(h.magic, wal_magic, sizeof h.magic) != 0
+      || h.block_size < MIN_BLOCK_SIZE || h.block_size > MAX_BLOCK_SIZE) {
+    put_msg(WARN, "wal: %s is not a log, ignored.\n", wal_file);
+    fclose(fp);
+    return;
+  }
+
+  wal_replay_file *files = 0;
+  int num_files = 0, num_changes = 0;
+  char *bytes = malloc(MAX_BLOCK_SIZE + 1);
+  wal_rec r;
+  /* a torn record ends the log */
+  while (bytes && fread(&r, sizeof r, 1, fp) == 1) {
+    if (r.len < 0 || r.len > MAX_BLOCK_SIZE
+        || fread(bytes, 1, r.len, fp) != (size_t) r.len
+        || wal_sum(&r, bytes) != r.sum)
+      break;
+    if (r.type == WAL_FILE) {
+      wal_replay_file *fs = realloc(files, (num_files + 1) * sizeof *fs);
+      if (!fs) break;
+      files = fs;
+      bytes[r.len] = '\0';
+      /* a file removed since was dropped, its changes are not needed */
+      files[num_files].fid = r.fid;
+      files[num_files++].fd = vfs->exists(bytes) ? vfs->open(bytes, 0) : -1;
+      continue;
+    }
+    if (r.type != WAL_PAGE || r.offset < 0
+        || r.offset + r.len > h.block_size)
+      break;
+    int i = num_files - 1;
+    while (i >= 0 && files[i].fid != r.fid)
+      i--;
+    if (i < 0) break;
+    if (files[i].fd == -1) continue;
+    if (vfs->pwrite(files[i].fd, bytes, r.len,
+                    (off_t) h.block_size * r.blk_nr + r.offset) != r.len)
+      put_msg(ERROR, "wal: replaying a change fails.\n");
+    num_changes++;
+  }
+  fclose(fp);
+  free(bytes);
+
+  for (int i = 0; i < num_files; i++) {
+    int fd = files[i].fd;
+    if (fd == -1) continue;
+    /* a block is whole even if only its beginning is logged */
+    off_t size = vfs->size(fd);
+    if (size % h.block_size)
+      vfs->truncate(fd, size + h.block_size - size % h.block_size);
+    vfs->sync(fd);
+    spool_drop(spool_file_of(fd), 0);
+    vfs->close(fd);
+  }
+  free(files);
+  if (num_changes > 0)
+    put_msg(INFO, "wal: %d changes recovered from %s.\n",
+            num_changes, wal_file);
+}
+
+/* Recover from the log of a crash and start a new log */
+static void wal_start(void) {
+  if (in_memory) {
+    /* nothing to recover after a crash */
+    durability = DURABILITY_OFF;
+    return;
+  }
+  wal_replay();
+  durability = durability_conf;
+  if (durability == DURABILITY_OFF) {
+    unlink(wal_file);
+    return;
+  }
+  wal_start_lsn = 1;
+  wal_fd = wal_new_file(wal_start_lsn, wal_start_lsn);
+  if (wal_fd != -1) {
+    wal_buf_lsn = wal_durable_lsn = wal_forced_lsn = wal_start_lsn;
+    wal_len = 0;
+    wal_epoch++;
+    wal_stop = 0;
+    wal_running = pthread_create(&wal_writer, 0, wal_writer_main, 0) == 0;
+  }
+  if (!wal_running) {
+    put_msg(WARN, "wal: cannot start the log, durability is off.\n");
+    if (wal_fd != -1) close(wal_fd);
+    wal_fd = -1;
+    unlink(wal_file);
+    durability = DURABILITY_OFF;
+  }
+}
+
+/* Stop the log writer and remove the log, all files are on disk */
+static void wal_terminate(void) {
+  if (!wal_running) return;
+  pthread_mutex_lock(&wal_mutex);
+  wal_stop = 1;
+  pthread_cond_signal(&wal_wanted);
+  pthread_mutex_unlock(&wal_mutex);
+  pthread_join(wal_writer, 0);
+  wal_running = 0;
+  close(wal_fd);
+  wal_fd = -1;
+  unlink(wal_file);
+  sync_dir();
+  free(wal_buf);
+  free(wal_spare);
+  wal_buf = wal_spare = 0;
+  wal_cap = wal_spare_cap = 0;
+}
+
+void pager_commit(void) {
+  if (!wal_running) return;
+  prof()->c.num_commits++;
+  pthread_mutex_lock(&wal_mutex);
+  long long end = wal_buf_lsn + wal_len;
+  long long size = end - wal_start_lsn;
+  pthread_mutex_unlock(&wal_mutex);
+  if (durability == DURABILITY_STATEMENT)
+    wal_force(end);
+  if (size > WAL_CHECKPOINT_SIZE)
+    wal_checkpoint();
+}
+
+long long pager_num_checkpoints(void) {
+  pager_counters pc;
+  sum_counters(&pc);
+  return pc.num_checkpoints;
+}
+
+void pager_set_durability(durability_level level) {
+  durability_conf = level;
+}
+
+durability_level pager_durability(void) {
+  return durability;
+}
+
+int durability_by_name(char const* name) {
+  static char const* names[] = { "off", "group", "statement" };
+  for (int i = 0; i < 3; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+/* Allocate the memory of a chunk of buffer pages in one piece, backed by
+   huge pages if possible, so that a large buffer takes few TLB entries.
+   The memory is aligned to FRAME_ALIGN. *size is rounded up to the size
+   of the memory. */
+static char* alloc_frames(size_t* psize) {
+  void* mem = MAP_FAILED;
+  size_t size = (*psize + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+  if (size >= HUGE_PAGE_SIZE) {
+    size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (huge_pages)
+      mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED) {
+      /* transparent huge pages, if the kernel can */
+      mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem != MAP_FAILED)
+        madvise(mem, size, MADV_HUGEPAGE);
+    }
+  } else
+    mem = mmap(0, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return 0;
+  *psize = size;
+  return mem;
+}
+
+int pager_set_block_size(long size) {
+  if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1))) {
+    put_msg(ERROR, "Block size %ld is not a power of 2 in [%ld,%ld].\n",
+            size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    return 0;
+  }
+  block_size_conf = size;
+  return 1;
+}
+
+long pager_block_size(void) {
+  return block_size;
+}
+
+void pager_set_huge_pages(int on) {
+  huge_pages = on;
+}
+
+int pager_huge_pages(void) {
+  return huge_pages;
+}
+
+int pager_set_extent_blocks(int n) {
+  if (n < 1) {
+    put_msg(ERROR, "Extent of %d blocks is not positive.\n", n);
+    return 0;
+  }
+  extent_blocks = n;
+  return 1;
+}
+
+int pager_extent_blocks(void) {
+  return extent_blocks;
+}
+
+/* A block struct, reusing a released one if there is any */
+static block_p alloc_block(fhandle_p fh, int blk_nr) {
+  block_p b = spare_blocks;
+  if (b)
+    spare_blocks = b->hnext;
+  else if (!(b = malloc(sizeof (block_struct))))
+    return 0;
+  b->fhandle = fh;
+  b->blk_nr = blk_nr;
+  b->page = 0;
+  return b;
+}
+
+static void free_block(block_p b) {
+  b->hnext = spare_blocks;
+  spare_blocks = b;
+}
+
+/* ---------------------------------------------------------------------
+   Compressed cache.
+   The content of a replaced block is kept compressed in memory, so that
+   reading it again is a decompression rather than a disk read. The
+   compressed cache holds at most ccache_size bytes, and replaces its
+   least recently kept blocks when it is full.
+   A block is either in a page or in the compressed cache, never in
+   both: a block is taken out of the compressed cache when it is read
+   into a page, and reading ahead stops at a block in the compressed
+   cache. The copy kept is clean, since a dirty page is written back
+   before it is replaced.
+   The compressed cache is guarded by the pool lock.
+   Blocks are compressed with LZ77 into sequences of
+     token: 4 bits of the number of literals, 4 bits of the match
+            length - LZ_MIN_MATCH, 15 if more bytes of 255 follow,
+     the literals, and
+     the match offset in 2 bytes (little endian),
+   and the last sequence has only literals.
+   --------------------------------------------------------------------- */
+
+/** @brief A block kept in the compressed cache */
+typedef struct ccache_entry {
+  int fid;       /**< file id of the block */
+  int blk_nr;    /**< block number */
+  int len;       /**< length of the compressed content */
+  struct ccache_entry *hnext; /**< next entry in the same bucket */
+  struct ccache_entry *prev;  /**< previous (less recent) entry */
+  struct ccache_entry *next;  /**< next (more recent) entry */
+  unsigned char data[];       /**< the compressed content */
+} ccache_entry;
+
+/** Memory of the compressed cache, and of the next pager_init() */
+static long ccache_size;
+static long ccache_size_conf = CCACHE_SIZE;
+
+static ccache_entry **cc_table;
+static size_t cc_table_mask;
+static ccache_entry *cc_first; /* least recently kept */
+static ccache_entry *cc_last;  /* most recently kept */
+static long cc_bytes;          /* memory of the entries */
+static int cc_num_blocks;
+static unsigned char *cc_scratch; /* block_size bytes to compress into */
+
+static uint32_t lz_read32(unsigned char const* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+/* Put the rest of a length that does not fit in a token at dst + o */
+static int lz_put_len(unsigned char* dst, int o, int len) {
+  for (; len >= 255; len -= 255)
+    dst[o++] = 255;
+  dst[o++] = len;
+  return o;
+}
+
+/* Put a sequence of literals src[from, to) and a match of match_len
+   bytes at offset at dst + o. Returns the new o, 0 if cap is exceeded. */
+static int lz_put_seq(unsigned char* dst, int o, int cap,
+                      unsigned char const* src, int from, int to,
+                      int offset, int match_len) {
+  int lit = to - from, ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+  if (o + 1 + lit / 255 + 1 + lit + 2 + ml / 255 + 1 > cap) return 0;
+  int token = o++;
+  dst[token] = (lit < 15 ? lit : 15) << 4 | (ml < 15 ? ml : 15);
+  if (lit >= 15) o = lz_put_len(dst, o, lit - 15);
+  memcpy(dst + o, src + from, lit);
+  o += lit;
+  if (match_len == 0) return o;
+  dst[o++] = offset & 0xff;
+  dst[o++] = offset >> 8;
+  if (ml >= 15) o = lz_put_len(dst, o, ml - 15);
+  return o;
+}
+
+/* Compress n bytes of src into at most cap bytes of dst.
+   Returns the compressed length, 0 if it is not shorter than cap. */
+static int lz_compress(unsigned char const* src, int n,
+                       unsigned char* dst, int cap) {
+  int table[1 << LZ_HASH_BITS];
+  memset(table, -1, sizeof table);
+  int i = 0, anchor = 0, o = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    uint32_t v = lz_read32(src + i);
+    uint32_t h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+    int ref = table[h];
+    table[h] = i;
+    if (ref < 0 || i - ref > 0xffff || lz_read32(src + ref) != v) {
+      i++;
+      continue;
+    }
+    int len = LZ_MIN_MATCH;
+    while (i + len < n && src[ref + len] == src[i + len])
+      len++;
+    if (!(o = lz_put_seq(dst, o, cap, src, anchor, i, i - ref, len)))
+      return 0;
+    i += len;
+    anchor = i;
+  }
+  o = lz_put_seq(dst, o, cap, src, anchor, n, 0, 0);
+  return o < cap ? o : 0;
+}
+
+/* Read the rest of a length at src + *i, adding to *len */
+static int lz_get_len(unsigned char const* src, int* i, int n, int* len) {
+  int c;
+  do {
+    if (*i >= n) return 0;
+    c = src[(*i)++];
+    *len += c;
+  } while (c == 255);
+  return 1;
+}
+
+/* Decompress len bytes of src into exactly n bytes of dst.
+   Returns 0 if src is corrupt. */
+static int lz_decompress(unsigned char const* src, int len,
+                         unsigned char* dst, int n) {
+  int i = 0, o = 0;
+  while (i < len) {
+    int token = src[i++];
+    int lit = token >> 4, ml = (token & 15) + LZ_MIN_MATCH;
+    if (lit == 15 && !lz_get_len(src, &i, len, &lit)) return 0;
+    if (lit > len - i || lit > n - o) return 0;
+    memcpy(dst + o, src + i, lit);
+    i += lit;
+    o += lit;
+    if (i == len) break; /* the last sequence */
+    if (len - i < 2) return 0;
+    int offset = src[i] | src[i + 1] << 8;
+    i += 2;
+    if ((token & 15) == 15 && !lz_get_len(src, &i, len, &ml)) return 0;
+    if (offset == 0 || offset > o || ml > n - o) return 0;
+    /* byte by byte, a match may overlap what it produces */
+    for (int k = 0; k < ml; k++, o++)
+      dst[o] = dst[o - offset];
+  }
+  return o == n;
+}
+
+static void ccache_init(void) {
+  ccache_size = ccache_size_conf;
+  cc_first = cc_last = 0;
+  cc_bytes = 0;
+  cc_num_blocks = 0;
+  if (ccache_size == 0) return;
+  /* a bucket for every 4 blocks of the size of the cache */
+  size_t num_buckets = 64;
+  while (num_buckets < (size_t) (ccache_size / block_size / 4))
+    num_buckets <<= 1;
+  cc_table = calloc(num_buckets, sizeof (ccache_entry*));
+  cc_table_mask = num_buckets - 1;
+  cc_scratch = malloc(block_size);
+  if (!cc_table || !cc_scratch) {
+    put_msg(WARN, "Cannot allocate the compressed cache, turned off.\n");
+    free(cc_table);
+    free(cc_scratch);
+    cc_table = 0;
+    cc_scratch = 0;
+    ccache_size = 0;
+  }
+}
+
+/* The bucket of the block in cc_table */
+static ccache_entry** cc_bucket(int fid, int blk_nr) {
+  return &cc_table[blk_hash(fid, blk_nr) & cc_table_mask];
+}
+
+/* Take the entry out of the compressed cache, without freeing it */
+static void ccache_unlink(ccache_entry* e) {
+  ccache_entry **ep = cc_bucket(e->fid, e->blk_nr);
+  while (*ep != e)
+    ep = &(*ep)->hnext;
+  *ep = e->hnext;
+  if (e->prev) e->prev->next = e->next;
+  else cc_first = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else cc_last = e->prev;
+  cc_bytes -= sizeof (ccache_entry) + e->len;
+  cc_num_blocks--;
+}
+
+static ccache_entry* ccache_find(int fid, int blk_nr) {
+  if (ccache_size == 0) return 0;
+  for (ccache_entry *e = *cc_bucket(fid, blk_nr); e; e = e->hnext)
+    if (e->fid == fid && e->blk_nr == blk_nr)
+      return e;
+  return 0;
+}
+
+/* Take the block out of the compressed cache, NULL if it is not there.
+   The caller decompresses it with ccache_load(). */
+static ccache_entry* ccache_take(int fid, int blk_nr) {
+  ccache_entry *e = ccache_find(fid, blk_nr);
+  if (e) ccache_unlink(e);
+  return e;
+}
+
+/* Decompress a block taken out of the compressed cache into content,
+   and free it. The pool lock is not needed. */
+static int ccache_load(ccache_entry* e, char* content) {
+  int ok = lz_decompress(e->data, e->len, (unsigned char*) content,
+                         block_size);
+  if (ok)
+    prof()->c.num_cc_hits++;
+  else
+    put_msg(WARN, "Compressed cache: block %d is corrupt, read again.\n",
+            e->blk_nr);
+  free(e);
+  return ok;
+}
+
+/* Keep the content of the page, whose block is being replaced, in the
+   compressed cache. Blocks that do not compress are not kept. */
+static void ccache_put(page_p pg) {
+  if (ccache_size == 0 || is_dirty(pg) || pg->content != pg->buffer
+      || !__atomic_load_n(&pg->valid, __ATOMIC_ACQUIRE))
+    return;
+  int fid = pg->block->fhandle->fid, blk_nr = pg->block->blk_nr;
+  ccache_entry *e = ccache_take(fid, blk_nr);
+  free(e);
+  int len = lz_compress((unsigned char*) pg->content, block_size,
+                        cc_scratch, block_size);
+  if (len == 0 || sizeof (ccache_entry) + len > ccache_size) return;
+  while (cc_first && cc_bytes + sizeof (ccache_entry) + len > ccache_size) {
+    e = cc_first;
+    ccache_unlink(e);
+    free(e);
+  }
+  if (!(e = malloc(sizeof (ccache_entry) + len))) return;
+  e->fid = fid;
+  e->blk_nr = blk_nr;
+  e->len = len;
+  memcpy(e->data, cc_scratch, len);
+  ccache_entry **bucket = cc_bucket(fid, blk_nr);
+  e->hnext = *bucket;
+  *bucket = e;
+  e->next = 0;
+  e->prev = cc_last;
+  if (cc_last) cc_last->next = e;
+  else cc_first = e;
+  cc_last = e;
+  cc_bytes += sizeof (ccache_entry) + len;
+  cc_num_blocks++;
+  prof()->c.num_cc_puts++;
+}
+
+/* Forget the blocks of the file, which is being closed */
+static void ccache_drop_file(int fid) {
+  for (ccache_entry *e = cc_first, *next; e; e = next) {
+    next = e->next;
+    if (e->fid == fid) {
+      ccache_unlink(e);
+      free(e);
+    }
+  }
+}
+
+static void ccache_terminate(void) {
+  while (cc_first) {
+    ccache_entry *e = cc_first;
+    ccache_unlink(e);
+    free(e);
+  }
+  free(cc_table);
+  cc_table = 0;
+  free(cc_scratch);
+  cc_scratch = 0;
+  ccache_size = 0;
+}
+
+int pager_set_ccache_size(long size) {
+  if (size < 0) {
+    put_msg(ERROR, "Compressed cache size %ld is negative.\n", size);
+    return 0;
+  }
+  ccache_size_conf = size;
+  return 1;
 }
 
-page_p get_page_for_append(char const* fname) {
-  page_p pg = get_page(fname, -1);
-  if (!pg) return 0;
-  pg->current_pos = pg->free_pos;
+long pager_ccache_size(void) {
+  return ccache_size_conf;
+}
+
+/* Release a block that is replaced, with the pool lock. Its content is
+   kept in the compressed cache after it is written back. */
+static void evict_block(block_p b) {
+  write_back(b->page);
+  ccache_put(b->page);
+  release_block(b);
+}
+
+/* ---------------------------------------------------------------------
+   Buffer size.
+   The buffer grows and shrinks while the pager is running. Pages never
+   move, since threads hold pointers to them, so a growing buffer gets
+   a new chunk of pages. A page taken out of the buffer stays allocated
+   beyond num_pages in pages[], its memory is given back to the kernel,
+   and it is the first to come back when the buffer grows again.
+   The replacement policy starts over when the size changes, with the
+   pages admitted from the least to the most recently used.
+   A file may have a quota of pages. A file having as many pages as its
+   quota replaces its own least recently used unpinned page, so that a
+   scan of a large table does not push other tables out of the buffer.
+   --------------------------------------------------------------------- */
+
+/* Order of pages, the most recently used first */
+static int cmp_last_used(void const* a, void const* b) {
+  unsigned long x = (*(page_p const*) a)->last_used;
+  unsigned long y = (*(page_p const*) b)->last_used;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Make room for n allocated pages in pages[] and in the arrays of pages */
+static int grow_page_arrays(int n) {
+  page_p *p = realloc(pages, n * sizeof (page_p));
+  if (!p) return 0;
+  pages = p;
+  if (!(p = realloc(free_pages, n * sizeof (page_p)))) return 0;
+  free_pages = p;
+  if (!(p = realloc(flush_batch, n * sizeof (page_p)))) return 0;
+  flush_batch = p;
+  return 1;
+}
+
+/* Allocate a chunk of n pages, put after the allocated pages in pages[] */
+static int alloc_page_chunk(int n) {
+  page_chunk *c = malloc(sizeof (page_chunk));
+  if (!c) return 0;
+  if (posix_memalign((void**) &c->structs, CACHE_LINE_SIZE,
+                     n * sizeof (page_struct)))
+    c->structs = 0;
+  /* each page is aligned to block_size, as required for direct I/O */
+  c->frames_size = block_size * n;
+  c->frames = alloc_frames(&c->frames_size);
+  if (!c->structs || !c->frames) {
+    if (c->frames) munmap(c->frames, c->frames_size);
+    free(c->structs);
+    free(c);
+    return 0;
+  }
+  c->next = page_chunks;
+  page_chunks = c;
+  for (int i = 0; i < n; i++, num_alloc_pages++)
+    pages[num_alloc_pages] = make_page(&c->structs[i], num_alloc_pages,
+                                       c->frames + block_size * i);
+  return 1;
+}
+
+static void free_page_chunks(void) {
+  while (page_chunks) {
+    page_chunk *c = page_chunks;
+    page_chunks = c->next;
+    munmap(c->frames, c->frames_size);
+    free(c->structs);
+    free(c);
+  }
+}
+
+/* Keep at least twice as many buckets in the block table as pages,
+   so that chains stay short, with the pool lock. The blocks move to
+   other buckets but stay in their stripes, all of which are locked. */
+static void grow_blk_table(int n) {
+  size_t num_buckets = blk_table_mask + 1;
+  while (num_buckets < 2 * (size_t) n)
+    num_buckets <<= 1;
+  if (num_buckets == blk_table_mask + 1) return;
+  block_p *table = calloc(num_buckets, sizeof (block_p));
+  if (!table) return; /* longer chains then */
+
+  for (int i = 0; i < BLK_STRIPES; i++)
+    pthread_mutex_lock(&blk_stripes[i].mutex);
+  for (size_t i = 0; i <= blk_table_mask; i++)
+    while (blk_table[i]) {
+      block_p b = blk_table[i];
+      blk_table[i] = b->hnext;
+      size_t h = blk_hash(b->fhandle->fid, b->blk_nr) & (num_buckets - 1);
+      b->hnext = table[h];
+      table[h] = b;
+    }
+  free(blk_table);
+  blk_table = table;
+  blk_table_mask = num_buckets - 1;
+  for (int i = BLK_STRIPES - 1; i >= 0; i--)
+    pthread_mutex_unlock(&blk_stripes[i].mutex);
+}
+
+/* Let the buffer have n > num_pages pages, with the pool lock.
+   The pages taken out before come back first. */
+static int grow_pool(int n) {
+  if (n > num_alloc_pages
+      && (!grow_page_arrays(n) || !alloc_page_chunk(n - num_alloc_pages)))
+    return 0;
+  grow_blk_table(n);
+  /* unused pages are handed out in the order of page_nr */
+  for (int i = n - 1; i >= num_pages; i--) {
+    /* memory given back to the kernel is zeros again */
+    init_page(pages[i]);
+    free_pages[num_free_pages++] = pages[i];
+  }
+  __atomic_store_n(&num_pages, n, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Let the buffer have n < num_pages pages, with the pool lock.
+   Unused pages are taken out first, then unpinned pages from the least
+   recently used on. Returns 0 if too many pages are pinned, leaving the
+   buffer with as few pages as possible. */
+static int shrink_pool(int n) {
+  page_p *cands = malloc(num_pages * sizeof (page_p));
+  page_p *out = malloc((num_pages - n) * sizeof (page_p));
+  if (!cands || !out) {
+    free(cands);
+    free(out);
+    return 0;
+  }
+  int num_cands = 0, num_out = 0;
+  while (num_out < num_pages - n && num_free_pages > 0)
+    out[num_out++] = free_pages[--num_free_pages];
+  /* pages being read are not valid yet */
+  for (int i = 0; i < num_pages; i++)
+    if (pages[i]->block && __atomic_load_n(&pages[i]->valid, __ATOMIC_ACQUIRE)
+        && !is_pinned(pages[i]))
+      cands[num_cands++] = pages[i];
+  qsort(cands, num_cands, sizeof (page_p), cmp_last_used);
+  for (int i = num_cands - 1; i >= 0 && num_out < num_pages - n; i--) {
+    page_p pg = cands[i];
+    if (!claim_page(pg)) continue;
+    repl->remove(pg);
+    prof()->c.num_evictions++;
+    evict_block(pg->block);
+    init_page(pg);
+    out[num_out++] = pg;
+  }
+
+  /* the pages left keep their order in front of those taken out */
+  for (int i = 0; i < num_out; i++)
+    out[i]->page_nr = -1;
+  int k = 0;
+  for (int i = 0; i < num_pages; i++)
+    if (pages[i]->page_nr != -1)
+      pages[k++] = pages[i];
+  for (int i = 0; i < num_out; i++) {
+    page_p pg = out[i];
+    pages[k++] = pg;
+    /* the page is read again as zeros, reinitialized by grow_pool() */
+    if (block_size % FRAME_ALIGN == 0)
+      madvise(pg->buffer, block_size, MADV_DONTNEED);
+  }
+  __atomic_store_n(&num_pages, num_pages - num_out, __ATOMIC_RELAXED);
+  for (int i = 0; i < num_alloc_pages; i++)
+    pages[i]->page_nr = i;
+  free(cands);
+  free(out);
+  return num_pages == n;
+}
+
+/* Start the replacement policy over, with the pool lock */
+static void restart_repl(void) {
+  repl->terminate();
+  repl->init();
+  page_p *pgs = malloc(num_pages * sizeof (page_p));
+  if (!pgs) {
+    for (int i = 0; i < num_pages; i++)
+      if (pages[i]->block && __atomic_load_n(&pages[i]->valid, __ATOMIC_ACQUIRE))
+        repl->admit(pages[i]);
+    return;
+  }
+  int n = 0;
+  for (int i = 0; i < num_pages; i++)
+    if (pages[i]->block && __atomic_load_n(&pages[i]->valid, __ATOMIC_ACQUIRE))
+      pgs[n++] = pages[i];
+  qsort(pgs, n, sizeof (page_p), cmp_last_used);
+  while (n > 0)
+    repl->admit(pgs[--n]);
+  free(pgs);
+}
+
+int pager_resize(int n) {
+  if (n <= 0) {
+    put_msg(ERROR, "pager_resize: %d pages are too few.\n", n);
+    return 0;
+  }
+  if (!pages) {
+    num_pages_conf = n;
+    return 1;
+  }
+  pool_lock();
+  int ok = n > num_pages ? grow_pool(n) : n < num_pages ? shrink_pool(n) : 1;
+  restart_repl();
+  flush_hand = 0;
+  num_pages_conf = num_pages;
+  pool_unlock();
+  if (!ok)
+    put_msg(ERROR, "pager_resize: cannot resize the buffer to %d pages, "
+            "it has %d pages.\n", n, num_pages_conf);
+  return ok;
+}
+
+int pager_num_pages(void) {
+  return pages ? __atomic_load_n(&num_pages, __ATOMIC_RELAXED) : num_pages_conf;
+}
+
+/* The least recently used unpinned page of the file, claimed and
+   taken away from the replacement policy, NULL if there is none */
+static page_p claim_lru_page_of(fhandle_p fh) {
+  for (;;) {
+    page_p pg = 0;
+    for (block_p b = fh->blocks_in_mem; b; b = b->fnext)
+      if (__atomic_load_n(&b->page->valid, __ATOMIC_ACQUIRE)
+          && !is_pinned(b->page)
+          && (!pg || b->page->last_used < pg->last_used))
+        pg = b->page;
+    if (!pg) return 0;
+    if (claim_page(pg)) {
+      repl->remove(pg);
+      return pg;
+    }
+  }
+}
+
+/* Give the unpinned pages of the file beyond its quota back to the
+   unused pages, with the pool lock. A file goes beyond its quota when
+   its pages are pinned or the quota is lowered. */
+static void trim_to_quota(fhandle_p fh) {
+  page_p pg;
+  while (fh->max_pages > 0 && fh->num_blocks_in_mem > fh->max_pages
+         && (pg = claim_lru_page_of(fh))) {
+    prof()->c.num_evictions++;
+    evict_block(pg->block);
+    put_free_page(pg);
+  }
+}
+
+/* A page of the file to be replaced if the file has used up its quota,
+   claimed, NULL if the file is under its quota or all its pages are
+   pinned */
+static page_p quota_victim(fhandle_p fh) {
+  if (fh->max_pages == 0 || fh->num_blocks_in_mem < fh->max_pages)
+    return 0;
+  trim_to_quota(fh);
+  return claim_lru_page_of(fh);
+}
+
+int file_set_quota(char const* fname, int max_pages) {
+  if (max_pages < 0) {
+    put_msg(ERROR, "file_set_quota: quota %d is negative.\n", max_pages);
+    return 0;
+  }
+  pool_lock();
+  fhandle_p fh = open_tbl_file(fname);
+  if (!fh) {
+    pool_unlock();
+    put_msg(ERROR, "file_set_quota: cannot get file \"%s\".\n", fname);
+    return 0;
+  }
+  fh->max_pages = max_pages;
+  trim_to_quota(fh);
+  pool_unlock();
+  return 1;
+}
+
+int file_num_pages(char const* fname) {
+  pool_lock();
+  fhandle_p fh = get_tbl_file(fname);
+  int n = fh ? fh->num_blocks_in_mem : 0;
+  pool_unlock();
+  return n;
+}
+
+int file_direct_io(char const* fname) {
+  if (in_memory) return 0;
+  pool_lock();
+  fhandle_p fh = get_tbl_file(fname);
+  int flags = fh && fh->fd != -1 ? fcntl(fh->fd, F_GETFL) : -1;
+  pool_unlock();
+  return flags != -1 && (flags & O_DIRECT);
+}
+
+/* ---------------------------------------------------------------------
+   Scan rings.
+   A sequential scan of a table larger than a quarter of the buffer can
+   read its blocks into a ring of a few pages of its own: once the ring
+   is full, the next block read replaces the block of the ring read the
+   longest ago, if it is unpinned, rather than a page chosen by the
+   replacement policy, and the kernel is told that the replaced block
+   is not read again soon. Blocks found in the buffer stay where they
+   are, so a scan does not push the working set of other accesses out.
+   The ring of a scan is used by the thread that gets its pages; it
+   records page nrs and the blocks read into them, so a page replaced
+   by others meanwhile, or a ring kept over a restart of the pager,
+   takes no page that is not its own.
+   The ring holds the pages the scan has pinned, the blocks read ahead
+   into it and one page more to recycle, so that it never runs out of
+   unpinned pages and takes one from the rest of the buffer.
+   --------------------------------------------------------------------- */
+
+/** @brief A ring of pages a sequential scan recycles */
+typedef struct scan_ring {
+  int size;   /**< number of pages the ring may have */
+  int len;    /**< number of pages it has */
+  int hand;   /**< next slot to be recycled */
+  struct {
+    int page_nr;
+    int fid;
+    int blk_nr;
+  } slots[SCAN_RING_PAGES];
+} scan_ring;
+
+/** The ring of the scan the thread is getting a page for, if any */
+static __thread ring_p my_ring;
+
+ring_p new_scan_ring(void) {
+  ring_p r = calloc(1, sizeof (scan_ring));
+  if (!r) {
+    put_msg(ERROR, "new_scan_ring: out of memory.\n");
+    return 0;
+  }
+  /* room for a block read ahead, unless that takes half the buffer */
+  r->size = pager_num_pages() / 4;
+  if (r->size > SCAN_RING_PAGES) r->size = SCAN_RING_PAGES;
+  if (r->size < SCAN_PINS + 2) r->size = SCAN_PINS + 2;
+  if (r->size > pager_num_pages() / 2) r->size = pager_num_pages() / 2;
+  if (r->size < SCAN_PINS + 1) r->size = SCAN_PINS + 1;
+  return r;
+}
+
+void release_scan_ring(ring_p r) {
+  free(r);
+}
+
+/* The page of the slot of my_ring if it still holds the block read into
+   it, with the pool lock */
+static page_p ring_page(int i) {
+  int nr = my_ring->slots[i].page_nr;
+  if (nr < 0 || nr >= num_pages) return 0;
+  page_p pg = pages[nr];
+  block_p b = pg->block;
+  if (!b || b->fhandle->fid != my_ring->slots[i].fid
+      || b->blk_nr != my_ring->slots[i].blk_nr
+      || !__atomic_load_n(&pg->valid, __ATOMIC_ACQUIRE))
+    return 0;
+  return pg;
+}
+
+/* The page of the full ring of the scan to be recycled, claimed and
+   taken away from the replacement policy, with the pool lock.
+   NULL if there is no ring, or its pages are all pinned or gone. */
+static page_p ring_victim(void) {
+  if (!my_ring || my_ring->len < my_ring->size) return 0;
+  for (int n = 0; n < my_ring->size; n++) {
+    page_p pg = ring_page(my_ring->hand);
+    if (pg && claim_page(pg)) {
+      repl->remove(pg);
+      prof()->c.num_ring_reuses++;
+      return pg;
+    }
+    my_ring->hand = (my_ring->hand + 1) % my_ring->size;
+  }
+  return 0;
+}
+
+/* Put the page that block b is read into into the ring of the scan, in
+   a slot whose page is gone or else the slot of the hand, with the pool
+   lock */
+static void ring_add(page_p pg, block_p b) {
+  if (!my_ring) return;
+  int i = my_ring->len < my_ring->size ? my_ring->len++ : my_ring->hand;
+  /* a slot whose page has gone to other blocks is taken before the
+     slot of the hand, whose page may still be pinned by the scan */
+  for (int n = 0; my_ring->len == my_ring->size && n < my_ring->size; n++) {
+    int j = (my_ring->hand + n) % my_ring->size;
+    if (!ring_page(j)) {
+      i = j;
+      break;
+    }
+  }
+  my_ring->slots[i].page_nr = pg->page_nr;
+  my_ring->slots[i].fid = b->fhandle->fid;
+  my_ring->slots[i].blk_nr = b->blk_nr;
+  if (my_ring->len == my_ring->size)
+    my_ring->hand = (i + 1) % my_ring->size;
+}
+
+/* Tell the kernel that the block recycled from the ring is not read
+   again soon, after it is written back, with the pool lock */
+static void ring_drop_behind(fhandle_p fh, int blk_nr) {
+  int fd = io_begin(fh);
+  if (fd == -1) return;
+  vfs->drop_cache(fd, (off_t) block_size * blk_nr, block_size);
+  io_end(fh);
+}
+
+/* Use the ring for the pages of the file got by this thread, unless
+   the file is small enough to be kept in the buffer */
+static void use_ring(ring_p r, char const* fname) {
+  fhandle_p fh = r ? get_or_open_tbl_file(fname) : 0;
+  my_ring = fh && num_blocks_of(fh) > pager_num_pages() / 4 ? r : 0;
+}
+
+page_p get_page_in_ring(ring_p r, char const* fname, int blknr) {
+  use_ring(r, fname);
+  page_p pg = get_page(fname, blknr);
+  my_ring = 0;
+  return pg;
+}
+
+page_p get_next_page_in_ring(ring_p r, page_p p) {
+  use_ring(r, p->block->fhandle->fname);
+  page_p pg = get_next_page(p);
+  my_ring = 0;
   return pg;
 }
 
+int pager_init(int n_pages, repl_policy policy) {
+  if (pages) pager_terminate();
+
+  if (n_pages > 0) num_pages_conf = n_pages;
+  if (policy != REPL_SAME) repl_policy_conf = policy;
+  block_size = block_size_conf;
+  vfs_start();
+  lss_start();
+  spool_attach();
+  num_file_handles = 0;
+  num_open_fds = 0;
+  num_pages = 0;
+  num_alloc_pages = 0;
+  num_free_pages = 0;
+  my_pins = 0;
+
+  ccache_init();
+  /* more buckets are added as the buffer grows */
+  blk_table = calloc(BLK_STRIPES, sizeof (block_p));
+  blk_table_mask = BLK_STRIPES - 1;
+  if (!blk_table || !grow_pool(num_pages_conf)) {
+    put_msg(ERROR, "pager_init failed to allocate %d pages\n", num_pages_conf);
+    pager_terminate();
+    return 0;
+  }
+
+  num_dirty_pages = 0;
+  flush_hand = 0;
+  pending_pages = 0;
+
+  repl = &repl_policies[repl_policy_conf - REPL_LRU];
+  repl->init();
+  flusher_start();
+  wal_start();
+
+  pager_profiler_reset();
+  return 1;
+}
 
+static int is_last_block(block_p b) {
+  return (b->blk_nr == num_blocks_of(b->fhandle) - 1);
+}
 
+int peof(page_p p) {
+  return (is_last_block(p->block) && eop(p));
+}
 
+/** Release a block, with the pool lock. */
+static void release_block(block_p b) {
+  if (!b) return;
+  write_back(b->page);
+  if (b->page->prefetched)
+    prof()->c.num_ra_wasted++;
+  unlink_block(b);
+  b->page->block = 0;
+  free_block(b);
+}
 
+void pager_terminate(void) {
+  preload_terminate();
+  /* put_pqueues_info (DEBUG); */
+  if (pages) {
+    write_back_all(0);
+    /* release all blocks before any page is gone */
+    for (size_t i = 0; i < num_pages; i++)
+      if (pages[i])
+        release_block(pages[i]->block);
+  }
+  for (size_t i = 0; fh_table && i <= fh_table_mask; i++)
+    while (fh_table[i])
+      close_tbl_file(fh_table[i]);
+  free(fh_table);
+  fh_table = 0;
+  flusher_terminate();
+  wal_terminate();
+  lss_terminate();
+  spool_detach();
+  ccache_terminate();
+  if (repl) repl->terminate();
+  repl = 0;
+  pending_pages = 0;
+  while (spare_blocks) {
+    block_p b = spare_blocks;
+    spare_blocks = b->hnext;
+    free(b);
+  }
+  for (size_t i = 0; pages && i < num_alloc_pages; i++)
+    pthread_rwlock_destroy(&pages[i]->latch);
+  free_page_chunks();
+  free(pages);
+  pages = 0;
+  num_pages = 0;
+  num_alloc_pages = 0;
+  free(free_pages);
+  free_pages = 0;
+  free(flush_batch);
+  flush_batch = 0;
+  num_free_pages = 0;
+  free(blk_table);
+  blk_table = 0;
+  my_pins = 0;
+}
 
+/* Return a page that no longer holds a block to the unused pages */
+static void put_free_page(page_p pg) {
+  repl->remove(pg);
+  init_page(pg);
+  free_pages[num_free_pages++] = pg;
+}
 
+/* For block b, the next page of the ring of the scan if it is full, an
+   unpinned page of its file if the file has used up its quota,
+   otherwise an unused page or an unpinned page chosen by the
+   replacement policy, NULL if all pages are pinned */
+static page_p replaceable_page(block_p b) {
+  page_p pg = ring_victim();
+  fhandle_p dropped = pg ? pg->block->fhandle : 0;
+  int dropped_nr = pg ? pg->block->blk_nr : 0;
+  if (!pg)
+    pg = quota_victim(b->fhandle);
+  if (!pg && num_free_pages > 0) {
+    pg = free_pages[--num_free_pages];
+    ring_add(pg, b);
+    return pg;
+  }
 
+  /* put_msg (DEBUG, "available_page: all pages are used.\n"); */
+  if (!pg)
+    pg = repl->victim(b); /* replace an unpinned page */
+  if (!pg) return 0;
+  prof()->c.num_evictions++;
+  evict_block(pg->block);
+  init_page(pg);
+  if (dropped)
+    ring_drop_behind(dropped, dropped_nr);
+  ring_add(pg, b);
+  return pg;
+}
 
+/* Whether threads other than this one have pinned pages, with the pool
+   lock */
+static int pinned_by_others(void) {
+  int n = 0;
+  for (int i = 0; i < num_pages; i++) {
+    int c = __atomic_load_n(&pages[i]->pin_count, __ATOMIC_ACQUIRE);
+    if (c > 0) n += c;
+  }
+  return n > my_pins;
+}
 
+/* Wait a while for another thread to unpin a page, with the pool lock.
+   Returns 0 if the time is up or no other thread holds a pin. */
+static int wait_for_unpin(struct timespec const* until) {
+  if (!pinned_by_others())
+    return 0;
+  __atomic_add_fetch(&num_unpin_waiters, 1, __ATOMIC_ACQ_REL);
+  int res = pthread_cond_timedwait(&page_unpinned, &pool_mutex, until);
+  __atomic_sub_fetch(&num_unpin_waiters, 1, __ATOMIC_ACQ_REL);
+  apply_pending_accesses();
+  return res == 0;
+}
 
+/* Find an available buffer page for block b, in this order:
+   - unused page,
+   - unpinned page chosen by the replacement policy,
+   - unpinned page, after waiting for other threads to unpin one.
+   A pinned page is never given to another block, its holder may still
+   read it. Returns NULL if all pages stay pinned.
+   The pool lock may be released while waiting.
+*/
+static page_p available_page(block_p b) {
+  /* put_pqueues_info (DEBUG); */
+  page_p pg = replaceable_page(b);
+  if (pg) return pg;
+
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += PIN_WAIT_MS * 1000000L;
+  until.tv_sec += until.tv_nsec / 1000000000L;
+  until.tv_nsec %= 1000000000L;
+  while (wait_for_unpin(&until))
+    if ((pg = replaceable_page(b)))
+      return pg;
+  return replaceable_page(b);
+}
 
+/* Start reading block b into page pg, with the pool lock.
+   The page is pinned, latched exclusively and can be found in the block
+   table, but the replacement policy is not told till the end of reading.
+   Threads that find the block wait for the latch. */
+static void load_begin(block_p b, page_p pg) {
+  /* the page is not pinned, so no thread has latched it */
+  while (pthread_rwlock_trywrlock(&pg->latch) != 0)
+    sched_yield();
+  b->page = pg;
+  pg->block = b;
+  __atomic_store_n(&pg->pin_count, 1, __ATOMIC_RELEASE);
+  link_block(b);
+}
 
+/* End reading the block into the page, with the pool lock.
+   The caller unlatches the page afterwards. */
+static void load_end(page_p pg, int ok) {
+  if (ok) {
+    __atomic_store_n(&pg->valid, 1, __ATOMIC_RELEASE);
+    pg->last_used = ++use_clock;
+    repl->admit(pg);
+  } else
+    unlink_block(pg->block);
+}
 
+/* Give the page whose block could not be read back to the unused pages,
+   once the threads that found the block meanwhile have unpinned it */
+static void load_failed(page_p pg) {
+  unpin_page(pg);
+  while (is_pinned(pg))
+    sched_yield();
+  pool_lock();
+  free_block(pg->block);
+  put_free_page(pg);
+  pool_unlock();
+}
 
+/* Wait till the block of the pinned page has been read.
+   Returns 0 if reading it failed. */
+static int wait_for_read(page_p pg) {
+  if (__atomic_load_n(&pg->valid, __ATOMIC_ACQUIRE)) return 1;
+  pthread_rwlock_rdlock(&pg->latch);
+  pthread_rwlock_unlock(&pg->latch);
+  return __atomic_load_n(&pg->valid, __ATOMIC_ACQUIRE);
+}
 
+/* Detect sequential access of the file, with the pool lock */
+static void detect_sequential(fhandle_p fh, int blk_nr) {
+  if (blk_nr != fh->ra_last) {
+    fh->ra_seq = blk_nr == fh->ra_last + 1 ? fh->ra_seq + 1 : 0;
+    fh->ra_last = blk_nr;
+  }
+}
 
+/* Adapt the read-ahead depth of the file to how much of what was read
+   ahead last time is accessed. */
+static void adapt_ra_depth(fhandle_p fh) {
+  /* never take more than a quarter of the buffer */
+  int max_depth = num_pages / 4 < RA_MAX_DEPTH ? num_pages / 4 : RA_MAX_DEPTH;
+  /* nor more than half of the quota of the file */
+  if (fh->max_pages > 0 && fh->max_pages / 2 < max_depth)
+    max_depth = fh->max_pages / 2;
+  /* nor more than the pages of the ring of the scan left unpinned */
+  if (my_ring && my_ring->size - SCAN_PINS - 1 < max_depth)
+    max_depth = my_ring->size - SCAN_PINS - 1;
+  int ra_used = __atomic_exchange_n(&fh->ra_used, 0, __ATOMIC_RELAXED);
+  if (fh->ra_issued > 0) {
+    if (ra_used >= fh->ra_issued)
+      fh->ra_depth *= 2;
+    else if (ra_used < fh->ra_issued / 2)
+      fh->ra_depth /= 2;
+  }
+  if (fh->ra_depth < 1) fh->ra_depth = 1;
+  if (fh->ra_depth > max_depth) fh->ra_depth = max_depth;
+  if (fh->ra_depth < 0) fh->ra_depth = 0;
+  fh->ra_issued = 0;
+}
 
+/* Read the blocks from block nr @em from on, that are not in the buffer
+   yet, into unpinned pages with one disk read.
+   Only unused or replaceable pages are taken, never a pinned one. */
+/* Read up to n blocks of the file from block from on into pages with
+   one read, stopping at a block that is in the buffer already.
+   Reading ahead (ra non-zero) may replace pages, preloading takes
+   only unused pages, and leaves @ref PRELOAD_HEADROOM of them.
+   Called with the pool lock, which is released.
+   Returns the number of blocks read. */
+static int load_run(fhandle_p fh, int from, int n, int ra) {
+  page_p pgs[RA_MAX_DEPTH];
+  struct iovec iov[RA_MAX_DEPTH];
+  int ok[RA_MAX_DEPTH];
+  int m = 0;
+  if (n > RA_MAX_DEPTH) n = RA_MAX_DEPTH;
+  for (int bnr = from; m < n && bnr < fh->num_blocks; bnr++, m++) {
+    /* a block in the compressed cache is read from there */
+    if (lookup_block(fh, bnr) || ccache_find(fh->fid, bnr)) break;
+    if (!ra && num_free_pages <= PRELOAD_HEADROOM) break;
+    block_p b = alloc_block(fh, bnr);
+    if (!b) break;
+    page_p pg = replaceable_page(b);
+    if (!pg) {
+      free_block(b);
+      break;
+    }
+    load_begin(b, pg);
+    pg->prefetched = ra;
+    pgs[m] = pg;
+    iov[m].iov_base = pg->content;
+    iov[m].iov_len = block_size;
+  }
+  int fd = m > 0 ? io_begin(fh) : -1;
+  pool_unlock();
+  if (m == 0) return 0;
+
+  /* the leading blocks in the shared pool are copied from there */
+  int k = 0;
+  if (fd != -1) {
+    flusher_wait(fd, from, m);
+    while (k < m && spool_get(fh->sfile, from + k, pgs[k]->content))
+      k++;
+  }
+  ssize_t bytes_read = -1;
+  if (fd != -1)
+    bytes_read = k < m ?
+      vfs->preadv(fd, iov + k, m - k, (off_t) block_size * (from + k)) : 0;
+  if (fd != -1)
+    io_end(fh);
+  for (int i = k; i < m && bytes_read >= (ssize_t) block_size * (i - k + 1);
+       i++)
+    spool_put(fh->sfile, from + i, pgs[i]->content, 0);
+  if (ra)
+    prof()->c.num_ra_reads++;
+
+  int num_read = 0;
+  pool_lock();
+  for (int i = 0; i < m; i++) {
+    page_p pg = pgs[i];
+    ok[i] = i < k || bytes_read >= (ssize_t) block_size * (i - k + 1);
+    if (!ok[i]) {
+      /* failed or beyond the end of the file, drop it */
+      pg->prefetched = 0;
+      load_end(pg, 0);
+      continue;
+    }
+    if (set_page_from_content(pg) && i >= k)
+      inc_num_reads(fd, pg->block->blk_nr);
+    if (ra) {
+      fh->ra_issued++;
+      prof()->c.num_ra_blocks++;
+    } else
+      prof()->c.num_preloaded++;
+    num_read++;
+    load_end(pg, 1);
+    unpin_page(pg);
+    apply_accesses(pg, PENDING_PIN);
+  }
+  pool_unlock();
+  for (int i = 0; i < m; i++) {
+    pthread_rwlock_unlock(&pgs[i]->latch);
+    if (!ok[i])
+      load_failed(pgs[i]);
+  }
+  return num_read;
+}
 
+static void read_ahead(fhandle_p fh, int from) {
+  pool_lock();
+  adapt_ra_depth(fh);
+  load_run(fh, from, fh->ra_depth, 1);
+}
 
+/* ---------------------------------------------------------------------
+   Warm restart.
+   The blocks in the buffer can be listed in a file, the most recently
+   used first, and read into a new buffer in the background by a
+   preloader thread, so that the buffer is warm before it is used.
+   The list consists of a line
+     #resident <number of files> <number of blocks>
+   the file names, one per line, and a line of the index of the file
+   and the block nr for every block.
+   --------------------------------------------------------------------- */
+
+static const char resident_key[] = "#resident";
+
+/** @brief A block to be preloaded */
+typedef struct preload_blk {
+  int file;    /**< index in preload_files */
+  int blk_nr;
+} preload_blk;
+
+static pthread_t preloader;
+static int preloading;
+static int preload_stop;
+static char **preload_files;
+static int num_preload_files;
+static preload_blk *preload_blks;
+static int num_preload_blks;
+
+int pager_save_resident(char const* fname) {
+  FILE *fp = fopen(fname, "w");
+  if (!fp) {
+    put_msg(ERROR, "pager_save_resident: cannot write \"%s\".\n", fname);
+    return 0;
+  }
+  pool_lock();
+  page_p *pgs = malloc(num_pages * sizeof (page_p));
+  fhandle_p *fhs = malloc(num_pages * sizeof (fhandle_p));
+  int n = 0, num_fhs = 0;
+  for (int i = 0; pgs && fhs && i < num_pages; i++)
+    if (pages[i]->block && __atomic_load_n(&pages[i]->valid, __ATOMIC_ACQUIRE))
+      pgs[n++] = pages[i];
+  qsort(pgs, n, sizeof (page_p), cmp_last_used);
+  int *file_of = malloc((n + 1) * sizeof (int));
+  for (int i = 0; file_of && i < n; i++) {
+    fhandle_p fh = pgs[i]->block->fhandle;
+    int f = 0;
+    while (f < num_fhs && fhs[f] != fh)
+      f++;
+    if (f == num_fhs)
+      fhs[num_fhs++] = fh;
+    file_of[i] = f;
+  }
+  if (!file_of) n = 0;
+  fprintf(fp, "%s %d %d\n", resident_key, num_fhs, n);
+  for (int f = 0; f < num_fhs; f++)
+    fprintf(fp, "%s\n", fhs[f]->fname);
+  for (int i = 0; i < n; i++)
+    fprintf(fp, "%d %d\n", file_of[i], pgs[i]->block->blk_nr);
+  pool_unlock();
+  free(file_of);
+  free(fhs);
+  free(pgs);
+  return fclose(fp) == 0;
+}
 
+static int cmp_preload_blks(void const* a, void const* b) {
+  preload_blk const *x = a, *y = b;
+  if (x->file != y->file)
+    return x->file - y->file;
+  return x->blk_nr - y->blk_nr;
+}
 
+static void release_preload(void) {
+  for (int f = 0; f < num_preload_files; f++)
+    free(preload_files[f]);
+  free(preload_files);
+  preload_files = 0;
+  num_preload_files = 0;
+  free(preload_blks);
+  preload_blks = 0;
+  num_preload_blks = 0;
+}
 
-void corect_block_check(block_p block, int offset, int rec_len, int cmp)
-{ //lower block
-  if(cmp > page_get_int_at(block->page, offset + PAGE_HEADER_SIZE)){
-    return 1;
-  } // a lower block
-  if(cmp < page_get_int_at(block->page, offset + PAGE_HEADER_SIZE)){
-    return -1; //cmp is higher THIS SHOULD WORK
+static void* preloader_main(void* arg) {
+  for (int i = 0, len; i < num_preload_blks
+         && !__atomic_load_n(&preload_stop, __ATOMIC_ACQUIRE); i += len) {
+    preload_blk *b = &preload_blks[i];
+    for (len = 1; i + len < num_preload_blks && len < RA_MAX_DEPTH
+           && b[len].file == b->file && b[len].blk_nr == b->blk_nr + len; len++)
+      ;
+    fhandle_p fh = get_or_open_tbl_file(preload_files[b->file]);
+    if (!fh) continue;
+    pool_lock();
+    if (num_free_pages <= PRELOAD_HEADROOM) {
+      pool_unlock();
+      break;
+    }
+    int n = load_run(fh, b->blk_nr, len, 0);
+    /* a block in the buffer already ends the run */
+    if (n < len)
+      len = n + 1;
   }
-  else{ //correct block
+  return 0;
+}
+
+/* Stop preloading, with no pool lock */
+static void preload_terminate(void) {
+  if (!preloading) return;
+  __atomic_store_n(&preload_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(preloader, 0);
+  preloading = 0;
+  release_preload();
+}
+
+int pager_preload(char const* fname) {
+  FILE *fp = fopen(fname, "r");
+  if (!fp) return 0;
+  preload_terminate();
+  char key[16] = "";
+  int num_files = 0, num_blks = 0;
+  if (fscanf(fp, "%15s %d %d", key, &num_files, &num_blks) < 3
+      || strcmp(key, resident_key) != 0 || num_files < 0 || num_blks < 0) {
+    put_msg(ERROR, "pager_preload: \"%s\" is not a list of blocks.\n", fname);
+    fclose(fp);
     return 0;
   }
+  /* the most recently used blocks that fit, with room for the others */
+  if (num_blks > pager_num_pages() - PRELOAD_HEADROOM)
+    num_blks = pager_num_pages() - PRELOAD_HEADROOM;
+  if (num_blks < 0)
+    num_blks = 0;
+  preload_files = calloc(num_files + 1, sizeof (char*));
+  preload_blks = malloc((num_blks + 1) * sizeof (preload_blk));
+  char name[512];
+  int *exists = calloc(num_files + 1, sizeof (int));
+  for (int f = 0; preload_files && exists && f < num_files
+         && fscanf(fp, "%511s", name) == 1; f++) {
+    preload_files[f] = strdup(name);
+    num_preload_files++;
+    /* files dropped since are skipped */
+    exists[f] = vfs->exists(name);
+  }
+  preload_blk b;
+  while (preload_blks && exists && num_preload_blks < num_blks
+         && fscanf(fp, "%d %d", &b.file, &b.blk_nr) == 2)
+    if (b.file >= 0 && b.file < num_preload_files && exists[b.file]
+        && b.blk_nr >= 0)
+      preload_blks[num_preload_blks++] = b;
+  fclose(fp);
+  free(exists);
+  qsort(preload_blks, num_preload_blks, sizeof (preload_blk),
+        cmp_preload_blks);
+
+  preload_stop = 0;
+  preloading = num_preload_blks > 0
+    && pthread_create(&preloader, 0, preloader_main, 0) == 0;
+  if (!preloading)
+    release_preload();
+  return 1;
 }
 
+page_p get_page(char const* fname, int blknr) {
+  fhandle_p fh = get_or_open_tbl_file(fname);
+
+  if (!fh) {
+    put_msg(ERROR, "get_page: NULL fh.\n");
+    return 0;
+  }
+
+  for (;;) {
+    /* a hit takes only the lock of the stripe of the block */
+    int num_blocks = num_blocks_of(fh);
+    int bnr = blknr != -1 ? blknr : num_blocks == 0 ? 0 : num_blocks - 1;
+    if (bnr >= 0 && bnr < num_blocks) {
+      int pin_count;
+      page_p pg = pin_buffered(fh, bnr, &pin_count);
+      if (pg && wait_for_read(pg)) {
+        prof()->c.num_hits++;
+        if (__atomic_exchange_n(&pg->prefetched, 0, __ATOMIC_ACQ_REL)) {
+          __atomic_add_fetch(&fh->ra_used, 1, __ATOMIC_RELAXED);
+          prof()->c.num_ra_hits++;
+        }
+        note_accesses(pg, PENDING_TOUCH | (pin_count == 1 ? PENDING_PIN : 0), 0);
+        my_pins++;
+        return pg;
+      }
+      if (pg) /* reading it failed */
+        unpin_page(pg);
+    }
+
+    pool_lock();
+    if (blknr == -1)
+      blknr = fh->num_blocks == 0 ? 0 : fh->num_blocks - 1;
 
+    if (blknr < 0 || blknr > fh->num_blocks) {
+      pool_unlock();
+      put_msg(ERROR, "get_page: block nr %d out of ragne [0,%d].",
+              blknr, fh->num_blocks);
+      return 0;
+    }
+    /* got into the buffer meanwhile, or replaced meanwhile */
+    if (!lookup_block(fh, blknr)) break;
+    pool_unlock();
+  }
 
+  prof()->c.num_misses++;
+  detect_sequential(fh, blknr);
+  int append = blknr == fh->num_blocks;
+  if (append) {
+    /* a file being appended to is read into pages again */
+    unmap_file(fh);
+    fh->use_mmap = 0;
+    if (fh->num_blocks >= fh->phys_blocks)
+      grow_file(fh);
+    __atomic_store_n(&fh->num_blocks, fh->num_blocks + 1, __ATOMIC_RELEASE);
+  }
+  if (fh->use_mmap)
+    map_file(fh);
+  if (fh->map)
+    /* the kernel reads ahead for mapped files */
+    advise_map(fh, fh->ra_seq >= RA_TRIGGER ? MADV_SEQUENTIAL : MADV_RANDOM);
+  int ra = !fh->map && fh->ra_seq >= RA_TRIGGER && blknr < fh->num_blocks - 1;
+  block_p blk = alloc_block(fh, blknr);
+  pool_unlock();
+  if (!blk) {
+    put_msg(ERROR, "get_page: cannot allocate block.\n");
+    return 0;
+  }
 
-//check if the records matches
-//Make binary search
-page_p get_mid_block(page_p p){ //retrieves next page
-  int nr_of_blocks = p->block->fhandle->num_blocks;
-  int mid_block = round(nr_of_blocks /2); //rounds to an int
-  return get_page(p->block->fhandle->fname, mid_block); //retrive the mid block
+  /* the current position of a page read in is right after the header */
+  page_p pg = pin(blk);
+  if (!pg) {
+    /* no page for the new block: the file does not grow */
+    pool_lock();
+    if (append && fh->num_blocks == blknr + 1)
+      __atomic_store_n(&fh->num_blocks, blknr, __ATOMIC_RELEASE);
+    pool_unlock();
+    return 0;
+  }
+  if (ra)
+    read_ahead(fh, blknr + 1);
+  /* put_msg (DEBUG, "get_page: blk %d, page %d\n",
+     blk->blk_nr, blk->page->page_nr); */
+  return pg;
 }
 
+page_p get_page_for_append(char const* fname) {
+  page_p pg = get_page(fname, -1);
+  if (!pg) return 0;
+  pg->current_pos = pg->free_pos;
+  return pg;
+}
 
 //Does linear search
 page_p get_next_page(page_p p) { //retrieves next page
   int blk_nr = is_last_block(p->block) ? //blk_nr is the last block
-    p->block->fhandle->num_blocks : p->block->blk_nr + 1; //num_blocks is (blk_nr+1) bits long
+    num_blocks_of(p->block->fhandle) : p->block->blk_nr + 1; //num_blocks is (blk_nr+1) bits long
   return get_page(p->block->fhandle->fname, blk_nr); //returns file name, blk_nr
 }
 
@@ -850,24 +5899,74 @@ void page_set_pos_begin(page_p p) {
 
 page_p pin(block_p b) {
   if (!b) return 0;
-  page_p pg = page_for_block(b);
-
-  b->page = pg;
-  pq_turn_pinned(pg);
-  pg->block = b;
-  pg->pinned = 1;
-  if (!read_page(pg)) {
+  int pin_count;
+  pool_lock();
+  page_p pg = pin_buffered(b->fhandle, b->blk_nr, &pin_count);
+  if (pg) {
+    /* another thread got the block into the buffer meanwhile */
+    free_block(b);
+    pool_unlock();
+    if (!wait_for_read(pg)) {
+      unpin_page(pg);
+      put_msg(ERROR, "read_page %d fails\n", pg->page_nr);
+      return 0;
+    }
+    note_accesses(pg, PENDING_TOUCH | (pin_count == 1 ? PENDING_PIN : 0), 0);
+    my_pins++;
+    return pg;
+  }
+  pg = available_page(b);
+  if (!pg) {
+    free_block(b);
+    pool_unlock();
+    put_msg(ERROR, "pin: all pages are pinned.\n");
+    return 0;
+  }
+  if (lookup_block(b->fhandle, b->blk_nr)) {
+    /* got into the buffer while waiting for a page */
+    put_free_page(pg);
+    pool_unlock();
+    return pin(b);
+  }
+  load_begin(b, pg);
+  pool_unlock();
+
+  int ok = read_page(pg);
+  pool_lock();
+  load_end(pg, ok);
+  pool_unlock();
+  pthread_rwlock_unlock(&pg->latch);
+  if (!ok) {
     put_msg(ERROR, "read_page %d fails\n", pg->page_nr);
+    load_failed(pg);
     return 0;
   }
+  my_pins++;
   return pg;
 }
 
 void unpin(page_p pg) {
-  pq_turn_unpinned(pg);
-  pg->pinned = 0;
-  if (pg->dirty != 0)
-    write_page(pg);
+  int pin_count = unpin_page(pg);
+  if (pin_count >= 0)
+    my_pins--;
+  note_accesses(pg, pin_count == 0 ? PENDING_PIN : 0, 1);
+  if (pin_count == 0 && __atomic_load_n(&num_unpin_waiters, __ATOMIC_ACQUIRE)) {
+    pool_lock();
+    pthread_cond_broadcast(&page_unpinned);
+    pool_unlock();
+  }
+}
+
+void page_latch_shared(page_p p) {
+  pthread_rwlock_rdlock(&p->latch);
+}
+
+void page_latch_exclusive(page_p p) {
+  pthread_rwlock_wrlock(&p->latch);
+}
+
+void page_unlatch(page_p p) {
+  pthread_rwlock_unlock(&p->latch);
 }
 
 int read_page(page_p p) {
@@ -875,7 +5974,7 @@ int read_page(page_p p) {
     put_msg(ERROR, "read_page: NULL page.\n");
     return 0;
   }
-  if (p->dirty) return 1;
+  if (is_dirty(p)) return 1;
   if (!p->block) {
     put_msg(ERROR, "read_page: NULL block.\n");
     return 0;
@@ -884,21 +5983,55 @@ int read_page(page_p p) {
     put_msg(ERROR, "read_page: NULL fhandle.\n");
     return 0;
   }
-  int fd = p->block->fhandle->fd;
-  if (lseek(fd, (off_t) BLOCK_SIZE * p->block->blk_nr, SEEK_SET) < 0) {
-    put_msg(ERROR, "read_page: lseek to fd %d offset %ld fails.\n",
-            fd, BLOCK_SIZE * p->block->blk_nr);
+  fhandle_p fh = p->block->fhandle;
+  int blk_nr = p->block->blk_nr;
+  pool_lock();
+  ccache_entry *e = ccache_take(fh->fid, blk_nr);
+  if (e) {
+    pool_unlock();
+    p->content = p->buffer;
+    if (ccache_load(e, p->content)) {
+      set_page_from_content(p);
+      return 1;
+    }
+    pool_lock();
+  }
+  if (fh->map && blk_nr < fh->map_blocks) {
+    /* serve the block in place */
+    p->content = fh->map + block_size * blk_nr;
+    pool_unlock();
+    prof()->c.num_mapped++;
+    set_page_from_content(p);
+    return 1;
+  }
+  int fd = io_begin(fh);
+  pool_unlock();
+  if (fd == -1) {
+    put_msg(ERROR, "read_page: cannot open \"%s\".\n", fh->fname);
     return 0;
   }
-  int bytes_read = read(fd, p->content, BLOCK_SIZE);
-  if (bytes_read == -1) return 0;
-  if (bytes_read == 0)
-    set_page_free_pos(p, PAGE_HEADER_SIZE);
-  else {
-    inc_num_reads(fd, p->block->blk_nr);
-    check_page_header_size(p);
-    set_page_free_pos_from_content(p);
+  /* copies of the block queued for the flusher are to be written first */
+  flusher_wait(fd, blk_nr, 1);
+  p->content = p->buffer;
+  if (spool_get(fh->sfile, blk_nr, p->content)) {
+    io_end(fh);
+    set_page_from_content(p);
+    return 1;
+  }
+  int bytes_read = vfs->pread(fd, p->content, block_size,
+                              (off_t) block_size * blk_nr);
+  io_end(fh);
+  if (bytes_read == block_size)
+    spool_put(fh->sfile, blk_nr, p->content, 0);
+  if (bytes_read == -1) {
+    put_msg(ERROR, "read_page: reading fd %d offset %ld fails.\n",
+            fd, block_size * blk_nr);
+    return 0;
   }
+  if (bytes_read == 0)
+    memset(p->content, 0, block_size); /* a new block */
+  if (set_page_from_content(p))
+    inc_num_reads(fd, blk_nr);
   return 1;
 }
 
@@ -907,17 +6040,30 @@ int write_page(page_p p) {
     put_msg(ERROR, "write_page: NULL page.\n");
     return 0;
   }
-  if (!p->dirty) return 1;
+  if (!is_dirty(p)) return 1;
   if (!p->block) return 0;
   if (!p->block->fhandle) return 0;
 
-  int fd = p->block->fhandle->fd;
+  fhandle_p fh = p->block->fhandle;
+  pool_lock();
+  int fd = io_begin(fh);
+  pool_unlock();
+  if (fd == -1) return 0;
+  flusher_wait(fd, p->block->blk_nr, 1);
 
-  if (lseek(fd, (off_t) BLOCK_SIZE * p->block->blk_nr, SEEK_SET) < 0)
-    return 0;
+  wal_force(__atomic_load_n(&p->lsn, __ATOMIC_ACQUIRE));
   inc_num_writes(fd, p->block->blk_nr);
-  p->dirty = 0;
-  if (write(fd, p->content, BLOCK_SIZE) == -1) return 0;
+  stamp_num_blocks(p);
+  set_page_clean(p);
+  ssize_t written = vfs->pwrite(fd, p->content, block_size,
+                                (off_t) block_size * p->block->blk_nr);
+  io_end(fh);
+  if (written == block_size)
+    spool_put(fh->sfile, p->block->blk_nr, p->content, 1);
+  if (written == -1) {
+    set_page_unwritten(p);
+    return 0;
+  }
   return 1;
 }
 
@@ -946,6 +6092,27 @@ int page_set_current_pos(page_p p, int pos) {
   return p->current_pos;
 }
 
+int page_free_pos(page_p p) {
+  if (!p) {
+    put_msg(ERROR, "page_free_pos: NULL page.\n");
+    return -1;
+  }
+  return p->free_pos;
+}
+
+int page_truncate(page_p p, int pos) {
+  if (!p || pos < PAGE_HEADER_SIZE || pos > p->free_pos) {
+    put_msg(ERROR, "page_truncate: invalid position %d.\n", pos);
+    return 0;
+  }
+  unmap_page(p);
+  set_page_free_pos(p, pos);
+  set_page_dirty(p);
+  if (p->current_pos > pos)
+    p->current_pos = pos;
+  return 1;
+}
+
 int page_valid_pos_for_get(page_p p, int offset) {
   if (offset >= PAGE_HEADER_SIZE && offset < p->free_pos)
     return 1;
@@ -957,7 +6124,7 @@ int page_valid_pos_for_get(page_p p, int offset) {
 
 int page_valid_pos_for_put(page_p p, int offset, int len) {
   if (offset >= PAGE_HEADER_SIZE && offset <= p->free_pos
-      && offset <= BLOCK_SIZE - len)
+      && offset <= block_size - len)
     return 1;
   return 0;
 }
@@ -989,8 +6156,10 @@ int page_put_int(page_p p, int val) {
   if (!page_valid_pos_for_put(p, p->current_pos, INT_SIZE)) {
     return 0;
   }
+  unmap_page(p);
   memcpy(p->content + p->current_pos, (char *) &val, INT_SIZE);
-  p->dirty = 1;
+  set_page_dirty(p);
+  wal_log(p, p->current_pos, INT_SIZE);
   set_pos_after_put(p, p->current_pos + INT_SIZE);
   return 1;
 }
@@ -1000,17 +6169,18 @@ int page_get_int_at(page_p p, int offset) {
     put_msg(FATAL, "page_get_int_at\n");
     exit(EXIT_FAILURE);
   }
-  int res = (int) *((int *)((p->content) + offset));
-  p->current_pos += INT_SIZE;
-  return res;
+  /* the current position is left alone, as readers share the page */
+  return (int) *((int *)((p->content) + offset));
 }
 
 int page_put_int_at(page_p p, int offset, int val) {
   if (!page_valid_pos_for_put(p, offset, INT_SIZE)) {
     return 0;
   }
+  unmap_page(p);
   memcpy(p->content + offset, (char *) &val, INT_SIZE);
-  p->dirty = 1;
+  set_page_dirty(p);
+  wal_log(p, offset, INT_SIZE);
   set_pos_after_put(p, offset + INT_SIZE);
   return 1;
 }
@@ -1029,8 +6199,10 @@ int page_put_str(page_p p, char const* str, int len) {
   if (!page_valid_pos_for_put(p, p->current_pos, len)) {
     return 0;
   }
+  unmap_page(p);
   strncpy(p->content + p->current_pos, str, len);
-  p->dirty = 1;
+  set_page_dirty(p);
+  wal_log(p, p->current_pos, len);
   set_pos_after_put(p, p->current_pos + len);
   return 1;
 }
@@ -1041,16 +6213,37 @@ int page_get_str_at(page_p p, int offset, char* str, int len) {
     exit(EXIT_FAILURE);
   }
   strncpy(str, p->content + offset, len);
-  p->current_pos += len;
   return 0;
 }
 
+int page_get_bytes_at(page_p p, int offset, void* buf, int len) {
+  if (len <= 0) return 1;
+  if (!page_valid_pos_for_get(p, offset) || offset + len > p->free_pos)
+    return 0;
+  memcpy(buf, p->content + offset, len);
+  return 1;
+}
+
+int page_put_bytes_at(page_p p, int offset, void const* buf, int len) {
+  if (len <= 0) return 1;
+  if (!page_valid_pos_for_put(p, offset, len))
+    return 0;
+  unmap_page(p);
+  memcpy(p->content + offset, buf, len);
+  set_page_dirty(p);
+  wal_log(p, offset, len);
+  set_pos_after_put(p, offset + len);
+  return 1;
+}
+
 int page_put_str_at(page_p p, int offset, char const* str, int len) {
   if(!page_valid_pos_for_put(p, offset, len)) {
     return 0;
   }
+  unmap_page(p);
   strncpy(p->content + offset, str, len);
-  p->dirty = 1;
+  set_page_dirty(p);
+  wal_log(p, offset, len);
   set_pos_after_put(p, offset + len);
   return 1;
 }
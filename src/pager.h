@@ -13,7 +13,8 @@
  * tries to associate a page with the block. If it is the first time to
  * get a page for a table that does not exist yet, @ref get_page "get_page()"
  * will try to create a file for the table.
- * The file is located at @ref sys_dir "sys_dir".
+ * The file is located at @ref sys_dir "sys_dir",
+ * or in memory for a system dir of @ref MEMORY_DB.
  *
  * It is also possible to use @ref get_page_for_append "get_page_for_append()"
  * or @ref get_next_page "get_next_page()" to get an appropriate page.
@@ -24,15 +25,32 @@
  * to write the content of a page into the block.
  *
  * When a page is @em pinned to a block, it cannot be replaced by
- * another block unless all pages are pinned.
- * @ref unpin "unpin()" a page to allow the page to be associated
- * with another block.
+ * another block. If all pages are pinned, get_page() waits a while for
+ * other threads to unpin one, and returns NULL if none does.
+ * Every @ref get_page "get_page()" pins the page once more,
+ * and every @ref unpin "unpin()" takes one pin away.
+ * @ref unpin "unpin()" a page as many times as it is got
+ * to allow the page to be associated with another block.
+ *
+ * The pager can be used by several threads at the same time.
+ * A thread latches a page it has got with
+ * @ref page_latch_shared "page_latch_shared()" before reading its content,
+ * or with @ref page_latch_exclusive "page_latch_exclusive()"
+ * before changing it, and @ref page_unlatch "page_unlatch()" it afterwards.
+ * The current position of a page is shared by all threads.
+ * Only pager_init() and pager_terminate() must be called when no other
+ * thread is using the pager, and a file must not be used by other
+ * threads while it is being closed.
+ *
+ * Changes to pages are logged ahead of writing the pages, so that they
+ * survive a crash, see @ref pager_set_durability "pager_set_durability()".
+ * Call @ref pager_commit "pager_commit()" at the end of every statement.
  *
  * A page has a <em>current position</em> that can be obtained with
  * @ref page_current_pos "page_current_pos()".
  * To access a data value of type @em x at the current position,
  * where @em x could be int or str,
- * use @ref field_desc_p "page_get_x()" and @ref page_put_int "page_put_x()".
+ * use @ref page_get_int "page_get_x()" and @ref page_put_int "page_put_x()".
  * To access a value at a particular position,
  * use @ref page_get_int_at "page_get_x_at()" and @ref page_put_int_at "page_put_x_at()".
  *
@@ -52,53 +70,250 @@
 #include <stdlib.h>
 #include "pmsg.h"
 
-/** block size in number of bytes */
+/** default block size in number of bytes */
 #define BLOCK_SIZE 512L
 
-/** buffer size in number of pages */
+/** smallest block size, also the size of blocks of old databases */
+#define MIN_BLOCK_SIZE 512L
+
+/** largest block size */
+#define MAX_BLOCK_SIZE 65536L
+
+/** default buffer size in number of pages */
 #define NUM_PAGES 10
 
+/** default number of blocks a file grows by, see pager_set_extent_blocks() */
+#define EXTENT_BLOCKS 16
+
+/** default memory in bytes of the compressed cache, see pager_set_ccache_size() */
+#define CCACHE_SIZE (1L << 20)
+
+/** default percentage of dirty pages at which the flusher starts,
+    see pager_set_dirty_thresholds() */
+#define DIRTY_HIGH_PCT 50
+
+/** default percentage of dirty pages the flusher brings it down to */
+#define DIRTY_LOW_PCT 25
+
+/** Size in bytes of the write-ahead log after which a commit checkpoints */
+#define WAL_CHECKPOINT_SIZE (4L << 20)
+
+/** system dir of a database whose files are kept in the memory of the
+    process, see set_system_dir() */
+#define MEMORY_DB ":memory:"
+
 /** number of bytes as page header */
 #define PAGE_HEADER_SIZE 20
 
-/** max number of open files */
-#define MAX_OPEN_FILES 10
+/** max number of file descriptors kept open.
+    Any number of files can be open, the file descriptors of the least
+    recently used ones are closed when there are too many. */
+#define MAX_OPEN_FILES 64
 
 /** an integer consists of 4 bytes */
 #define INT_SIZE 4
 
+/** Page replacement policies, see pager_init() */
+typedef enum {
+  REPL_SAME,  /**< the policy of the previous pager (REPL_LRU initially) */
+  REPL_LRU,   /**< least recently used */
+  REPL_CLOCK, /**< clock sweep (second chance) */
+  REPL_LRU_K, /**< LRU-K with K = 2 */
+  REPL_2Q,    /**< 2Q, scan resistant */
+  REPL_ARC    /**< adaptive replacement cache */
+} repl_policy;
+
+/** Durability of changes to blocks, see pager_set_durability() */
+typedef enum {
+  DURABILITY_OFF,       /**< no log, a crash may lose or tear changes */
+  DURABILITY_GROUP,     /**< logged, the log is forced to disk every
+                           @ref WAL_GROUP_MS ms at the latest */
+  DURABILITY_STATEMENT  /**< logged, pager_commit() waits till
+                           the log is on disk */
+} durability_level;
+
+/** max milliseconds the changes of a statement wait for the log writer
+    with @ref DURABILITY_GROUP */
+#define WAL_GROUP_MS 10
+
 typedef struct block_struct * block_p;
 typedef struct page_struct * page_p;
 
-/** Database buffer */
-extern page_p pages[];
+/** Database buffer, with the number of pages given to pager_init()
+or pager_resize() */
+extern page_p *pages;
 
 extern void put_file_info(pmsg_level level, char const* fname);
 extern void put_page_info(pmsg_level level, page_p p);
 extern void put_block_info(pmsg_level level, block_p b);
 extern void put_pager_info(pmsg_level level, char const* msg);
+/** Print the number of buffer pages held by each file */
+extern void put_buffer_info(pmsg_level level);
 extern void put_pager_profiler_info(pmsg_level level);
 extern void put_pqueues_info(pmsg_level level);
 
-/** Set the directory of the system */
+/** Set the directory of the system.
+With @ref MEMORY_DB, the files are kept in the memory of the process
+instead, till it exits, and there is no log (@ref DURABILITY_OFF).
+*/
 extern int set_system_dir(char const* dir);
+/** Non-zero if the files are in memory, see set_system_dir() */
+extern int pager_in_memory(void);
 
 /** Get the directory of the system */
 extern char* system_dir();
 
-/** Initiates a pager.
+/** Initiates a pager with a buffer of @em num_pages pages,
+replaced with the given @em policy.
 Memory of buffer pages are allocated.
+If @em num_pages is not positive, the buffer gets as many pages as
+the previous pager had (@ref NUM_PAGES initially).
+A running pager is terminated first.
 Must be called first.
 */
-extern int pager_init(void);
+extern int pager_init(int num_pages, repl_policy policy);
 /** Terminates a pager.
 Memory of buffer pages are released.
-If there are dirty pages, they are writtern back to the file blocks.
+If there are dirty pages, they are writtern back to the file blocks,
+and the background flusher is stopped after it has written them all.
 All open files are closed.
 Must be called before the program exits.
 */
 extern void pager_terminate(void);
 
+/** Grow or shrink the buffer of the running pager to @em num_pages pages,
+while other threads may be using it.
+A shrinking buffer gives up its unused pages first, then its unpinned
+pages from the least recently used on, writing back the dirty ones.
+The replacement policy starts over, with the pages in the order they
+have been used.
+The next pager_init() without a given size gets as many pages.
+Returns 0 if the buffer cannot get @em num_pages pages, because memory
+runs out or too many pages are pinned. It keeps the pages it has then.
+*/
+extern int pager_resize(int num_pages);
+/** Number of pages in the buffer */
+extern int pager_num_pages(void);
+
+/** Set the thresholds of dirty pages, in percentage of the buffer pages.
+When more than @em high_pct percent of the pages are dirty, dirty pages
+are handed to the background flusher until at most @em low_pct percent
+are dirty. Returns 0 if the thresholds are invalid.
+*/
+extern int pager_set_dirty_thresholds(int high_pct, int low_pct);
+/** The thresholds of dirty pages, in percentage of the buffer pages */
+extern void pager_dirty_thresholds(int* high_pct, int* low_pct);
+
+/** Open table files for direct I/O (O_DIRECT) from now on if @em on is
+non-zero, bypassing the kernel page cache, so that blocks are cached only
+in the buffer pages. Files that are open already are not affected.
+Falls back to normal I/O where the file system or the device does not
+support direct I/O of blocks of the block size.
+*/
+extern void pager_set_direct_io(int on);
+/** Non-zero if table files are opened for direct I/O from now on */
+extern int pager_direct_io(void);
+/** Non-zero if the file is open for direct I/O now. It is not if the
+file system refuses direct I/O, or once an I/O failed because of it. */
+extern int file_direct_io(char const* fname);
+
+/** Set the block size of the next pager_init(), a power of 2 between
+@ref MIN_BLOCK_SIZE and @ref MAX_BLOCK_SIZE (@ref BLOCK_SIZE initially).
+The block size is recorded in the header of every block, and a pager
+refuses blocks of another size.
+Returns 0 if the size is invalid.
+*/
+extern int pager_set_block_size(long size);
+/** Block size of the current pager */
+extern long pager_block_size(void);
+
+/** Let files grow by extents of @em n blocks from now on, instead of a
+block at a time. The blocks of an extent are preallocated on disk
+(posix_fallocate()) when the first of them is appended, and those
+left unused are given back when the file is closed.
+The number of blocks in use is recorded in the header of the first block.
+Returns 0 if @em n is not positive.
+*/
+extern int pager_set_extent_blocks(int n);
+/** Number of blocks a file grows by */
+extern int pager_extent_blocks(void);
+
+/** Set the durability of the next pager_init() (@ref DURABILITY_GROUP
+initially).
+Unless it is @ref DURABILITY_OFF, every change to a page is recorded in a
+write-ahead log in the system dir, and a page is not written to its file
+before the log records of its changes are on disk.
+The first change to a page since it was written logs the whole block,
+so that a block torn by a crash is repaired as well.
+A background log writer forces the log to disk, with one fdatasync()
+for all the changes made since the last time.
+pager_init() replays the log left by a crash into the files.
+*/
+extern void pager_set_durability(durability_level level);
+/** Durability of the current pager */
+extern durability_level pager_durability(void);
+/** The durability level with the given name ("off", "group" or
+"statement"), -1 if there is no such level. */
+extern int durability_by_name(char const* name);
+/** End of a statement. Its changes are durable as soon as the log
+is on disk, which is waited for with @ref DURABILITY_STATEMENT.
+*/
+extern void pager_commit(void);
+/** Number of checkpoints since the reset of the pager profiler.
+A checkpoint drops the log whose changes are in the files on disk.
+*/
+extern long long pager_num_checkpoints(void);
+
+/** Set the memory in bytes of the compressed cache of the next
+pager_init() (@ref CCACHE_SIZE initially), 0 to have none.
+The content of a block replaced from the buffer is kept compressed in
+this memory, and a block that is read again is decompressed from there
+instead of read from disk, so that more blocks are kept in memory than
+there are buffer pages. Blocks that do not compress are not kept.
+Returns 0 if @em size is negative.
+*/
+extern int pager_set_ccache_size(long size);
+/** The memory in bytes of the compressed cache of the next pager_init() */
+extern long pager_ccache_size(void);
+
+/** Let the next pager_init() share a pool of @em num_pages blocks with
+the other processes using the same system dir, 0 (initially) for none.
+The pool is kept in POSIX shared memory, made by the first process and
+removed when the last one terminates its pager, not counting the
+processes that died without terminating it. A block missing in the
+buffer is copied from the pool if it is there, and blocks read from or
+written to disk are put into it, so that processes do not read the
+blocks again that other processes have read or written.
+The buffer pages of a process are still its own, and a process does not
+see changes another process makes to blocks that are in its buffer.
+Returns 0 if @em num_pages is negative.
+*/
+extern int pager_set_shared_pages(int num_pages);
+/** Blocks shared with other processes by the next pager_init() */
+extern int pager_shared_pages(void);
+
+/** Let the files of the next pager_init() be as slow as a disk on which
+a read takes @em read_us and a write @em write_us microseconds, and on which
+all reads and writes share a bandwidth of @em bandwidth bytes per second.
+A sync takes as long as a write. Files are not mapped into memory then.
+Meant for seeing how the database behaves on slow disks, without them.
+0 for all of them (initially) lets the files be as fast as they are.
+Returns 0 if any of them is negative.
+*/
+extern int pager_set_io_delay(long read_us, long write_us, long bandwidth);
+
+/** Let the memory of buffer pages of the next pager_init() be backed by
+reserved huge pages (MAP_HUGETLB) if @em on is non-zero. Without reserved
+huge pages, a large buffer asks for transparent huge pages instead.
+*/
+extern void pager_set_huge_pages(int on);
+/** Non-zero if the buffer pages may be backed by reserved huge pages */
+extern int pager_huge_pages(void);
+
+/** The policy with the given name ("lru", "clock", "lru-k", "2q" or "arc"),
+REPL_SAME if there is no such policy. */
+extern repl_policy repl_policy_by_name(char const* name);
+
 /** Reset th pager profiler */
 extern void pager_profiler_reset(void);
 
@@ -113,34 +328,107 @@ get_page() does the following
   - pin the block to a buffer page (and read the block into the page).
   - Returns NULL upon failure of getting the page or pinning (reading) the page.
   - The current position of the page is set to right after the header
+- the page is pinned in both cases.
 */
 
-
-
-
-//MADE THIS
-extern page_p get_mid_block(char const* fname);
-
-
-
-
-
 extern page_p get_page(char const* fname, int blknr);
 /** Get the last block and move the current position to the end */
 extern page_p get_page_for_append(char const* fname);
 /** Get the next page */
 extern page_p get_next_page(page_p p);
+
+/** @brief A ring of buffer pages that a sequential scan recycles */
+typedef struct scan_ring * ring_p;
+/** Make a ring of a few buffer pages for a sequential scan, NULL upon
+failure. Blocks of a file larger than a quarter of the buffer that are
+read by get_page_in_ring() go into the pages of the ring, replacing the
+block of the ring read the longest ago once the ring is full, so that
+the scan does not replace the other pages of the buffer.
+The scan may keep two pages of the ring pinned, the one it is at and
+the next one.
+*/
+extern ring_p new_scan_ring(void);
+/** Release the ring, its pages stay in the buffer */
+extern void release_scan_ring(ring_p r);
+/** get_page() for a scan with the ring @em r, NULL for no ring */
+extern page_p get_page_in_ring(ring_p r, char const* fname, int blknr);
+/** get_next_page() for a scan with the ring @em r, NULL for no ring */
+extern page_p get_next_page_in_ring(ring_p r, page_p p);
 /** Set current position to the beginning */
 void page_set_pos_begin(page_p p);
 /** Number of blocks in the file */
 extern int file_num_blocks(char const* fname);
-/** Close the file */
+/** Serve the blocks of the file from a memory mapping of the file
+(if @em on is non-zero) instead of reading them into buffer pages.
+Meant for tables that are mostly read: a page is copied into its own
+buffer as soon as it is changed, and a file that is appended to is
+read into buffer pages again.
+Returns 0 upon failure, also if the file cannot be mapped (in memory,
+for example). Its blocks are read into buffer pages then.
+*/
+extern int file_set_mmap(char const* fname, int on);
+/** Number of blocks served from file mappings since the reset of the
+pager profiler */
+extern long long pager_num_mapped(void);
+/** Give the file a quota of @em max_pages buffer pages, no quota if 0.
+A file that has as many pages as its quota replaces its own least
+recently used unpinned page to get another block, so that a scan of
+a large table does not push the blocks of other tables out of the
+buffer. The quota is kept till the file is closed.
+Returns 0 upon failure.
+*/
+extern int file_set_quota(char const* fname, int max_pages);
+/** Number of buffer pages holding blocks of the file */
+extern int file_num_pages(char const* fname);
+/** Close the file. Returns -1 if the file is not open. */
 extern int close_file(char const* fname);
+/** Close and remove the file. Returns 0 upon failure. */
+extern int file_remove(char const* fname);
+/** Close both files and rename the file @em from to @em to,
+replacing it. Returns 0 upon failure. */
+extern int file_rename(char const* from, char const* to);
+/** Store the file log-structured from now on: a block written is
+appended to a log of segment files, <fname>.seg<n>, and the file holds
+the map of where each block is, written when the file is synced or
+closed. Suits files that are mostly written. A background cleaner
+compacts the segments that are mostly overwritten.
+The file is closed first. Returns 0 upon failure.
+*/
+extern int file_set_log_structured(char const* fname);
+
+/** Write the list of the blocks in the buffer to the file @em fname,
+the most recently used first, for pager_preload() after a restart.
+Returns 0 upon failure.
+*/
+extern int pager_save_resident(char const* fname);
+/** Read the blocks listed in the file @em fname by pager_save_resident()
+into unused buffer pages by a background thread, sorted by file and
+block nr so that adjacent blocks are read with one read.
+Two pages are left unused for the other threads: the most recently used
+blocks are taken when they do not all fit in the others,
+and blocks of files that no longer exist are skipped.
+Returns 0 if there is no such list.
+*/
+extern int pager_preload(char const* fname);
 
 /** Pin the block to a buffer page and read the block into the page. */
 extern page_p pin(block_p b);
-/** Unpin the page. If the page is dirty, write the content back to disk. */
+/** Unpin the page, taking away one pin of it.
+A dirty page is not written at once, but by the background flusher
+later on (when there are too many dirty pages, when the page is
+replaced or when the file is closed).
+*/
 extern void unpin(page_p p);
+/** Latch the page for reading its content. Several threads can latch a
+page shared at the same time. The page must be pinned while it is latched.
+*/
+extern void page_latch_shared(page_p p);
+/** Latch the page for changing its content, waiting till no other thread
+has latched it. The page must be pinned while it is latched.
+*/
+extern void page_latch_exclusive(page_p p);
+/** Release the latch of the page. */
+extern void page_unlatch(page_p p);
 /** Read the content of the page from disk.
 If the content of the page is already uptodate, return immediately.
 */
@@ -153,6 +441,11 @@ extern int page_block_nr(page_p p);
 extern int page_current_pos(page_p p);
 /** Set page's current position. */
 extern int page_set_current_pos(page_p p, int pos);
+/** Return page's free position, right after its last value. */
+extern int page_free_pos(page_p p);
+/** Drop the values of the page from @em pos on, so that @em pos becomes
+the free position. Returns 0 if @em pos is beyond the free position. */
+extern int page_truncate(page_p p, int pos);
 
 /** Check if @em offset is valid for getting a value */
 extern int page_valid_pos_for_get(page_p p, int offset);
@@ -164,14 +457,15 @@ extern int eop(page_p p);
 /** returns true (non-zero) if current position is at the @em end-of-file */
 extern int peof(page_p p);
 /** Retrieve the int value at the current position. */
-extern int field_desc_p(page_p p);
+extern int page_get_int(page_p p);
 /** Put the int value @em val at the current position.
 Returns 0 if there is not enough space at current position.
 The current position is moved to the next value.
 */
 extern int page_put_int(page_p p, int val);
 /** Retrieve the int value at @em offset.
-The current position is moved to the next value.
+The current position is not changed, so threads that latch the page
+shared can read it at the same time.
 */
 extern int page_get_int_at(page_p p, int offset);
 /** Put the int value @em val at @em offset.
@@ -196,7 +490,7 @@ extern int page_put_str(page_p p, char const* str, int len);
 The return value -1 indicates a failure.
 It is the resposibility of the program using the pager to manage
 the returned string memory.
-The current position is moved to the next value.
+The current position is not changed.
 */
 extern int page_get_str_at(page_p p, int offset, char* str, int len);
 /** Put the string value @em str of length @em len at @em offset.
@@ -204,5 +498,13 @@ extern int page_get_str_at(page_p p, int offset, char* str, int len);
 Returns 0 if fails (@em offset out of range).
 */
 extern int page_put_str_at(page_p p, int offset, char const* str, int len);
+/** Copy the @em len bytes at @em offset into @em buf.
+Returns 0 if they are not all before the free position.
+*/
+extern int page_get_bytes_at(page_p p, int offset, void* buf, int len);
+/** Put the @em len bytes of @em buf at @em offset, as they are.
+Returns 0 if fails (@em offset out of range).
+*/
+extern int page_put_bytes_at(page_p p, int offset, void const* buf, int len);
 
 #endif
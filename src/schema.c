@@ -6,7 +6,10 @@
 
 #include "schema.h"
 #include "pmsg.h"
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /** @brief Field descriptor */
 typedef struct field_desc_struct {
@@ -30,6 +33,9 @@ typedef struct schema_struct {
   tbl_p tbl;            /**< table descriptor */
 } schema_struct;
 
+typedef struct index_desc_struct * index_p;
+typedef struct bitmaps_struct * bitmaps_p;
+
 /** @brief Table descriptor */
 /** A table descriptor allows us to find the schema and
     run-time infomation about the table.
@@ -37,10 +43,47 @@ typedef struct schema_struct {
 typedef struct tbl_desc_struct {
   schema_p sch;      /**< schema of this table. */
   int num_records;   /**< number of records this table has. */
-  page_p current_pg; /**< current page being accessed. */
+  page_p current_pg; /**< current page being accessed, pinned once. */
+  ring_p scan;       /**< ring of the pages of its sequential scans. */
+  char *fsm_name;    /**< name of the file of the free-space map. */
+  int fsm_blocks;    /**< number of blocks covered by the free-space map,
+                        -1 before the map is loaded. */
+  int fsm_recorded;  /**< number of blocks recorded in the map file. */
+  int *room;         /**< stack of the blocks with room for a record. */
+  int num_room;      /**< number of blocks in room. */
+  int room_cap;      /**< capacity of room. */
+  index_p indexes;   /**< B+tree indexes of the table. */
   tbl_p next;        /**< next tbl_desc in the database. */
 } tbl_desc_struct;
 
+/** @brief Cursor */
+/** A cursor scans the records of a table with a position of its own.
+ */
+typedef struct cursor_struct {
+  tbl_p tbl;         /**< table being scanned. */
+  page_p pg;         /**< page the cursor is at, pinned once. */
+  int pos;           /**< position of the next record in the page. */
+  int got;           /**< whether the record before pos was just got. */
+} cursor_struct;
+
+typedef enum {BTREE_INDEX, HASH_INDEX, BITMAP_INDEX} index_kind;
+
+/** @brief Index */
+/** A B+tree or bitmap index on an int field, or a hash index on any
+    field, of a table, in a file of its own.
+ */
+typedef struct index_desc_struct {
+  tbl_p tbl;         /**< indexed table. */
+  field_desc_p fld;  /**< indexed field. */
+  index_kind kind;   /**< B+tree, hash or bitmap index. */
+  char *file;        /**< name of the file of the index. */
+  char *ovf;         /**< name of the file of the overflow blocks of a
+                        hash index, NULL for the others. */
+  bitmaps_p bms;     /**< bitmaps of a bitmap index, NULL before they
+                        are read. */
+  index_p next;      /**< next index of the table. */
+} index_desc_struct;
+
 
 /** @brief Database tables*/
 tbl_p db_tables; /**< a linked list of table descriptors */
@@ -223,8 +266,1186 @@ int schema_len(schema_p sch) {
   }
 }
 
+/* Free-space map.
+   The free-space map of a table records the number of free bytes of each
+   block of the table, one int per block, in a file of its own that is
+   managed by the pager like any table file. In memory, a table keeps the
+   blocks with room for a record on a stack, so that an insert finds one
+   at once.
+   The file is brought up to date when the database is closed. Before
+   that, only the blocks it records already are updated when they get or
+   lose room. Blocks it does not record, such as blocks of databases from
+   before the map, are read when the map is loaded.
+   --------------------------------------------------------------------- */
+
+static char const* fsm_file_name(tbl_p t) {
+  if (!t->fsm_name) {
+    t->fsm_name = malloc(strlen(t->sch->name) + 5);
+    sprintf(t->fsm_name, "%s.fsm", t->sch->name);
+  }
+  return t->fsm_name;
+}
+
+static void release_fsm(tbl_p t) {
+  free(t->fsm_name);
+  free(t->room);
+}
+
+static int fsm_entries_per_block(void) {
+  return (pager_block_size() - PAGE_HEADER_SIZE) / INT_SIZE;
+}
+
+static void room_push(tbl_p t, int blk_nr) {
+  if (t->num_room == t->room_cap) {
+    t->room_cap = t->room_cap ? 2 * t->room_cap : 16;
+    t->room = realloc(t->room, t->room_cap * sizeof (int));
+  }
+  t->room[t->num_room++] = blk_nr;
+}
+
+/* Number of free bytes of the block, as recorded in the map */
+static int fsm_get(tbl_p t, int blk_nr) {
+  int per_block = fsm_entries_per_block();
+  page_p pg = get_page(fsm_file_name(t), blk_nr / per_block);
+  if (!pg) return 0;
+  int free_bytes = page_get_int_at(pg, PAGE_HEADER_SIZE
+                                   + blk_nr % per_block * INT_SIZE);
+  unpin(pg);
+  return free_bytes;
+}
+
+/* Record the number of free bytes of the block in the map page of the
+   block, which is pinned and returned. map_pg is the map page of a
+   previous block, or NULL; it is unpinned unless the block is in it.
+   Blocks are added to the map file in order, so it never has gaps. */
+static page_p fsm_put_in(tbl_p t, page_p map_pg, int blk_nr, int free_bytes) {
+  int per_block = fsm_entries_per_block();
+  if (map_pg && page_block_nr(map_pg) != blk_nr / per_block) {
+    unpin(map_pg);
+    map_pg = 0;
+  }
+  if (!map_pg)
+    map_pg = get_page(fsm_file_name(t), blk_nr / per_block);
+  if (!map_pg) return 0;
+  if (!page_put_int_at(map_pg, PAGE_HEADER_SIZE + blk_nr % per_block * INT_SIZE,
+                       free_bytes))
+    put_msg(ERROR, "fsm_put: cannot record block %d of \"%s\".\n",
+            blk_nr, t->sch->name);
+  return map_pg;
+}
+
+/* Record the number of free bytes of the block */
+static void fsm_put(tbl_p t, int blk_nr, int free_bytes) {
+  page_p map_pg = fsm_put_in(t, 0, blk_nr, free_bytes);
+  if (map_pg) unpin(map_pg);
+}
+
+/* Number of blocks recorded in the map file */
+static int fsm_num_entries(tbl_p t) {
+  int num_blocks = file_num_blocks(fsm_file_name(t));
+  if (num_blocks <= 0) return 0;
+  page_p pg = get_page(fsm_file_name(t), num_blocks - 1);
+  if (!pg) return 0;
+  int n = (num_blocks - 1) * fsm_entries_per_block()
+    + (page_free_pos(pg) - PAGE_HEADER_SIZE) / INT_SIZE;
+  unpin(pg);
+  return n;
+}
+
+/* Read the blocks of the table that the map does not cover yet */
+static void fsm_sync(tbl_p t) {
+  schema_p s = t->sch;
+  int num_blocks = file_num_blocks(s->name);
+  for (int blk_nr = t->fsm_blocks; blk_nr < num_blocks; blk_nr++) {
+    page_p pg = get_page(s->name, blk_nr);
+    if (!pg) return;
+    if (pager_block_size() - page_free_pos(pg) >= s->len)
+      room_push(t, blk_nr);
+    unpin(pg);
+    t->fsm_blocks = blk_nr + 1;
+  }
+}
+
+/* Load the map of the table the first time it is needed */
+static void fsm_load(tbl_p t) {
+  if (t->fsm_blocks >= 0) return;
+  int n = fsm_num_entries(t), num_blocks = file_num_blocks(t->sch->name);
+  if (n > num_blocks) n = num_blocks; /* the map of a truncated table */
+  for (int blk_nr = 0; blk_nr < n; blk_nr++)
+    if (fsm_get(t, blk_nr) >= t->sch->len)
+      room_push(t, blk_nr);
+  t->fsm_recorded = t->fsm_blocks = n;
+  fsm_sync(t);
+}
+
+/* A block with room for a record, a new block at the end if there is none */
+static int fsm_block_with_room(tbl_p t) {
+  fsm_load(t);
+  if (t->num_room == 0)
+    fsm_sync(t); /* blocks added by scans of an empty table */
+  if (t->num_room == 0) {
+    room_push(t, t->fsm_blocks);
+    t->fsm_blocks++;
+  }
+  return t->room[t->num_room - 1];
+}
+
+/* The block at the top of the stack has no room left */
+static void fsm_lost_room(tbl_p t, int blk_nr, int free_bytes) {
+  t->num_room--;
+  if (blk_nr < t->fsm_recorded)
+    fsm_put(t, blk_nr, free_bytes);
+}
+
+/* The page of the block has lost a record, and had old_free bytes free */
+static void fsm_emptied(tbl_p t, page_p pg, int old_free) {
+  int blk_nr = page_block_nr(pg);
+  if (blk_nr >= t->fsm_blocks || old_free >= t->sch->len) return;
+  room_push(t, blk_nr);
+  if (blk_nr < t->fsm_recorded)
+    fsm_put(t, blk_nr, pager_block_size() - page_free_pos(pg));
+}
+
+/* Bring the map file up to date. The blocks without room are full of
+   records, so their free bytes follow from the record length. */
+static void fsm_save(tbl_p t) {
+  if (t->fsm_blocks < 0) return;
+  page_p map_pg = 0;
+  int full = (pager_block_size() - PAGE_HEADER_SIZE) % t->sch->len;
+  for (int blk_nr = t->fsm_recorded; blk_nr < t->fsm_blocks; blk_nr++)
+    map_pg = fsm_put_in(t, map_pg, blk_nr, full);
+  t->fsm_recorded = t->fsm_blocks;
+  for (int i = 0; i < t->num_room; i++) {
+    page_p pg = get_page(t->sch->name, t->room[i]);
+    if (!pg) continue;
+    map_pg = fsm_put_in(t, map_pg, t->room[i],
+                        pager_block_size() - page_free_pos(pg));
+    unpin(pg);
+  }
+  if (map_pg) unpin(map_pg);
+}
+
+/* B+tree indexes.
+   A B+tree index on an int field maps the value of the field in each
+   record to the location of the record, a (block nr, slot) pair where the
+   slot is the number of the record in its block. It is kept in a file of
+   its own that is managed by the pager like any table file. Block 0 of
+   the file holds the block nr of the root, the other blocks are nodes.
+   A node starts with three ints: whether it is a leaf, its number of
+   entries and, for a leaf, the block nr of the next leaf (-1 for the
+   last one). A leaf entry is a (key, block nr, slot) triple. An internal
+   node has a child before its entries, and each entry is a triple followed
+   by the child holding the triples from it on. The triples are all
+   different, so equal keys need no special care.
+   Nodes split when they are full, but are not merged when they get
+   emptier: an empty leaf stays in the chain of leaves until the index is
+   made again.
+   --------------------------------------------------------------------- */
+
+#define NODE_LEAF 0
+#define NODE_NUM 1
+#define NODE_NEXT 2
+#define NODE_HEAD 3    /* ints before the entries */
+#define LEAF_ENTRY 3   /* ints of a leaf entry */
+#define INNER_ENTRY 4  /* ints of an internal entry */
+
+/** Key of the line of an index in tables_desc_file */
+static const char btree_key[] = "#btree";
+
+/* Max number of entries of a node */
+static int node_cap(int leaf) {
+  return ((pager_block_size() - PAGE_HEADER_SIZE) / INT_SIZE - NODE_HEAD
+          - (leaf ? 0 : 1)) / (leaf ? LEAF_ENTRY : INNER_ENTRY);
+}
+
+/* A buffer for a node, with room for one entry more than it can hold */
+static int* new_node(void) {
+  return malloc(pager_block_size() + INNER_ENTRY * INT_SIZE);
+}
+
+static int node_len(int const* node) {
+  return NODE_HEAD + (node[NODE_LEAF] ? node[NODE_NUM] * LEAF_ENTRY
+                      : 1 + node[NODE_NUM] * INNER_ENTRY);
+}
+
+/* The i-th triple of the node */
+static int* node_triple(int* node, int i) {
+  return node[NODE_LEAF] ? node + NODE_HEAD + i * LEAF_ENTRY
+    : node + NODE_HEAD + 1 + i * INNER_ENTRY;
+}
+
+/* The i-th child of an internal node, the one before the i-th entry */
+static int* node_child(int* node, int i) {
+  return node + NODE_HEAD + i * INNER_ENTRY;
+}
+
+static int triple_cmp(int const* a, int const* b) {
+  for (int i = 0; i < 3; i++)
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  return 0;
+}
+
+/* Number of triples of the node that are less than (or equal to) t */
+static int node_rank(int* node, int const* t, int or_equal) {
+  int lo = 0, hi = node[NODE_NUM];
+  while (lo < hi) {
+    int mid = (lo + hi) / 2, c = triple_cmp(node_triple(node, mid), t);
+    if (c < 0 || (or_equal && c == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int read_node(index_p ix, int blk_nr, int* node) {
+  page_p pg = get_page(ix->file, blk_nr);
+  if (!pg) return 0;
+  int ok = page_get_bytes_at(pg, PAGE_HEADER_SIZE, node, NODE_HEAD * INT_SIZE)
+    && page_get_bytes_at(pg, PAGE_HEADER_SIZE, node, node_len(node) * INT_SIZE);
+  unpin(pg);
+  if (!ok)
+    put_msg(ERROR, "index \"%s\": bad node at block %d.\n", ix->file, blk_nr);
+  return ok;
+}
+
+static int write_node(index_p ix, int blk_nr, int const* node) {
+  page_p pg = get_page(ix->file, blk_nr);
+  if (!pg) return 0;
+  int end = PAGE_HEADER_SIZE + node_len(node) * INT_SIZE;
+  int ok = page_put_bytes_at(pg, PAGE_HEADER_SIZE, node, end - PAGE_HEADER_SIZE)
+    && (page_free_pos(pg) == end || page_truncate(pg, end));
+  unpin(pg);
+  return ok;
+}
+
+/* Write the node into a new block at the end of the file */
+static int append_node(index_p ix, int const* node) {
+  int blk_nr = file_num_blocks(ix->file);
+  return write_node(ix, blk_nr, node) ? blk_nr : -1;
+}
+
+static int index_root(index_p ix) {
+  page_p pg = get_page(ix->file, 0);
+  if (!pg) return -1;
+  int root = page_get_int_at(pg, PAGE_HEADER_SIZE);
+  unpin(pg);
+  return root;
+}
+
+static void set_index_root(index_p ix, int root) {
+  page_p pg = get_page(ix->file, 0);
+  if (!pg) return;
+  page_put_int_at(pg, PAGE_HEADER_SIZE, root);
+  unpin(pg);
+}
+
+/* Insert triple t into the subtree at block blk_nr. If the node there
+   splits, up gets the entry of the new node for the parent and 1 is
+   returned. Returns -1 upon failure. */
+static int btree_insert_in(index_p ix, int blk_nr, int const* t, int* up) {
+  int *node = new_node(), res = -1;
+  if (!read_node(ix, blk_nr, node))
+    goto done;
+  int leaf = node[NODE_LEAF], i = node_rank(node, t, 1);
+  int ent = leaf ? LEAF_ENTRY : INNER_ENTRY;
+  int entry[INNER_ENTRY];
+  if (leaf) {
+    memcpy(entry, t, 3 * INT_SIZE);
+  } else {
+    res = btree_insert_in(ix, *node_child(node, i), t, entry);
+    if (res != 1)
+      goto done;
+  }
+
+  int *at = node_triple(node, i);
+  memmove(at + ent, at, (node[NODE_NUM] - i) * ent * INT_SIZE);
+  memcpy(at, entry, ent * INT_SIZE);
+  node[NODE_NUM]++;
+  res = 0;
+  if (node[NODE_NUM] <= node_cap(leaf)) {
+    if (!write_node(ix, blk_nr, node))
+      res = -1;
+    goto done;
+  }
+
+  /* a full leaf moves its upper half to a new leaf, a full internal node
+     moves the entries after the middle one, which goes up */
+  int *right = new_node(), mid = node[NODE_NUM] / 2;
+  right[NODE_LEAF] = leaf;
+  if (leaf) {
+    right[NODE_NUM] = node[NODE_NUM] - mid;
+    right[NODE_NEXT] = node[NODE_NEXT];
+    memcpy(node_triple(right, 0), node_triple(node, mid),
+           right[NODE_NUM] * ent * INT_SIZE);
+    memcpy(up, node_triple(node, mid), 3 * INT_SIZE);
+  } else {
+    right[NODE_NUM] = node[NODE_NUM] - mid - 1;
+    right[NODE_NEXT] = -1;
+    memcpy(up, node_triple(node, mid), 3 * INT_SIZE);
+    memcpy(node_child(right, 0), node_child(node, mid + 1),
+           (1 + right[NODE_NUM] * ent) * INT_SIZE);
+  }
+  node[NODE_NUM] = mid;
+  up[3] = append_node(ix, right);
+  if (leaf)
+    node[NODE_NEXT] = up[3];
+  res = up[3] >= 0 && write_node(ix, blk_nr, node) ? 1 : -1;
+  free(right);
+ done:
+  free(node);
+  return res;
+}
+
+static int btree_insert(index_p ix, int key, int blk_nr, int slot) {
+  int t[3] = { key, blk_nr, slot }, up[INNER_ENTRY];
+  int root = index_root(ix);
+  int res = root < 0 ? -1 : btree_insert_in(ix, root, t, up);
+  if (res == 1) {
+    /* the root has split, a new root gets the two halves */
+    int *node = new_node();
+    node[NODE_LEAF] = 0;
+    node[NODE_NUM] = 1;
+    node[NODE_NEXT] = -1;
+    *node_child(node, 0) = root;
+    memcpy(node_triple(node, 0), up, INNER_ENTRY * INT_SIZE);
+    root = append_node(ix, node);
+    free(node);
+    if (root < 0) res = -1;
+    else set_index_root(ix, root);
+  }
+  if (res < 0)
+    put_msg(ERROR, "index \"%s\": cannot insert key %d.\n", ix->file, key);
+  return res >= 0;
+}
+
+/* Block nr of the leaf where triple t belongs, -1 upon failure */
+static int btree_leaf(index_p ix, int const* t, int* node) {
+  int blk_nr = index_root(ix);
+  while (blk_nr >= 0) {
+    if (!read_node(ix, blk_nr, node))
+      return -1;
+    if (node[NODE_LEAF])
+      return blk_nr;
+    blk_nr = *node_child(node, node_rank(node, t, 1));
+  }
+  return -1;
+}
+
+static int btree_delete(index_p ix, int key, int blk_nr, int slot) {
+  int t[3] = { key, blk_nr, slot }, *node = new_node(), res = 0;
+  int leaf_nr = btree_leaf(ix, t, node);
+  if (leaf_nr >= 0) {
+    int i = node_rank(node, t, 0);
+    if (i < node[NODE_NUM] && triple_cmp(node_triple(node, i), t) == 0) {
+      int *at = node_triple(node, i);
+      memmove(at, at + LEAF_ENTRY,
+              (node[NODE_NUM] - i - 1) * LEAF_ENTRY * INT_SIZE);
+      node[NODE_NUM]--;
+      res = write_node(ix, leaf_nr, node);
+    }
+  }
+  if (!res)
+    put_msg(ERROR, "index \"%s\": cannot delete key %d.\n", ix->file, key);
+  free(node);
+  return res;
+}
+
+/** @brief Locations of records found with an index */
+typedef struct {
+  int *locs;         /**< (block nr, slot) pairs. */
+  int num;           /**< number of pairs in locs. */
+  int cap;           /**< capacity of locs in number of pairs. */
+} rec_locs;
+
+static void add_loc(rec_locs* ls, int blk_nr, int slot) {
+  if (ls->num == ls->cap) {
+    ls->cap = ls->cap ? 2 * ls->cap : 64;
+    ls->locs = realloc(ls->locs, ls->cap * 2 * sizeof (int));
+  }
+  ls->locs[2 * ls->num] = blk_nr;
+  ls->locs[2 * ls->num + 1] = slot;
+  ls->num++;
+}
+
+static int loc_cmp(void const* a, void const* b) {
+  int const *x = a, *y = b;
+  return x[0] != y[0] ? (x[0] < y[0] ? -1 : 1)
+    : x[1] != y[1] ? (x[1] < y[1] ? -1 : 1) : 0;
+}
+
+/* Add the locations of the records with keys from lo to hi to ls */
+static void btree_range(index_p ix, int lo, int hi, rec_locs* ls) {
+  int t[3] = { lo, INT_MIN, INT_MIN }, *node = new_node();
+  int blk_nr = btree_leaf(ix, t, node);
+  int i = blk_nr >= 0 ? node_rank(node, t, 0) : 0;
+  while (blk_nr >= 0) {
+    for (; i < node[NODE_NUM]; i++) {
+      int *e = node_triple(node, i);
+      if (e[0] > hi)
+        goto done;
+      add_loc(ls, e[1], e[2]);
+    }
+    blk_nr = node[NODE_NEXT];
+    i = 0;
+    if (blk_nr >= 0 && !read_node(ix, blk_nr, node))
+      break;
+  }
+ done:
+  free(node);
+}
+
+/* An empty B+tree, a root leaf without entries */
+static int btree_init(index_p ix) {
+  int *node = new_node();
+  node[NODE_LEAF] = 1;
+  node[NODE_NUM] = 0;
+  node[NODE_NEXT] = -1;
+  set_index_root(ix, 1);
+  int ok = write_node(ix, 1, node);
+  free(node);
+  return ok;
+}
+
+/* Hash indexes.
+   A hash index finds the records with a given value of an int or str
+   field in a few block reads, whatever the size of the table. It is a
+   linear hash table: the number of buckets grows by one, by splitting
+   the bucket at the split pointer, each time the entries fill more than
+   HASH_FILL_PCT percent of the buckets. Only the entries of that bucket
+   are hashed again. A key hashes to bucket h mod 2^level, or to
+   h mod 2^(level+1) if that bucket is split already in this round.
+   Block 0 of the file of the index holds the level, the split pointer,
+   the number of entries and the first free overflow block. Bucket b is
+   at block 1 + b, so that buckets are added at the end of the file.
+   The overflow blocks of full buckets are in a file of their own.
+   A bucket block starts with its number of entries and its next
+   overflow block, -1 at the end of the chain. An entry is the key,
+   as many bytes as the field, followed by the block nr and the slot of
+   the record.
+   --------------------------------------------------------------------- */
+
+#define HASH_FILL_PCT 75
+
+#define HASH_LEVEL 0
+#define HASH_SPLIT 1
+#define HASH_ENTRIES 2
+#define HASH_FREE 3
+#define HASH_META 4    /* ints of the meta block */
+
+/** Key of the line of a hash index in tables_desc_file */
+static const char hash_key[] = "#hash";
+
+static int hash_entry_len(index_p ix) {
+  return ix->fld->len + 2 * INT_SIZE;
+}
+
+static int bucket_cap(index_p ix) {
+  return (pager_block_size() - PAGE_HEADER_SIZE - 2 * INT_SIZE)
+    / hash_entry_len(ix);
+}
+
+static int entry_pos(index_p ix, int i) {
+  return PAGE_HEADER_SIZE + 2 * INT_SIZE + i * hash_entry_len(ix);
+}
+
+/* FNV-1a */
+static unsigned hash_of(char const* key, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char) key[i]) * 16777619u;
+  return h;
+}
+
+static int hash_bucket(int const* meta, char const* key, int len) {
+  unsigned h = hash_of(key, len);
+  unsigned b = h & ((1u << meta[HASH_LEVEL]) - 1);
+  if (b < (unsigned) meta[HASH_SPLIT])
+    b = h & ((2u << meta[HASH_LEVEL]) - 1);
+  return b;
+}
+
+static int hash_meta_get(index_p ix, int* meta) {
+  page_p pg = get_page(ix->file, 0);
+  if (!pg) return 0;
+  int ok = page_get_bytes_at(pg, PAGE_HEADER_SIZE, meta, HASH_META * INT_SIZE);
+  unpin(pg);
+  return ok;
+}
+
+static int hash_meta_put(index_p ix, int const* meta) {
+  page_p pg = get_page(ix->file, 0);
+  if (!pg) return 0;
+  int ok = page_put_bytes_at(pg, PAGE_HEADER_SIZE, meta, HASH_META * INT_SIZE);
+  unpin(pg);
+  return ok;
+}
+
+/* Make the page an empty bucket block, followed by block next */
+static void bucket_reset(page_p pg, int next) {
+  if (page_free_pos(pg) > PAGE_HEADER_SIZE)
+    page_truncate(pg, PAGE_HEADER_SIZE);
+  page_put_int_at(pg, PAGE_HEADER_SIZE, 0);
+  page_put_int_at(pg, PAGE_HEADER_SIZE + INT_SIZE, next);
+}
+
+/* The next block of the chain of the bucket block, which is unpinned */
+static page_p bucket_next(index_p ix, page_p pg) {
+  int next = page_get_int_at(pg, PAGE_HEADER_SIZE + INT_SIZE);
+  unpin(pg);
+  return next >= 0 ? get_page(ix->ovf, next) : 0;
+}
+
+/* Put the entry into the chain of the bucket, in a new overflow block
+   if the blocks of the chain are full */
+static int bucket_put(index_p ix, int* meta, int bucket, char const* entry) {
+  int len = hash_entry_len(ix);
+  page_p pg = get_page(ix->file, 1 + bucket);
+  while (pg) {
+    int n = page_get_int_at(pg, PAGE_HEADER_SIZE);
+    if (n < bucket_cap(ix)) {
+      int ok = page_put_bytes_at(pg, entry_pos(ix, n), entry, len)
+        && page_put_int_at(pg, PAGE_HEADER_SIZE, n + 1);
+      unpin(pg);
+      return ok;
+    }
+    if (page_get_int_at(pg, PAGE_HEADER_SIZE + INT_SIZE) < 0) {
+      int ovf_nr = meta[HASH_FREE];
+      page_p ovf = get_page(ix->ovf, ovf_nr >= 0 ? ovf_nr
+                            : file_num_blocks(ix->ovf));
+      if (!ovf) break;
+      if (ovf_nr >= 0)
+        meta[HASH_FREE] = page_get_int_at(ovf, PAGE_HEADER_SIZE + INT_SIZE);
+      else
+        ovf_nr = page_block_nr(ovf);
+      bucket_reset(ovf, -1);
+      page_put_int_at(pg, PAGE_HEADER_SIZE + INT_SIZE, ovf_nr);
+      unpin(pg);
+      pg = ovf;
+      continue;
+    }
+    pg = bucket_next(ix, pg);
+  }
+  return 0;
+}
+
+/* Split the bucket at the split pointer into itself and a new bucket
+   at the end of the file */
+static int hash_split(index_p ix, int* meta) {
+  int len = hash_entry_len(ix), num = 0, bucket = meta[HASH_SPLIT];
+  char *entries = 0;
+
+  /* take the entries out of the bucket, its overflow blocks are freed */
+  page_p pg = get_page(ix->file, 1 + bucket);
+  for (int first = 1; pg; first = 0) {
+    int n = page_get_int_at(pg, PAGE_HEADER_SIZE);
+    if (n > 0) {
+      entries = realloc(entries, (num + n) * len);
+      page_get_bytes_at(pg, entry_pos(ix, 0), entries + num * len, n * len);
+      num += n;
+    }
+    int next = page_get_int_at(pg, PAGE_HEADER_SIZE + INT_SIZE);
+    if (first)
+      bucket_reset(pg, -1);
+    else {
+      bucket_reset(pg, meta[HASH_FREE]);
+      meta[HASH_FREE] = page_block_nr(pg);
+    }
+    unpin(pg);
+    pg = next >= 0 ? get_page(ix->ovf, next) : 0;
+  }
+
+  pg = get_page(ix->file, 1 + (1 << meta[HASH_LEVEL]) + bucket);
+  int ok = pg != 0;
+  if (pg) {
+    bucket_reset(pg, -1);
+    unpin(pg);
+  }
+  if (++meta[HASH_SPLIT] == 1 << meta[HASH_LEVEL]) {
+    meta[HASH_LEVEL]++;
+    meta[HASH_SPLIT] = 0;
+  }
+  for (int i = 0; ok && i < num; i++)
+    ok = bucket_put(ix, meta, hash_bucket(meta, entries + i * len,
+                                          ix->fld->len), entries + i * len);
+  free(entries);
+  return ok;
+}
+
+static int hash_insert(index_p ix, char const* key, int blk_nr, int slot) {
+  int meta[HASH_META], len = hash_entry_len(ix), klen = ix->fld->len;
+  char *entry = malloc(len);
+  memcpy(entry, key, klen);
+  memcpy(entry + klen, &blk_nr, INT_SIZE);
+  memcpy(entry + klen + INT_SIZE, &slot, INT_SIZE);
+  int ok = hash_meta_get(ix, meta)
+    && bucket_put(ix, meta, hash_bucket(meta, key, klen), entry);
+  free(entry);
+  if (ok) {
+    meta[HASH_ENTRIES]++;
+    int num_buckets = (1 << meta[HASH_LEVEL]) + meta[HASH_SPLIT];
+    if (meta[HASH_ENTRIES] * 100L
+        > (long) HASH_FILL_PCT * num_buckets * bucket_cap(ix))
+      ok = hash_split(ix, meta);
+    ok = hash_meta_put(ix, meta) && ok;
+  }
+  if (!ok)
+    put_msg(ERROR, "index \"%s\": cannot insert an entry.\n", ix->file);
+  return ok;
+}
+
+/* Remove the entry from the bucket. The last entry of its block takes
+   its place. An overflow block emptied stays in the chain until the
+   bucket is split. */
+static int hash_delete(index_p ix, char const* key, int blk_nr, int slot) {
+  int meta[HASH_META], len = hash_entry_len(ix), klen = ix->fld->len;
+  char *entry = malloc(len), *e = malloc(len);
+  memcpy(entry, key, klen);
+  memcpy(entry + klen, &blk_nr, INT_SIZE);
+  memcpy(entry + klen + INT_SIZE, &slot, INT_SIZE);
+  int found = 0;
+  page_p pg = hash_meta_get(ix, meta)
+    ? get_page(ix->file, 1 + hash_bucket(meta, key, klen)) : 0;
+  while (pg) {
+    int n = page_get_int_at(pg, PAGE_HEADER_SIZE);
+    for (int i = 0; i < n && !found; i++) {
+      page_get_bytes_at(pg, entry_pos(ix, i), e, len);
+      if (memcmp(e, entry, len) != 0)
+        continue;
+      if (i < n - 1) {
+        page_get_bytes_at(pg, entry_pos(ix, n - 1), e, len);
+        page_put_bytes_at(pg, entry_pos(ix, i), e, len);
+      }
+      page_truncate(pg, entry_pos(ix, n - 1));
+      page_put_int_at(pg, PAGE_HEADER_SIZE, n - 1);
+      found = 1;
+    }
+    if (found) {
+      unpin(pg);
+      break;
+    }
+    pg = bucket_next(ix, pg);
+  }
+  if (found) {
+    meta[HASH_ENTRIES]--;
+    found = hash_meta_put(ix, meta);
+  }
+  if (!found)
+    put_msg(ERROR, "index \"%s\": cannot delete an entry.\n", ix->file);
+  free(entry);
+  free(e);
+  return found;
+}
+
+/* Add the locations of the records with the key to ls */
+static void hash_lookup(index_p ix, char const* key, rec_locs* ls) {
+  int meta[HASH_META], len = hash_entry_len(ix), klen = ix->fld->len;
+  char *e = malloc(len);
+  page_p pg = hash_meta_get(ix, meta)
+    ? get_page(ix->file, 1 + hash_bucket(meta, key, klen)) : 0;
+  while (pg) {
+    int n = page_get_int_at(pg, PAGE_HEADER_SIZE);
+    for (int i = 0; i < n; i++) {
+      page_get_bytes_at(pg, entry_pos(ix, i), e, len);
+      if (memcmp(e, key, klen) == 0) {
+        int loc[2];
+        memcpy(loc, e + klen, 2 * INT_SIZE);
+        add_loc(ls, loc[0], loc[1]);
+      }
+    }
+    pg = bucket_next(ix, pg);
+  }
+  free(e);
+}
+
+/* An empty hash table of one bucket */
+static int hash_init(index_p ix) {
+  int meta[HASH_META] = { 0, 0, 0, -1 };
+  if (!hash_meta_put(ix, meta)) return 0;
+  page_p pg = get_page(ix->file, 1);
+  if (!pg) return 0;
+  bucket_reset(pg, -1);
+  unpin(pg);
+  return 1;
+}
+
+/* The key of a field value of a record, as the field is in a page */
+static void key_of_value(field_desc_p f, void const* val, char* key) {
+  if (is_int_field(f))
+    memcpy(key, val, INT_SIZE);
+  else
+    strncpy(key, val, f->len);
+}
+
+/* Bitmap indexes.
+   A bitmap index on an int field of few distinct values has a bitmap
+   per value. The bitmap of a value has bit p set for record position p,
+   which is blk_nr * records per block + slot. Conditions on the field
+   become AND, OR and NOT of bitmaps, so a combination of conditions
+   finds the positions of the records that meet it before any block of
+   the table is read.
+   The bitmaps are word-aligned hybrid (WAH) compressed. The bits are
+   in groups of 31. A literal word has the top bit 0 and holds a group
+   as it is. A fill word has the top bit 1. Its next bit is the value of
+   all the bits of a run of groups, and the other 30 bits are the number
+   of groups in the run. Long runs of records without the value take one
+   word.
+   The bitmaps are in memory while the database is open. They are read
+   from the file of the index when first needed, and written back when
+   the database is closed, like the free-space map.
+   --------------------------------------------------------------------- */
+
+#define WAH_BITS 31
+#define WAH_FILL 0x80000000u
+#define WAH_ONES 0x40000000u
+#define WAH_LIT_MASK 0x7fffffffu
+#define WAH_MAX_RUN 0x3fffffffu
+
+/** @brief WAH-compressed bitmap */
+typedef struct {
+  unsigned *w;       /**< words. */
+  int num;           /**< number of words. */
+  int cap;           /**< capacity of w. */
+  int groups;        /**< number of groups of bits in the words. */
+} wah;
+
+/** @brief Bitmaps of a bitmap index */
+typedef struct bitmaps_struct {
+  int num;           /**< number of distinct values. */
+  int cap;           /**< capacity of vals and bms. */
+  int *vals;         /**< values, in ascending order. */
+  wah *bms;          /**< bitmap of each value. */
+  int dirty;         /**< whether they differ from the file. */
+} bitmaps_struct;
+
+/** Key of the line of a bitmap index in tables_desc_file */
+static const char bitmap_key[] = "#bitmap";
+
+static void wah_push(wah* b, unsigned word) {
+  if (b->num == b->cap) {
+    b->cap = b->cap ? 2 * b->cap : 4;
+    b->w = realloc(b->w, b->cap * sizeof (unsigned));
+  }
+  b->w[b->num++] = word;
+}
+
+/* Append n groups of all 0 (or all 1) bits */
+static void wah_add_fill(wah* b, int bit, int n) {
+  unsigned fill = WAH_FILL | (bit ? WAH_ONES : 0);
+  b->groups += n;
+  if (b->num > 0 && (b->w[b->num - 1] & ~WAH_MAX_RUN) == fill) {
+    unsigned room = WAH_MAX_RUN - (b->w[b->num - 1] & WAH_MAX_RUN);
+    unsigned k = (unsigned) n < room ? (unsigned) n : room;
+    b->w[b->num - 1] += k;
+    n -= k;
+  }
+  for (; n > 0; n -= WAH_MAX_RUN)
+    wah_push(b, fill | (unsigned) (n < WAH_MAX_RUN ? n : WAH_MAX_RUN));
+}
+
+/* Append a group of bits */
+static void wah_add_group(wah* b, unsigned lit) {
+  if (lit == 0 || lit == WAH_LIT_MASK)
+    wah_add_fill(b, lit != 0, 1);
+  else {
+    wah_push(b, lit);
+    b->groups++;
+  }
+}
+
+/** @brief Position in a WAH bitmap, a group at a time */
+typedef struct {
+  wah const* b;      /**< the bitmap. */
+  int i;             /**< next word. */
+  unsigned lit;      /**< current group, or the groups of the fill. */
+  int run;           /**< groups left in the current word. */
+} wah_iter;
+
+/* Move to the next word if the current one is used up. Past the end,
+   the bitmap is a fill of zeros without end. */
+static void wah_next_word(wah_iter* it) {
+  if (it->run > 0) return;
+  if (it->i >= it->b->num) {
+    it->lit = 0;
+    it->run = WAH_MAX_RUN;
+    return;
+  }
+  unsigned word = it->b->w[it->i++];
+  if (word & WAH_FILL) {
+    it->lit = word & WAH_ONES ? WAH_LIT_MASK : 0;
+    it->run = word & WAH_MAX_RUN;
+  } else {
+    it->lit = word;
+    it->run = -1; /* a literal */
+  }
+}
+
+/* Number of groups the iterator can give at once */
+static int wah_run(wah_iter* it) {
+  wah_next_word(it);
+  return it->run < 0 ? 1 : it->run;
+}
+
+static void wah_skip(wah_iter* it, int n) {
+  it->run = it->run < 0 ? 0 : it->run - n;
+}
+
+typedef enum {WAH_AND, WAH_OR, WAH_ANDNOT} wah_op;
+
+/* a op b, of the groups of the longer of the two */
+static wah wah_combine(wah const* a, wah const* b, wah_op op) {
+  wah res = { 0, 0, 0, 0 };
+  wah_iter x = { a, 0, 0, 0 }, y = { b, 0, 0, 0 };
+  int groups = a->groups > b->groups ? a->groups : b->groups;
+  while (res.groups < groups) {
+    int n = wah_run(&x), m = wah_run(&y);
+    if (m < n) n = m;
+    if (n > groups - res.groups) n = groups - res.groups;
+    unsigned lit = op == WAH_AND ? x.lit & y.lit
+      : op == WAH_OR ? x.lit | y.lit : x.lit & ~y.lit & WAH_LIT_MASK;
+    if (n > 1)
+      wah_add_fill(&res, lit != 0, n);
+    else
+      wah_add_group(&res, lit);
+    wah_skip(&x, n);
+    wah_skip(&y, n);
+  }
+  return res;
+}
+
+/* NOT b, of the first groups groups */
+static wah wah_not(wah const* b, int groups) {
+  wah ones = { 0, 0, 0, 0 };
+  wah_add_fill(&ones, 1, groups);
+  wah res = wah_combine(&ones, b, WAH_ANDNOT);
+  free(ones.w);
+  return res;
+}
+
+/* Replace *a with a op b */
+static void wah_apply(wah* a, wah const* b, wah_op op) {
+  wah res = wah_combine(a, b, op);
+  free(a->w);
+  *a = res;
+}
+
+/* Set (or clear) bit p. Setting a bit at the end of the bitmap, as
+   inserts do, adds to the last word. */
+static void wah_set(wah* b, int p, int bit) {
+  int g = p / WAH_BITS;
+  unsigned mask = 1u << (p % WAH_BITS);
+  if (g >= b->groups) {
+    if (!bit) return;
+    if (g > b->groups)
+      wah_add_fill(b, 0, g - b->groups);
+    wah_add_group(b, mask);
+    return;
+  }
+  if (g == b->groups - 1 && !(b->w[b->num - 1] & WAH_FILL)) {
+    unsigned lit = bit ? b->w[b->num - 1] | mask : b->w[b->num - 1] & ~mask;
+    b->num--;
+    b->groups--;
+    wah_add_group(b, lit);
+    return;
+  }
+  wah unit = { 0, 0, 0, 0 };
+  wah_add_fill(&unit, 0, g);
+  wah_add_group(&unit, mask);
+  wah_apply(b, &unit, bit ? WAH_OR : WAH_ANDNOT);
+  free(unit.w);
+}
+
+static int wah_empty(wah const* b) {
+  for (int i = 0; i < b->num; i++)
+    if (b->w[i] & WAH_FILL ? (b->w[i] & WAH_ONES) != 0 : b->w[i] != 0)
+      return 0;
+  return 1;
+}
+
+/* Add the locations of the set bits to ls */
+static void wah_locs(wah const* b, int per_block, rec_locs* ls) {
+  wah_iter it = { b, 0, 0, 0 };
+  for (int g = 0; g < b->groups; ) {
+    int n = wah_run(&it);
+    if (n > b->groups - g) n = b->groups - g;
+    if (it.lit)
+      for (int k = 0; k < n; k++)
+        for (int j = 0; j < WAH_BITS; j++)
+          if (it.lit >> j & 1) {
+            int p = (g + k) * WAH_BITS + j;
+            add_loc(ls, p / per_block, p % per_block);
+          }
+    wah_skip(&it, n);
+    g += n;
+  }
+}
+
+static int records_per_block(schema_p s) {
+  return (pager_block_size() - PAGE_HEADER_SIZE) / s->len;
+}
+
+/* The bitmap of the value, a new empty one if add is set and there is
+   none, NULL otherwise */
+static wah* bitmap_of(bitmaps_p bms, int val, int add) {
+  int lo = 0, hi = bms->num;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (bms->vals[mid] < val) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo < bms->num && bms->vals[lo] == val)
+    return bms->bms + lo;
+  if (!add) return 0;
+  if (bms->num == bms->cap) {
+    bms->cap = bms->cap ? 2 * bms->cap : 16;
+    bms->vals = realloc(bms->vals, bms->cap * sizeof (int));
+    bms->bms = realloc(bms->bms, bms->cap * sizeof (wah));
+  }
+  memmove(bms->vals + lo + 1, bms->vals + lo, (bms->num - lo) * sizeof (int));
+  memmove(bms->bms + lo + 1, bms->bms + lo, (bms->num - lo) * sizeof (wah));
+  bms->num++;
+  bms->vals[lo] = val;
+  bms->bms[lo] = (wah) { 0, 0, 0, 0 };
+  return bms->bms + lo;
+}
+
+static bitmaps_p new_bitmaps(void) {
+  bitmaps_p bms = malloc(sizeof (bitmaps_struct));
+  bms->num = bms->cap = 0;
+  bms->vals = 0;
+  bms->bms = 0;
+  bms->dirty = 0;
+  return bms;
+}
+
+static void release_bitmaps(bitmaps_p bms) {
+  if (!bms) return;
+  for (int i = 0; i < bms->num; i++)
+    free(bms->bms[i].w);
+  free(bms->vals);
+  free(bms->bms);
+  free(bms);
+}
+
+/** @brief Ints in the blocks of a file, one after another */
+typedef struct {
+  char const* file;  /**< name of the file. */
+  page_p pg;         /**< current page. */
+  int pos;           /**< position of the next int in the page. */
+} int_stream;
+
+static int stream_get(int_stream* st, int* v) {
+  if (!st->pg || st->pos + INT_SIZE > page_free_pos(st->pg)) {
+    int blk_nr = st->pg ? page_block_nr(st->pg) + 1 : 0;
+    if (st->pg) unpin(st->pg);
+    st->pg = blk_nr < file_num_blocks(st->file)
+      ? get_page(st->file, blk_nr) : 0;
+    st->pos = PAGE_HEADER_SIZE;
+    if (!st->pg || st->pos + INT_SIZE > page_free_pos(st->pg))
+      return 0;
+  }
+  *v = page_get_int_at(st->pg, st->pos);
+  st->pos += INT_SIZE;
+  return 1;
+}
+
+static int stream_put(int_stream* st, int v) {
+  if (!st->pg || st->pos + INT_SIZE > pager_block_size()) {
+    int blk_nr = st->pg ? page_block_nr(st->pg) + 1 : 0;
+    if (st->pg) unpin(st->pg);
+    st->pg = get_page(st->file, blk_nr);
+    st->pos = PAGE_HEADER_SIZE;
+    if (!st->pg) return 0;
+  }
+  if (!page_put_int_at(st->pg, st->pos, v))
+    return 0;
+  st->pos += INT_SIZE;
+  return 1;
+}
+
+/* The bitmaps of the index, read from its file the first time.
+   The file holds the number of values, then for each value the value,
+   its number of groups and of words, and the words. */
+static bitmaps_p index_bitmaps(index_p ix) {
+  if (ix->bms) return ix->bms;
+  ix->bms = new_bitmaps();
+  int_stream st = { ix->file, 0, 0 };
+  int num = 0, val, groups, num_words;
+  if (stream_get(&st, &num))
+    for (int i = 0; i < num && stream_get(&st, &val)
+           && stream_get(&st, &groups) && stream_get(&st, &num_words); i++) {
+      wah *b = bitmap_of(ix->bms, val, 1);
+      b->w = malloc(num_words * sizeof (unsigned));
+      b->cap = num_words;
+      for (int k = 0; k < num_words && stream_get(&st, (int *) b->w + k); k++)
+        b->num++;
+      b->groups = groups;
+    }
+  if (st.pg) unpin(st.pg);
+  return ix->bms;
+}
+
+/* Write the bitmaps back to the file of the index, if they have changed */
+static void bitmaps_save(index_p ix) {
+  bitmaps_p bms = ix->bms;
+  if (!bms || !bms->dirty) return;
+  file_remove(ix->file);
+  int_stream st = { ix->file, 0, 0 };
+  int num = 0;
+  for (int i = 0; i < bms->num; i++)
+    num += !wah_empty(bms->bms + i);
+  int ok = stream_put(&st, num);
+  for (int i = 0; ok && i < bms->num; i++) {
+    wah *b = bms->bms + i;
+    if (wah_empty(b)) continue;
+    ok = stream_put(&st, bms->vals[i]) && stream_put(&st, b->groups)
+      && stream_put(&st, b->num);
+    for (int k = 0; ok && k < b->num; k++)
+      ok = stream_put(&st, (int) b->w[k]);
+  }
+  if (st.pg) unpin(st.pg);
+  if (!ok)
+    put_msg(ERROR, "index \"%s\": cannot save the bitmaps.\n", ix->file);
+  bms->dirty = 0;
+}
+
+/* Set (or clear) the bit of the record at the slot of block blk_nr in
+   the bitmap of val */
+static int bitmap_update(index_p ix, int val, int blk_nr, int slot, int bit) {
+  bitmaps_p bms = index_bitmaps(ix);
+  wah *b = bitmap_of(bms, val, bit);
+  if (!b) return 0;
+  wah_set(b, blk_nr * records_per_block(ix->tbl->sch) + slot, bit);
+  bms->dirty = 1;
+  return 1;
+}
+
+/* Indexes of a table.
+   --------------------------------------------------------------------- */
+
+static index_p get_index(tbl_p t, field_desc_p f, index_kind kind) {
+  for (index_p ix = t->indexes; ix; ix = ix->next)
+    if (ix->fld == f && ix->kind == kind)
+      return ix;
+  return 0;
+}
+
+static char* index_file_name(tbl_p t, field_desc_p f, char const* ext) {
+  char *name = malloc(strlen(t->sch->name) + strlen(f->name)
+                      + strlen(ext) + 3);
+  sprintf(name, "%s.%s.%s", t->sch->name, f->name, ext);
+  return name;
+}
+
+static index_p add_index(tbl_p t, field_desc_p f, index_kind kind) {
+  index_p ix = malloc(sizeof (index_desc_struct));
+  ix->tbl = t;
+  ix->fld = f;
+  ix->kind = kind;
+  ix->file = index_file_name(t, f, kind == HASH_INDEX ? "hash"
+                             : kind == BITMAP_INDEX ? "bmp" : "idx");
+  ix->ovf = kind == HASH_INDEX ? index_file_name(t, f, "ovf") : 0;
+  ix->bms = 0;
+  ix->next = t->indexes;
+  t->indexes = ix;
+  return ix;
+}
+
+static void release_index(index_p ix) {
+  release_bitmaps(ix->bms);
+  free(ix->file);
+  free(ix->ovf);
+  free(ix);
+}
+
+static void release_indexes(tbl_p t) {
+  while (t->indexes) {
+    index_p ix = t->indexes;
+    t->indexes = ix->next;
+    release_index(ix);
+  }
+}
+
+static void remove_index_files(index_p ix) {
+  file_remove(ix->file);
+  if (ix->ovf)
+    file_remove(ix->ovf);
+}
+
+/* Add (or remove) the record at pos of the page to (or from) the index */
+static int index_update(index_p ix, page_p pg, int pos, int slot, int add) {
+  if (ix->kind == BTREE_INDEX) {
+    int key = page_get_int_at(pg, pos + ix->fld->offset);
+    return add ? btree_insert(ix, key, page_block_nr(pg), slot)
+      : btree_delete(ix, key, page_block_nr(pg), slot);
+  }
+  if (ix->kind == BITMAP_INDEX)
+    return bitmap_update(ix, page_get_int_at(pg, pos + ix->fld->offset),
+                         page_block_nr(pg), slot, add);
+  char *key = malloc(ix->fld->len);
+  page_get_bytes_at(pg, pos + ix->fld->offset, key, ix->fld->len);
+  int ok = add ? hash_insert(ix, key, page_block_nr(pg), slot)
+    : hash_delete(ix, key, page_block_nr(pg), slot);
+  free(key);
+  return ok;
+}
+
+/* Add the record at pos of the page to the indexes of the table */
+static void index_add_at(tbl_p t, page_p pg, int pos) {
+  int slot = (pos - PAGE_HEADER_SIZE) / t->sch->len;
+  for (index_p ix = t->indexes; ix; ix = ix->next)
+    index_update(ix, pg, pos, slot, 1);
+}
+
+/* Remove the record at pos of the page from the indexes of the table */
+static void index_remove_at(tbl_p t, page_p pg, int pos) {
+  int slot = (pos - PAGE_HEADER_SIZE) / t->sch->len;
+  for (index_p ix = t->indexes; ix; ix = ix->next)
+    index_update(ix, pg, pos, slot, 0);
+}
+
+/* Make the index from the records of the table */
+static int build_index(tbl_p t, index_p ix) {
+  remove_index_files(ix); /* of a table of the same name dropped before */
+  int ok = 1;
+  if (ix->kind == HASH_INDEX)
+    ok = hash_init(ix);
+  else if (ix->kind == BTREE_INDEX)
+    ok = btree_init(ix);
+  else {
+    ix->bms = new_bitmaps();
+    ix->bms->dirty = 1;
+  }
+
+  schema_p s = t->sch;
+  int num_blocks = file_num_blocks(s->name);
+  for (int blk_nr = 0; ok && blk_nr < num_blocks; blk_nr++) {
+    page_p pg = get_page(s->name, blk_nr);
+    if (!pg) return 0;
+    for (int pos = PAGE_HEADER_SIZE; ok && pos + s->len <= page_free_pos(pg);
+         pos += s->len)
+      ok = index_update(ix, pg, pos, (pos - PAGE_HEADER_SIZE) / s->len, 1);
+    unpin(pg);
+  }
+  return ok;
+}
+
 const char tables_desc_file[] = "db.db"; /***< File holding table descriptors */
 
+/** File listing the blocks in the buffer when the database was closed,
+    read into the buffer again when it is opened */
+static const char resident_file[] = "__resident.db";
+
+/** Key of the line holding the block size in tables_desc_file.
+    Databases without it are of blocks of @ref MIN_BLOCK_SIZE bytes. */
+static const char block_size_key[] = "#block_size";
+
+/** The table descriptors of an in-memory database, as they would be in
+    tables_desc_file */
+static char *mem_tbl_descs;
+static size_t mem_tbl_descs_len;
+
 static char* concat_names(char const* name1, char const* sep, char const* name2) {
   char *res = malloc((sizeof name1) + (sizeof sep) + (sizeof name2) + 1);
   strcpy(res, name1);
@@ -243,28 +1464,92 @@ static void save_tbl_desc(FILE *fp, tbl_p tbl) {
     fld = fld->next;
   }
   fprintf(fp, "%d\n", tbl->num_records);
+  for (index_p ix = tbl->indexes; ix; ix = ix->next) {
+    int fld_nr = 0;
+    for (fld = sch->first; fld != ix->fld; fld = fld->next)
+      fld_nr++;
+    fprintf(fp, "%s %d\n", ix->kind == HASH_INDEX ? hash_key
+            : ix->kind == BITMAP_INDEX ? bitmap_key : btree_key, fld_nr);
+  }
 }
 
-static void save_tbl_descs() {
-  /* backup the descriptors first in case we need some manual investigation */
-  char *tbl_desc_backup = concat_names("__backup", "_", tables_desc_file);
-  rename(tables_desc_file, tbl_desc_backup);
-  free(tbl_desc_backup);
+/* The current page of the table becomes pg, which is pinned already */
+static void set_current_pg(tbl_p t, page_p pg) {
+  if (t->current_pg)
+    unpin(t->current_pg);
+  t->current_pg = pg;
+}
 
-  FILE *dbfile = fopen(tables_desc_file, "w");
+/* Write the descriptors of all tables, and release the tables */
+static void write_tbl_descs(FILE* dbfile) {
+  fprintf(dbfile, "%s %ld\n", block_size_key, pager_block_size());
   tbl_p tbl = db_tables, next_tbl = 0;
   while (tbl) {
     save_tbl_desc(dbfile, tbl);
+    set_current_pg(tbl, 0);
+    fsm_save(tbl);
+    for (index_p ix = tbl->indexes; ix; ix = ix->next)
+      bitmaps_save(ix);
     release_schema(tbl->sch);
+    release_fsm(tbl);
+    release_indexes(tbl);
+    release_scan_ring(tbl->scan);
     next_tbl = tbl->next;
     free(tbl);
     tbl = next_tbl;
   }
+}
+
+static void save_tbl_descs() {
+  if (pager_in_memory()) {
+    free(mem_tbl_descs);
+    FILE *dbfile = open_memstream(&mem_tbl_descs, &mem_tbl_descs_len);
+    write_tbl_descs(dbfile);
+    fclose(dbfile);
+    return;
+  }
+
+  /* backup the descriptors first in case we need some manual investigation */
+  char *tbl_desc_backup = concat_names("__backup", "_", tables_desc_file);
+  unlink(tbl_desc_backup);
+  link(tables_desc_file, tbl_desc_backup);
+  free(tbl_desc_backup);
+
+  /* the descriptors replace the old ones at once when they are all
+     written, so that a crash leaves either of them */
+  char *new_desc_file = concat_names(tables_desc_file, ".", "new");
+  FILE *dbfile = fopen(new_desc_file, "w");
+  write_tbl_descs(dbfile);
+  fflush(dbfile);
+  if (pager_durability() != DURABILITY_OFF)
+    fdatasync(fileno(dbfile));
   fclose(dbfile);
+  rename(new_desc_file, tables_desc_file);
+  free(new_desc_file);
+}
+
+/* The table descriptors for reading, NULL if there are none */
+static FILE* open_tbl_descs(void) {
+  if (pager_in_memory())
+    return mem_tbl_descs ? fmemopen(mem_tbl_descs, mem_tbl_descs_len, "r") : 0;
+  return fopen(tables_desc_file, "r");
+}
+
+/* The block size of the database, 0 if there is no database yet */
+static long read_db_block_size() {
+  FILE *fp = open_tbl_descs();
+  if (!fp) return 0;
+  char key[30] = "";
+  long size = MIN_BLOCK_SIZE;
+  if (fscanf(fp, "%29s %ld", key, &size) < 2
+      || strcmp(key, block_size_key) != 0)
+    size = MIN_BLOCK_SIZE;
+  fclose(fp);
+  return size;
 }
 
 static void read_tbl_descs() {
-  FILE *fp = fopen(tables_desc_file, "r");
+  FILE *fp = open_tbl_descs();
   if (!fp) return;
   char name[30] = "";
   schema_p sch = NULL;
@@ -275,6 +1560,19 @@ static void read_tbl_descs() {
       fclose(fp);
       return;
     }
+    if (strcmp(name, block_size_key) == 0)
+      continue;
+    if (strcmp(name, btree_key) == 0 || strcmp(name, hash_key) == 0
+        || strcmp(name, bitmap_key) == 0) {
+      /* an index on field num_flds of the table just read */
+      for (fld = sch ? sch->first : 0; fld && num_flds > 0; fld = fld->next)
+        num_flds--;
+      if (fld)
+        add_index(sch->tbl, fld, strcmp(name, hash_key) == 0 ? HASH_INDEX
+                  : strcmp(name, bitmap_key) == 0 ? BITMAP_INDEX
+                  : BTREE_INDEX);
+      continue;
+    }
     sch = new_schema(name);
     for (size_t i = 0; i < num_flds; i++) {
       fscanf(fp, "%s %d %d", name, &(fld_type), &(fld_len));
@@ -291,18 +1589,30 @@ static void read_tbl_descs() {
     }
     fscanf(fp, "%d\n", &(sch->tbl->num_records));
   }
-  db_tables = sch->tbl;
+  db_tables = sch ? sch->tbl : 0;
   fclose(fp);
 }
 
 int open_db(void) {
   pager_terminate(); /* first clean up for a fresh start */
-  pager_init();
+  /* an existing database keeps its block size */
+  long size = read_db_block_size();
+  if (size > 0 && !pager_set_block_size(size)) {
+    put_msg(ERROR, "open_db: invalid block size %ld in %s.\n",
+            size, tables_desc_file);
+    return 0;
+  }
+  if (!pager_init(0, REPL_SAME))
+    return 0;
   read_tbl_descs();
+  if (!pager_in_memory())
+    pager_preload(resident_file);
   return 1;
 }
 
 void close_db(void) {
+  if (!pager_in_memory())
+    pager_save_resident(resident_file);
   save_tbl_descs();
   db_tables = 0;
   pager_terminate();
@@ -314,6 +1624,14 @@ schema_p new_schema(char const* name) {
   tbl->sch->tbl = tbl;
   tbl->num_records = 0;
   tbl->current_pg = 0;
+  tbl->scan = 0;
+  tbl->fsm_name = 0;
+  tbl->fsm_blocks = -1;
+  tbl->fsm_recorded = 0;
+  tbl->room = 0;
+  tbl->num_room = 0;
+  tbl->room_cap = 0;
+  tbl->indexes = 0;
   tbl->next = db_tables;
   db_tables = tbl;
   return tbl->sch;
@@ -326,6 +1644,10 @@ tbl_p get_table(char const* name) {
   return 0;
 }
 
+schema_p table_schema(tbl_p t) {
+  return t ? t->sch : 0;
+}
+
 schema_p get_schema(char const* name) {
   tbl_p tbl = get_table(name);
   if (tbl) return tbl->sch;
@@ -344,9 +1666,15 @@ void remove_table(tbl_p t) {
       else
         prev->next = t->next;
 
-      close_file(t->sch->name);
+      set_current_pg(t, 0);
+      release_scan_ring(t->scan);
+      file_remove(fsm_file_name(t)); /* can be made again from the table */
+      release_fsm(t);
+      for (index_p ix = t->indexes; ix; ix = ix->next)
+        remove_index_files(ix); /* can be made again from the table */
+      release_indexes(t);
       char *tbl_backup = concat_names("_", "_", t->sch->name);
-      rename(t->sch->name, tbl_backup);
+      file_rename(t->sch->name, tbl_backup);
       free(tbl_backup);
       release_schema(t->sch);
       free(t);
@@ -354,6 +1682,11 @@ void remove_table(tbl_p t) {
     }
 }
 
+int set_tbl_log_structured(tbl_p t) {
+  set_current_pg(t, 0);
+  return file_set_log_structured(t->sch->name);
+}
+
 void remove_schema(schema_p s) {
   if (s) remove_table(s->tbl);
 }
@@ -382,6 +1715,47 @@ static field_desc_p get_field(schema_p s, char const* name) {
   return 0;
 }
 
+/* Make an index of the kind on the field attr of the table */
+static int make_index(tbl_p t, char const* attr, index_kind kind) {
+  if (!t) {
+    put_msg(ERROR, "create_index: NULL table.\n");
+    return 0;
+  }
+  field_desc_p f = get_field(t->sch, attr);
+  if (!f) {
+    put_msg(ERROR, "\"%s\" has no field \"%s\".\n", t->sch->name, attr);
+    return 0;
+  }
+  if (kind != HASH_INDEX && !is_int_field(f)) {
+    put_msg(ERROR, "\"%s\" is not an integer field.\n", attr);
+    return 0;
+  }
+  if (get_index(t, f, kind))
+    return 1;
+  set_current_pg(t, 0);
+  index_p ix = add_index(t, f, kind);
+  if (!build_index(t, ix)) {
+    put_msg(ERROR, "create_index: cannot make the index on \"%s\".\n", attr);
+    t->indexes = ix->next;
+    remove_index_files(ix);
+    release_index(ix);
+    return 0;
+  }
+  return 1;
+}
+
+int create_index(tbl_p t, char const* attr) {
+  return make_index(t, attr, BTREE_INDEX);
+}
+
+int create_hash_index(tbl_p t, char const* attr) {
+  return make_index(t, attr, HASH_INDEX);
+}
+
+int create_bitmap_index(tbl_p t, char const* attr) {
+  return make_index(t, attr, BITMAP_INDEX);
+}
+
 static char* tmp_schema_name(char const* op_name, char const* name) {
   //char *res = malloc((sizeof op_name) + (sizeof name) + 10);
   char *res = malloc((strlen(op_name)) + (strlen(name)) + 10);
@@ -417,10 +1791,10 @@ static schema_p make_sub_schema(schema_p s, int num_fields, char *fields[]) {
 
 int add_field(schema_p s, field_desc_p f) {
   if (!s) return 0;
-  if (s->len + f->len > BLOCK_SIZE - PAGE_HEADER_SIZE) {
+  if (s->len + f->len > pager_block_size() - PAGE_HEADER_SIZE) {
     put_msg(ERROR,
-            "schema already has %d bytes, adding %d will exceed limited %d bytes.\n",
-            s->len, f->len, BLOCK_SIZE - PAGE_HEADER_SIZE);
+            "schema already has %d bytes, adding %d will exceed limited %ld bytes.\n",
+            s->len, f->len, pager_block_size() - PAGE_HEADER_SIZE);
     return 0;
   }
   if (s->num_fields == 0) {
@@ -531,17 +1905,21 @@ void set_tbl_position(tbl_p t, tbl_position pos) {
   switch (pos) {
   case TBL_BEG:
     {
-      t->current_pg = get_page(t->sch->name, 0);
+      /* the scans of a large table recycle a few pages of its own */
+      if (!t->scan)
+        t->scan = new_scan_ring();
+      set_current_pg(t, get_page_in_ring(t->scan, t->sch->name, 0));
       page_set_pos_begin(t-> current_pg);
     }
     break;
   case TBL_END:
-    t->current_pg = get_page_for_append(t->sch->name);
+    set_current_pg(t, get_page_for_append(t->sch->name));
   }
 }
 
 int eot(tbl_p t) {
-  return (peof(t->current_pg));
+  /* no current page if the buffer had none to spare */
+  return !t->current_pg || peof(t->current_pg);
 }
 
 /** check if the the current position is valid */
@@ -558,17 +1936,16 @@ static int page_valid_pos_for_put_with_schema(page_p p, schema_p s) {
 
 static page_p get_page_for_next_record(schema_p s) {
   page_p pg = s->tbl->current_pg;
-  if (peof(pg)) return 0;
+  if (!pg || peof(pg)) return 0;
   if (eop(pg)) {
-    unpin(pg);
-    pg = get_next_page(pg);
+    pg = get_next_page_in_ring(s->tbl->scan, pg);
     if (!pg) {
-      put_msg(FATAL, "get_page_for_next_record failed at block %d\n",
-              page_block_nr(pg) + 1);
-      exit(EXIT_FAILURE);
+      put_msg(ERROR, "get_page_for_next_record failed at block %d\n",
+              page_block_nr(s->tbl->current_pg) + 1);
+      return 0;
     }
     page_set_pos_begin(pg);
-    s->tbl->current_pg = pg;
+    set_current_pg(s->tbl, pg);
   }
   return pg;
 }
@@ -584,97 +1961,220 @@ static int get_page_record(page_p p, record r, schema_p s) {
   for (fld_desc = s->first; fld_desc;
        fld_desc = fld_desc->next, i++)
     if (is_int_field(fld_desc))
-      assign_int_field(r[i], field_desc_p(p));
+      assign_int_field(r[i], page_get_int(p));
     else
       page_get_str(p, r[i], fld_desc->len);
   return 1;
 }
 
+/* Get the record at position pos of the page, leaving the current
+   position of the page alone, so that readers can share the page */
+static int get_page_record_at(page_p p, int pos, record r, schema_p s) {
+  if (!p) return 0;
+  if (!page_valid_pos_for_get(p, pos)
+      || (pos - PAGE_HEADER_SIZE) % s->len != 0) {
+    put_msg(ERROR, "try to get record at invalid position %d.\n", pos);
+    return 0;
+  }
+  field_desc_p fld_desc;
+  size_t i = 0;
+  for (fld_desc = s->first; fld_desc;
+       fld_desc = fld_desc->next, i++)
+    if (is_int_field(fld_desc))
+      assign_int_field(r[i], page_get_int_at(p, pos + fld_desc->offset));
+    else
+      page_get_str_at(p, pos + fld_desc->offset, r[i], fld_desc->len);
+  return 1;
+}
+
 int get_record(record r, schema_p s) {
   page_p pg = get_page_for_next_record(s);
   return pg ? get_page_record(pg, r, s) : 0;
 }
 
+/* forward declaration */
+static int put_page_record(page_p p, record r, schema_p s);
 
+cursor_p open_cursor(tbl_p t) {
+  if (!t) {
+    put_msg(ERROR, "open_cursor: NULL table.\n");
+    return 0;
+  }
+  cursor_p c = malloc(sizeof (cursor_struct));
+  if (!c) {
+    put_msg(ERROR, "open_cursor: no memory for a cursor.\n");
+    return 0;
+  }
+  page_p pg = get_page(t->sch->name, 0);
+  if (!pg) {
+    free(c);
+    return 0;
+  }
+  c->tbl = t;
+  c->pg = pg;
+  c->pos = PAGE_HEADER_SIZE;
+  c->got = 0;
+  return c;
+}
+
+/* Move the cursor to the next page if it is at the end of its page.
+   Returns 0 at the end of the table. */
+static int cursor_to_record(cursor_p c) {
+  char const* name = c->tbl->sch->name;
+  if (!c->pg) return -1;
+  while (c->pos >= page_free_pos(c->pg)) {
+    int blk_nr = page_block_nr(c->pg) + 1;
+    if (blk_nr >= file_num_blocks(name))
+      return 0;
+    unpin(c->pg);
+    c->pg = get_page(name, blk_nr);
+    if (!c->pg) return -1;
+    c->pos = PAGE_HEADER_SIZE;
+  }
+  return 1;
+}
 
+int cursor_next(cursor_p c, record r) {
+  if (!c) return -1;
+  c->got = 0;
+  int res = cursor_to_record(c);
+  if (res <= 0) return res;
 
-
-
-//DID THIS
-static int int_equal(int x, int y) {
-  return x == y;
-}
-static int int_greatequal(int x, int y)
-{
-    return x >= y;
-}
-static int int_lessequal(int x, int y)
-{
-    return x <= y;
-}
-static int int_unequal(int x, int y)
-{
-    return x != y;
+  /* the current position of the page belongs to the table */
+  schema_p s = c->tbl->sch;
+  page_latch_shared(c->pg);
+  get_page_record_at(c->pg, c->pos, r, s);
+  page_unlatch(c->pg);
+  c->pos += s->len;
+  c->got = 1;
+  return 1;
 }
 
+void cursor_rewind(cursor_p c) {
+  if (!c) return;
+  if (!c->pg || page_block_nr(c->pg) != 0) {
+    if (c->pg) unpin(c->pg);
+    c->pg = get_page(c->tbl->sch->name, 0);
+  }
+  c->pos = PAGE_HEADER_SIZE;
+  c->got = 0;
+}
 
-/* We restrict ourselves to equality search on an int attribute */
-tbl_p table_search(tbl_p t, char const* attr, char const* op, int val) {
-  if (!t) return 0;
-
-  int (*cmp_op)() = 0;
-
-  //Equal
-  if (strcmp(op, "=") == 0) //Return 0 for equal
-    cmp_op = int_equal;
-  //Less
-  if (strcmp(op, "<=") == 1)
-    cmp_op = int_lessequal;
-  //Greater
-  if (strcmp(op, ">=") == 1)
-    cmp_op = int_greatequal;
-  //Unequal
-  if (strcmp(op, "!=") == 1)
-    cmp_op = int_unequal;
-
-  if (!cmp_op) {
-    put_msg(ERROR, "unknown comparison operator \"%s\".\n", op);
+int cursor_delete(cursor_p c) {
+  if (!(c && c->got)) {
+    put_msg(ERROR, "cursor_delete: no record to delete.\n");
     return 0;
   }
+  tbl_p t = c->tbl;
+  schema_p s = t->sch;
+  page_p pg = c->pg;
+  int pos = c->pos - s->len;
+  int last_pos = page_free_pos(pg) - s->len;
+  fsm_load(t);
+  index_remove_at(t, pg, pos);
+  if (pos < last_pos)
+    index_remove_at(t, pg, last_pos); /* it gets the slot of the hole */
+
+  /* the last record of the page fills the hole */
+  page_latch_exclusive(pg);
+  int cur_pos = page_current_pos(pg);
+  int old_free = pager_block_size() - page_free_pos(pg);
+  if (pos < last_pos) {
+    record r = new_record(s);
+    get_page_record_at(pg, last_pos, r, s);
+    page_set_current_pos(pg, pos);
+    put_page_record(pg, r, s);
+    release_record(r, s);
+  }
+  page_set_current_pos(pg, cur_pos);
+  page_truncate(pg, last_pos);
+  page_unlatch(pg);
+  if (pos < last_pos)
+    index_add_at(t, pg, pos);
+
+  fsm_emptied(t, pg, old_free);
+  t->num_records--;
+  c->pos = pos;
+  c->got = 0;
+  return 1;
 }
 
+void close_cursor(cursor_p c) {
+  if (!c) return;
+  if (c->pg) unpin(c->pg);
+  free(c);
+}
 
+static int int_equal(int x, int y) {
+  return x == y;
+}
 
+static int int_lessequal(int x, int y) {
+  return x <= y;
+}
 
+static int int_greatequal(int x, int y) {
+  return x >= y;
+}
 
+static int int_unequal(int x, int y) {
+  return x != y;
+}
 
+typedef int (*int_cmp) (int, int);
 
+/* The comparison of the operator, NULL if there is none */
+static int_cmp cmp_op_of(char const* op) {
+  if (strcmp(op, "=") == 0)
+    return int_equal;
+  if (strcmp(op, "<=") == 0)
+    return int_lessequal;
+  if (strcmp(op, ">=") == 0)
+    return int_greatequal;
+  if (strcmp(op, "!=") == 0)
+    return int_unequal;
+  put_msg(ERROR, "unknown comparison operator \"%s\".\n", op);
+  return 0;
+}
 
+/* The int field attr of the schema, and its number in fld_nr */
+static field_desc_p int_field_of(schema_p s, char const* attr,
+                                 size_t* fld_nr) {
+  field_desc_p f;
+  size_t i = 0;
+  for (f = s->first; f; f = f->next, i++)
+    if (strcmp(f->name, attr) == 0) {
+      if (f->type != INT_TYPE) {
+        put_msg(ERROR, "\"%s\" is not an integer field.\n", attr);
+        return 0;
+      }
+      *fld_nr = i;
+      return f;
+    }
+  put_msg(ERROR, "\"%s\" has no field \"%s\".\n", s->name, attr);
+  return 0;
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-//My binary search
-binary_searcher(page_p p, record r, schema_p s)
-{
-  field_desc_p field; //field is a colone in the table. 
-  block_p block = get_mid_block(p); 
-  page_get_int_at(p, PAGE_HEADER_SIZE);//
-
-  
-
-  
-
+/* The bitmap of the records whose values meet (*op) (value, val) */
+static wah bitmap_select(index_p ix, int (*op) (int, int), int val) {
+  bitmaps_p bms = index_bitmaps(ix);
+  wah res = { 0, 0, 0, 0 };
+  if (op == int_unequal) {
+    /* the records, but those of val */
+    wah *eq = bitmap_of(bms, val, 0);
+    for (int i = 0; i < bms->num; i++)
+      wah_apply(&res, bms->bms + i, WAH_OR);
+    if (eq) {
+      wah not_eq = wah_not(eq, res.groups);
+      wah_apply(&res, &not_eq, WAH_AND);
+      free(not_eq.w);
+    }
+    return res;
+  }
+  for (int i = 0; i < bms->num; i++)
+    if ((*op) (bms->vals[i], val))
+      wah_apply(&res, bms->bms + i, WAH_OR);
+  return res;
 }
 
 //Does Linear Search
@@ -686,7 +2186,7 @@ static int find_record_int_val(record r, schema_p s, int offset,
   for (; pg; pg = get_page_for_next_record(s)) { //loop to next record
     pos = page_current_pos(pg); //pos is current
     rec_val = page_get_int_at (pg, pos + offset); //rec_val is page int??
-    if ((*op) (val, rec_val)) { 
+    if ((*op) (rec_val, val)) { 
       page_set_current_pos(pg, pos); //set next positin to current
       get_page_record(pg, r, s); //get page record
       return 1;
@@ -697,6 +2197,192 @@ static int find_record_int_val(record r, schema_p s, int offset,
   return 0;
 }
 
+/* Get the record at the slot of block blk_nr of t into rec. *pg is the
+   page of the record got before, or NULL. It stays pinned for the next
+   record, to be unpinned by the caller. Returns 0 if there is no such
+   record, which happens only with a stale index. */
+static int get_record_at(tbl_p t, page_p* pg, int blk_nr, int slot,
+                         record rec) {
+  schema_p s = t->sch;
+  int pos = PAGE_HEADER_SIZE + slot * s->len;
+  if (!*pg || page_block_nr(*pg) != blk_nr) {
+    if (*pg) unpin(*pg);
+    *pg = get_page(s->name, blk_nr);
+    if (!*pg) return 0;
+  }
+  if (pos + s->len > page_free_pos(*pg))
+    return 0;
+  return get_page_record_at(*pg, pos, rec, s);
+}
+
+/* Append the records of t at the locations found with an index to the
+   result table, in the order of the locations so that each page is read
+   once. The records are checked again, against a stale index. */
+static void append_records_at(tbl_p t, rec_locs* ls, schema_p res_sch,
+                              int fld_nr, int (*op) (int, int), int val) {
+  schema_p s = t->sch;
+  record rec = new_record(s);
+  page_p pg = 0;
+  qsort(ls->locs, ls->num, 2 * sizeof (int), loc_cmp);
+  for (int i = 0; i < ls->num; i++)
+    if (get_record_at(t, &pg, ls->locs[2 * i], ls->locs[2 * i + 1], rec)
+        && (*op) (*(int *)rec[fld_nr], val)) {
+      put_record_info(DEBUG, rec, s);
+      append_record(rec, res_sch);
+    }
+  if (pg) unpin(pg);
+  release_record(rec, s);
+}
+
+/** @brief Condition of a search */
+typedef struct {
+  field_desc_p fld;  /**< int field of the records. */
+  size_t fld_nr;     /**< number of the field in the schema. */
+  int_cmp op;        /**< comparison of the field with val. */
+  int val;           /**< value compared with. */
+} search_cond;
+
+/* Whether the record meets all (or any) of the conditions */
+static int record_meets(record r, search_cond const* conds, int num,
+                        int any) {
+  for (int i = 0; i < num; i++)
+    if ((*conds[i].op) (*(int *)r[conds[i].fld_nr], conds[i].val) == any)
+      return any;
+  return !any;
+}
+
+/* Append the records of t that meet all (or any) of the conditions to
+   the result table. The bitmap indexes of the fields of the conditions
+   give the positions of the records to read. Without a bitmap index for
+   each of them, the positions of any still need a scan, the positions
+   of all only a check of the records. */
+static void search_where(tbl_p t, search_cond const* conds, int num, int any,
+                         schema_p res_sch) {
+  schema_p s = t->sch;
+  wah bm = { 0, 0, 0, 0 };
+  int have = 0, complete = 1;
+  for (int i = 0; i < num; i++) {
+    index_p ix = get_index(t, conds[i].fld, BITMAP_INDEX);
+    if (!ix) {
+      complete = 0;
+      continue;
+    }
+    wah c = bitmap_select(ix, conds[i].op, conds[i].val);
+    if (have) {
+      wah_apply(&bm, &c, any ? WAH_OR : WAH_AND);
+      free(c.w);
+    } else {
+      bm = c;
+      have = 1;
+    }
+  }
+
+  record rec = new_record(s);
+  if (have && (complete || !any)) {
+    rec_locs ls = { 0, 0, 0 };
+    page_p pg = 0;
+    wah_locs(&bm, records_per_block(s), &ls);
+    for (int i = 0; i < ls.num; i++)
+      if (get_record_at(t, &pg, ls.locs[2 * i], ls.locs[2 * i + 1], rec)
+          && record_meets(rec, conds, num, any)) {
+        put_record_info(DEBUG, rec, s);
+        append_record(rec, res_sch);
+      }
+    if (pg) unpin(pg);
+    free(ls.locs);
+  } else {
+    set_tbl_position(t, TBL_BEG);
+    while (get_record(rec, s))
+      if (record_meets(rec, conds, num, any)) {
+        put_record_info(DEBUG, rec, s);
+        append_record(rec, res_sch);
+      }
+  }
+  release_record(rec, s);
+  free(bm.w);
+}
+
+tbl_p table_search_where(tbl_p t, int num, char const* attrs[],
+                         char const* ops[], int const vals[], int any) {
+  if (!t || num <= 0) return 0;
+
+  search_cond *conds = malloc(num * sizeof (search_cond));
+  for (int i = 0; i < num; i++) {
+    conds[i].op = cmp_op_of(ops[i]);
+    conds[i].fld = int_field_of(t->sch, attrs[i], &conds[i].fld_nr);
+    conds[i].val = vals[i];
+    if (!(conds[i].op && conds[i].fld)) {
+      free(conds);
+      return 0;
+    }
+  }
+
+  char *tmp_name = tmp_schema_name("select", t->sch->name);
+  schema_p res_sch = copy_schema(t->sch, tmp_name);
+  free(tmp_name);
+  search_where(t, conds, num, any, res_sch);
+  free(conds);
+  return res_sch->tbl;
+}
+
+/* We restrict ourselves to comparisons with an int attribute */
+tbl_p table_search(tbl_p t, char const* attr, char const* op, int val) {
+  if (!t) return 0;
+
+  int_cmp cmp_op = cmp_op_of(op);
+  if (!cmp_op) return 0;
+
+  schema_p s = t->sch;
+  size_t i = 0;
+  field_desc_p f = int_field_of(s, attr, &i);
+  if (!f) return 0;
+
+  char *tmp_name = tmp_schema_name("select", s->name);
+  schema_p res_sch = copy_schema(s, tmp_name);
+  free(tmp_name);
+
+  /* a hash index answers only equality, in fewer block reads */
+  index_p hx = cmp_op == int_equal ? get_index(t, f, HASH_INDEX) : 0;
+  index_p ix = get_index(t, f, BTREE_INDEX);
+  if (hx || ix) {
+    rec_locs ls = { 0, 0, 0 };
+    if (hx)
+      hash_lookup(hx, (char const*) &val, &ls);
+    else if (cmp_op == int_equal)
+      btree_range(ix, val, val, &ls);
+    else if (cmp_op == int_lessequal)
+      btree_range(ix, INT_MIN, val, &ls);
+    else if (cmp_op == int_greatequal)
+      btree_range(ix, val, INT_MAX, &ls);
+    else {
+      if (val > INT_MIN)
+        btree_range(ix, INT_MIN, val - 1, &ls);
+      if (val < INT_MAX)
+        btree_range(ix, val + 1, INT_MAX, &ls);
+    }
+    append_records_at(t, &ls, res_sch, i, cmp_op, val);
+    free(ls.locs);
+    return res_sch->tbl;
+  }
+  if (get_index(t, f, BITMAP_INDEX)) {
+    search_cond cond = { f, i, cmp_op, val };
+    search_where(t, &cond, 1, 0, res_sch);
+    return res_sch->tbl;
+  }
+
+  record rec = new_record(s);
+
+  set_tbl_position(t, TBL_BEG);
+  while (find_record_int_val(rec, s, f->offset, cmp_op, val)) {
+    put_record_info(DEBUG, rec, s);
+    append_record(rec, res_sch);
+  }
+
+  release_record(rec, s);
+
+  return res_sch->tbl;
+}
+
 static int put_page_record(page_p p, record r, schema_p s) {
   if (!page_valid_pos_for_put_with_schema(p, s))
     return 0;
@@ -715,8 +2401,11 @@ static int put_page_record(page_p p, record r, schema_p s) {
 int put_record(record r, schema_p s) {
   page_p p = s->tbl->current_pg;
 
-  if (!page_valid_pos_for_put_with_schema(p, s))
+  if (!p || !page_valid_pos_for_put_with_schema(p, s))
     return 0;
+  int pos = page_current_pos(p);
+  if (pos < page_free_pos(p))
+    index_remove_at(s->tbl, p, pos); /* the record is overwritten */
 
   field_desc_p fld_desc;
   size_t i = 0;
@@ -726,33 +2415,35 @@ int put_record(record r, schema_p s) {
       page_put_int(p, *(int *)r[i]);
     else
       page_put_str(p, (char *)r[i], fld_desc->len);
+  index_add_at(s->tbl, p, pos);
   return 1;
 }
 
 void append_record(record r, schema_p s) {
   tbl_p tbl = s->tbl;
-  page_p pg = get_page_for_append(s->name);
-  if (!pg) {
-    put_msg(FATAL, "Failed to get page for appending to \"%s\".\n",
-            s->name);
-    exit(EXIT_FAILURE);
-  }
-  if (!put_page_record(pg, r, s)) {
-    /* not enough space in the current page */
-    unpin(pg);
-    pg = get_next_page(pg);
+  for (;;) {
+    int blk_nr = fsm_block_with_room(tbl);
+    if (tbl->current_pg && page_block_nr(tbl->current_pg) != blk_nr)
+      set_current_pg(tbl, 0); /* keep few pages pinned */
+    page_p pg = get_page(s->name, blk_nr);
     if (!pg) {
-      put_msg(FATAL, "Failed to get page for \"%s\" block %d.\n",
-              s->name, page_block_nr(pg) + 1);
-      exit(EXIT_FAILURE);
+      put_msg(ERROR, "Failed to get page for \"%s\" block %d.\n",
+              s->name, blk_nr);
+      return;
     }
-    if (!put_page_record(pg, r, s)) {
-      put_msg(FATAL, "Failed to put record to page for \"%s\" block %d.\n",
-              s->name, page_block_nr(pg) + 1);
-      exit(EXIT_FAILURE);
+    int pos = page_free_pos(pg);
+    page_set_current_pos(pg, pos);
+    int put = put_page_record(pg, r, s);
+    int free_bytes = pager_block_size() - page_free_pos(pg);
+    if (free_bytes < s->len)
+      fsm_lost_room(tbl, blk_nr, free_bytes);
+    if (put) {
+      index_add_at(tbl, pg, pos);
+      set_current_pg(tbl, pg);
+      break;
     }
+    unpin(pg); /* the free-space map was out of date */
   }
-  tbl->current_pg = pg;
   tbl->num_records++;
 }
 
@@ -801,36 +2492,6 @@ void table_display(tbl_p t) {
 }
 
 
-  schema_p s = t->sch;
-  field_desc_p f;
-  size_t i = 0;
-  for (f = s->first; f; f = f->next, i++)
-    if (strcmp(f->name, attr) == 0) {
-      if (f->type != INT_TYPE) {
-        put_msg(ERROR, "\"%s\" is not an integer field.\n", attr);
-        return 0;
-      }
-      break;
-    }
-  if (!f) return 0;
-
-  char *tmp_name = tmp_schema_name("select", s->name);
-  schema_p res_sch = copy_schema(s, tmp_name);
-  free(tmp_name);
-
-  record rec = new_record(s);
-
-  set_tbl_position(t, TBL_BEG);
-  while (find_record_int_val(rec, s, f->offset, cmp_op, val)) {
-    put_record_info(DEBUG, rec, s);
-    append_record(rec, res_sch);
-  }
-
-  release_record(rec, s);
-
-  return res_sch->tbl;
-}
-
 tbl_p table_project(tbl_p t, int num_fields, char* fields[]) {
   schema_p s = t->sch;
   schema_p dest = make_sub_schema(s, num_fields, fields);
@@ -851,15 +2512,163 @@ tbl_p table_project(tbl_p t, int num_fields, char* fields[]) {
   return dest->tbl;
 }
 
+/* Schema of the natural join of l and r: the fields of l followed by
+   the fields of r that l does not have. */
+static schema_p make_join_schema(schema_p l, schema_p r) {
+  for (field_desc_p f = r->first; f; f = f->next) {
+    field_desc_p lf = get_field(l, f->name);
+    if (lf && (lf->type != f->type || lf->len != f->len)) {
+      put_msg(ERROR, "\"%s\" is of different types in \"%s\" and \"%s\".\n",
+              f->name, l->name, r->name);
+      return 0;
+    }
+  }
+
+  char *tmp_name = tmp_schema_name("join", l->name);
+  schema_p res = copy_schema(l, tmp_name);
+  free(tmp_name);
+  for (field_desc_p f = r->first; f; f = f->next)
+    if (!get_field(l, f->name) && !add_field(res, dup_field(f))) {
+      remove_schema(res);
+      return 0;
+    }
+  return res;
+}
+
+/* Whether lr and rr have equal values in the fields they both have */
+static int join_match(record lr, schema_p l, record rr, schema_p r) {
+  field_desc_p lf, rf;
+  size_t i, j;
+  for (rf = r->first, j = 0; rf; rf = rf->next, j++)
+    for (lf = l->first, i = 0; lf; lf = lf->next, i++)
+      if (strcmp(lf->name, rf->name) == 0) {
+        if (is_int_field(lf) ? *(int *)lr[i] != *(int *)rr[j]
+            : strcmp((char *)lr[i], (char *)rr[j]) != 0)
+          return 0;
+        break;
+      }
+  return 1;
+}
+
+/* Fill the joined record of lr and rr */
+static void fill_join_record(record dest_r, schema_p dest_s,
+                             record lr, schema_p l, record rr, schema_p r) {
+  field_desc_p f, src_f;
+  size_t i = 0, j;
+  for (f = dest_s->first; f; f = f->next, i++) {
+    void *val;
+    if (i < l->num_fields)
+      val = lr[i];
+    else {
+      for (j = 0, src_f = r->first;
+           strcmp(src_f->name, f->name) != 0;
+           j++, src_f = src_f->next)
+        ;
+      val = rr[j];
+    }
+    if (is_int_field(f))
+      assign_int_field(dest_r[i], *(int *)val);
+    else
+      assign_str_field(dest_r[i], (char *)val);
+  }
+}
+
+/* Join lr with the records of right that the hash index finds with the
+   value of field li of lr */
+static void join_probe(record lr, schema_p l, size_t li, tbl_p right,
+                       index_p ix, record rr, record dest_r, schema_p dest) {
+  schema_p r = right->sch;
+  char *key = malloc(ix->fld->len);
+  rec_locs ls = { 0, 0, 0 };
+  page_p pg = 0;
+  key_of_value(ix->fld, lr[li], key);
+  hash_lookup(ix, key, &ls);
+  qsort(ls.locs, ls.num, 2 * sizeof (int), loc_cmp);
+  for (int i = 0; i < ls.num; i++)
+    if (get_record_at(right, &pg, ls.locs[2 * i], ls.locs[2 * i + 1], rr)
+        && join_match(lr, l, rr, r)) {
+      fill_join_record(dest_r, dest, lr, l, rr, r);
+      put_record_info(DEBUG, dest_r, dest);
+      append_record(dest_r, dest);
+    }
+  if (pg) unpin(pg);
+  free(ls.locs);
+  free(key);
+}
+
+/* Read up to max records of the cursor into rs. Returns the number
+   of records read, 0 at the end of the table. */
+static int cursor_next_batch(cursor_p c, record* rs, int max) {
+  int n = 0;
+  while (n < max && cursor_next(c, rs[n]) > 0)
+    n++;
+  return n;
+}
+
 tbl_p table_natural_join(tbl_p left, tbl_p right) {
   if (!(left && right)) {
     put_msg(ERROR, "no table found!\n");
     return 0;
   }
 
-  tbl_p res = 0;
+  schema_p l = left->sch, r = right->sch;
+  schema_p dest = make_join_schema(l, r);
+  if (!dest) return 0;
 
-  /* TODO: assignment 3 */
+  /* a hash index of right on a field of both finds the matching records
+     instead of a scan of right for each batch of records of left */
+  index_p ix = 0;
+  size_t li = 0;
+  for (field_desc_p rf = r->first; rf && !ix; rf = rf->next) {
+    field_desc_p lf = l->first;
+    for (li = 0; lf && strcmp(lf->name, rf->name) != 0; lf = lf->next)
+      li++;
+    if (lf)
+      ix = get_index(right, rf, HASH_INDEX);
+  }
 
-  return res;
+  /* block nested loops, with a cursor each, so a table can be joined with
+     itself: the records of left are taken in batches of as many blocks
+     as half the buffer, and right is read once for each batch. Probing
+     the index needs no cursor of right, which would keep a page pinned. */
+  cursor_p outer = open_cursor(left), inner = ix ? 0 : open_cursor(right);
+  if (!(outer && (ix || inner))) {
+    close_cursor(outer);
+    close_cursor(inner);
+    remove_schema(dest);
+    return 0;
+  }
+
+  int batch = records_per_block(l)
+    * (pager_num_pages() > 2 ? pager_num_pages() / 2 : 1);
+  record *lrs = malloc(batch * sizeof (record));
+  for (int i = 0; i < batch; i++)
+    lrs[i] = new_record(l);
+  record rr = new_record(r), dest_r = new_record(dest);
+  int n;
+  while ((n = cursor_next_batch(outer, lrs, batch)) > 0) {
+    if (ix)
+      for (int i = 0; i < n; i++)
+        join_probe(lrs[i], l, li, right, ix, rr, dest_r, dest);
+    else {
+      cursor_rewind(inner);
+      while (cursor_next(inner, rr) > 0)
+        for (int i = 0; i < n; i++)
+          if (join_match(lrs[i], l, rr, r)) {
+            fill_join_record(dest_r, dest, lrs[i], l, rr, r);
+            put_record_info(DEBUG, dest_r, dest);
+            append_record(dest_r, dest);
+          }
+    }
+  }
+
+  close_cursor(outer);
+  close_cursor(inner);
+  for (int i = 0; i < batch; i++)
+    release_record(lrs[i], l);
+  free(lrs);
+  release_record(rr, r);
+  release_record(dest_r, dest);
+
+  return dest->tbl;
 }
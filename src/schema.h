@@ -36,6 +36,14 @@
  * "equal_record()".  Access the record at the current position of a
  * page with @ref get_record "get_record()" and @ref put_record
  * "put_record()".
+ *
+ * A table has one current position, shared by all users of the table.
+ * To scan a table independently of other scans of the same table,
+ * such as in a self-join, use a @em cursor: open it with @ref open_cursor
+ * "open_cursor()", get the records one by one with @ref cursor_next
+ * "cursor_next()" and close it with @ref close_cursor "close_cursor()".
+ * Any number of cursors can be open on a table. Each keeps the page it is
+ * at pinned, so the page stays in the buffer while the cursor uses it.
  */
 
 #ifndef _SCHEMA_H_
@@ -52,6 +60,7 @@ typedef enum {TBL_BEG, TBL_END} tbl_position;
 typedef struct field_desc_struct * field_desc_p;
 typedef struct schema_struct * schema_p;
 typedef struct tbl_desc_struct * tbl_p;
+typedef struct cursor_struct * cursor_p;
 
 /** @brief Data record
 
@@ -81,17 +90,6 @@ extern int open_db(void);
 /** Close a database */
 extern void close_db(void);
 
-
-
-
-
-extern void pos_mid_block_of_page(page_p p);
-
-
-
-
-
-
 /** Make a new schema and add it to the current database */
 extern schema_p new_schema(char const* name);
 /** Return an existing schema, NULL if the named schema does not exist. */
@@ -158,22 +156,79 @@ extern int get_record(record const r, schema_p s);
     Returns -1 if there is not enough space at current position.
 */
 extern int put_record(record const r, schema_p s);
-/** Append the record to the table file.
-    The current position moves to the new end of the file.
+/** Insert the record into the table file, in a block with room for it
+    according to the free-space map of the table, or in a new block at the
+    end of the file if no block has room.
+    The current position moves to right after the new record.
+    The record is not inserted if the buffer has no page to spare.
 */
 extern void append_record(record const r, schema_p s);
 
+/** Open a cursor at the beginning of table @em t.
+    The position of the cursor is its own, independent of the current
+    position of the table and of other cursors.
+    Returns NULL upon failure.
+*/
+extern cursor_p open_cursor(tbl_p t);
+/** Retrieve the record at the cursor and move the cursor to the next one.
+    Returns 1 when @em r is updated, 0 when there is no more record,
+    and -1 when something goes wrong.
+*/
+extern int cursor_next(cursor_p c, record const r);
+/** Delete the record just retrieved with cursor_next().
+    The last record of the page takes its place, so pages stay dense,
+    and is retrieved by the next cursor_next(). Other cursors at the same
+    page may miss that record or get it twice.
+    Returns 0 if there is no record to delete.
+*/
+extern int cursor_delete(cursor_p c);
+/** Move the cursor back to the beginning of its table. */
+extern void cursor_rewind(cursor_p c);
+/** Close the cursor, unpinning its page.
+    All cursors of a table must be closed before the table is removed.
+*/
+extern void close_cursor(cursor_p c);
+
 /** Return an existing table desc, NULL if the table does not exist. */
 extern tbl_p get_table(char const* name);
+/** Return the schema of the table. */
+extern schema_p table_schema(tbl_p t);
 /** Remove a table from the current database */
 extern void remove_table(tbl_p t);
+/** Store the table log-structured, see file_set_log_structured().
+    Its cursors must be closed. Returns 0 upon failure. */
+extern int set_tbl_log_structured(tbl_p t);
+/** Make a B+tree index on the int field @em attr of table @em t,
+    in a file of its own. The index is kept up to date when records are
+    inserted, updated and deleted, and table_search() uses it to find
+    the records instead of scanning the table.
+    Returns 0 upon failure. */
+extern int create_index(tbl_p t, char const* attr);
+/** Make a hash index on the field @em attr of table @em t, int or str.
+    It finds the records with a given value in a few block reads, for
+    equality searches with table_search() and for table_natural_join()
+    when @em t is the right table. Returns 0 upon failure. */
+extern int create_hash_index(tbl_p t, char const* attr);
+/** Make a bitmap index on the int field @em attr of table @em t, for
+    fields of few distinct values. It keeps a compressed bitmap of the
+    record positions of each value, so that table_search_where() answers
+    combined conditions with the bitmaps before reading the records.
+    Returns 0 upon failure. */
+extern int create_bitmap_index(tbl_p t, char const* attr);
 /** Print all rows of a table. */
 extern void table_display(tbl_p s);
 /** Make a new table as the result of a search. */
 extern tbl_p table_search(tbl_p t, char const* attr,
                           char const* op, int val);
+/** Make a new table of the records meeting all the @em num conditions
+    attrs[i] ops[i] vals[i], or any of them if @em any is set. */
+extern tbl_p table_search_where(tbl_p t, int num, char const* attrs[],
+                                char const* ops[], int const vals[],
+                                int any);
 /** Make a new table as a result of project. */
 extern tbl_p table_project(tbl_p t, int num_fields, char* fields[]);
-/** Join two tables and return the joined table. */
+/** Join two tables on their common fields and return the joined table.
+    Without a hash index of @em right on a common field, @em right is
+    scanned once for each block of @em left. */
 extern tbl_p table_natural_join(tbl_p left, tbl_p right);
 #endif
@@ -1,4 +1,5 @@
 #include "test_data_gen.h"
+#include "testpager.h"
 #include "testschema.h"
 #include "pmsg.h"
 #include <ctype.h>
@@ -10,17 +11,33 @@
 void handle_test_options(int argc, char* argv[]) {
   int c;
   char new_sys_dir[512];
+  int num_pages = 0;
+  repl_policy policy = REPL_SAME;
+  long io_delay[3] = { 0, 0, 0 };
+  int dirty_pct[2];
 
   new_sys_dir[0] = '\0';
   msglevel = INFO;
 
-  while ((c = getopt(argc, argv, "hm:d:")) != -1)
+  while ((c = getopt(argc, argv, "hm:d:p:r:b:e:w:z:l:s:t:og")) != -1)
     switch (c) {
     case 'h':
       printf("Usage: runtest [switches]\n");
       printf("\t-h           help, print this message\n");
       printf("\t-m [fewid]   msg level [fatal,error,warn,info,debug]\n");
-      printf("\t-d db_dir  default to ./tests/testdb\n");
+      printf("\t-d db_dir  default to ./tests/testdb, %s for in memory\n", MEMORY_DB);
+      printf("\t-p num_pages buffer size in pages, default to %d\n", NUM_PAGES);
+      printf("\t-r policy    page replacement [lru,clock,lru-k,2q,arc], default to lru\n");
+      printf("\t-b size      block size of a new database, default to %ld\n", BLOCK_SIZE);
+      printf("\t-e blocks    blocks a file grows by, default to %d\n", EXTENT_BLOCKS);
+      printf("\t-w level     durability [off,group,statement], default to group\n");
+      printf("\t-z size      memory of the compressed cache, default to %ld\n", CCACHE_SIZE);
+      printf("\t-l r,w,bw    slow disk: read and write latency in us, bytes/s\n");
+      printf("\t-s num_pages blocks shared with other processes, default to 0\n");
+      printf("\t-t high,low  dirty pages written back, in %% of the pages, default to %d,%d\n",
+             DIRTY_HIGH_PCT, DIRTY_LOW_PCT);
+      printf("\t-o           direct I/O (O_DIRECT) of table files\n");
+      printf("\t-g           buffer pages in reserved huge pages\n");
       exit(0);
     case 'm':
       switch (optarg[0]) {
@@ -34,8 +51,64 @@ void handle_test_options(int argc, char* argv[]) {
     case 'd':
       strcpy(new_sys_dir, optarg);
       break;
+    case 'p':
+      num_pages = atoi(optarg);
+      break;
+    case 'r':
+      policy = repl_policy_by_name(optarg);
+      if (policy == REPL_SAME)
+        printf("Unknown page replacement policy \"%s\", use lru.\n", optarg);
+      break;
+    case 'b':
+      if (!pager_set_block_size(atol(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 'e':
+      if (!pager_set_extent_blocks(atoi(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 'w':
+      if (durability_by_name(optarg) == -1)
+        printf("Unknown durability \"%s\", use group.\n", optarg);
+      else
+        pager_set_durability(durability_by_name(optarg));
+      break;
+    case 'z':
+      if (!pager_set_ccache_size(atol(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 'l':
+      if (sscanf(optarg, "%ld,%ld,%ld", &io_delay[0], &io_delay[1],
+                 &io_delay[2]) < 1) {
+        printf("Invalid disk delays \"%s\".\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (!pager_set_io_delay(io_delay[0], io_delay[1], io_delay[2]))
+        exit(EXIT_FAILURE);
+      break;
+    case 's':
+      if (!pager_set_shared_pages(atoi(optarg)))
+        exit(EXIT_FAILURE);
+      break;
+    case 't':
+      if (sscanf(optarg, "%d,%d", &dirty_pct[0], &dirty_pct[1]) != 2) {
+        printf("Invalid dirty thresholds \"%s\".\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (!pager_set_dirty_thresholds(dirty_pct[0], dirty_pct[1]))
+        exit(EXIT_FAILURE);
+      break;
+    case 'o':
+      pager_set_direct_io(1);
+      break;
+    case 'g':
+      pager_set_huge_pages(1);
+      break;
     case '?':
-      if (optopt == 'm' || optopt == 'd' || optopt == 'c')
+      if (optopt == 'm' || optopt == 'd' || optopt == 'p' || optopt == 'r'
+          || optopt == 'b' || optopt == 'e' || optopt == 'w'
+          || optopt == 'z'
+          || optopt == 'l' || optopt == 's' || optopt == 't')
         printf("Option -%c requires an argument.\n", optopt);
       else if (isprint(optopt))
         printf("Unknown option `-%c'.\n", optopt);
@@ -53,6 +126,12 @@ void handle_test_options(int argc, char* argv[]) {
     put_msg(ERROR, "cannot set system dir at %s\n", new_sys_dir);
     exit(EXIT_FAILURE);
   }
+
+  if ((num_pages > 0 || policy != REPL_SAME)
+      && !pager_init(num_pages, policy)) {
+    put_msg(ERROR, "cannot make a buffer of %d pages\n", num_pages);
+    exit(EXIT_FAILURE);
+  }
 }
 
 int main(int argc, char* argv[]) {
@@ -65,12 +144,32 @@ int main(int argc, char* argv[]) {
   test_page_write_with_offset("testpage_w_offset");
   test_page_read_with_offset("testpage_w_offset");
   */
+  test_page_write("testpage_mmap");
+  test_page_read_mmap("testpage_mmap");
+  test_page_concurrent("testpage_mt");
+  test_page_preload("testpage_preload");
+  test_page_crash("testpage_crash");
+  test_page_shared_pool("testpage_shared");
+  test_page_write_back("testpage_flush");
+  test_page_direct_io("testpage_direct");
+  test_page_huge("testpage_huge");
+  test_page_extents("testpage_extents");
 
   char my_tbl[] = "Me";
   test_tbl_write(my_tbl);
+  test_tbl_cursors(my_tbl);
   test_tbl_read(my_tbl);
+  test_tbl_reuse(my_tbl);
+  test_buffer_resize(my_tbl);
+  test_tbl_log_structured(my_tbl);
+  test_tbl_scan_ring(my_tbl);
+  test_tbl_search(my_tbl);
+  test_tbl_index(my_tbl);
 
   test_tbl_natural_join(my_tbl, "You");
+  test_tbl_hash_index(my_tbl, "You");
+  test_tbl_bitmap_index("You");
+  test_db_block_size("Bs");
 
   return (0);
 }
@@ -1,6 +1,12 @@
 #include "testpager.h"
 #include "pmsg.h"
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define NUM_BLOCKS_IN_FILE 20 /* can be greater than NUM_PAGES */
 #define NUM_RECORDS_IN_BLOCK 3
@@ -11,7 +17,7 @@ static size_t str_len = 14;
 
 void test_page_write(char const* fname) {
   put_msg(INFO, "test_page_write() ...\n");
-  pager_init();
+  pager_init(0, REPL_SAME);
   /* put_pager_info(DEBUG, "After pager_init"); */
 
   page_p pg;
@@ -49,7 +55,7 @@ void test_page_write(char const* fname) {
 
 void test_page_read(char const* fname) {
   put_msg(INFO, "test_page_read() ...\n");
-  pager_init();
+  pager_init(0, REPL_SAME);
   /* put_pager_info(DEBUG, "After pager_init"); */
 
   page_p pg;
@@ -97,7 +103,7 @@ void test_page_read(char const* fname) {
 
 void test_page_write_with_offset(char const* fname) {
   put_msg(INFO, "test_page_write_with_offset() ...\n");
-  pager_init();
+  pager_init(0, REPL_SAME);
   /* put_pager_info(DEBUG, "After pager_init"); */
 
   page_p pg;
@@ -133,7 +139,7 @@ void test_page_write_with_offset(char const* fname) {
 
 void test_page_read_with_offset(char const* fname) {
   put_msg(INFO, "test_page_read_with_offset() ...\n");
-  pager_init();
+  pager_init(0, REPL_SAME);
   /* put_pager_info(DEBUG, "After pager_init"); */
 
   page_p pg;
@@ -151,7 +157,8 @@ void test_page_read_with_offset(char const* fname) {
     /* put_pager_info(DEBUG, "After get_page"); */
 
     int i = 0;
-    while (!eop(pg)) {
+    /* reading at an offset leaves the current position alone */
+    while (PAGE_HEADER_SIZE + i*(INT_SIZE + str_len) < page_free_pos(pg)) {
       int offset = PAGE_HEADER_SIZE + i*(INT_SIZE + str_len);
       int_out = page_get_int_at(pg, offset);
       if (int_out != ints_in[i] + bnr) {
@@ -180,3 +187,715 @@ void test_page_read_with_offset(char const* fname) {
   /* put_pager_info(DEBUG, "After pager_terminate"); */
   put_msg(INFO, "test_page_read_with_offset() succeeds.\n");
 }
+
+void test_page_read_mmap(char const* fname) {
+  put_msg(INFO, "test_page_read_mmap() ...\n");
+  pager_init(0, REPL_SAME);
+
+  int mapped = file_set_mmap(fname, 1);
+  if (!mapped)
+    put_msg(INFO, "test_page_read_mmap: %s cannot be mapped here, its "
+            "blocks are read into pages.\n", fname);
+
+  page_p pg;
+  int int_out;
+  char str_out[14];
+
+  for (size_t bnr = 0; bnr < NUM_BLOCKS_IN_FILE; bnr++) {
+    pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      put_pager_info(FATAL, "After get_page");
+      exit(EXIT_FAILURE);
+    }
+
+    int i = 0;
+    while (!eop(pg)) {
+      int_out = page_get_int(pg);
+      if (int_out != ints_in[i] + bnr) {
+        put_msg(FATAL,
+                "test_page_read_mmap fails: (read: %d, should be %d)\n",
+                int_out, ints_in[i] + bnr);
+        put_pager_info(FATAL, "After page_get_int");
+        exit(EXIT_FAILURE);
+      }
+      page_get_str(pg, str_out, str_len);
+      if (strcmp(str_out, strs_in[i]) != 0) {
+        put_msg(FATAL,
+                "test_page_read_mmap fails: (read: \"%s\", should be \"%s\")\n",
+                str_out, strs_in[i]);
+        put_pager_info(FATAL, "After page_get_str");
+        exit(EXIT_FAILURE);
+      }
+      i++;
+    }
+    /* a changed page no longer refers to the mapping, and the file
+       keeps the old value till the page is written back */
+    int old_val = ints_in[0] + bnr, int_disk = old_val;
+    page_put_int_at(pg, PAGE_HEADER_SIZE, old_val + 1);
+    if (mapped) {
+      int fd = open(fname, O_RDONLY);
+      if (fd == -1
+          || pread(fd, &int_disk, INT_SIZE,
+                   pager_block_size() * bnr + PAGE_HEADER_SIZE) != INT_SIZE)
+        int_disk = -1;
+      if (fd != -1) close(fd);
+    }
+    int_out = page_get_int_at(pg, PAGE_HEADER_SIZE);
+    if (int_out != old_val + 1 || int_disk != old_val) {
+      put_msg(FATAL, "test_page_read_mmap fails: block %d changed to %d, "
+              "%d on disk, should be %d and %d\n", (int) bnr, int_out,
+              int_disk, old_val + 1, old_val);
+      exit(EXIT_FAILURE);
+    }
+    unpin(pg);
+  }
+
+  if (mapped && pager_num_mapped() != NUM_BLOCKS_IN_FILE) {
+    put_msg(FATAL, "test_page_read_mmap fails: %lld blocks mapped, "
+            "should be %d\n", pager_num_mapped(), NUM_BLOCKS_IN_FILE);
+    exit(EXIT_FAILURE);
+  }
+
+  put_pager_profiler_info(INFO);
+  pager_terminate();
+  put_msg(INFO, "test_page_read_mmap() succeeds.\n");
+}
+
+#define NUM_THREADS 8
+#define NUM_MT_BLOCKS 40
+#define NUM_MT_INTS 16
+#define NUM_MT_ACCESSES 20000
+
+/** @brief Arguments of a thread of test_page_concurrent() */
+typedef struct {
+  char const* fname;
+  unsigned seed;
+  int num_bad;
+} mt_arg;
+
+/* The int at slot k of block bnr in test_page_concurrent() */
+static int mt_val(int bnr, int k) {
+  return bnr * 1000 + k;
+}
+
+/* Read random blocks, latched shared, and now and then write one with
+   the same values, latched exclusively */
+static void* mt_reader(void* arg) {
+  mt_arg *a = arg;
+  for (int i = 0; i < NUM_MT_ACCESSES; i++) {
+    /* most accesses go to a few hot blocks, so that threads share pages */
+    int bnr = rand_r(&a->seed) % 3 ? rand_r(&a->seed) % 4
+      : rand_r(&a->seed) % NUM_MT_BLOCKS;
+    int k = rand_r(&a->seed) % NUM_MT_INTS;
+    int write = rand_r(&a->seed) % 8 == 0;
+    page_p pg = get_page(a->fname, bnr);
+    if (!pg) {
+      a->num_bad++;
+      continue;
+    }
+    if (write)
+      page_latch_exclusive(pg);
+    else
+      page_latch_shared(pg);
+    if (page_block_nr(pg) != bnr
+        || page_get_int_at(pg, PAGE_HEADER_SIZE + k * INT_SIZE)
+        != mt_val(bnr, k))
+      a->num_bad++;
+    if (write)
+      page_put_int_at(pg, PAGE_HEADER_SIZE + k * INT_SIZE, mt_val(bnr, k));
+    page_unlatch(pg);
+    unpin(pg);
+  }
+  return 0;
+}
+
+void test_page_concurrent(char const* fname) {
+  put_msg(INFO, "test_page_concurrent() ...\n");
+  pager_init(0, REPL_SAME);
+
+  for (int bnr = 0; bnr < NUM_MT_BLOCKS; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    for (int k = 0; k < NUM_MT_INTS; k++)
+      page_put_int(pg, mt_val(bnr, k));
+    unpin(pg);
+  }
+
+  /* each thread pins a page at a time, some pages are left to replace */
+  int num_threads = pager_num_pages() > NUM_THREADS ? NUM_THREADS
+    : pager_num_pages() > 1 ? pager_num_pages() - 1 : 1;
+  pthread_t threads[NUM_THREADS];
+  mt_arg args[NUM_THREADS];
+  for (int i = 0; i < num_threads; i++) {
+    args[i] = (mt_arg) { fname, i + 1, 0 };
+    pthread_create(&threads[i], 0, mt_reader, &args[i]);
+  }
+  int num_bad = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], 0);
+    num_bad += args[i].num_bad;
+  }
+  if (num_bad > 0) {
+    put_msg(FATAL, "test_page_concurrent: %d of %d reads by %d threads "
+            "fail\n", num_bad, num_threads * NUM_MT_ACCESSES, num_threads);
+    exit(EXIT_FAILURE);
+  }
+
+  put_pager_profiler_info(INFO);
+  pager_terminate();
+  put_msg(INFO, "test_page_concurrent() succeeds.\n");
+}
+
+/* The list of the blocks in the buffer is written by a pager and read
+   back by the next one, which preloads the most recently used blocks
+   but for two pages */
+void test_page_preload(char const* fname) {
+  put_msg(INFO, "test_page_preload() ...\n");
+  char list[] = "testpage_resident";
+  pager_init(0, REPL_SAME);
+  int num_pages = pager_num_pages();
+  for (int bnr = 0; bnr < 2 * num_pages; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    page_put_int(pg, bnr);
+    unpin(pg);
+  }
+  /* the last blocks written are in the buffer */
+  if (!pager_save_resident(list)) {
+    put_msg(FATAL, "test_page_preload: cannot save the list\n");
+    exit(EXIT_FAILURE);
+  }
+  pager_terminate();
+
+  FILE *fp = fopen(list, "r");
+  char key[16] = "";
+  int num_files = 0, num_blks = 0;
+  if (!fp || fscanf(fp, "%15s %d %d", key, &num_files, &num_blks) != 3
+      || num_files != 1 || num_blks != num_pages) {
+    put_msg(FATAL, "test_page_preload: the list has %d files and %d "
+            "blocks, should be 1 and %d\n", num_files, num_blks, num_pages);
+    exit(EXIT_FAILURE);
+  }
+  fclose(fp);
+
+  pager_init(0, REPL_SAME);
+  int should = num_pages - 2;
+  if (!pager_preload(list)) {
+    put_msg(FATAL, "test_page_preload: cannot read the list\n");
+    exit(EXIT_FAILURE);
+  }
+  /* wait for the preloader, at most a few seconds */
+  for (int i = 0; i < 5000 && file_num_pages(fname) < should; i++)
+    usleep(1000);
+  usleep(20000);
+  int n = file_num_pages(fname);
+  if (n != should) {
+    put_msg(FATAL, "test_page_preload: %d blocks preloaded, should be %d\n",
+            n, should);
+    exit(EXIT_FAILURE);
+  }
+  for (int bnr = 2 * num_pages - should; bnr < 2 * num_pages; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg || page_get_int_at(pg, PAGE_HEADER_SIZE) != bnr) {
+      put_msg(FATAL, "test_page_preload: block %d is wrong\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    unpin(pg);
+  }
+  if (file_num_pages(fname) != should) {
+    put_msg(FATAL, "test_page_preload: the blocks preloaded are not the "
+            "last ones used\n");
+    exit(EXIT_FAILURE);
+  }
+
+  put_pager_profiler_info(INFO);
+  pager_terminate();
+  remove(list);
+  put_msg(INFO, "test_page_preload() succeeds.\n");
+}
+
+#define CRASH_MAX_PASSES 2000
+
+static int crash_val(int bnr, int pos) {
+  return bnr * 10000 + pos;
+}
+
+/* Fill the blocks of the file, then change the first int of every block
+   once per statement till the log is checkpointed, and once more.
+   The buffer holds a quarter of the blocks, so that they are written
+   back and their next change logs their image.
+   Exits without closing anything, as if the process crashed. */
+static void crash_writer(char const* fname, int num_blks) {
+  pager_set_durability(DURABILITY_STATEMENT);
+  pager_init(num_blks / 4, REPL_SAME);
+  for (int bnr = 0; bnr < num_blks; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) _exit(EXIT_FAILURE);
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    while (page_put_int(pg, crash_val(bnr, page_current_pos(pg))))
+      ;
+    unpin(pg);
+  }
+  pager_commit();
+  long long num_ckpts = pager_num_checkpoints();
+  int checkpointed = 0;
+  for (int pass = 1; pass < CRASH_MAX_PASSES; pass++) {
+    for (int bnr = 0; bnr < num_blks; bnr++) {
+      page_p pg = get_page(fname, bnr);
+      if (!pg) _exit(EXIT_FAILURE);
+      page_put_int_at(pg, PAGE_HEADER_SIZE, pass);
+      unpin(pg);
+    }
+    pager_commit();
+    if (checkpointed)
+      break;
+    checkpointed = pager_num_checkpoints() > num_ckpts;
+  }
+  _exit(checkpointed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void test_page_crash(char const* fname) {
+  put_msg(INFO, "test_page_crash() ...\n");
+  if (pager_in_memory()) {
+    put_msg(INFO, "test_page_crash() skipped in memory.\n");
+    return;
+  }
+  pager_init(0, REPL_SAME);
+  int num_blks = 4 * pager_num_pages();
+  if (num_blks < 64)
+    num_blks = 64;
+  long bsize = pager_block_size();
+  /* the images of all blocks fit in the log before a checkpoint, so that
+     the statement after the checkpoint leaves them in the log */
+  if (num_blks > WAL_CHECKPOINT_SIZE / (2 * bsize))
+    num_blks = WAL_CHECKPOINT_SIZE / (2 * bsize);
+  durability_level level = pager_durability();
+  pager_terminate();
+  remove(fname);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    put_msg(FATAL, "test_page_crash: cannot fork\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0)
+    crash_writer(fname, num_blks);
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+      || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    put_msg(FATAL, "test_page_crash: the writer fails or never "
+            "checkpoints the log\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* tear the last block: its second half is garbage */
+  int fd = open(fname, O_WRONLY);
+  char *junk = malloc(bsize / 2);
+  if (fd == -1 || !junk) {
+    put_msg(FATAL, "test_page_crash: cannot open %s\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  memset(junk, 0x5a, bsize / 2);
+  if (pwrite(fd, junk, bsize / 2, bsize * num_blks - bsize / 2)
+      != bsize / 2) {
+    put_msg(FATAL, "test_page_crash: cannot tear %s\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  free(junk);
+
+  pager_set_durability(level);
+  pager_init(0, REPL_SAME);
+  if (file_num_blocks(fname) != num_blks) {
+    put_msg(FATAL, "test_page_crash: %d blocks recovered, should be %d\n",
+            file_num_blocks(fname), num_blks);
+    exit(EXIT_FAILURE);
+  }
+  int pass = 0;
+  for (int bnr = 0; bnr < num_blks; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    if (bnr == 0)
+      pass = page_get_int_at(pg, PAGE_HEADER_SIZE);
+    int ok = pass > 0 && page_free_pos(pg) > bsize - INT_SIZE
+      && page_get_int_at(pg, PAGE_HEADER_SIZE) == pass;
+    for (int pos = PAGE_HEADER_SIZE + INT_SIZE;
+         ok && pos + INT_SIZE <= page_free_pos(pg); pos += INT_SIZE)
+      ok = page_get_int_at(pg, pos) == crash_val(bnr, pos);
+    unpin(pg);
+    if (!ok) {
+      put_msg(FATAL, "test_page_crash: block %d is not recovered\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+  }
+  file_remove(fname);
+  pager_terminate();
+  put_msg(INFO, "test_page_crash() succeeds after %d statements.\n", pass);
+}
+
+#define SP_BLOCKS 16
+
+/* Whether blocks [1, SP_BLOCKS) of the file hold the values written by
+   shared_pool_writer(), or are empty if !written */
+static int shared_blocks_are(char const* fname, int written) {
+  int ok = 1;
+  for (int bnr = 1; ok && bnr < SP_BLOCKS; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) return 0;
+    if (page_free_pos(pg) <= PAGE_HEADER_SIZE)
+      ok = !written;
+    else
+      ok = written && page_get_int_at(pg, PAGE_HEADER_SIZE) == bnr * 7 + 1;
+    unpin(pg);
+  }
+  return ok;
+}
+
+/* Write the blocks of the file, which puts them into the shared pool,
+   tell the parent and wait for it, and exit without terminating the
+   pager, as if the process crashed */
+static void shared_pool_writer(char const* fname, int to_parent,
+                               int from_parent) {
+  char c = 0;
+  pager_init(0, REPL_SAME);
+  for (int bnr = 0; bnr < SP_BLOCKS; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) _exit(EXIT_FAILURE);
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    page_put_int(pg, bnr * 7 + 1);
+    unpin(pg);
+  }
+  close_file(fname);
+  if (write(to_parent, &c, 1) != 1 || read(from_parent, &c, 1) != 1)
+    _exit(EXIT_FAILURE);
+  _exit(EXIT_SUCCESS);
+}
+
+/* A process reads the blocks another process has put into the shared
+   pool, and the pool is removed when the other process has died */
+void test_page_shared_pool(char const* fname) {
+  put_msg(INFO, "test_page_shared_pool() ...\n");
+  if (pager_in_memory()) {
+    put_msg(INFO, "test_page_shared_pool() skipped in memory.\n");
+    return;
+  }
+  pager_init(0, REPL_SAME);
+  long bsize = pager_block_size();
+  durability_level level = pager_durability();
+  int shared_pages = pager_shared_pages();
+  file_remove(fname);
+  pager_terminate();
+  /* both processes use the system dir, but not the log */
+  pager_set_durability(DURABILITY_OFF);
+  /* room for all the blocks in every partition of the pool */
+  pager_set_shared_pages(16 * SP_BLOCKS);
+
+  int to_parent[2], from_parent[2];
+  pid_t pid;
+  if (pipe(to_parent) == -1 || pipe(from_parent) == -1
+      || (pid = fork()) == -1) {
+    put_msg(FATAL, "test_page_shared_pool: cannot fork\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close(to_parent[0]);
+    close(from_parent[1]);
+    shared_pool_writer(fname, to_parent[1], from_parent[0]);
+  }
+  close(to_parent[1]);
+  close(from_parent[0]);
+  char c = 0;
+  if (read(to_parent[0], &c, 1) != 1) {
+    put_msg(FATAL, "test_page_shared_pool: the writer fails\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* the blocks on disk are zero, those in the pool are not */
+  int fd = open(fname, O_WRONLY);
+  char *zeros = calloc(SP_BLOCKS - 1, bsize);
+  if (fd == -1 || !zeros
+      || pwrite(fd, zeros, (SP_BLOCKS - 1) * bsize, bsize)
+      != (SP_BLOCKS - 1) * bsize) {
+    put_msg(FATAL, "test_page_shared_pool: cannot clear %s\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  free(zeros);
+  pager_init(0, REPL_SAME);
+  if (!shared_blocks_are(fname, 1)) {
+    put_msg(FATAL, "test_page_shared_pool: the blocks are not read from "
+            "the shared pool\n");
+    exit(EXIT_FAILURE);
+  }
+  put_pager_profiler_info(INFO);
+  pager_terminate();
+
+  int status;
+  if (write(from_parent[1], &c, 1) != 1 || waitpid(pid, &status, 0) != pid
+      || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    put_msg(FATAL, "test_page_shared_pool: the writer fails\n");
+    exit(EXIT_FAILURE);
+  }
+  close(to_parent[0]);
+  close(from_parent[1]);
+
+  /* the writer died attached, yet the pool goes with the last process */
+  pager_init(0, REPL_SAME);
+  pager_terminate();
+  pager_init(0, REPL_SAME);
+  if (!shared_blocks_are(fname, 0)) {
+    put_msg(FATAL, "test_page_shared_pool: the pool outlives the "
+            "processes\n");
+    exit(EXIT_FAILURE);
+  }
+  file_remove(fname);
+  pager_terminate();
+  pager_set_durability(level);
+  pager_set_shared_pages(shared_pages);
+  put_msg(INFO, "test_page_shared_pool() succeeds.\n");
+}
+
+/* Whether the first int of block bnr of the file on disk is val */
+static int disk_int_is(int fd, long bsize, int bnr, int val) {
+  int v;
+  return pread(fd, &v, INT_SIZE, bsize * bnr + PAGE_HEADER_SIZE) == INT_SIZE
+    && v == val;
+}
+
+/* With dirty thresholds of 0%, the flusher writes back the pages changed
+   while they are still in the buffer */
+void test_page_write_back(char const* fname) {
+  put_msg(INFO, "test_page_write_back() ...\n");
+  if (pager_in_memory()) {
+    put_msg(INFO, "test_page_write_back() skipped in memory.\n");
+    return;
+  }
+  int high_pct, low_pct;
+  pager_dirty_thresholds(&high_pct, &low_pct);
+  pager_set_dirty_thresholds(0, 0);
+  pager_init(0, REPL_SAME);
+  long bsize = pager_block_size();
+  /* fewer than with the default thresholds */
+  int num_blks = pager_num_pages() / 4 > 0 ? pager_num_pages() / 4 : 1;
+  for (int bnr = 0; bnr < num_blks; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    page_put_int(pg, bnr + 1);
+    unpin(pg);
+  }
+  /* every unpin hands the dirty pages to the flusher */
+  int fd = open(fname, O_RDONLY);
+  int written = 0;
+  for (int i = 0; fd != -1 && i < 5000 && written < num_blks; i++) {
+    usleep(1000);
+    for (written = 0; written < num_blks
+           && disk_int_is(fd, bsize, written, written + 1); written++)
+      ;
+  }
+  if (fd != -1) close(fd);
+  if (written < num_blks || file_num_pages(fname) < num_blks) {
+    put_msg(FATAL, "test_page_write_back: %d of %d blocks written, %d in "
+            "the buffer\n", written, num_blks, file_num_pages(fname));
+    exit(EXIT_FAILURE);
+  }
+  put_pager_profiler_info(INFO);
+  file_remove(fname);
+  pager_terminate();
+  pager_set_dirty_thresholds(high_pct, low_pct);
+  put_msg(INFO, "test_page_write_back() succeeds.\n");
+}
+
+#define DIO_INTS 8
+
+/* Blocks written and read with direct I/O, more of them than pages */
+void test_page_direct_io(char const* fname) {
+  put_msg(INFO, "test_page_direct_io() ...\n");
+  int direct = pager_direct_io();
+  pager_set_direct_io(1);
+  pager_init(0, REPL_SAME);
+  int num_blks = 2 * pager_num_pages() + 3;
+  for (int bnr = 0; bnr < num_blks; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    for (int i = 0; i < DIO_INTS; i++)
+      page_put_int(pg, bnr * 100 + i);
+    unpin(pg);
+  }
+  if (!file_direct_io(fname)) {
+    put_msg(INFO, "test_page_direct_io() skipped, %s is not open for "
+            "direct I/O here.\n", fname);
+    file_remove(fname);
+    pager_terminate();
+    pager_set_direct_io(direct);
+    return;
+  }
+  pager_terminate();
+
+  pager_init(0, REPL_SAME);
+  for (int bnr = 0; bnr < num_blks; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < DIO_INTS; i++)
+      if (page_get_int_at(pg, PAGE_HEADER_SIZE + i * INT_SIZE)
+          != bnr * 100 + i) {
+        put_msg(FATAL, "test_page_direct_io: block %d is wrong\n", bnr);
+        exit(EXIT_FAILURE);
+      }
+    unpin(pg);
+  }
+  if (!file_direct_io(fname)) {
+    put_msg(FATAL, "test_page_direct_io: direct I/O of %s is turned off\n",
+            fname);
+    exit(EXIT_FAILURE);
+  }
+  put_pager_profiler_info(INFO);
+  file_remove(fname);
+  pager_terminate();
+  pager_set_direct_io(direct);
+  put_msg(INFO, "test_page_direct_io() succeeds.\n");
+}
+
+/* Whether blocks [0, n) of the file hold the values of test_page_huge() */
+static int huge_blocks_ok(char const* fname, int n) {
+  for (int bnr = 0; bnr < n; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) return 0;
+    int ok = page_get_int_at(pg, PAGE_HEADER_SIZE) == bnr;
+    unpin(pg);
+    if (!ok) return 0;
+  }
+  return 1;
+}
+
+/* A buffer grown by a few MB gets them in one piece, backed by reserved
+   huge pages or else by transparent ones, and shrinks back */
+void test_page_huge(char const* fname) {
+  put_msg(INFO, "test_page_huge() ...\n");
+  int huge = pager_huge_pages();
+  pager_set_huge_pages(1);
+  pager_init(0, REPL_SAME);
+  int num_pages = pager_num_pages();
+  int big = num_pages + (int) ((4L << 20) / pager_block_size());
+  if (!pager_resize(big) || pager_num_pages() != big) {
+    put_msg(FATAL, "test_page_huge: cannot grow the buffer to %d pages\n",
+            big);
+    exit(EXIT_FAILURE);
+  }
+  int num_blks = big / 2;
+  for (int bnr = 0; bnr < num_blks; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    page_truncate(pg, PAGE_HEADER_SIZE);
+    page_put_int(pg, bnr);
+    unpin(pg);
+  }
+  if (!huge_blocks_ok(fname, num_blks)) {
+    put_msg(FATAL, "test_page_huge: the blocks are wrong\n");
+    exit(EXIT_FAILURE);
+  }
+  if (!pager_resize(num_pages) || !huge_blocks_ok(fname, num_blks)) {
+    put_msg(FATAL, "test_page_huge: the blocks are wrong in %d pages\n",
+            num_pages);
+    exit(EXIT_FAILURE);
+  }
+  file_remove(fname);
+  pager_terminate();
+  pager_set_huge_pages(huge);
+  put_msg(INFO, "test_page_huge() succeeds.\n");
+}
+
+#define EXT_BLOCKS 8
+#define EXT_USED 5
+
+static long file_size(char const* fname) {
+  struct stat st;
+  return stat(fname, &st) == 0 ? (long) st.st_size : -1;
+}
+
+/* A file is trimmed to the blocks in use when it is closed, and the
+   zeros preallocated beyond them are not blocks in use when it is opened
+   again, as after a crash */
+void test_page_extents(char const* fname) {
+  put_msg(INFO, "test_page_extents() ...\n");
+  if (pager_in_memory()) {
+    put_msg(INFO, "test_page_extents() skipped in memory.\n");
+    return;
+  }
+  int extent = pager_extent_blocks();
+  pager_set_extent_blocks(EXT_BLOCKS);
+  pager_init(0, REPL_SAME);
+  long bsize = pager_block_size();
+  file_remove(fname);
+  for (int bnr = 0; bnr < EXT_USED; bnr++) {
+    page_p pg = get_page(fname, bnr);
+    if (!pg) {
+      put_msg(FATAL, "get_page %d fails\n", bnr);
+      exit(EXIT_FAILURE);
+    }
+    page_put_int(pg, bnr);
+    unpin(pg);
+  }
+  close_file(fname);
+  if (file_size(fname) != EXT_USED * bsize) {
+    put_msg(FATAL, "test_page_extents: %ld bytes after closing, should be "
+            "%ld\n", file_size(fname), EXT_USED * bsize);
+    exit(EXIT_FAILURE);
+  }
+  pager_terminate();
+
+  /* the tail of an extent left by a crash */
+  if (truncate(fname, EXT_BLOCKS * bsize) == -1) {
+    put_msg(FATAL, "test_page_extents: cannot extend %s\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  pager_init(0, REPL_SAME);
+  if (file_num_blocks(fname) != EXT_USED) {
+    put_msg(FATAL, "test_page_extents: %d blocks, should be %d\n",
+            file_num_blocks(fname), EXT_USED);
+    exit(EXIT_FAILURE);
+  }
+  page_p pg = get_page(fname, EXT_USED);
+  if (!pg || file_num_blocks(fname) != EXT_USED + 1) {
+    put_msg(FATAL, "test_page_extents: %d blocks after appending one, "
+            "should be %d\n", file_num_blocks(fname), EXT_USED + 1);
+    exit(EXIT_FAILURE);
+  }
+  page_put_int(pg, EXT_USED);
+  unpin(pg);
+  close_file(fname);
+  if (file_size(fname) != (EXT_USED + 1) * bsize) {
+    put_msg(FATAL, "test_page_extents: %ld bytes after appending, should "
+            "be %ld\n", file_size(fname), (EXT_USED + 1) * bsize);
+    exit(EXIT_FAILURE);
+  }
+  file_remove(fname);
+  pager_terminate();
+  pager_set_extent_blocks(extent);
+  put_msg(INFO, "test_page_extents() succeeds.\n");
+}
@@ -7,5 +7,14 @@ extern void test_page_write(char const* fname);
 extern void test_page_read(char const* fname);
 extern void test_page_write_with_offset(char const* fname);
 extern void test_page_read_with_offset(char const* fname);
+extern void test_page_read_mmap(char const* fname);
+extern void test_page_concurrent(char const* fname);
+extern void test_page_preload(char const* fname);
+extern void test_page_crash(char const* fname);
+extern void test_page_shared_pool(char const* fname);
+extern void test_page_write_back(char const* fname);
+extern void test_page_direct_io(char const* fname);
+extern void test_page_huge(char const* fname);
+extern void test_page_extents(char const* fname);
 
 #endif
@@ -1,4 +1,10 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "testschema.h"
 #include "test_data_gen.h"
 #include "pmsg.h"
@@ -77,6 +83,437 @@ void test_tbl_read(char const* tbl_name) {
 
 }
 
+static void check_cursor_record(cursor_p c, record out_rec, int rec_n,
+                                schema_p sch) {
+  if (cursor_next(c, out_rec) != 1
+      || !equal_record(out_rec, in_recs[rec_n], sch)) {
+    put_msg(FATAL, "test_tbl_cursors: record %d\n", rec_n);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Two cursors scan the table interleaved, one lagging behind the other */
+void test_tbl_cursors(char const* tbl_name) {
+  put_msg(INFO,  "test_tbl_cursors (\"%s\") ...\n", tbl_name);
+
+  open_db();
+
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch);
+  cursor_p ahead = open_cursor(tbl), behind = open_cursor(tbl);
+  int lag = NUM_RECORDS / 3;
+
+  for (int rec_n = 0; rec_n < NUM_RECORDS + lag; rec_n++) {
+    if (rec_n < NUM_RECORDS)
+      check_cursor_record(ahead, out_rec, rec_n, sch);
+    if (rec_n >= lag)
+      check_cursor_record(behind, out_rec, rec_n - lag, sch);
+  }
+  if (cursor_next(ahead, out_rec) != 0 || cursor_next(behind, out_rec) != 0)
+    put_msg(ERROR, "test_tbl_cursors: more than %d records", NUM_RECORDS);
+
+  close_cursor(ahead);
+  close_cursor(behind);
+  release_record(out_rec, sch);
+
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  put_msg(INFO,  "test_tbl_cursors() succeeds.\n");
+}
+
+/* Delete every other record, then insert as many again.
+   The free-space map lets the inserts fill the holes. */
+void test_tbl_reuse(char const* tbl_name) {
+  put_msg(INFO,  "test_tbl_reuse (\"%s\") ...\n", tbl_name);
+
+  open_db();
+
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  int num_blocks = file_num_blocks(tbl_name);
+  record out_rec = new_record(sch);
+  cursor_p c = open_cursor(tbl);
+  int num_recs = 0, num_deleted = 0;
+  while (cursor_next(c, out_rec) > 0)
+    if (num_recs++ % 2 == 0)
+      num_deleted += cursor_delete(c);
+  close_cursor(c);
+  close_db();
+
+  open_db();
+  for (int i = 0; i < num_deleted; i++)
+    append_record(out_rec, sch = get_schema(tbl_name));
+
+  c = open_cursor(get_table(tbl_name));
+  int num_left = 0;
+  while (cursor_next(c, out_rec) > 0)
+    num_left++;
+  close_cursor(c);
+
+  if (num_recs != NUM_RECORDS || num_left != NUM_RECORDS
+      || file_num_blocks(tbl_name) != num_blocks) {
+    put_msg(FATAL, "test_tbl_reuse: %d records in %d blocks, should be %d in %d\n",
+            num_left, file_num_blocks(tbl_name), NUM_RECORDS, num_blocks);
+    exit(EXIT_FAILURE);
+  }
+
+  release_record(out_rec, sch);
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  put_msg(INFO,  "test_tbl_reuse() succeeds.\n");
+}
+
+static int count_records(tbl_p tbl, record out_rec) {
+  cursor_p c = open_cursor(tbl);
+  int n = 0;
+  while (cursor_next(c, out_rec) > 0)
+    n++;
+  close_cursor(c);
+  return n;
+}
+
+void test_buffer_resize(char const* tbl_name) {
+  put_msg(INFO,  "test_buffer_resize (\"%s\") ...\n", tbl_name);
+
+  open_db();
+
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch);
+  int num_pages = pager_num_pages();
+  int num_big = count_records(tbl, out_rec);
+
+  int shrunk = pager_resize(4);
+  int num_small = count_records(tbl, out_rec);
+  if (!shrunk || pager_num_pages() != 4 || num_small != num_big) {
+    put_msg(FATAL, "test_buffer_resize: %d records in %d pages, should be %d in 4\n",
+            num_small, pager_num_pages(), num_big);
+    exit(EXIT_FAILURE);
+  }
+
+  file_set_quota(tbl_name, 2);
+  pager_resize(num_pages + 10);
+  int num_quota = count_records(tbl, out_rec);
+  if (num_quota != num_big || file_num_pages(tbl_name) > 2) {
+    put_msg(FATAL, "test_buffer_resize: %d records in %d pages, should be %d in 2\n",
+            num_quota, file_num_pages(tbl_name), num_big);
+    exit(EXIT_FAILURE);
+  }
+  put_buffer_info(INFO);
+  pager_resize(num_pages);
+
+  release_record(out_rec, sch);
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  put_msg(INFO,  "test_buffer_resize() succeeds.\n");
+}
+
+/** Max number of sessions rewriting a log-structured table */
+#define LSS_MAX_ROUNDS 500
+
+/* Order-independent checksum of the records of the table */
+static unsigned long records_sum(tbl_p tbl, record rec) {
+  cursor_p c = open_cursor(tbl);
+  unsigned long sum = 0;
+  while (cursor_next(c, rec) > 0) {
+    unsigned long h = 5381 * 33 + *(int *)rec[0];
+    for (char const* str = rec[1]; *str; str++)
+      h = h * 33 + *str;
+    sum += (h * 33 + *(int *)rec[2]) * 2654435761UL;
+  }
+  close_cursor(c);
+  return sum;
+}
+
+static int lss_seg_exists(char const* fname, int seg) {
+  char name[512];
+  snprintf(name, sizeof name, "%s.seg%d", fname, seg);
+  return access(name, F_OK) == 0;
+}
+
+/* Delete the records of the second half of the table and insert them
+   again, in holes of the same blocks */
+static void rewrite_second_half(char const* tbl_name) {
+  open_db();
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch);
+  int num_recs = count_records(tbl, out_rec), n = 0, k = 0;
+  record *kept = malloc(num_recs * sizeof (record));
+  cursor_p c = open_cursor(tbl);
+  while (cursor_next(c, out_rec) > 0)
+    if (n++ >= num_recs / 2 && cursor_delete(c)) {
+      kept[k] = new_record(sch);
+      assign_int_field(kept[k][0], *(int *)out_rec[0]);
+      assign_str_field(kept[k][1], out_rec[1]);
+      assign_int_field(kept[k++][2], *(int *)out_rec[2]);
+    }
+  close_cursor(c);
+  for (int i = 0; i < k; i++) {
+    append_record(kept[i], sch);
+    release_record(kept[i], sch);
+  }
+  free(kept);
+  release_record(out_rec, sch);
+  close_db();
+}
+
+/* Store the table log-structured, then delete every other record and
+   insert as many again, which moves the blocks to the log.
+   Then rewrite the blocks of the second half of the table till the log
+   has left its first segment, which keeps the blocks of the first half
+   only, few enough for the cleaner to move them and remove the segment.
+   The table has the same records in the next session. */
+void test_tbl_log_structured(char const* tbl_name) {
+  put_msg(INFO,  "test_tbl_log_structured (\"%s\") ...\n", tbl_name);
+
+  open_db();
+
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch);
+  int num_recs = count_records(tbl, out_rec);
+  if (!set_tbl_log_structured(tbl)
+      || count_records(tbl, out_rec) != num_recs) {
+    put_msg(FATAL, "test_tbl_log_structured: converting the table fails\n");
+    exit(EXIT_FAILURE);
+  }
+
+  cursor_p c = open_cursor(tbl);
+  int n = 0, num_deleted = 0;
+  while (cursor_next(c, out_rec) > 0)
+    if (n++ % 2 == 0)
+      num_deleted += cursor_delete(c);
+  close_cursor(c);
+  for (int i = 0; i < num_deleted; i++)
+    append_record(out_rec, sch);
+  release_record(out_rec, sch);
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  open_db();
+  sch = get_schema(tbl_name);
+  out_rec = new_record(sch);
+  n = count_records(get_table(tbl_name), out_rec);
+  if (n != num_recs) {
+    put_msg(FATAL, "test_tbl_log_structured: %d records, should be %d\n",
+            n, num_recs);
+    exit(EXIT_FAILURE);
+  }
+  unsigned long sum = records_sum(get_table(tbl_name), out_rec);
+  release_record(out_rec, sch);
+  close_db();
+
+  /* the segments are files of the system dir */
+  if (!pager_in_memory()) {
+    int round = 0;
+    while (round++ < LSS_MAX_ROUNDS && !lss_seg_exists(tbl_name, 1))
+      rewrite_second_half(tbl_name);
+    /* the cleaner cleans the files that are open */
+    open_db();
+    page_p pg = get_page(tbl_name, 0);
+    for (int i = 0; i < 5000 && lss_seg_exists(tbl_name, 0); i++)
+      usleep(1000);
+    if (pg) unpin(pg);
+    put_pager_profiler_info(INFO);
+    int cleaned = !lss_seg_exists(tbl_name, 0);
+    close_db();
+    if (!cleaned) {
+      put_msg(FATAL, "test_tbl_log_structured: the cleaner leaves the first "
+              "segment after %d sessions\n", round);
+      exit(EXIT_FAILURE);
+    }
+
+    open_db();
+    sch = get_schema(tbl_name);
+    out_rec = new_record(sch);
+    n = count_records(get_table(tbl_name), out_rec);
+    if (n != num_recs || records_sum(get_table(tbl_name), out_rec) != sum) {
+      put_msg(FATAL, "test_tbl_log_structured: %d records after cleaning, "
+              "should be the %d before\n", n, num_recs);
+      exit(EXIT_FAILURE);
+    }
+    release_record(out_rec, sch);
+    close_db();
+  }
+
+  put_msg(INFO,  "test_tbl_log_structured() succeeds.\n");
+}
+
+static int scan_records(tbl_p tbl, schema_p sch, record out_rec) {
+  int n = 0;
+  set_tbl_position(tbl, TBL_BEG);
+  while (get_record(out_rec, sch))
+    n++;
+  return n;
+}
+
+/* A scan of the table recycles the pages of its ring, the blocks of
+   another file used since the last scan stay in the buffer */
+void test_tbl_scan_ring(char const* tbl_name) {
+  put_msg(INFO,  "test_tbl_scan_ring (\"%s\") ...\n", tbl_name);
+
+  /* without the compressed cache, a hot block replaced is read again */
+  long ccache_size = pager_ccache_size();
+  pager_set_ccache_size(0);
+  open_db();
+
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch);
+  char hot[] = "__hot";
+  scan_records(tbl, sch, out_rec);
+  for (int b = 0; b < pager_num_pages() / 2; b++) {
+    page_p pg = get_page(hot, b);
+    page_put_int(pg, b);
+    unpin(pg);
+  }
+  /* the replacement policy may have replaced some of them already */
+  int num_hot = file_num_pages(hot);
+  int n = scan_records(tbl, sch, out_rec);
+  if (n != NUM_RECORDS || file_num_pages(hot) != num_hot) {
+    put_msg(FATAL, "test_tbl_scan_ring: %d records, %d blocks of %s in the "
+            "buffer, should be %d and %d\n", n, file_num_pages(hot), hot,
+            NUM_RECORDS, num_hot);
+    exit(EXIT_FAILURE);
+  }
+  file_remove(hot);
+  release_record(out_rec, sch);
+  put_pager_profiler_info(INFO);
+  close_db();
+  pager_set_ccache_size(ccache_size);
+
+  put_msg(INFO,  "test_tbl_scan_ring() succeeds.\n");
+}
+
+static int count_matching(tbl_p tbl, record out_rec, char const* op, int val) {
+  cursor_p c = open_cursor(tbl);
+  int n = 0;
+  while (cursor_next(c, out_rec) > 0) {
+    int v = *(int *)out_rec[2];
+    n += strcmp(op, "=") == 0 ? v == val : strcmp(op, "<=") == 0 ? v <= val
+      : strcmp(op, ">=") == 0 ? v >= val : v != val;
+  }
+  close_cursor(c);
+  return n;
+}
+
+/* Range searches on the "Int" field of a table without an index find
+   the records at most or at least the operand, halfway between the
+   smallest and the largest value */
+void test_tbl_search(char const* tbl_name) {
+  put_msg(INFO,  "test_tbl_search (\"%s\") ...\n", tbl_name);
+
+  char const* ops[] = { "<=", ">=" };
+  open_db();
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch);
+  cursor_p c = open_cursor(tbl);
+  int min = INT_MAX, max = INT_MIN;
+  while (cursor_next(c, out_rec) > 0) {
+    int v = *(int *)out_rec[2];
+    if (v < min) min = v;
+    if (v > max) max = v;
+  }
+  close_cursor(c);
+  int val = min + (max - min) / 2;
+  for (int i = 0; i < 2; i++) {
+    tbl_p res = table_search(tbl, "Int", ops[i], val);
+    int found = count_records(res, out_rec);
+    int should = count_matching(tbl, out_rec, ops[i], val);
+    remove_table(res);
+    if (found != should) {
+      put_msg(FATAL, "test_tbl_search: Int %s %d finds %d records, "
+              "should be %d\n", ops[i], val, found, should);
+      exit(EXIT_FAILURE);
+    }
+  }
+  release_record(out_rec, sch);
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  put_msg(INFO,  "test_tbl_search() succeeds.\n");
+}
+
+/* Searches with an index on the "Int" field find what scans find,
+   after records are deleted and inserted, and in the next session */
+void test_tbl_index(char const* tbl_name) {
+  put_msg(INFO,  "test_tbl_index (\"%s\") ...\n", tbl_name);
+
+  char const* ops[] = { "=", "<=", ">=", "!=" };
+  open_db();
+  schema_p sch = get_schema(tbl_name);
+  tbl_p tbl = get_table(tbl_name);
+  record out_rec = new_record(sch), val_rec = new_record(sch);
+  if (!create_index(tbl, "Int")) {
+    put_msg(FATAL, "test_tbl_index: cannot create the index\n");
+    exit(EXIT_FAILURE);
+  }
+  cursor_p c = open_cursor(tbl);
+  int n = 0, num_deleted = 0;
+  while (cursor_next(c, out_rec) > 0)
+    if (n++ % 3 == 0)
+      num_deleted += cursor_delete(c);
+  close_cursor(c);
+  c = open_cursor(tbl);
+  for (int i = 0; i < n / 3; i++)
+    cursor_next(c, val_rec);
+  close_cursor(c);
+  int val = *(int *)val_rec[2];
+  for (int i = 0; i < num_deleted / 2; i++)
+    append_record(val_rec, sch);
+  close_db();
+
+  for (int round = 0; round < 2; round++) {
+    open_db();
+    sch = get_schema(tbl_name);
+    tbl = get_table(tbl_name);
+    for (int i = 0; i < 4; i++) {
+      tbl_p res = table_search(tbl, "Int", ops[i], val);
+      int found = count_records(res, out_rec);
+      int should = count_matching(tbl, out_rec, ops[i], val);
+      remove_table(res);
+      if (found != should) {
+        put_msg(FATAL, "test_tbl_index: Int %s %d finds %d records, "
+                "should be %d\n", ops[i], val, found, should);
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (round == 0)
+      append_record(val_rec, sch);
+    put_pager_profiler_info(INFO);
+    if (round == 1) {
+      release_record(out_rec, sch);
+      release_record(val_rec, sch);
+    }
+    close_db();
+  }
+
+  put_msg(INFO,  "test_tbl_index() succeeds.\n");
+}
+
+/* Count the records of the table by their "Int" values, which are
+   below 100 in the test data */
+static void count_int_values(tbl_p tbl, int* counts) {
+  record rec = new_record(table_schema(tbl));
+  cursor_p c = open_cursor(tbl);
+  while (cursor_next(c, rec) > 0) {
+    int v = *(int *)rec[2];
+    if (v < 0 || v >= 100) {
+      put_msg(FATAL, "count_int_values: unexpected value %d\n", v);
+      exit(EXIT_FAILURE);
+    }
+    counts[v]++;
+  }
+  close_cursor(c);
+  release_record(rec, table_schema(tbl));
+}
+
 void test_tbl_natural_join(char const* my_tbl, char const* yr_tbl) {
   put_msg(INFO, "test_tbl_natural_join (\"%s\", \"%s\") ...\n", my_tbl, yr_tbl);
 
@@ -87,12 +524,346 @@ void test_tbl_natural_join(char const* my_tbl, char const* yr_tbl) {
   tbl_p tbl_m = get_table(my_tbl);
   tbl_p tbl_y = get_table(yr_tbl);
 
-  table_natural_join(tbl_m, tbl_y);
+  /* the tables have only "Int" in common */
+  int counts_m[100] = { 0 }, counts_y[100] = { 0 }, should = 0;
+  count_int_values(tbl_m, counts_m);
+  count_int_values(tbl_y, counts_y);
+  for (int v = 0; v < 100; v++)
+    should += counts_m[v] * counts_y[v];
+
+  tbl_p res = table_natural_join(tbl_m, tbl_y);
+  if (!res) {
+    put_msg(FATAL, "test_tbl_natural_join: no result\n");
+    exit(EXIT_FAILURE);
+  }
+  record rec = new_record(table_schema(res));
+  int found = count_records(res, rec);
+  release_record(rec, table_schema(res));
+  if (found != should) {
+    put_msg(FATAL, "test_tbl_natural_join: %d records, should be %d\n",
+            found, should);
+    exit(EXIT_FAILURE);
+  }
 
   put_db_info(DEBUG);
   close_db();
   /* put_pager_info(DEBUG, "After close_db"); */
 
   put_pager_profiler_info(INFO);
-  put_msg(INFO,  "test_tbl_natural_join() done.\n\n");
+  put_msg(INFO,  "test_tbl_natural_join() succeeds.\n\n");
+}
+
+static int count_join(tbl_p left, tbl_p right) {
+  tbl_p res = table_natural_join(left, right);
+  record rec = new_record(table_schema(res));
+  int n = count_records(res, rec);
+  release_record(rec, table_schema(res));
+  remove_table(res);
+  return n;
+}
+
+/* Joins probing a hash index on the "Int" or the str field find what
+   nested loops find, and so do equality searches on "Int", also after
+   records are deleted and inserted and in the next session */
+void test_tbl_hash_index(char const* my_tbl, char const* yr_tbl) {
+  put_msg(INFO, "test_tbl_hash_index (\"%s\", \"%s\") ...\n", my_tbl, yr_tbl);
+
+  open_db();
+  tbl_p tbl_m = get_table(my_tbl), tbl_y = get_table(yr_tbl);
+  char str_attr[11] = "Str";
+  strcat(str_attr, my_tbl);
+  int num_join = count_join(tbl_m, tbl_y), num_self = count_join(tbl_m, tbl_m);
+  if (!create_hash_index(tbl_y, "Int") || !create_hash_index(tbl_m, "Int")
+      || !create_hash_index(tbl_m, str_attr)) {
+    put_msg(FATAL, "test_tbl_hash_index: cannot create the indexes\n");
+    exit(EXIT_FAILURE);
+  }
+  int n = count_join(tbl_m, tbl_y), n_self = count_join(tbl_m, tbl_m);
+  if (n != num_join || n_self != num_self) {
+    put_msg(FATAL, "test_tbl_hash_index: joins find %d and %d records, "
+            "should be %d and %d\n", n, n_self, num_join, num_self);
+    exit(EXIT_FAILURE);
+  }
+
+  schema_p sch = get_schema(my_tbl);
+  record out_rec = new_record(sch);
+  cursor_p c = open_cursor(tbl_m);
+  int num_deleted = 0;
+  for (n = 0; cursor_next(c, out_rec) > 0; n++)
+    if (n % 5 == 0)
+      num_deleted += cursor_delete(c);
+  close_cursor(c);
+  for (int i = 0; i < num_deleted / 2; i++)
+    append_record(out_rec, sch);
+  close_db();
+
+  open_db();
+  tbl_m = get_table(my_tbl);
+  sch = get_schema(my_tbl);
+  for (int val = 0; val < 100; val += 7) {
+    tbl_p res = table_search(tbl_m, "Int", "=", val);
+    int found = count_records(res, out_rec);
+    int should = count_matching(tbl_m, out_rec, "=", val);
+    remove_table(res);
+    if (found != should) {
+      put_msg(FATAL, "test_tbl_hash_index: Int = %d finds %d records, "
+              "should be %d\n", val, found, should);
+      exit(EXIT_FAILURE);
+    }
+  }
+  release_record(out_rec, sch);
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  put_msg(INFO,  "test_tbl_hash_index() succeeds.\n");
+}
+
+/* The number of records of tbl meeting all (or any) of the num conditions
+   on the fields numbered nrs[i] */
+static int count_matching_where(tbl_p tbl, record out_rec, int num,
+                                int const nrs[], char const* ops[],
+                                int const vals[], int any) {
+  cursor_p c = open_cursor(tbl);
+  int n = 0;
+  while (cursor_next(c, out_rec) > 0) {
+    int meets = !any;
+    for (int i = 0; i < num; i++) {
+      int v = *(int *)out_rec[nrs[i]], val = vals[i];
+      char const* op = ops[i];
+      if ((strcmp(op, "=") == 0 ? v == val : strcmp(op, "<=") == 0
+           ? v <= val : strcmp(op, ">=") == 0 ? v >= val : v != val) == any)
+        meets = any;
+    }
+    n += meets;
+  }
+  close_cursor(c);
+  return n;
+}
+
+/* Searches with all or any of two conditions find what scans find,
+   without bitmap indexes, with a bitmap index on one of the fields and on
+   both, after records are deleted and inserted, and in the next session */
+static void check_search_where(char const* tbl_name, char const* id_attr,
+                               int round) {
+  char const* attrs[] = { "Int", id_attr };
+  int const nrs[] = { 2, 0 };
+  char const* ops[][2] = {
+    { "=", "<=" }, { ">=", "<=" }, { "!=", ">=" }, { "<=", "!=" }
+  };
+  int const vals[][2] = { { 42, 500 }, { 90, 30 }, { 42, 900 }, { 3, 7 } };
+  tbl_p tbl = get_table(tbl_name);
+  schema_p sch = get_schema(tbl_name);
+  record out_rec = new_record(sch);
+  for (int i = 0; i < 4; i++)
+    for (int any = 0; any < 2; any++) {
+      tbl_p res = table_search_where(tbl, 2, attrs, ops[i], vals[i], any);
+      int found = count_records(res, out_rec);
+      int should = count_matching_where(tbl, out_rec, 2, nrs, ops[i],
+                                        vals[i], any);
+      remove_table(res);
+      if (found != should) {
+        put_msg(FATAL, "test_tbl_bitmap_index: Int %s %d %s %s %s %d finds "
+                "%d records, should be %d (round %d)\n", ops[i][0],
+                vals[i][0], any ? "or" : "and", id_attr, ops[i][1],
+                vals[i][1], found, should, round);
+        exit(EXIT_FAILURE);
+      }
+    }
+  release_record(out_rec, sch);
+}
+
+void test_tbl_bitmap_index(char const* tbl_name) {
+  put_msg(INFO, "test_tbl_bitmap_index (\"%s\") ...\n", tbl_name);
+
+  char id_attr[11] = "Id";
+  strcat(id_attr, tbl_name);
+  open_db();
+  check_search_where(tbl_name, id_attr, 0);
+  tbl_p tbl = get_table(tbl_name);
+  if (!create_bitmap_index(tbl, "Int")) {
+    put_msg(FATAL, "test_tbl_bitmap_index: cannot create the index\n");
+    exit(EXIT_FAILURE);
+  }
+  check_search_where(tbl_name, id_attr, 1);
+  if (!create_bitmap_index(tbl, id_attr)) {
+    put_msg(FATAL, "test_tbl_bitmap_index: cannot create the index\n");
+    exit(EXIT_FAILURE);
+  }
+  check_search_where(tbl_name, id_attr, 2);
+
+  schema_p sch = get_schema(tbl_name);
+  record out_rec = new_record(sch);
+  cursor_p c = open_cursor(tbl);
+  int n, num_deleted = 0;
+  for (n = 0; cursor_next(c, out_rec) > 0; n++)
+    if (n % 4 == 0)
+      num_deleted += cursor_delete(c);
+  close_cursor(c);
+  for (int i = 0; i < num_deleted / 2; i++)
+    append_record(out_rec, sch);
+  check_search_where(tbl_name, id_attr, 3);
+  release_record(out_rec, sch);
+  close_db();
+
+  open_db();
+  check_search_where(tbl_name, id_attr, 4);
+  put_pager_profiler_info(INFO);
+  close_db();
+
+  put_msg(INFO,  "test_tbl_bitmap_index() succeeds.\n");
+}
+
+#define BS_RECORDS 200
+
+/* Make a database of one table in the current dir, at the block size
+   the next pager_init() would use */
+static void make_bs_db(char const* tbl_name) {
+  open_db();
+  char *attrs[] = {"Id", "Str", "Int"};
+  int attr_types[] = {INT_TYPE, STR_TYPE, INT_TYPE};
+  schema_p sch = create_test_schema(tbl_name, 3, attrs, attr_types);
+  record recs[BS_RECORDS];
+  test_data_gen(sch, recs, BS_RECORDS);
+  for (int i = 0; i < BS_RECORDS; i++) {
+    append_record(recs[i], sch);
+    release_record(recs[i], sch);
+  }
+  close_db();
+}
+
+/* Open the database with -b set to conf_size. It must be opened at
+   size, with all records of the table. */
+static void check_bs_db(char const* tbl_name, long conf_size, long size) {
+  pager_set_block_size(conf_size);
+  open_db();
+  schema_p sch = get_schema(tbl_name);
+  record out_rec = new_record(sch);
+  int n = count_records(get_table(tbl_name), out_rec);
+  release_record(out_rec, sch);
+  if (pager_block_size() != size || n != BS_RECORDS) {
+    put_msg(FATAL, "test_db_block_size: opened at %ld with %d records, "
+            "should be %ld with %d\n", pager_block_size(), n, size,
+            BS_RECORDS);
+    exit(EXIT_FAILURE);
+  }
+  remove_table(get_table(tbl_name));
+  close_db();
+}
+
+/* The block size in the header of a block on disk */
+static int disk_block_size(char const* fname, int blk_nr, long size) {
+  int fd = open(fname, O_RDONLY), val = -1;
+  if (fd == -1 || pread(fd, &val, INT_SIZE, size * blk_nr + 8) != INT_SIZE)
+    val = -1;
+  if (fd != -1) close(fd);
+  return val;
+}
+
+/* The block size on the #block_size line of db.db, 0 if there is none */
+static long db_block_size(void) {
+  FILE *fp = fopen("db.db", "r");
+  char key[30] = "";
+  long size = 0;
+  if (!fp) return 0;
+  if (fscanf(fp, "%29s %ld", key, &size) < 2
+      || strcmp(key, "#block_size") != 0)
+    size = 0;
+  fclose(fp);
+  return size;
+}
+
+/* Make db.db and the blocks of the table look like a database written
+   before block sizes were recorded */
+static void make_bs_db_old(char const* tbl_name) {
+  FILE *fp = fopen("db.db", "r");
+  char *buf = calloc(1, 1 << 16);
+  size_t len = fp ? fread(buf, 1, (1 << 16) - 1, fp) : 0;
+  if (fp) fclose(fp);
+  char *rest = strchr(buf, '\n');
+  fp = fopen("db.db", "w");
+  if (!fp || !rest) {
+    put_msg(FATAL, "test_db_block_size: cannot rewrite db.db\n");
+    exit(EXIT_FAILURE);
+  }
+  fwrite(rest + 1, 1, len - (rest + 1 - buf), fp);
+  fclose(fp);
+  free(buf);
+
+  int fd = open(tbl_name, O_RDWR), zero = 0;
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    put_msg(FATAL, "test_db_block_size: cannot open %s\n", tbl_name);
+    exit(EXIT_FAILURE);
+  }
+  for (off_t pos = 8; pos < st.st_size; pos += MIN_BLOCK_SIZE)
+    pwrite(fd, &zero, INT_SIZE, pos);
+  close(fd);
+}
+
+static void remove_bs_dir(char const* dir) {
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  char path[512];
+  while (d && (e = readdir(d)))
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+      snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+      unlink(path);
+    }
+  if (d) closedir(d);
+  rmdir(dir);
+}
+
+/* Move to a fresh database dir, or back out of it */
+static void enter_bs_dir(char const* dir, int enter) {
+  if (!enter && chdir("..") == -1) {
+    put_msg(FATAL, "test_db_block_size: cannot leave %s\n", dir);
+    exit(EXIT_FAILURE);
+  }
+  remove_bs_dir(dir);
+  if (enter && (mkdir(dir, 0755) == -1 || chdir(dir) == -1)) {
+    put_msg(FATAL, "test_db_block_size: cannot make %s\n", dir);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* A database keeps the block size it was made with, whatever the block
+   size set with -b. A database that recorded no block size is of
+   MIN_BLOCK_SIZE bytes. */
+void test_db_block_size(char const* tbl_name) {
+  put_msg(INFO,  "test_db_block_size (\"%s\") ...\n", tbl_name);
+  if (pager_in_memory()) {
+    put_msg(INFO,  "test_db_block_size() skipped in memory.\n");
+    return;
+  }
+
+  long conf = pager_block_size();
+  long size = conf == 4096 ? 8192 : 4096;
+  char dir[] = "__bs_db";
+
+  enter_bs_dir(dir, 1);
+  pager_set_block_size(size);
+  make_bs_db(tbl_name);
+  if (db_block_size() != size || disk_block_size(tbl_name, 0, size) != size) {
+    put_msg(FATAL, "test_db_block_size: db.db and block 0 record %ld and "
+            "%d, should be %ld\n", db_block_size(),
+            disk_block_size(tbl_name, 0, size), size);
+    exit(EXIT_FAILURE);
+  }
+  check_bs_db(tbl_name, BLOCK_SIZE, size);
+  enter_bs_dir(dir, 0);
+
+  enter_bs_dir(dir, 1);
+  pager_set_block_size(MIN_BLOCK_SIZE);
+  make_bs_db(tbl_name);
+  make_bs_db_old(tbl_name);
+  if (db_block_size() != 0
+      || disk_block_size(tbl_name, 0, MIN_BLOCK_SIZE) != 0) {
+    put_msg(FATAL, "test_db_block_size: the old database records a size\n");
+    exit(EXIT_FAILURE);
+  }
+  check_bs_db(tbl_name, size, MIN_BLOCK_SIZE);
+  enter_bs_dir(dir, 0);
+  pager_set_block_size(conf);
+
+  put_msg(INFO,  "test_db_block_size() succeeds.\n");
 }
@@ -5,6 +5,16 @@
 
 extern void test_tbl_write(char const* tbl_name);
 extern void test_tbl_read(char const* tbl_name);
+extern void test_tbl_cursors(char const* tbl_name);
+extern void test_tbl_reuse(char const* tbl_name);
+extern void test_buffer_resize(char const* tbl_name);
+extern void test_tbl_log_structured(char const* tbl_name);
+extern void test_tbl_scan_ring(char const* tbl_name);
+extern void test_tbl_search(char const* tbl_name);
+extern void test_tbl_index(char const* tbl_name);
 extern void test_tbl_natural_join(char const* my_tbl, char const* yr_tbl);
+extern void test_tbl_hash_index(char const* my_tbl, char const* yr_tbl);
+extern void test_tbl_bitmap_index(char const* tbl_name);
+extern void test_db_block_size(char const* tbl_name);
 
 #endif